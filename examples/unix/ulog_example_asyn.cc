@@ -32,9 +32,9 @@ int main() {
 
   // Initial logger
   logger_set_user_data(ULOG_GLOBAL, &fifo);
-  logger_set_output_callback(ULOG_GLOBAL, [](void *user_data, const char *str) {
+  logger_set_output_callback_len(ULOG_GLOBAL, [](void *user_data, const char *str, size_t len) {
     auto &fifo = *(ulog::FifoPowerOfTwo *)(user_data);
-    return (int)fifo.InputPacketOrDrop(str, strlen(str));
+    return (int)fifo.InputPacketOrDrop(str, len);
   });
   logger_set_flush_callback(ULOG_GLOBAL, [](void *user_data) {
     auto &fifo = *(ulog::FifoPowerOfTwo *)(user_data);
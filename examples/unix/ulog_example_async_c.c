@@ -0,0 +1,29 @@
+#include <pthread.h>
+#include <unistd.h>
+
+#include "ulog/ulog.h"
+#include "ulog/ulog_async.h"
+
+static void *log_thread(void *arg) {
+  struct ulog_s *logger = arg;
+  for (int i = 0; i < 1000; i++) LOGGER_LOCAL_INFO(logger, "PI = %.3f, count = %d", 3.14159265, i);
+  return NULL;
+}
+
+int main(void) {
+  // Formatted and written to stdout by a background thread, logs are dropped instead of blocking when the queue is full
+  struct ulog_async_config_s config = ULOG_ASYNC_CONFIG_INIT;
+  config.fd = STDOUT_FILENO;
+  config.full_policy = ULOG_QUEUE_FULL_DROP;
+  struct ulog_s *logger = logger_create_async(&config);
+  if (!logger) return 1;
+
+  pthread_t threads[20];
+  for (int i = 0; i < 20; i++) pthread_create(&threads[i], NULL, log_thread, logger);
+  for (int i = 0; i < 20; i++) pthread_join(threads[i], NULL);
+
+  logger_flush_deferred(logger);
+  LOGGER_LOCAL_INFO(logger, "dropped: %llu", (unsigned long long)logger_get_dropped_count(logger));
+  logger_destroy(&logger);
+  return 0;
+}
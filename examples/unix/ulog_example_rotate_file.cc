@@ -56,12 +56,17 @@ int main() {
   // Initial logger
   logger_format_enable(ULOG_GLOBAL, ULOG_F_NUMBER);
   logger_set_user_data(ULOG_GLOBAL, &async_rotate);
-  logger_set_output_callback(ULOG_GLOBAL, [](void *user_data, const char *str) {
-    printf("%s", str);
-    auto &async = *static_cast<decltype(&async_rotate)>(user_data);
-    int len = strlen(str);
-    return async.SinkIt(str, len) ? len : 0;
-  });
+  // Render the logs directly into the queue of the async sink
+  logger_set_output_reserve_callback(
+      ULOG_GLOBAL,
+      [](void *user_data, size_t size) {
+        auto &async = *static_cast<decltype(&async_rotate)>(user_data);
+        return async.Reserve(size, std::chrono::milliseconds{100});
+      },
+      [](void *user_data, void *data, size_t size) {
+        auto &async = *static_cast<decltype(&async_rotate)>(user_data);
+        async.Commit(data, size);
+      });
   logger_set_flush_callback(ULOG_GLOBAL, [](void *user_data) {
     auto &async = *static_cast<decltype(&async_rotate)>(user_data);
     const auto status = async.Flush();
@@ -0,0 +1,126 @@
+//
+// Drain of asynchronous log queues when the process crashes.
+//
+
+#pragma once
+
+#include <signal.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <initializer_list>
+
+namespace ulog::crash {
+
+// Called by the crash handler, must be async-signal-safe: no locks, no allocations, only write(2) and the like
+using DrainFunction = void (*)(void *arg);
+
+static constexpr size_t kMaxDrains = 16;
+
+namespace detail {
+
+struct DrainSlot {
+  std::atomic<DrainFunction> fn{nullptr};
+  std::atomic<void *> arg{nullptr};
+};
+
+inline DrainSlot drains[kMaxDrains];
+inline struct sigaction previous_actions[NSIG];
+inline std::atomic_flag draining = ATOMIC_FLAG_INIT;
+
+inline void Handler(int sig, siginfo_t *info, void *context) {
+  const int saved_errno = errno;
+  // A crash inside a drain does not drain again
+  if (!draining.test_and_set()) {
+    for (auto &slot : drains) {
+      if (const DrainFunction fn = slot.fn.load(std::memory_order_acquire)) fn(slot.arg.load(std::memory_order_relaxed));
+    }
+  }
+  errno = saved_errno;
+
+  // Hand the signal over to the handler installed before, or re-raise it with the default action, which is delivered
+  // when this handler returns
+  const struct sigaction &previous = previous_actions[sig];
+  if ((previous.sa_flags & SA_SIGINFO) && previous.sa_sigaction) {
+    previous.sa_sigaction(sig, info, context);
+  } else if (!(previous.sa_flags & SA_SIGINFO) && previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+    previous.sa_handler(sig);
+  } else {
+    signal(sig, SIG_DFL);
+    raise(sig);
+  }
+}
+
+}  // namespace detail
+
+/**
+ * Install the crash handler for the given signals. On a crash, the handler calls every registered drain function, then
+ * the handler that was installed before, or the default action of the signal (the process terminates and dumps core as
+ * usual). Opt-in, call it once at startup. The handler runs on the alternate signal stack if the crashing thread has
+ * one (see sigaltstack(2)), which is required to survive a stack overflow.
+ * @return true on success
+ */
+inline bool InstallHandler(std::initializer_list<int> signals = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) {
+  struct sigaction action {};
+  action.sa_sigaction = detail::Handler;
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+  bool ok = true;
+  for (const int sig : signals) {
+    if (sig <= 0 || sig >= NSIG) {
+      ok = false;
+      continue;
+    }
+    struct sigaction previous {};
+    if (sigaction(sig, &action, &previous) != 0) {
+      ok = false;
+      continue;
+    }
+    // Installing twice keeps the handler of the first installation
+    if (!((previous.sa_flags & SA_SIGINFO) && previous.sa_sigaction == detail::Handler)) {
+      detail::previous_actions[sig] = previous;
+    }
+  }
+  return ok;
+}
+
+/**
+ * Register a function that saves buffered logs when the process crashes
+ * @return Id for UnregisterDrain(), -1 if all kMaxDrains slots are in use
+ */
+inline int RegisterDrain(DrainFunction fn, void *arg) {
+  for (size_t i = 0; i < kMaxDrains; i++) {
+    DrainFunction expected = nullptr;
+    // The slot is claimed with a placeholder, so the handler never calls fn with the argument of another drain
+    if (detail::drains[i].fn.compare_exchange_strong(expected, [](void *) {}, std::memory_order_acq_rel)) {
+      detail::drains[i].arg.store(arg, std::memory_order_relaxed);
+      detail::drains[i].fn.store(fn, std::memory_order_release);
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+inline void UnregisterDrain(int id) {
+  if (id >= 0 && static_cast<size_t>(id) < kMaxDrains) {
+    detail::drains[id].fn.store(nullptr, std::memory_order_release);
+  }
+}
+
+/**
+ * Write all data to a file descriptor, async-signal-safe
+ */
+inline void WriteAll(int fd, const void *data, size_t len) {
+  const char *ptr = static_cast<const char *>(data);
+  while (fd >= 0 && len > 0) {
+    const ssize_t n = write(fd, ptr, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return;
+    ptr += n;
+    len -= static_cast<size_t>(n);
+  }
+}
+
+}  // namespace ulog::crash
@@ -59,5 +59,11 @@ class FileWriterBase {
    * @return The current file write position.
    */
   virtual size_t TellP() = 0;
+
+  /**
+   * Get the descriptor of the open file, for writes from a crash handler (see SinkBase::SinkItOnCrash()).
+   * @return The file descriptor, -1 if the file is not open or the writer buffers or encodes the data.
+   */
+  virtual int Fd() const { return -1; }
 };
 }  // namespace ulog::file
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <fcntl.h>
 #include <unistd.h>
 
 #include "file.h"
@@ -80,6 +81,8 @@ public:
 
   size_t TellP() override { return file_write_size_; }
 
+  int Fd() const override { return fd_; }
+
 private:
   // config
   size_t file_limit_size_;
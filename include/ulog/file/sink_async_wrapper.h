@@ -8,12 +8,20 @@
 #include <cstring>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
 
+#include "ulog/crash_handler.h"
 #include "ulog/error.h"
 #include "ulog/file/sink_base.h"
 #include "ulog/status.h"
 
+namespace ulog::mpsc {
+class Mq;
+}
+
 namespace ulog::file {
 
 template <typename Queue>
@@ -86,6 +94,7 @@ class SinkAsyncWrapper final : public SinkBase {
   SinkAsyncWrapper &operator=(const SinkAsyncWrapper &) = delete;
 
   ~SinkAsyncWrapper() override {
+    crash::UnregisterDrain(crash_drain_id_);
     umq_->Flush(std::chrono::seconds(5));
     should_exit_ = true;
     umq_->Notify();
@@ -98,6 +107,18 @@ class SinkAsyncWrapper final : public SinkBase {
     return Status::OK();
   }
 
+  /**
+   * Opt in to saving the queued data when the process crashes: the crash handler (see crash::InstallHandler(), which
+   * must also be called) writes the data that the background thread has not sunk yet to every sink with
+   * SinkItOnCrash(), e.g. straight into the file descriptor of a file written with FileWriterUnbufferedIo. Data that
+   * the background thread is sinking at that moment may be written twice.
+   * @return true on success, false if no drain slot is left
+   */
+  bool EnableCrashDrain() {
+    if (crash_drain_id_ < 0) crash_drain_id_ = crash::RegisterDrain(DrainOnCrash, this);
+    return crash_drain_id_ >= 0;
+  }
+
   typename Queue::Producer CreateProducer() const { return typename Queue::Producer(umq_->shared_from_this()); }
 
   Status SinkIt(const void *data, const size_t len, std::chrono::milliseconds timeout) override {
@@ -110,6 +131,29 @@ class SinkAsyncWrapper final : public SinkBase {
     return Status::Full();
   }
 
+  /**
+   * Reserve space in the queue to build a packet in place, e.g. the reserve callback of
+   * logger_set_output_reserve_callback(). The packet must be published with Commit(). Both use the producer of the
+   * calling thread, which the wrapper keeps.
+   * @param len Maximum length of the packet
+   * @param timeout The maximum waiting time if the queue is full
+   * @return Pointer to the reserved space, nullptr if the queue is still full after the timeout
+   */
+  void *Reserve(const size_t len, std::chrono::milliseconds timeout) {
+    static_assert(std::is_same_v<Queue, mpsc::Mq>, "Reserve()/Commit() require SinkAsyncWrapper<mpsc::Mq>");
+    return ThreadProducer().ReserveOrWaitFor(len, timeout);
+  }
+
+  /**
+   * Publish a packet built in the space returned by Reserve()
+   * @param data Pointer returned by Reserve()
+   * @param len Real length of the packet, at most the reserved length, 0 discards it
+   */
+  void Commit(void *data, const size_t len) {
+    static_assert(std::is_same_v<Queue, mpsc::Mq>, "Reserve()/Commit() require SinkAsyncWrapper<mpsc::Mq>");
+    ThreadProducer().Commit(static_cast<uint8_t *>(data), len);
+  }
+
   Status SinkIt(const void *data, const size_t len) override {
     typename Queue::Producer writer(umq_->shared_from_this());
     if (auto *buffer = writer.Reserve(len)) {
@@ -121,6 +165,32 @@ class SinkAsyncWrapper final : public SinkBase {
   }
 
  private:
+  // Each thread caches its producers of the last few wrappers it used, so Reserve() and Commit() do not take a lock or
+  // touch the reference count of the queue. The ids of the wrappers are never reused, the entry of a destroyed wrapper
+  // is never matched again.
+  typename Queue::Producer &ThreadProducer() {
+    struct CachedProducer {
+      uint64_t id;
+      typename Queue::Producer *producer;
+    };
+    constexpr unsigned kCached = 4;
+    thread_local CachedProducer cache[kCached] = {};
+    thread_local unsigned next_slot = 0;
+    for (const auto &c : cache) {
+      if (c.id == id_) return *c.producer;
+    }
+
+    typename Queue::Producer *producer;
+    {
+      std::lock_guard<std::mutex> lock(producers_mutex_);
+      auto &owned = producers_[std::this_thread::get_id()];
+      if (!owned) owned = std::make_unique<typename Queue::Producer>(umq_);
+      producer = owned.get();
+    }
+    cache[next_slot++ % kCached] = {id_, producer};
+    return *producer;
+  }
+
   [[nodiscard]] Status SinkAll(const void *data, const size_t len) {
     Status result = Status::OK();
     for (auto sink = sinks_.begin(); sink != sinks_.end();) {
@@ -137,6 +207,13 @@ class SinkAsyncWrapper final : public SinkBase {
     return result;
   }
 
+  static void DrainOnCrash(void *arg) {
+    auto *self = static_cast<SinkAsyncWrapper *>(arg);
+    self->umq_->ForEachPending([self](const void *data, const size_t len) {
+      for (auto &sink : self->sinks_) sink->SinkItOnCrash(data, len);
+    });
+  }
+
   [[nodiscard]] Status FlushAllSink() const {
     Status result = Status::OK();
     for (auto &sink : sinks_) {
@@ -147,12 +224,19 @@ class SinkAsyncWrapper final : public SinkBase {
     return result;
   }
 
+  static inline std::atomic<uint64_t> next_id_{1};
+
   std::shared_ptr<Queue> umq_;
+  const uint64_t id_ = next_id_.fetch_add(1, std::memory_order_relaxed);
+  // Producers of the threads that have called Reserve(), freed with the wrapper
+  std::mutex producers_mutex_;
+  std::unordered_map<std::thread::id, std::unique_ptr<typename Queue::Producer>> producers_;
   std::list<std::unique_ptr<SinkBase>> sinks_;
   std::unique_ptr<std::thread> async_thread_;
 
   std::atomic_bool should_exit_{false};
   std::atomic_bool should_flush_{false};
+  int crash_drain_id_ = -1;
 };
 
 }  // namespace ulog::file
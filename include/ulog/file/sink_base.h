@@ -33,5 +33,11 @@ public:
    * @return Negative numbers are errors, use Status to judge
    */
   virtual Status Flush() = 0;
+
+  /**
+   * Write data from a crash handler (see SinkAsyncWrapper::EnableCrashDrain()): must be async-signal-safe, without
+   * locks or allocations. Sinks that can not do so ignore the data.
+   */
+  virtual void SinkItOnCrash([[maybe_unused]] const void* data, [[maybe_unused]] size_t len) {}
 };
 }
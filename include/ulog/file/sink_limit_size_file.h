@@ -13,6 +13,7 @@
 #include "rotation_strategy_incremental.h"
 #include "rotation_strategy_rename.h"
 #include "sink_base.h"
+#include "ulog/crash_handler.h"
 
 namespace ulog::file {
 
@@ -41,6 +42,9 @@ class SinkLimitSizeFile final : public SinkBase {
 
   [[nodiscard]] Status Flush() override { return writer_->Flush(); }
 
+  // Straight into the current file, ignoring the size limit
+  void SinkItOnCrash(const void *data, const size_t len) override { crash::WriteAll(writer_->Fd(), data, len); }
+
  private:
   const std::size_t file_size_;
   std::unique_ptr<FileWriterBase> writer_;
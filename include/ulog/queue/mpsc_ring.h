@@ -171,6 +171,42 @@ class Mq : public std::enable_shared_from_this<Mq> {
     cons_notifier_.notify_all();
   }
 
+  /**
+   * Pass the committed packets that have not been released by the consumer to fn(data, size), in order, without
+   * consuming them. Only reads the queue, without locks, waits or allocations, so it can be called from a signal
+   * handler to save the data of a crashing process. Stops at the first packet that is still being written. The
+   * consumer may be processing some of the packets at the same time.
+   * @return Number of packets passed to fn
+   */
+  template <typename Fn>
+  size_t ForEachPending(Fn &&fn) const {
+    const uint32_t cons_head = cons_head_.load(std::memory_order_acquire);
+    const uint32_t prod_head = prod_head_.load(std::memory_order_acquire);
+    const uint32_t prod_last = prod_last_.load(std::memory_order_relaxed);
+
+    size_t count = 0;
+    for (uint32_t pos = cons_head; pos != prod_head && pos - cons_head <= size();) {
+      if ((pos ^ prod_head) & ~mask()) {
+        // The producer has wrapped around: the rest of this block up to prod_last is skipped
+        if (pos == prod_last) {
+          pos = next_buffer(pos);
+          continue;
+        }
+        if (prod_last - pos > size()) break;  // The wrap point is not published yet
+      }
+
+      const HeaderPtr packet(&data_[pos & mask()]);
+      if (!packet->valid(std::memory_order_acquire)) break;
+      // Discarded packets have no data
+      if (const uint32_t packet_size = packet->size(std::memory_order_relaxed)) {
+        fn(static_cast<const void *>(packet->data), static_cast<size_t>(packet_size));
+        count++;
+      }
+      pos += sizeof(Header) + align8(packet->reserved_size.load(std::memory_order_relaxed));
+    }
+    return count;
+  }
+
  private:
   size_t size() const { return mask_ + 1; }
 
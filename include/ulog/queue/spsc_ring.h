@@ -88,6 +88,38 @@ class Mq : public std::enable_shared_from_this<Mq<T>> {
     cons_notifier_.notify_all();
   }
 
+  /**
+   * Pass the committed data that has not been released by the consumer to fn(data, size), at most two contiguous
+   * blocks, without consuming it. Only reads the queue, without locks, waits or allocations, so it can be called from
+   * a signal handler to save the data of a crashing process. The consumer may be processing the data at the same time.
+   * @return Number of blocks passed to fn
+   */
+  template <typename Fn>
+  size_t ForEachPending(Fn &&fn) const {
+    const auto in = in_.load(std::memory_order_acquire);
+    const auto last = last_.load(std::memory_order_relaxed);
+    const auto out = out_.load(std::memory_order_acquire);
+    if (out == in) return 0;
+
+    const auto cur_in = in & mask();
+    const auto cur_out = out & mask();
+    if (cur_out < cur_in) {
+      fn(static_cast<const void *>(&data_[cur_out]), (in - out) * sizeof(T));
+      return 1;
+    }
+
+    size_t count = 0;
+    if (out != last) {
+      fn(static_cast<const void *>(&data_[cur_out]), (last - out) * sizeof(T));
+      count++;
+    }
+    if (cur_in != 0) {
+      fn(static_cast<const void *>(&data_[0]), cur_in * sizeof(T));
+      count++;
+    }
+    return count;
+  }
+
  private:
   size_t size() const { return mask_ + 1; }
 
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "ulog/ulog_c.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef ULOG_ASYNC_BATCH_LEN
+#define ULOG_ASYNC_BATCH_LEN (64 * 1024) /* Output buffer of logger_create_async() for a file descriptor */
+#endif
+
+/**
+ * Enable deferred formatting: the LOGGER_XXX macros only copy the header fields
+ * and the raw arguments into a lock-free queue, a background thread formats
+ * and outputs them. The output is identical to synchronous logging. Call sites
+ * whose format can not be deferred ("%n", "%ls", positional arguments, too
+ * many arguments) are formatted on the calling thread and queued as text.
+ * Callers block while the queue is full, no log is dropped.
+ * Requires linking the ulog_async library.
+ * @param queue_size Size of the queue in bytes, at least 16 * ULOG_OUTBUF_LEN, rounded up to a power of two
+ * @return 0 on success, -1 on failure
+ */
+int logger_enable_deferred(struct ulog_s *logger, size_t queue_size);
+
+/**
+ * Output the queued logs, stop the background thread and return to
+ * synchronous logging. Also done by logger_destroy().
+ */
+void logger_disable_deferred(struct ulog_s *logger);
+
+/**
+ * Wait until all queued logs are output, and pass them on to the file
+ * descriptor or the flush callback of a logger_create_async() logger
+ */
+void logger_flush_deferred(struct ulog_s *logger);
+
+enum ulog_queue_full_e {
+  ULOG_QUEUE_FULL_BLOCK,  // The caller waits for room, no log is lost
+  ULOG_QUEUE_FULL_DROP,   // The log is dropped and counted, the caller never waits
+};
+
+struct ulog_async_config_s {
+  size_t queue_size;  // Bytes, at least 16 * ULOG_OUTBUF_LEN, rounded up to a power of two
+  enum ulog_queue_full_e full_policy;
+  // Longest time output is held back by the background thread, 0 passes it on
+  // after every batch drained from the queue
+  uint32_t flush_interval_ms;
+  int fd;  // Output file descriptor, written in batches, used if output_cb is NULL
+  ulog_output_len_callback output_cb;  // Called on the background thread
+  ulog_flush_callback flush_cb;        // Called every flush interval, may be NULL
+  void *user_data;                     // Passed to output_cb and flush_cb
+};
+
+#define ULOG_ASYNC_CONFIG_INIT \
+  {1024 * 1024, ULOG_QUEUE_FULL_BLOCK, 100, 1, NULL, NULL, NULL}
+
+/**
+ * Create a logger with deferred formatting (see logger_enable_deferred()) whose
+ * background thread also owns the output: lines are written to the file
+ * descriptor in batches of up to ULOG_ASYNC_BATCH_LEN bytes, or passed to the
+ * output callback, and passed on at the latest after the flush interval.
+ * logger_disable_deferred() outputs the queued logs and returns the logger to
+ * writing to the same output synchronously. The user data and the output
+ * callbacks of the logger must not be changed, see config->user_data.
+ * Requires linking the ulog_async library.
+ * @param config NULL for ULOG_ASYNC_CONFIG_INIT (stdout)
+ * @return The logger, released with logger_destroy(), NULL on failure
+ */
+struct ulog_s *logger_create_async(const struct ulog_async_config_s *config);
+
+/**
+ * Number of logs dropped by a full queue, see ULOG_QUEUE_FULL_DROP
+ */
+uint64_t logger_get_dropped_count(struct ulog_s *logger);
+
+#ifdef __cplusplus
+}
+#endif
@@ -5,8 +5,24 @@
 #include <stdio.h>
 #include <string.h>
 
+/**
+ * A segment of a log line, same layout as struct iovec of <sys/uio.h>, so
+ * an array of segments can be passed to writev() with a cast
+ */
+struct ulog_iovec_s {
+  const void *iov_base;
+  size_t iov_len;
+};
+
 typedef int (*ulog_output_callback)(void *user_data, const char *ptr);
+typedef int (*ulog_output_len_callback)(void *user_data, const char *ptr,
+                                        size_t len);
+typedef int (*ulog_output_v_callback)(void *user_data,
+                                      const struct ulog_iovec_s *iov,
+                                      int iovcnt);
 typedef void (*ulog_flush_callback)(void *user_data);
+typedef void *(*ulog_reserve_callback)(void *user_data, size_t size);
+typedef void (*ulog_commit_callback)(void *user_data, void *data, size_t size);
 
 enum ulog_level_e {
   ULOG_LEVEL_TRACE = 0,
@@ -58,6 +74,49 @@ void logger_set_user_data(struct ulog_s *logger, void *user_data);
 void logger_set_output_callback(struct ulog_s *logger,
                                 ulog_output_callback output_callback);
 
+/**
+ * Same as logger_set_output_callback(), the callback also receives the length
+ * of the string, so it does not need to call strlen(). When set, it is used
+ * instead of the output callback.
+ *
+ * @param logger
+ * @param output_callback Callback function to output "len" bytes of "ptr"
+ * (the string is also null-terminated), NULL to unset
+ */
+void logger_set_output_callback_len(struct ulog_s *logger,
+                                    ulog_output_len_callback output_callback);
+
+/**
+ * Set a vectored output callback: a log line is passed as the header, the
+ * message and the tail (color reset and newline) in 3 segments, so a sink can
+ * writev() them without concatenating. Raw output and hex dumps are passed in
+ * a single segment. Segments may be empty. When set, it is used instead of
+ * the output callback and the length-aware output callback.
+ *
+ * @param logger
+ * @param output_callback Callback function to output "iovcnt" segments, NULL
+ * to unset
+ */
+void logger_set_output_callback_v(struct ulog_s *logger,
+                                  ulog_output_v_callback output_callback);
+
+/**
+ * Render the logs directly into memory reserved from the output (such as a
+ * ring buffer) instead of a stack buffer that is passed to the output
+ * callback. This saves the copies and the strlen() of the output callback,
+ * and log lines are no longer truncated to ULOG_OUTBUF_LEN. When set, it is
+ * used instead of all the output callbacks.
+ *
+ * @param logger
+ * @param reserve_callback Returns at least "size" writable bytes, NULL to
+ * drop the log
+ * @param commit_callback Publishes the first "size" bytes of the reserved
+ * memory (without a terminating null byte), a size of 0 discards it
+ */
+void logger_set_output_reserve_callback(struct ulog_s *logger,
+                                        ulog_reserve_callback reserve_callback,
+                                        ulog_commit_callback commit_callback);
+
 /**
  * Set the callback function of log flush, which is executed when the log level
  * is error
@@ -68,6 +127,22 @@ void logger_set_output_callback(struct ulog_s *logger,
 void logger_set_flush_callback(struct ulog_s *logger,
                                ulog_flush_callback flush_callback);
 
+/**
+ * Batched console output, an opt-in replacement of the printf() default.
+ * The log lines of each thread are collected in a buffer of the thread and
+ * written to stdout with one write() per batch: when the buffer is full,
+ * ULOG_CONSOLE_FLUSH_MS after the first buffered line, on FATAL logs, when
+ * the thread exits and at exit. On a terminal, each line is written at once.
+ * Lines are written without stdio, so they are not ordered with printf().
+ *
+ * usage: logger_set_output_callback_len(logger, logger_console_output);
+ *        logger_set_flush_callback(logger, logger_console_flush);
+ */
+int logger_console_output(void *user_data, const char *ptr, size_t len);
+
+// Write the buffered lines of all threads
+void logger_console_flush(void *user_data);
+
 /*****************************************************************************
  * log format configuration:
  */
@@ -106,6 +181,288 @@ void logger_format_disable(struct ulog_s *logger, int32_t format);
  */
 bool logger_check_format(struct ulog_s *logger, int32_t format);
 
+/**
+ * Collapse runs of identical logs: a log with the same level, location and
+ * message as the previous log of the logger is only counted, and one
+ * "last message repeated N times" line is output when a different log
+ * arrives, when the filter is changed, or by a timer thread once timeout_ms
+ * passed since the first counted repetition. Filtered logs are formatted on
+ * the calling thread, also with deferred formatting. Disabled by default.
+ * @param timeout_ms Longest time a run is held back, 0 disables the filter
+ */
+void logger_set_repeat_filter(struct ulog_s *logger, uint32_t timeout_ms);
+
+enum ulog_number_mode_e {
+  // One counter shared by all threads, the numbers are consecutive (default)
+  ULOG_NUMBER_SEQUENTIAL = 0,
+
+  // Threads take numbers from counters on separate cache lines, the numbers
+  // are unique and increase within a thread, but are not consecutive
+  ULOG_NUMBER_STRIPED,
+};
+
+/**
+ * Set how the logs are numbered when ULOG_F_NUMBER is enabled. The counters
+ * are not touched while ULOG_F_NUMBER is disabled.
+ */
+void logger_set_number_mode(struct ulog_s *logger,
+                            enum ulog_number_mode_e mode);
+
+enum ulog_clock_e {
+  // clock_gettime(CLOCK_REALTIME) (default)
+  ULOG_CLOCK_REALTIME = 0,
+
+  // CLOCK_REALTIME_COARSE: cheaper, with the resolution of the scheduler tick
+  ULOG_CLOCK_REALTIME_COARSE,
+
+  // CLOCK_MONOTONIC plus the offset to the wall time measured once, so the
+  // timestamps never go backwards when the wall clock is adjusted
+  ULOG_CLOCK_MONOTONIC,
+
+  // Invariant TSC of x86 CPUs, calibrated once against CLOCK_MONOTONIC. Logs
+  // only read the cycle counter, it is converted to the wall time when the
+  // header is rendered.
+  ULOG_CLOCK_TSC,
+};
+
+/**
+ * Set the clock of the ULOG_F_TIME timestamps. The log only records the raw
+ * clock value, the conversion to the wall time happens when the header is
+ * rendered, on the backend thread with deferred formatting. The first use of
+ * ULOG_CLOCK_TSC calibrates it for about ULOG_TSC_CALIBRATION_MS.
+ * @return 0 on success, -1 if the clock is not available on this machine (the
+ * logger keeps its clock)
+ */
+int logger_set_clock(struct ulog_s *logger, enum ulog_clock_e clock);
+
+/**
+ * Set the number of fraction digits of the timestamps, 3 (milliseconds) by
+ * default, up to 9 (nanoseconds). 0 omits the fraction.
+ */
+void logger_set_time_precision(struct ulog_s *logger, unsigned frac_digits);
+
+/**
+ * Get the number of logs that have been numbered, the striped counters are
+ * summed up
+ */
+uint64_t logger_get_log_count(struct ulog_s *logger);
+
+/*****************************************************************************
+ * Call sites:
+ * Every log macro (LOGGER_XXX, except the raw output) owns a static descriptor
+ * of its call site holding the level, file, function, line and format. Call
+ * sites are shared by all loggers and can be listed and switched on or off at
+ * runtime.
+ */
+
+struct ulog_site_s;
+
+struct ulog_site_info_s {
+  enum ulog_level_e level;  // ULOG_LEVEL_NUMBER if the level is not a constant
+  const char *file;         // File name without the directory
+  const char *func;
+  uint32_t line;
+  const char *format;  // NULL if the format is not a string literal
+  const char *module;  // ULOG_MODULE of the call site, may be NULL
+  bool enabled;
+};
+
+typedef void (*ulog_site_callback)(void *arg, struct ulog_site_s *site);
+
+/**
+ * Call the callback for every call site of the program. With GCC or clang on
+ * ELF targets, the sites are collected by the linker, so sites that have never
+ * been executed are listed too (only those linked into the same executable or
+ * shared library as ulog). Elsewhere, only the executed sites are listed.
+ *
+ * @return Number of call sites
+ */
+size_t logger_site_foreach(ulog_site_callback callback, void *arg);
+
+/**
+ * Get the description of a call site
+ */
+void logger_site_get_info(struct ulog_site_s *site,
+                          struct ulog_site_info_s *info);
+
+/**
+ * Enable or disable a call site, which is enabled by default. A disabled call
+ * site neither evaluates its arguments nor calls into the logger.
+ */
+void logger_site_enable(struct ulog_site_s *site, bool enable);
+
+/**
+ * Enable or disable all call sites of a file or a line of a file
+ *
+ * @param file File name without the directory, NULL matches all files
+ * @param line Line number, 0 matches all lines
+ * @return Number of matched call sites
+ */
+size_t logger_site_enable_match(const char *file, uint32_t line, bool enable);
+
+/**
+ * Set the minimum levels of modules from a spec such as
+ * "info,net.*=warn,db.pool=debug", replacing the previous rules. The call
+ * sites of a translation unit belong to the module ULOG_MODULE, defined
+ * before including ulog.h. A rule applies to its module and to the modules
+ * below it ("net" and "net.*" both match "net" and "net.http"), the longest
+ * matching rule wins, and "*" or an item without '=' is the root rule, which
+ * also applies to sites without a module. Levels are trace, debug, info, warn,
+ * error, fatal or off. The levels are applied on top of the level of the
+ * logger; each call site caches its decision until the next change, so a
+ * filtered call costs one compare.
+ *
+ * @param spec Comma separated rules, NULL or "" removes all rules
+ * @return 0 on success, -1 if the spec is invalid (the rules are unchanged)
+ */
+int logger_set_module_levels(const char *spec);
+
+/**
+ * Add or replace the rule of one module, see logger_set_module_levels()
+ *
+ * @param module Module name, "*" for the root rule
+ * @param level Minimum level, ULOG_LEVEL_NUMBER disables the module
+ * @return 0 on success, -1 otherwise
+ */
+int logger_set_module_level(const char *module, enum ulog_level_e level);
+
+/**
+ * Get the minimum level of a module: the level of its longest matching rule,
+ * or ULOG_LEVEL_TRACE without a matching rule
+ *
+ * @param module Module name, NULL for the sites without a module
+ */
+enum ulog_level_e logger_get_module_level(const char *module);
+
+#ifndef ULOG_PROFILE_REPORT_MS
+#define ULOG_PROFILE_REPORT_MS 10000 /* Default interval of the profile summaries */
+#endif
+
+/**
+ * Statistics of a profiled code location since its last summary
+ */
+struct ulog_profile_info_s {
+  const char *name;
+  const char *file;  // File name without the directory
+  const char *func;
+  uint32_t line;
+  uint64_t count;  // Number of executions
+  uint64_t sum_ns;
+  uint64_t min_ns;
+  uint64_t max_ns;
+  // Percentiles from the latency histogram, which has 4 buckets per power of 2
+  // (so they are at most 25% too high)
+  uint64_t p50_ns;
+  uint64_t p90_ns;
+  uint64_t p99_ns;
+};
+
+typedef void (*ulog_profile_callback)(void *arg,
+                                      const struct ulog_profile_info_s *info);
+
+/**
+ * Set the interval of the summary lines of LOGGER_PROFILE_SCOPE and
+ * LOGGER_PROFILE_CODE, ULOG_PROFILE_REPORT_MS by default. A summary is output
+ * by the first execution after the interval has passed.
+ * @param interval_ms 0 to only output summaries with logger_profile_report()
+ */
+void logger_profile_set_report_interval(uint32_t interval_ms);
+
+/**
+ * Output the summary of every profiled location executed since its last
+ * summary, and restart the statistics
+ */
+void logger_profile_report(void);
+
+/**
+ * Call the callback with the statistics of every profiled location that has
+ * been executed, without restarting them
+ * @return Number of profiled locations
+ */
+size_t logger_profile_foreach(ulog_profile_callback callback, void *arg);
+
+/*****************************************************************************
+ * Structured logs:
+ * LOGGER_XXX_KV(msg, ULOG_KV("id", id), ...) encodes typed fields into a
+ * compact binary record on the calling thread. The record is rendered behind
+ * the message as logfmt or JSON when the line is output (by the background
+ * thread with deferred formatting), or handed undecoded to the structured
+ * output callback.
+ *
+ * Record layout, per field: the type (1 byte), the key length (varint) and
+ * the key, then the value: zigzag varint (INT), varint (UINT), 8 bytes little
+ * endian (DOUBLE), 1 byte (BOOL), or the length (varint) and the bytes
+ * (STRING).
+ */
+
+enum ulog_kv_type_e {
+  ULOG_KV_INT = 1,
+  ULOG_KV_UINT,
+  ULOG_KV_DOUBLE,
+  ULOG_KV_BOOL,
+  ULOG_KV_STRING,
+};
+
+struct ulog_kv_s {
+  const char *key;  // Not null-terminated when decoded
+  size_t key_len;
+  enum ulog_kv_type_e type;
+  union {
+    int64_t i;
+    uint64_t u;
+    double d;
+    bool b;
+    struct {
+      const char *ptr;  // Not null-terminated when decoded
+      size_t len;
+    } str;
+  } value;
+};
+
+enum ulog_kv_format_e {
+  ULOG_KV_LOGFMT = 0,  // ' id=42 px=1.5 side="buy limit"' (default)
+  ULOG_KV_JSON,        // ' {"id":42,"px":1.5,"side":"buy limit"}'
+};
+
+/**
+ * Set how the fields of structured logs are rendered into the log line
+ */
+void logger_set_kv_format(struct ulog_s *logger, enum ulog_kv_format_e format);
+
+/**
+ * Output callback of structured logs, used for them instead of the other
+ * output callbacks when set, so the fields are never rendered as text
+ * @param str The log line without the fields (header, message and tail),
+ * null-terminated
+ * @param fields Binary record of the fields, see logger_kv_next()
+ */
+typedef int (*ulog_output_kv_callback)(void *user_data, const char *str,
+                                       size_t len, const void *fields,
+                                       size_t fields_len);
+void logger_set_output_kv_callback(struct ulog_s *logger,
+                                   ulog_output_kv_callback output_callback);
+
+/**
+ * Encode fields into a binary record, the fields that do not fit are left out
+ * @return Length of the record
+ */
+size_t logger_kv_encode(const struct ulog_kv_s *fields, size_t count,
+                        void *buf, size_t size);
+
+/**
+ * Decode the field at *pos of a record and advance *pos to the next one
+ * @return false at the end of the record or if the field is malformed
+ */
+bool logger_kv_next(const void **pos, const void *end, struct ulog_kv_s *field);
+
+/**
+ * Render the fields of a record as text, the fields that do not fit are left
+ * out. The text starts with a space and is null-terminated.
+ * @return Length of the text
+ */
+size_t logger_kv_render(const void *fields, size_t fields_len,
+                        enum ulog_kv_format_e format, char *buf, size_t size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -153,6 +510,133 @@ bool logger_check_format(struct ulog_s *logger, int32_t format);
   ULOG_OUT_RAW(logger, ULOG_LEVEL_RAW, fmt, ##__VA_ARGS__)
 #define LOGGER_RAW(fmt, ...) LOGGER_LOCAL_RAW(ULOG_GLOBAL, fmt, ##__VA_ARGS__)
 
+/**
+ * Rate limited logs for hot paths. Each call site keeps its own state, a
+ * suppressed call is not formatted and only counted. The count is appended to
+ * the next output of the call site.
+ * - EVERY_N(n, ...): the 1st, (n + 1)th, (2n + 1)th... call
+ * - EVERY_MS(ms, ...): at most one call every ms milliseconds
+ * - RATE(per_sec, burst, ...): token bucket, bursts of up to burst calls and
+ *   per_sec calls per second on average
+ * example:
+ *  LOGGER_WARN_EVERY_MS(1000, "queue full, dropped frame %d", frame);
+ * output:
+ *  queue full, dropped frame 5012 [suppressed 1234]
+ */
+#define LOGGER_LOCAL_TRACE_EVERY_N(logger, n, fmt, ...)       \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_TRACE,              \
+                       logger_limit_every_n(&_ulog_limit, n), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_TRACE_EVERY_N(n, fmt, ...) \
+  LOGGER_LOCAL_TRACE_EVERY_N(ULOG_GLOBAL, n, fmt, ##__VA_ARGS__)
+#define LOGGER_LOCAL_TRACE_EVERY_MS(logger, ms, fmt, ...)       \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_TRACE,                \
+                       logger_limit_every_ms(&_ulog_limit, ms), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_TRACE_EVERY_MS(ms, fmt, ...) \
+  LOGGER_LOCAL_TRACE_EVERY_MS(ULOG_GLOBAL, ms, fmt, ##__VA_ARGS__)
+#define LOGGER_LOCAL_TRACE_RATE(logger, per_sec, burst, fmt, ...)       \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_TRACE,                        \
+                       logger_limit_rate(&_ulog_limit, per_sec, burst), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_TRACE_RATE(per_sec, burst, fmt, ...) \
+  LOGGER_LOCAL_TRACE_RATE(ULOG_GLOBAL, per_sec, burst, fmt, ##__VA_ARGS__)
+
+#define LOGGER_LOCAL_DEBUG_EVERY_N(logger, n, fmt, ...)       \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_DEBUG,              \
+                       logger_limit_every_n(&_ulog_limit, n), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_DEBUG_EVERY_N(n, fmt, ...) \
+  LOGGER_LOCAL_DEBUG_EVERY_N(ULOG_GLOBAL, n, fmt, ##__VA_ARGS__)
+#define LOGGER_LOCAL_DEBUG_EVERY_MS(logger, ms, fmt, ...)       \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_DEBUG,                \
+                       logger_limit_every_ms(&_ulog_limit, ms), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_DEBUG_EVERY_MS(ms, fmt, ...) \
+  LOGGER_LOCAL_DEBUG_EVERY_MS(ULOG_GLOBAL, ms, fmt, ##__VA_ARGS__)
+#define LOGGER_LOCAL_DEBUG_RATE(logger, per_sec, burst, fmt, ...)       \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_DEBUG,                        \
+                       logger_limit_rate(&_ulog_limit, per_sec, burst), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_DEBUG_RATE(per_sec, burst, fmt, ...) \
+  LOGGER_LOCAL_DEBUG_RATE(ULOG_GLOBAL, per_sec, burst, fmt, ##__VA_ARGS__)
+
+#define LOGGER_LOCAL_INFO_EVERY_N(logger, n, fmt, ...)        \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_INFO,               \
+                       logger_limit_every_n(&_ulog_limit, n), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_INFO_EVERY_N(n, fmt, ...) \
+  LOGGER_LOCAL_INFO_EVERY_N(ULOG_GLOBAL, n, fmt, ##__VA_ARGS__)
+#define LOGGER_LOCAL_INFO_EVERY_MS(logger, ms, fmt, ...)        \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_INFO,                 \
+                       logger_limit_every_ms(&_ulog_limit, ms), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_INFO_EVERY_MS(ms, fmt, ...) \
+  LOGGER_LOCAL_INFO_EVERY_MS(ULOG_GLOBAL, ms, fmt, ##__VA_ARGS__)
+#define LOGGER_LOCAL_INFO_RATE(logger, per_sec, burst, fmt, ...)        \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_INFO,                         \
+                       logger_limit_rate(&_ulog_limit, per_sec, burst), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_INFO_RATE(per_sec, burst, fmt, ...) \
+  LOGGER_LOCAL_INFO_RATE(ULOG_GLOBAL, per_sec, burst, fmt, ##__VA_ARGS__)
+
+#define LOGGER_LOCAL_WARN_EVERY_N(logger, n, fmt, ...)        \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_WARN,               \
+                       logger_limit_every_n(&_ulog_limit, n), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_WARN_EVERY_N(n, fmt, ...) \
+  LOGGER_LOCAL_WARN_EVERY_N(ULOG_GLOBAL, n, fmt, ##__VA_ARGS__)
+#define LOGGER_LOCAL_WARN_EVERY_MS(logger, ms, fmt, ...)        \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_WARN,                 \
+                       logger_limit_every_ms(&_ulog_limit, ms), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_WARN_EVERY_MS(ms, fmt, ...) \
+  LOGGER_LOCAL_WARN_EVERY_MS(ULOG_GLOBAL, ms, fmt, ##__VA_ARGS__)
+#define LOGGER_LOCAL_WARN_RATE(logger, per_sec, burst, fmt, ...)        \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_WARN,                         \
+                       logger_limit_rate(&_ulog_limit, per_sec, burst), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_WARN_RATE(per_sec, burst, fmt, ...) \
+  LOGGER_LOCAL_WARN_RATE(ULOG_GLOBAL, per_sec, burst, fmt, ##__VA_ARGS__)
+
+#define LOGGER_LOCAL_ERROR_EVERY_N(logger, n, fmt, ...)       \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_ERROR,              \
+                       logger_limit_every_n(&_ulog_limit, n), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_ERROR_EVERY_N(n, fmt, ...) \
+  LOGGER_LOCAL_ERROR_EVERY_N(ULOG_GLOBAL, n, fmt, ##__VA_ARGS__)
+#define LOGGER_LOCAL_ERROR_EVERY_MS(logger, ms, fmt, ...)       \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_ERROR,                \
+                       logger_limit_every_ms(&_ulog_limit, ms), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_ERROR_EVERY_MS(ms, fmt, ...) \
+  LOGGER_LOCAL_ERROR_EVERY_MS(ULOG_GLOBAL, ms, fmt, ##__VA_ARGS__)
+#define LOGGER_LOCAL_ERROR_RATE(logger, per_sec, burst, fmt, ...)       \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_ERROR,                        \
+                       logger_limit_rate(&_ulog_limit, per_sec, burst), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_ERROR_RATE(per_sec, burst, fmt, ...) \
+  LOGGER_LOCAL_ERROR_RATE(ULOG_GLOBAL, per_sec, burst, fmt, ##__VA_ARGS__)
+
+#define LOGGER_LOCAL_FATAL_EVERY_N(logger, n, fmt, ...)       \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_FATAL,              \
+                       logger_limit_every_n(&_ulog_limit, n), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_FATAL_EVERY_N(n, fmt, ...) \
+  LOGGER_LOCAL_FATAL_EVERY_N(ULOG_GLOBAL, n, fmt, ##__VA_ARGS__)
+#define LOGGER_LOCAL_FATAL_EVERY_MS(logger, ms, fmt, ...)       \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_FATAL,                \
+                       logger_limit_every_ms(&_ulog_limit, ms), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_FATAL_EVERY_MS(ms, fmt, ...) \
+  LOGGER_LOCAL_FATAL_EVERY_MS(ULOG_GLOBAL, ms, fmt, ##__VA_ARGS__)
+#define LOGGER_LOCAL_FATAL_RATE(logger, per_sec, burst, fmt, ...)       \
+  ULOG_OUT_LOG_LIMITED(logger, ULOG_LEVEL_FATAL,                        \
+                       logger_limit_rate(&_ulog_limit, per_sec, burst), \
+                       fmt, ##__VA_ARGS__)
+#define LOGGER_FATAL_RATE(per_sec, burst, fmt, ...) \
+  LOGGER_LOCAL_FATAL_RATE(ULOG_GLOBAL, per_sec, burst, fmt, ##__VA_ARGS__)
+
 /**
  * Output various tokens (Requires C++ 11 or GNU extension)
  * example:
@@ -161,11 +645,12 @@ bool logger_check_format(struct ulog_s *logger, int32_t format);
  *  LOG_TOKEN(pi * 50.f / 180.f);
  *  LOG_TOKEN(&pi);  // print address of pi
  * output:
- *  (float) pi => 3.140000
- *  (float) pi * 50.f / 180.f => 0.872222
- *  (void *) &pi => 7fff2f5568d8
+ *  pi => 3.14
+ *  pi * 50.f / 180.f => 0.8722222222222222
+ *  &pi => 0x7fff2f5568d8
  * @param token Can be float, double, [unsigned / signed] char / short / int /
- * long / long long and pointers of the above type
+ * long / long long and pointers of the above type. Floating point values are
+ * written with the fewest digits that read back as the same value.
  */
 #define LOGGER_LOCAL_TOKEN(logger, token) ULOG_OUT_TOKEN(logger, token)
 #define LOGGER_TOKEN(token) LOGGER_LOCAL_TOKEN(ULOG_GLOBAL, token)
@@ -186,6 +671,40 @@ bool logger_check_format(struct ulog_s *logger, int32_t format);
 #define LOGGER_MULTI_TOKEN(...) \
   LOGGER_LOCAL_MULTI_TOKEN(ULOG_GLOBAL, __VA_ARGS__)
 
+/**
+ * Structured logs, the fields are built with ULOG_KV(key, value) from an
+ * integer, floating point, bool or string value
+ * example:
+ *  LOGGER_INFO_KV("order filled", ULOG_KV("id", id), ULOG_KV("px", px));
+ * output:
+ *  order filled id=1042 px=101.25
+ * @param msg Message, a string literal
+ */
+#define LOGGER_LOCAL_TRACE_KV(logger, msg, ...) \
+  ULOG_OUT_KV(logger, ULOG_LEVEL_TRACE, msg, __VA_ARGS__)
+#define LOGGER_TRACE_KV(msg, ...) \
+  LOGGER_LOCAL_TRACE_KV(ULOG_GLOBAL, msg, __VA_ARGS__)
+#define LOGGER_LOCAL_DEBUG_KV(logger, msg, ...) \
+  ULOG_OUT_KV(logger, ULOG_LEVEL_DEBUG, msg, __VA_ARGS__)
+#define LOGGER_DEBUG_KV(msg, ...) \
+  LOGGER_LOCAL_DEBUG_KV(ULOG_GLOBAL, msg, __VA_ARGS__)
+#define LOGGER_LOCAL_INFO_KV(logger, msg, ...) \
+  ULOG_OUT_KV(logger, ULOG_LEVEL_INFO, msg, __VA_ARGS__)
+#define LOGGER_INFO_KV(msg, ...) \
+  LOGGER_LOCAL_INFO_KV(ULOG_GLOBAL, msg, __VA_ARGS__)
+#define LOGGER_LOCAL_WARN_KV(logger, msg, ...) \
+  ULOG_OUT_KV(logger, ULOG_LEVEL_WARN, msg, __VA_ARGS__)
+#define LOGGER_WARN_KV(msg, ...) \
+  LOGGER_LOCAL_WARN_KV(ULOG_GLOBAL, msg, __VA_ARGS__)
+#define LOGGER_LOCAL_ERROR_KV(logger, msg, ...) \
+  ULOG_OUT_KV(logger, ULOG_LEVEL_ERROR, msg, __VA_ARGS__)
+#define LOGGER_ERROR_KV(msg, ...) \
+  LOGGER_LOCAL_ERROR_KV(ULOG_GLOBAL, msg, __VA_ARGS__)
+#define LOGGER_LOCAL_FATAL_KV(logger, msg, ...) \
+  ULOG_OUT_KV(logger, ULOG_LEVEL_FATAL, msg, __VA_ARGS__)
+#define LOGGER_FATAL_KV(msg, ...) \
+  LOGGER_LOCAL_FATAL_KV(ULOG_GLOBAL, msg, __VA_ARGS__)
+
 /**
  * Statistics code running time,
  * example:
@@ -201,6 +720,34 @@ bool logger_check_format(struct ulog_s *logger, int32_t format);
 #define LOGGER_LOCAL_TIME_CODE(logger, ...) ULOG_TIME_CODE(logger, __VA_ARGS__)
 #define LOGGER_TIME_CODE(...) LOGGER_LOCAL_TIME_CODE(ULOG_GLOBAL, __VA_ARGS__)
 
+/**
+ * Aggregate the running time of a code location instead of printing it on
+ * every execution, for code executed too often for LOGGER_TIME_CODE. Each
+ * location counts its executions, the min / max / sum and a latency histogram
+ * in per-thread slots without locks, and outputs one summary line per interval
+ * (see logger_profile_set_report_interval()) or on logger_profile_report().
+ * LOGGER_PROFILE_SCOPE times the rest of the enclosing scope (requires GCC or
+ * clang), LOGGER_PROFILE_CODE the code passed to it and returns its running
+ * time in nanoseconds.
+ * example:
+ *  while (running) {
+ *    LOGGER_PROFILE_SCOPE("control loop");
+ *    ...
+ *  }
+ * output (every 10 seconds):
+ *  profile "control loop": count=998400 avg=3815ns min=3410ns p50=3583ns
+ *  p90=4095ns p99=6143ns max=51230ns (10.000s)
+ * @param name Name of the location in the summary, a string literal
+ */
+#define LOGGER_LOCAL_PROFILE_SCOPE(logger, name) \
+  ULOG_PROFILE_SCOPE(logger, name)
+#define LOGGER_PROFILE_SCOPE(name) \
+  LOGGER_LOCAL_PROFILE_SCOPE(ULOG_GLOBAL, name)
+#define LOGGER_LOCAL_PROFILE_CODE(logger, name, ...) \
+  ULOG_PROFILE_CODE(logger, name, __VA_ARGS__)
+#define LOGGER_PROFILE_CODE(name, ...) \
+  LOGGER_LOCAL_PROFILE_CODE(ULOG_GLOBAL, name, __VA_ARGS__)
+
 /**
  * Display contents in hexadecimal and ascii.
  * Same format as "hexdump -C filename"
@@ -13,23 +13,39 @@
 //
 // Usage:
 //   ulog::info("Hello {}", name);
+//   ulog::info("order filled", ulog::kv("id", id), ulog::kv("px", px));
 //   ulog::get_default_logger().set_output_callback(my_cb);
 //
 //   ulog::Logger my_logger;
 //   my_logger.set_output_callback(my_cb);
 //   my_logger.debug("x={:.2f}", value);
 //
+//   // Errors also go to a file, the line is formatted once for all targets
+//   my_logger.add_sink(std::make_unique<ulog::file::SinkLimitSizeFile>(...),
+//                      ulog::level::error, ulog::kDefaultFormat &
+//                                              ~ulog::kFormatColor);
+//
+//   // Arguments only evaluated when the level is output
+//   ULOG_FMT_DEBUG(my_logger, "state {}", dump_state());
+//
 // CMake: link against the `ulog_fmt` interface target.
 
 #ifdef __cplusplus
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <iterator>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <type_traits>
+#include <vector>
 
 // Select the format backend:
 //   ULOG_FMT_USE_STD=1  → C++20 std::format (set by cmake/fmt.cmake priority 1)
@@ -43,13 +59,10 @@
 #  define ULOG_FMT_USE_STD_ 0
 #endif
 
-// Platform includes for PID / TID
-#include <unistd.h>
-#if defined(__APPLE__)
-#  include <pthread.h>
-#else
-#  include <sys/syscall.h>
-#endif
+// Header rendering helpers shared with the C core (logger_render_time,
+// logger_render_process_id)
+#include "ulog/ulog_c.h"
+#include "ulog/file/sink_base.h"
 
 namespace ulog {
 
@@ -68,7 +81,7 @@ enum class level : int {
 
 // ---------------------------------------------------------------------------
 // Output format flags (mirror the C-API flags so existing callback code stays
-// compatible, but the C API itself is not used by this header)
+// compatible; only the C core's header rendering helpers are used here)
 // ---------------------------------------------------------------------------
 constexpr int kFormatColor    = 1 << 0;
 constexpr int kFormatNumber   = 1 << 1;
@@ -82,11 +95,76 @@ constexpr int kDefaultFormat =
     kFormatColor | kFormatTime | kFormatPid |
     kFormatLevel | kFormatFileLine | kFormatFunction;
 
+// Format of a sink that follows the format flags of its logger
+constexpr int kFormatOfLogger = -1;
+
+// How the logs are numbered when kFormatNumber is enabled (same as
+// enum ulog_number_mode_e): one shared counter with consecutive numbers, or
+// counters striped by thread with unique numbers that increase per thread
+enum class number_mode : int {
+  sequential = ULOG_NUMBER_SEQUENTIAL,
+  striped    = ULOG_NUMBER_STRIPED,
+};
+
+// Clock of the timestamps (same as enum ulog_clock_e), see logger_set_clock()
+enum class clock : int {
+  realtime        = ULOG_CLOCK_REALTIME,
+  realtime_coarse = ULOG_CLOCK_REALTIME_COARSE,
+  monotonic       = ULOG_CLOCK_MONOTONIC,
+  tsc             = ULOG_CLOCK_TSC,
+};
+
+// Rendering of the fields of structured logs (same as enum ulog_kv_format_e)
+enum class kv_format : int {
+  logfmt = ULOG_KV_LOGFMT,  // " id=42 px=1.5"
+  json   = ULOG_KV_JSON,    // " {\"id\":42,\"px\":1.5}"
+};
+
 // ---------------------------------------------------------------------------
 // Callback types (same ABI as the C API so existing callbacks can be reused)
 // ---------------------------------------------------------------------------
-using output_callback_t = int (*)(void*, const char*);
-using flush_callback_t  = void (*)(void*);
+using output_callback_t     = int (*)(void*, const char*);
+using output_len_callback_t = int (*)(void*, const char*, size_t);
+using output_v_callback_t   = int (*)(void*, const ulog_iovec_s*, int);
+using flush_callback_t      = void (*)(void*);
+using output_kv_callback_t  = int (*)(void*, const char*, size_t, const void*,
+                                      size_t);
+
+// ---------------------------------------------------------------------------
+// Field of a structured log, passed to the logging methods behind the message
+// arguments and encoded into a binary record (see logger_kv_encode()) instead
+// of being formatted into the message:
+//
+//   logger.info("order filled", ulog::kv("id", id), ulog::kv("px", px));
+//
+// The key and a string value are referenced, not copied, so a field must not
+// outlive the log call.
+// ---------------------------------------------------------------------------
+struct field {
+  ulog_kv_s kv;
+};
+
+template <typename T,
+          typename = std::enable_if_t<std::is_arithmetic<T>::value>>
+inline field kv(const char* key, T value) noexcept {
+  if constexpr (std::is_same<T, bool>::value) {
+    return {logger_kv_bool(key, value)};
+  } else if constexpr (std::is_floating_point<T>::value) {
+    return {logger_kv_double(key, static_cast<double>(value))};
+  } else if constexpr (std::is_signed<T>::value) {
+    return {logger_kv_int(key, static_cast<int64_t>(value))};
+  } else {
+    return {logger_kv_uint(key, static_cast<uint64_t>(value))};
+  }
+}
+
+inline field kv(const char* key, const char* value) noexcept {
+  return {logger_kv_string(key, value)};
+}
+
+inline field kv(const char* key, std::string_view value) noexcept {
+  return {logger_kv_string_len(key, value.data(), value.size())};
+}
 
 // ---------------------------------------------------------------------------
 // detail namespace – internal helpers, not part of the public API
@@ -112,13 +190,32 @@ template <typename... Args>
 using format_string = fmt::format_string<Args...>;
 #endif
 
-// Unified format call – dispatches to std::format or fmt::format.
+// Unified format call – dispatches to std::format_to or fmt::format_to and
+// appends to out without a temporary string.
 template <typename... Args>
-inline std::string do_format(format_string<Args...> fmt_str, Args&&... args) {
+inline void format_append(std::string& out, format_string<Args...> fmt_str,
+                          Args&&... args) {
 #if ULOG_FMT_USE_STD_
-  return std::format(fmt_str, std::forward<Args>(args)...);
+  std::format_to(std::back_inserter(out), fmt_str,
+                 std::forward<Args>(args)...);
 #else
-  return fmt::format(fmt_str, std::forward<Args>(args)...);
+  fmt::format_to(std::back_inserter(out), fmt_str,
+                 std::forward<Args>(args)...);
+#endif
+}
+
+// Appends the arguments formatted with a string that has already been checked
+// against their types at the call site.
+template <typename... Args>
+inline void vformat_append(std::string& out, std::string_view fmt_str,
+                           const Args&... args) {
+#if ULOG_FMT_USE_STD_
+  std::vformat_to(std::back_inserter(out), fmt_str,
+                  std::make_format_args(args...));
+#else
+  fmt::vformat_to(std::back_inserter(out),
+                  fmt::string_view(fmt_str.data(), fmt_str.size()),
+                  fmt::make_format_args(args...));
 #endif
 }
 
@@ -133,6 +230,35 @@ inline std::string do_format(format_string<Args...> fmt_str, Args&&... args) {
 #  define ULOG_FMT_STRLIT_CTOR
 #endif
 
+// The format string as a view when it is a string literal (static storage,
+// so it can be formatted later on another thread), empty otherwise.
+template <typename S>
+constexpr std::string_view literal_view(const S& s) {
+  if constexpr (std::is_array<S>::value &&
+                std::is_same<std::remove_cv_t<std::remove_extent_t<S>>,
+                             char>::value) {
+    return std::string_view(s, std::extent<S>::value - 1);
+  } else {
+    return std::string_view();
+  }
+}
+
+// File name of a path. GCC folds the search in __builtin_FILE() at compile
+// time, so the call site only holds a pointer into the literal.
+constexpr const char* path_basename(const char* path) noexcept {
+#if defined(__GNUC__) && !defined(__clang__)
+  const char* s = __builtin_strrchr(path, '/');
+  if (!s) s = __builtin_strrchr(path, '\\');
+  return s ? s + 1 : path;
+#else
+  const char* base = path;
+  for (const char* p = path; *p; ++p) {
+    if (*p == '/' || *p == '\\') base = p + 1;
+  }
+  return base;
+#endif
+}
+
 // Wraps a format string and captures the caller's source location via
 // __builtin_FILE / __builtin_LINE / __builtin_FUNCTION default parameters.
 // These builtins are evaluated at the point where loc_fmt_str is constructed
@@ -140,9 +266,10 @@ inline std::string do_format(format_string<Args...> fmt_str, Args&&... args) {
 template <typename... Args>
 struct loc_fmt_str {
   format_string<Args...> fmt;
-  const char* file;
+  std::string_view file;  // File name without the directories
   int line;
-  const char* func;
+  std::string_view func;
+  std::string_view literal;
 
   // Explicit copy / move constructors prevent the forwarding-reference
   // constructor below from being selected when this type is passed between
@@ -156,16 +283,22 @@ struct loc_fmt_str {
   // that std::format_string's consteval constructor can treat the string
   // literal argument as a constant expression.
   // enable_if ensures this is not selected when S is the same loc_fmt_str
-  // specialisation (copy/move ctors above take priority).
+  // specialisation (copy/move ctors above take priority), nor when S is not a
+  // format string (e.g. the log_limit of the rate limited overloads).
   template <typename S,
             typename = std::enable_if_t<
-                !std::is_same<std::decay_t<S>, loc_fmt_str>::value>>
+                !std::is_same<std::decay_t<S>, loc_fmt_str>::value &&
+                std::is_constructible<format_string<Args...>, S>::value>>
   ULOG_FMT_STRLIT_CTOR
   loc_fmt_str(S&& s,
               const char* f  = __builtin_FILE(),
               int l          = __builtin_LINE(),
               const char* fn = __builtin_FUNCTION())
-      : fmt(std::forward<S>(s)), file(f), line(l), func(fn) {}
+      : fmt(std::forward<S>(s)),
+        file(path_basename(f)),
+        line(l),
+        func(fn),
+        literal(literal_view<std::remove_reference_t<S>>(s)) {}
 };
 
 // ANSI color codes
@@ -192,34 +325,384 @@ constexpr level_info kLevelTable[] = {
     {kColorPurple, "F"},  // fatal
 };
 
-inline int get_pid() noexcept {
-  static const int pid = static_cast<int>(::getpid());
-  return pid;
+// Cached per thread by the C core, refreshed after fork()
+inline int get_pid() noexcept { return logger_process_id(); }
+
+inline long get_tid() noexcept { return logger_thread_id(); }
+
+// Log counter of a logger, each counter is alone on its cache line
+class log_counter {
+ public:
+  uint32_t next(number_mode mode) noexcept {
+    if (mode == number_mode::striped) {
+      // Stripe s hands out s + 1, s + 1 + kStripes, ...
+      const unsigned s = stripe();
+      return stripes_[s].value.fetch_add(1, std::memory_order_relaxed) *
+                 kStripes + s + 1;
+    }
+    return sequential_.value.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+
+  // Number of logs that have been numbered
+  uint64_t count() const noexcept {
+    uint64_t n = sequential_.value.load(std::memory_order_relaxed);
+    for (const auto& c : stripes_) n += c.value.load(std::memory_order_relaxed);
+    return n;
+  }
+
+ private:
+  static constexpr unsigned kStripes = 16;
+
+  struct alignas(64) counter {
+    std::atomic<uint32_t> value{0};
+  };
+
+  // Threads are spread over the stripes round-robin
+  static unsigned stripe() noexcept {
+    static std::atomic<unsigned> next_stripe{0};
+    thread_local const unsigned s =
+        next_stripe.fetch_add(1, std::memory_order_relaxed) % kStripes;
+    return s;
+  }
+
+  counter sequential_;
+  counter stripes_[kStripes];
+};
+
+// Minimum level of the module of a logger (see logger_set_module_levels()),
+// cached with the generation of the module levels, so it is only looked up
+// again after a change
+class module_filter {
+ public:
+  void set(const char* module) {
+    module_ = module ? module : "";
+    cache_.store(0, std::memory_order_relaxed);
+  }
+
+  int level() const noexcept {
+    const uint32_t generation =
+        __atomic_load_n(&ulog_site_generation, __ATOMIC_RELAXED);
+    uint64_t cache = cache_.load(std::memory_order_relaxed);
+    if (static_cast<uint32_t>(cache >> 8) != generation) {
+      const ulog_level_e lvl =
+          logger_get_module_level(module_.empty() ? nullptr : module_.c_str());
+      cache = static_cast<uint64_t>(generation) << 8 | lvl;
+      cache_.store(cache, std::memory_order_relaxed);
+    }
+    return static_cast<int>(cache & 0xff);
+  }
+
+ private:
+  std::string module_;
+  // Generation << 8 | level, the generation is never 0
+  mutable std::atomic<uint64_t> cache_{0};
+};
+
+// Appends the decimal digits of value
+inline void append_decimal(std::string& out, uint32_t value) {
+  char digits[10];
+  char* p = digits + sizeof(digits);
+  do {
+    *--p = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value);
+  out.append(p, digits + sizeof(digits) - p);
 }
 
-inline long get_tid() noexcept {
-#if defined(__APPLE__)
-  return static_cast<long>(pthread_mach_thread_np(pthread_self()));
-#else
-  return static_cast<long>(syscall(SYS_gettid));
-#endif
+// Raw value of the clock of a logger, converted to the wall time when the
+// header is rendered
+struct timestamp {
+  uint64_t tick;
+  uint8_t  clock;
+  uint8_t  digits;  // Fraction digits
+
+  static timestamp now(ulog::clock clk, unsigned digits) noexcept {
+    const auto c = static_cast<ulog_clock_e>(clk);
+    return {logger_clock_now(c), static_cast<uint8_t>(c),
+            static_cast<uint8_t>(digits)};
+  }
+};
+
+// Header fields of a log, captured once and rendered for every format the
+// log is output with
+struct header_fields {
+  level            lvl;
+  uint32_t         num;
+  timestamp        time;
+  long             tid;
+  std::string_view file;
+  int              line;
+  std::string_view func;
+};
+
+// Appends the log header for the given format flags, the header fields are
+// captured by the caller (num, time and tid are only used when their format
+// flag is set). "file" is the file name of the call site, already cut from
+// the path.
+inline void render_header(std::string& out, int format, level lvl,
+                          uint32_t num, const timestamp& time, long tid,
+                          std::string_view file, int line,
+                          std::string_view func) {
+  const bool col = format & kFormatColor;
+  const auto& lv = kLevelTable[static_cast<int>(lvl)];
+
+  // Color prefix for header
+  if ((format & (kFormatNumber | kFormatTime | kFormatLevel)) && col)
+    out += lv.color;
+
+  // Serial number
+  if (format & kFormatNumber) format_append(out, "#{:06} ", num);
+
+  // Timestamp (shares the per-thread date cache of the C core)
+  if (format & kFormatTime) {
+    char ts[ULOG_TIME_STR_MAX];
+    const uint64_t ns = logger_clock_to_real_ns(
+        static_cast<ulog_clock_e>(time.clock), time.tick);
+    const size_t n = logger_render_time(
+        static_cast<time_t>(ns / 1000000000),
+        static_cast<uint32_t>(ns % 1000000000), time.digits, ts);
+    out.append(ts, n);
+    out += ' ';
+  }
+
+  // PID-TID
+  if (format & kFormatPid) {
+    char process_id[ULOG_PROCESS_ID_STR_MAX];
+    out.append(process_id, logger_render_process_id(tid, process_id));
+  }
+
+  // Level mark
+  if (format & kFormatLevel) out += lv.mark;
+
+  // Gray color for source location
+  if ((format & (kFormatLevel | kFormatFileLine | kFormatFunction)) && col)
+    out += kColorGray;
+
+  if (format & kFormatLevel) out += ' ';
+
+  // Source location
+  if (format & (kFormatFileLine | kFormatFunction)) {
+    out += '(';
+    if (format & kFormatFileLine) {
+      out += file;
+      out += ':';
+      append_decimal(out, static_cast<uint32_t>(line));
+    }
+    if (format & kFormatFunction) {
+      if (format & kFormatFileLine) out += ' ';
+      out += func;
+    }
+    out += ')';
+  }
+
+  if (format & (kFormatLevel | kFormatFileLine | kFormatFunction)) out += ' ';
+
+  // Message with level color
+  if (col) out += lv.color;
 }
 
-inline const char* basename(const char* path) noexcept {
-  const char* s = strrchr(path, '/');
-  if (!s) s = strrchr(path, '\\');
-  return s ? s + 1 : path;
+// Appends what follows the message
+inline void render_tail(std::string& out, int format) {
+  if (format & kFormatColor) out += kColorReset;
+  out += '\n';
 }
 
-inline uint64_t real_time_us() noexcept {
-  struct timespec tp;
-  clock_gettime(CLOCK_REALTIME, &tp);
-  return static_cast<uint64_t>(tp.tv_sec) * 1000000ULL +
-         static_cast<uint64_t>(tp.tv_nsec) / 1000ULL;
+// Output callbacks of a logger, the vectored callback is used when set, then
+// the length-aware one, then the string one. Structured logs go to the
+// structured output callback instead when it is set.
+struct output_callbacks {
+  output_callback_t     cb        = nullptr;
+  output_len_callback_t len_cb    = nullptr;
+  output_v_callback_t   v_cb      = nullptr;
+  void*                 user_data = nullptr;
+  output_kv_callback_t  kv_cb     = nullptr;
+
+  bool valid() const noexcept { return cb || len_cb || v_cb; }
+  bool valid(bool structured) const noexcept {
+    return valid() || (structured && kv_cb);
+  }
+
+  // "out" is made of header_len bytes of header, body_len bytes of message
+  // and the tail.
+  int write(const std::string& out, size_t header_len,
+            size_t body_len) const noexcept {
+    if (v_cb) {
+      const ulog_iovec_s iov[3] = {
+          {out.data(), header_len},
+          {out.data() + header_len, body_len},
+          {out.data() + header_len + body_len,
+           out.size() - header_len - body_len},
+      };
+      // Raw output has no header or tail
+      if (header_len == 0 && body_len == out.size())
+        return v_cb(user_data, &iov[1], 1);
+      return v_cb(user_data, iov, 3);
+    }
+    if (len_cb) return len_cb(user_data, out.data(), out.size());
+    return cb ? cb(user_data, out.c_str()) : 0;
+  }
+};
+
+// Appends the number of logs suppressed by a log_limit, same as the C core
+inline void append_suppressed(std::string& msg, uint64_t suppressed) {
+  if (suppressed) format_append(msg, " [suppressed {}]", suppressed);
+}
+
+template <typename T>
+using is_field = std::is_same<std::decay_t<T>, field>;
+
+template <typename... Args>
+constexpr size_t field_count() {
+  return (size_t{0} + ... + size_t{is_field<Args>::value});
+}
+
+// Encodes the field arguments into a binary record, returns its length
+template <typename... Args>
+size_t encode_fields(uint8_t* buf, size_t size, const Args&... args) {
+  ulog_kv_s fields[field_count<Args...>()];
+  size_t count = 0;
+  auto collect = [&](const auto& arg) {
+    if constexpr (is_field<decltype(arg)>::value) fields[count++] = arg.kv;
+  };
+  (collect(args), ...);
+  return logger_kv_encode(fields, count, buf, size);
+}
+
+// Appends the rendered fields of a record, same as the C core
+inline void append_fields(std::string& out, const void* fields,
+                          size_t fields_len, kv_format format) {
+  char text[ULOG_OUTBUF_LEN];
+  out.append(text, logger_kv_render(fields, fields_len,
+                                    static_cast<ulog_kv_format_e>(format),
+                                    text, sizeof(text)));
 }
 
+// Line buffer of the calling thread, shared by all loggers and kept between
+// logs, so a log does not allocate once the buffer has grown to the longest
+// line. A log written while the thread is rendering another one (from a
+// formatter or an output callback) gets a buffer of its own. Each slot is a
+// separate buffer of the thread.
+template <int Slot>
+class thread_line_buffer {
+ public:
+  thread_line_buffer() noexcept {
+    thread_buffer& tb = get();
+    if (!tb.in_use) {
+      tb.in_use = true;
+      owner_    = &tb;
+      out_      = &tb.str;
+      out_->clear();
+    }
+  }
+
+  ~thread_line_buffer() {
+    if (!owner_) return;
+    // Do not keep the memory of an exceptionally long line
+    if (owner_->str.capacity() > kMaxKeptCapacity)
+      std::string().swap(owner_->str);
+    owner_->in_use = false;
+  }
+
+  thread_line_buffer(const thread_line_buffer&)            = delete;
+  thread_line_buffer& operator=(const thread_line_buffer&) = delete;
+
+  std::string& str() noexcept { return *out_; }
+
+ private:
+  static constexpr size_t kMaxKeptCapacity = 64 * 1024;
+
+  struct thread_buffer {
+    std::string str;
+    bool        in_use = false;
+  };
+
+  static thread_buffer& get() noexcept {
+    thread_local thread_buffer tb;
+    return tb;
+  }
+
+  thread_buffer* owner_ = nullptr;
+  std::string    local_;
+  std::string*   out_ = &local_;
+};
+
+using line_buffer = thread_line_buffer<0>;
+// The line rendered again with the format of a sink
+using layout_buffer = thread_line_buffer<1>;
+
 }  // namespace detail
 
+// ---------------------------------------------------------------------------
+// Rate limits of a call site, same as LOGGER_XXX_EVERY_N / _EVERY_MS / _RATE.
+// Declare them static at the call site and pass them as the first argument:
+//
+//   static ulog::every_ms limit(1000);
+//   logger.warn(limit, "queue full, dropped frame {}", frame);
+//
+// A suppressed log is not formatted and only counted, the count is appended
+// to the next output as " [suppressed N]".
+// ---------------------------------------------------------------------------
+class log_limit {
+ public:
+  log_limit(const log_limit&)            = delete;
+  log_limit& operator=(const log_limit&) = delete;
+
+  // Whether the log may be output now, counts it as suppressed otherwise
+  bool allow() noexcept {
+    bool allowed = false;
+    switch (kind_) {
+      case kind::every_n:
+        allowed = logger_limit_every_n(&state_, a_);
+        break;
+      case kind::every_ms:
+        allowed = logger_limit_every_ms(&state_, a_);
+        break;
+      case kind::rate:
+        allowed = logger_limit_rate(&state_, static_cast<uint32_t>(a_), b_);
+        break;
+    }
+    if (!allowed) logger_limit_suppress(&state_);
+    return allowed;
+  }
+
+  // Number of logs suppressed since the last call
+  uint64_t take_suppressed() noexcept {
+    return logger_limit_take_suppressed(&state_);
+  }
+
+ protected:
+  enum class kind { every_n, every_ms, rate };
+
+  log_limit(kind k, uint64_t a, uint32_t b) noexcept : kind_(k), a_(a), b_(b) {}
+
+ private:
+  ulog_limit_s state_ = ULOG_LIMIT_INIT;
+  const kind     kind_;
+  const uint64_t a_;
+  const uint32_t b_;
+};
+
+// The 1st, (n + 1)th, (2n + 1)th... log
+class every_n : public log_limit {
+ public:
+  explicit every_n(uint64_t n) noexcept : log_limit(kind::every_n, n, 0) {}
+};
+
+// At most one log every interval_ms milliseconds
+class every_ms : public log_limit {
+ public:
+  explicit every_ms(uint64_t interval_ms) noexcept
+      : log_limit(kind::every_ms, interval_ms, 0) {}
+};
+
+// Token bucket: bursts of up to "burst" logs, "per_sec" logs per second on
+// average
+class rate : public log_limit {
+ public:
+  rate(uint32_t per_sec, uint32_t burst) noexcept
+      : log_limit(kind::rate, per_sec, burst) {}
+};
+
 // ---------------------------------------------------------------------------
 // Logger class
 // ---------------------------------------------------------------------------
@@ -235,14 +718,69 @@ class Logger {
 
   void set_output_callback(output_callback_t cb,
                            void* user_data = nullptr) noexcept {
-    output_cb_ = cb;
-    user_data_ = user_data;
+    output_.cb        = cb;
+    output_.user_data = user_data;
+  }
+
+  // Same as logger_set_output_callback_len(): used instead of the output
+  // callback when set, it also receives the length of the string
+  void set_output_callback_len(output_len_callback_t cb,
+                               void* user_data = nullptr) noexcept {
+    output_.len_cb    = cb;
+    output_.user_data = user_data;
+  }
+
+  // Same as logger_set_output_callback_v(): used instead of the other output
+  // callbacks when set, it receives the header, the message and the tail as
+  // separate segments
+  void set_output_callback_v(output_v_callback_t cb,
+                             void* user_data = nullptr) noexcept {
+    output_.v_cb      = cb;
+    output_.user_data = user_data;
   }
 
   void set_flush_callback(flush_callback_t cb) noexcept { flush_cb_ = cb; }
 
+  // Same as logger_set_output_kv_callback(): structured logs are passed to it
+  // without their fields and with the binary record of the fields, instead of
+  // the other output callbacks
+  void set_output_kv_callback(output_kv_callback_t cb,
+                              void* user_data = nullptr) noexcept {
+    output_.kv_cb     = cb;
+    output_.user_data = user_data;
+  }
+
+  // Same as logger_set_kv_format()
+  void set_kv_format(kv_format format) noexcept { kv_format_ = format; }
+
+  // Also outputs the logs of min_level and above to the sink, which is owned
+  // by the logger. A log is formatted once and the line is handed to every
+  // sink it reaches; the header and tail are rendered again for a sink with
+  // other format flags (e.g. without kFormatColor), once per log for all the
+  // sinks with the same flags. The calls of a sink are serialized by a lock of
+  // its own, so a sink that is not thread-safe (e.g. SinkRotatingFile) may be
+  // used by a logger of several threads; SinkAsyncWrapper<mpsc::Mq> keeps the
+  // file writes off the logging threads. Add the sinks before logging.
+  void add_sink(std::unique_ptr<file::SinkBase>&& sink,
+                level min_level = level::trace, int format = kFormatOfLogger) {
+    sinks_.push_back({std::move(sink), std::make_unique<std::mutex>(),
+                      min_level, format});
+    // Sinks with the same format are next to each other
+    std::stable_sort(sinks_.begin(), sinks_.end(),
+                     [](const sink_entry& a, const sink_entry& b) {
+                       return a.format < b.format;
+                     });
+    if (static_cast<int>(min_level) < static_cast<int>(sinks_level_))
+      sinks_level_ = min_level;
+    if (format != kFormatOfLogger) sinks_format_ |= format;
+  }
+
   void set_level(level lvl) noexcept { level_ = lvl; }
 
+  // Module of the logs, filtered by logger_set_module_levels() on top of the
+  // level of the logger. Set before logging.
+  void set_module(const char* module) { module_.set(module); }
+
   void enable_format(int flags) noexcept { format_ |= flags; }
   void disable_format(int flags) noexcept { format_ &= ~flags; }
   bool check_format(int flags) const noexcept {
@@ -250,6 +788,29 @@ class Logger {
   }
   void enable_output(bool enable) noexcept { output_enabled_ = enable; }
 
+  // Same as logger_set_number_mode()
+  void set_number_mode(number_mode mode) noexcept { number_mode_ = mode; }
+
+  // Same as logger_set_clock(), false if the clock is not available
+  bool set_clock(ulog::clock clk) noexcept {
+    if (logger_clock_prepare(static_cast<ulog_clock_e>(clk)) != 0) return false;
+    clock_ = clk;
+    return true;
+  }
+
+  // Same as logger_set_time_precision()
+  void set_time_precision(unsigned frac_digits) noexcept {
+    time_digits_ = frac_digits < 9 ? frac_digits : 9;
+  }
+
+  // Number of logs that have been numbered
+  uint64_t log_count() const noexcept { return log_num_.count(); }
+
+  // Whether a log of the level would be output, checked by the logging
+  // methods before formatting and by ULOG_FMT_<LEVEL> before evaluating the
+  // arguments
+  bool should_log(level lvl) const noexcept { return is_enabled(lvl); }
+
   // --- Logging methods ---
   // Each method uses a loc_fmt_str wrapper as its first parameter.  The
   // wrapper's constructor default-parameter builtins are evaluated at the
@@ -259,150 +820,272 @@ class Logger {
   void trace(
       detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
       Args&&... args) {
-    log_(level::trace, lf.file, lf.line, lf.func,
-         detail::do_format(lf.fmt, std::forward<Args>(args)...));
+    log_<Args...>(level::trace, 0, lf, std::forward<Args>(args)...);
   }
 
   template <typename... Args>
   void debug(
       detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
       Args&&... args) {
-    log_(level::debug, lf.file, lf.line, lf.func,
-         detail::do_format(lf.fmt, std::forward<Args>(args)...));
+    log_<Args...>(level::debug, 0, lf, std::forward<Args>(args)...);
   }
 
   template <typename... Args>
   void info(
       detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
       Args&&... args) {
-    log_(level::info, lf.file, lf.line, lf.func,
-         detail::do_format(lf.fmt, std::forward<Args>(args)...));
+    log_<Args...>(level::info, 0, lf, std::forward<Args>(args)...);
   }
 
   template <typename... Args>
   void warn(
       detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
       Args&&... args) {
-    log_(level::warn, lf.file, lf.line, lf.func,
-         detail::do_format(lf.fmt, std::forward<Args>(args)...));
+    log_<Args...>(level::warn, 0, lf, std::forward<Args>(args)...);
   }
 
   template <typename... Args>
   void error(
       detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
       Args&&... args) {
-    log_(level::error, lf.file, lf.line, lf.func,
-         detail::do_format(lf.fmt, std::forward<Args>(args)...));
+    log_<Args...>(level::error, 0, lf, std::forward<Args>(args)...);
   }
 
   template <typename... Args>
   void fatal(
       detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
       Args&&... args) {
-    log_(level::fatal, lf.file, lf.line, lf.func,
-         detail::do_format(lf.fmt, std::forward<Args>(args)...));
+    log_<Args...>(level::fatal, 0, lf, std::forward<Args>(args)...);
   }
 
-  // raw: outputs the formatted message without any log header
+  // Rate limited logs, see log_limit
   template <typename... Args>
-  void raw(level lvl, detail::format_string<Args...> fmt_str, Args&&... args) {
-    if (!is_enabled(lvl)) return;
-    auto msg = detail::do_format(fmt_str, std::forward<Args>(args)...);
-    write_(msg.c_str());
+  void trace(log_limit& limit,
+             detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+             Args&&... args) {
+    log_limited_<Args...>(limit, level::trace, lf, std::forward<Args>(args)...);
   }
 
- private:
-  static int default_output(void*, const char* s) {
-    return ::printf("%s", s);
+  template <typename... Args>
+  void debug(log_limit& limit,
+             detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+             Args&&... args) {
+    log_limited_<Args...>(limit, level::debug, lf, std::forward<Args>(args)...);
   }
 
-  output_callback_t     output_cb_      = default_output;
-  flush_callback_t      flush_cb_       = nullptr;
-  void*                 user_data_      = nullptr;
-  level                 level_          = level::trace;
-  int                   format_         = kDefaultFormat;
-  bool                  output_enabled_ = true;
-  std::atomic<uint32_t> log_num_{1};
+  template <typename... Args>
+  void info(log_limit& limit,
+            detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+            Args&&... args) {
+    log_limited_<Args...>(limit, level::info, lf, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void warn(log_limit& limit,
+            detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+            Args&&... args) {
+    log_limited_<Args...>(limit, level::warn, lf, std::forward<Args>(args)...);
+  }
 
-  bool is_enabled(level lvl) const noexcept {
-    return output_enabled_ && output_cb_ &&
-           static_cast<int>(lvl) >= static_cast<int>(level_);
+  template <typename... Args>
+  void error(log_limit& limit,
+             detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+             Args&&... args) {
+    log_limited_<Args...>(limit, level::error, lf, std::forward<Args>(args)...);
   }
 
-  void write_(const char* s) noexcept {
-    if (output_cb_) output_cb_(user_data_, s);
+  template <typename... Args>
+  void fatal(log_limit& limit,
+             detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+             Args&&... args) {
+    log_limited_<Args...>(limit, level::fatal, lf, std::forward<Args>(args)...);
   }
 
-  void log_(level lvl, const char* file, int line, const char* func,
-            std::string msg) {
+  // raw: outputs the formatted message without any log header
+  template <typename... Args>
+  void raw(level lvl, detail::format_string<Args...> fmt_str, Args&&... args) {
     if (!is_enabled(lvl)) return;
+    detail::line_buffer buffer;
+    std::string& out = buffer.str();
+    detail::format_append(out, fmt_str, std::forward<Args>(args)...);
+    output_.write(out, 0, out.size());
+    for (auto& s : sinks_) {
+      if (static_cast<int>(lvl) >= static_cast<int>(s.min_level))
+        s.write(out.data(), out.size());
+    }
+  }
 
-    const int li   = static_cast<int>(lvl);
-    const bool col = check_format(kFormatColor);
-    const auto& lv = detail::kLevelTable[li];
-
-    std::string out;
-    out.reserve(256);
+ private:
+  static int default_output(void*, const char* s) {
+    return ::printf("%s", s);
+  }
 
-    // Color prefix for header
-    if (check_format(kFormatNumber | kFormatTime | kFormatLevel) && col)
-      out += lv.color;
+  struct sink_entry {
+    std::unique_ptr<file::SinkBase> sink;
+    std::unique_ptr<std::mutex>     mutex;  // Serializes the calls of the sink
+    level                           min_level;
+    int                             format;
 
-    // Serial number
-    if (check_format(kFormatNumber)) {
-      const uint32_t n =
-          log_num_.fetch_add(1, std::memory_order_relaxed);
-      out += detail::do_format("#{:06} ", n);
+    void write(const char* data, size_t len) {
+      std::lock_guard<std::mutex> lock(*mutex);
+      sink->SinkIt(data, len);
     }
 
-    // Timestamp
-    if (check_format(kFormatTime)) {
-      const uint64_t us = detail::real_time_us();
-      const time_t   s  = static_cast<time_t>(us / 1000000);
-      const int      ms = static_cast<int>((us % 1000000) / 1000);
-      struct tm      lt = *localtime(&s);  // NOLINT: same approach as C core
-      out += detail::do_format("{:04}-{:02}-{:02} {:02}:{:02}:{:02}.{:03} ",
-                               lt.tm_year + 1900, lt.tm_mon + 1, lt.tm_mday,
-                               lt.tm_hour, lt.tm_min, lt.tm_sec, ms);
+    void flush() {
+      std::lock_guard<std::mutex> lock(*mutex);
+      sink->Flush();
     }
+  };
+
+  detail::output_callbacks output_{default_output};
+  flush_callback_t         flush_cb_       = nullptr;
+  level                    level_          = level::trace;
+  int                      format_         = kDefaultFormat;
+  bool                     output_enabled_ = true;
+  number_mode              number_mode_    = number_mode::sequential;
+  ulog::clock              clock_          = ulog::clock::realtime;
+  unsigned                 time_digits_    = 3;
+  kv_format                kv_format_      = kv_format::logfmt;
+  detail::log_counter      log_num_;
+  detail::module_filter    module_;
+  std::vector<sink_entry>  sinks_;
+  level                    sinks_level_  = level::off;  // Lowest sink level
+  int                      sinks_format_ = 0;  // Flags of the sink formats
+
+  // @param structured Whether the log has fields
+  bool is_enabled(level lvl, bool structured = false) const noexcept {
+    return output_enabled_ &&
+           (output_.valid(structured) ||
+            static_cast<int>(lvl) >= static_cast<int>(sinks_level_)) &&
+           static_cast<int>(lvl) >= static_cast<int>(level_) &&
+           static_cast<int>(lvl) >= module_.level();
+  }
 
-    // PID-TID
-    if (check_format(kFormatPid))
-      out += detail::do_format("{}-{} ", detail::get_pid(), detail::get_tid());
+  // The limit is only checked for enabled levels, the suppressed logs are
+  // never formatted
+  template <typename... Args>
+  void log_limited_(log_limit& limit, level lvl,
+                    const detail::loc_fmt_str<Args...>& lf, Args&&... args) {
+    if (!is_enabled(lvl, detail::field_count<Args...>() > 0) || !limit.allow())
+      return;
+    log_<Args...>(lvl, limit.take_suppressed(), lf,
+                  std::forward<Args>(args)...);
+  }
 
-    // Level mark
-    if (check_format(kFormatLevel)) out += lv.mark;
+  // The message is formatted between the header and the tail into the line
+  // buffer of the thread, a disabled log is not formatted. The fields of a
+  // structured log are encoded first and rendered behind the message.
+  // @param suppressed Number of logs suppressed by the rate limit of the call
+  // site, appended to the message
+  template <typename... Args>
+  void log_(level lvl, uint64_t suppressed,
+            const detail::loc_fmt_str<Args...>& lf, Args&&... args) {
+    constexpr bool structured = detail::field_count<Args...>() > 0;
+    if (!is_enabled(lvl, structured)) return;
+
+    detail::line_buffer buffer;
+    std::string& out = buffer.str();
+    const detail::header_fields header =
+        capture_header_(lvl, lf.file, lf.line, lf.func);
+    detail::render_header(out, format_, lvl, header.num, header.time,
+                          header.tid, lf.file, lf.line, lf.func);
+    const size_t header_len = out.size();
+    if constexpr (structured) {
+      uint8_t fields[ULOG_OUTBUF_LEN];
+      const size_t fields_len =
+          detail::encode_fields(fields, sizeof(fields), args...);
+      detail::format_append(out, lf.fmt, std::forward<Args>(args)...);
+      detail::append_suppressed(out, suppressed);
+      end_fields_line_(out, header, header_len, fields, fields_len);
+    } else {
+      detail::format_append(out, lf.fmt, std::forward<Args>(args)...);
+      detail::append_suppressed(out, suppressed);
+      end_line_(out, header, header_len);
+    }
+  }
 
-    // Gray color for source location
-    if (check_format(kFormatLevel | kFormatFileLine | kFormatFunction) && col)
-      out += detail::kColorGray;
+  // Captures the header fields used by the format of the logger or of a sink
+  detail::header_fields capture_header_(level lvl, std::string_view file,
+                                        int line, std::string_view func) {
+    const int format = format_ | sinks_format_;
+    const uint32_t num =
+        (format & kFormatNumber) ? log_num_.next(number_mode_) : 0;
+    const detail::timestamp time =
+        (format & kFormatTime) ? detail::timestamp::now(clock_, time_digits_)
+                               : detail::timestamp{};
+    const long tid = (format & kFormatPid) ? detail::get_tid() : 0;
+    return {lvl, num, time, tid, file, line, func};
+  }
 
-    if (check_format(kFormatLevel)) out += ' ';
+  // Appends the tail to the message and outputs the line
+  void end_line_(std::string& out, const detail::header_fields& header,
+                 size_t header_len) {
+    const size_t body_len = out.size() - header_len;
+    detail::render_tail(out, format_);
 
-    // Source location
-    if (check_format(kFormatFileLine | kFormatFunction)) {
-      out += '(';
-      if (check_format(kFormatFileLine))
-        out += detail::do_format("{}:{}", detail::basename(file), line);
-      if (check_format(kFormatFunction)) {
-        if (check_format(kFormatFileLine)) out += ' ';
-        out += func;
-      }
-      out += ')';
-    }
+    output_.write(out, header_len, body_len);
+    write_sinks_(out, header, header_len, body_len);
 
-    if (check_format(kFormatLevel | kFormatFileLine | kFormatFunction))
-      out += ' ';
+    if (header.lvl == level::fatal && flush_cb_) flush_cb_(output_.user_data);
+  }
 
-    // Message with level color
-    if (col) out += lv.color;
-    out += msg;
-    if (col) out += detail::kColorReset;
-    out += '\n';
+  // Appends the rendered fields to the message and outputs the line, or
+  // passes the line without them and the record to the structured output
+  // callback
+  void end_fields_line_(std::string& out, const detail::header_fields& header,
+                        size_t header_len, const uint8_t* fields,
+                        size_t fields_len) {
+    if (!output_.kv_cb) {
+      detail::append_fields(out, fields, fields_len, kv_format_);
+      end_line_(out, header, header_len);
+      return;
+    }
+    const size_t body_len = out.size() - header_len;
+    detail::render_tail(out, format_);
+    output_.kv_cb(output_.user_data, out.c_str(), out.size(), fields,
+                  fields_len);
+
+    // The sinks get the line with the rendered fields
+    if (static_cast<int>(header.lvl) >= static_cast<int>(sinks_level_)) {
+      out.resize(header_len + body_len);
+      detail::append_fields(out, fields, fields_len, kv_format_);
+      const size_t fields_body_len = out.size() - header_len;
+      detail::render_tail(out, format_);
+      write_sinks_(out, header, header_len, fields_body_len);
+    }
 
-    write_(out.c_str());
+    if (header.lvl == level::fatal && flush_cb_) flush_cb_(output_.user_data);
+  }
 
-    if (lvl == level::fatal && flush_cb_) flush_cb_(user_data_);
+  // Hands the line to the sinks of its level. The message is not formatted
+  // again for a sink with another format, only the header and tail are.
+  void write_sinks_(const std::string& out, const detail::header_fields& header,
+                    size_t header_len, size_t body_len) {
+    if (static_cast<int>(header.lvl) < static_cast<int>(sinks_level_)) return;
+
+    detail::layout_buffer buffer;
+    std::string& layout = buffer.str();
+    int layout_format = kFormatOfLogger;  // Format rendered into "layout"
+    for (auto& s : sinks_) {
+      if (static_cast<int>(header.lvl) < static_cast<int>(s.min_level))
+        continue;
+      const int format = s.format == kFormatOfLogger ? format_ : s.format;
+      if (format == format_) {
+        s.write(out.data(), out.size());
+      } else {
+        if (format != layout_format) {
+          layout.clear();
+          detail::render_header(layout, format, header.lvl, header.num,
+                                header.time, header.tid, header.file,
+                                header.line, header.func);
+          layout.append(out, header_len, body_len);
+          detail::render_tail(layout, format);
+          layout_format = format;
+        }
+        s.write(layout.data(), layout.size());
+      }
+      if (header.lvl == level::fatal) s.flush();
+    }
   }
 };
 
@@ -426,6 +1109,13 @@ inline void trace(
   get_default_logger().trace(lf, std::forward<Args>(args)...);
 }
 
+template <typename... Args>
+inline void trace(log_limit& limit,
+                 detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+                 Args&&... args) {
+  get_default_logger().trace(limit, lf, std::forward<Args>(args)...);
+}
+
 template <typename... Args>
 inline void debug(
     detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
@@ -433,6 +1123,13 @@ inline void debug(
   get_default_logger().debug(lf, std::forward<Args>(args)...);
 }
 
+template <typename... Args>
+inline void debug(log_limit& limit,
+                 detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+                 Args&&... args) {
+  get_default_logger().debug(limit, lf, std::forward<Args>(args)...);
+}
+
 template <typename... Args>
 inline void info(
     detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
@@ -440,6 +1137,13 @@ inline void info(
   get_default_logger().info(lf, std::forward<Args>(args)...);
 }
 
+template <typename... Args>
+inline void info(log_limit& limit,
+                detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+                Args&&... args) {
+  get_default_logger().info(limit, lf, std::forward<Args>(args)...);
+}
+
 template <typename... Args>
 inline void warn(
     detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
@@ -447,6 +1151,13 @@ inline void warn(
   get_default_logger().warn(lf, std::forward<Args>(args)...);
 }
 
+template <typename... Args>
+inline void warn(log_limit& limit,
+                detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+                Args&&... args) {
+  get_default_logger().warn(limit, lf, std::forward<Args>(args)...);
+}
+
 template <typename... Args>
 inline void error(
     detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
@@ -454,6 +1165,13 @@ inline void error(
   get_default_logger().error(lf, std::forward<Args>(args)...);
 }
 
+template <typename... Args>
+inline void error(log_limit& limit,
+                 detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+                 Args&&... args) {
+  get_default_logger().error(limit, lf, std::forward<Args>(args)...);
+}
+
 template <typename... Args>
 inline void fatal(
     detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
@@ -461,6 +1179,13 @@ inline void fatal(
   get_default_logger().fatal(lf, std::forward<Args>(args)...);
 }
 
+template <typename... Args>
+inline void fatal(log_limit& limit,
+                 detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+                 Args&&... args) {
+  get_default_logger().fatal(limit, lf, std::forward<Args>(args)...);
+}
+
 template <typename... Args>
 inline void raw(level lvl, detail::format_string<Args...> fmt_str,
                 Args&&... args) {
@@ -469,6 +1194,65 @@ inline void raw(level lvl, detail::format_string<Args...> fmt_str,
 
 }  // namespace ulog
 
+// A field referenced by the format string is formatted as "key=value"
+#if ULOG_FMT_USE_STD_
+template <>
+struct std::formatter<ulog::field> {
+  constexpr auto parse(std::format_parse_context& ctx) { return ctx.begin(); }
+
+  template <typename FormatContext>
+  auto format(const ulog::field& f, FormatContext& ctx) const {
+#else
+template <>
+struct fmt::formatter<ulog::field> {
+  constexpr auto parse(fmt::format_parse_context& ctx) { return ctx.begin(); }
+
+  template <typename FormatContext>
+  auto format(const ulog::field& f, FormatContext& ctx) const {
+#endif
+    uint8_t record[ULOG_OUTBUF_LEN];
+    char text[ULOG_OUTBUF_LEN];
+    const size_t len = logger_kv_render(
+        record, logger_kv_encode(&f.kv, 1, record, sizeof(record)),
+        ULOG_KV_LOGFMT, text, sizeof(text));
+    // Without the separating space
+    const size_t skip = len ? 1 : 0;
+    return std::copy(text + skip, text + len, ctx.out());
+  }
+};
+
+// ---------------------------------------------------------------------------
+// Logging macros – the arguments are only evaluated when the level is output
+// by the logger (ulog::Logger or ulog::AsyncLogger), and levels below
+// ULOG_FMT_MIN_LEVEL are compiled out:
+//
+//   ULOG_FMT_DEBUG(logger, "state {}", dump_state());
+//   ULOG_FMT_WARN(logger, limit, "queue full, dropped frame {}", frame);
+// ---------------------------------------------------------------------------
+
+// 0 trace, 1 debug, 2 info, 3 warn, 4 error, 5 fatal, 6 off. Only read when
+// a macro is expanded, so it may differ between translation units.
+#ifndef ULOG_FMT_MIN_LEVEL
+#  define ULOG_FMT_MIN_LEVEL 0
+#endif
+
+#define ULOG_FMT_LOG_(logger, lvl, ...)                                    \
+  do {                                                                     \
+    if constexpr (static_cast<int>(ulog::level::lvl) >=                    \
+                  ULOG_FMT_MIN_LEVEL) {                                    \
+      auto& ulog_fmt_logger_ = (logger);                                   \
+      if (ulog_fmt_logger_.should_log(ulog::level::lvl))                   \
+        ulog_fmt_logger_.lvl(__VA_ARGS__);                                 \
+    }                                                                      \
+  } while (0)
+
+#define ULOG_FMT_TRACE(logger, ...) ULOG_FMT_LOG_(logger, trace, __VA_ARGS__)
+#define ULOG_FMT_DEBUG(logger, ...) ULOG_FMT_LOG_(logger, debug, __VA_ARGS__)
+#define ULOG_FMT_INFO(logger, ...) ULOG_FMT_LOG_(logger, info, __VA_ARGS__)
+#define ULOG_FMT_WARN(logger, ...) ULOG_FMT_LOG_(logger, warn, __VA_ARGS__)
+#define ULOG_FMT_ERROR(logger, ...) ULOG_FMT_LOG_(logger, error, __VA_ARGS__)
+#define ULOG_FMT_FATAL(logger, ...) ULOG_FMT_LOG_(logger, fatal, __VA_ARGS__)
+
 #undef ULOG_FMT_USE_STD_
 #undef ULOG_FMT_STRLIT_CTOR
 
@@ -0,0 +1,607 @@
+#pragma once
+
+// Asynchronous C++ logging frontend for ulog.
+//
+// AsyncLogger has the same interface as ulog::Logger, but the calling thread
+// does not format the message: the arguments are encoded into a lock-free
+// queue together with the header fields and a decoder instantiated for the
+// argument types, and a background thread formats and outputs the log.
+//
+// Arguments are deferred when every argument is an arithmetic type, an enum,
+// a void pointer, or a string (const char*, std::string, std::string_view,
+// whose characters are copied). Other types, and non-literal format strings,
+// are formatted on the calling thread. Trivially copyable user types that
+// own no pointers can opt in by specializing ulog::is_deferrable. The fields
+// of a structured log (ulog::kv) are queued as their binary record and
+// rendered by the background thread, the message is formatted on the calling
+// thread.
+//
+// Usage:
+//   ulog::AsyncLogger logger(1024 * 1024);
+//   logger.set_output_callback(my_cb);
+//   logger.info("x={:.2f}", value);
+//   logger.flush();
+//
+// CMake: link against the `ulog_fmt` interface target.
+
+#ifdef __cplusplus
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+
+#include "ulog/queue/mpsc_ring.h"
+#include "ulog/ulog_fmt.h"
+
+namespace ulog {
+
+// Specialize for trivially copyable types that are safe to format on another
+// thread after a byte copy (no pointers to data owned by the caller).
+template <typename T>
+struct is_deferrable : std::false_type {};
+
+namespace detail {
+
+template <typename T>
+using is_string_arg = std::integral_constant<
+    bool, std::is_same<T, const char*>::value || std::is_same<T, char*>::value ||
+              std::is_same<T, std::string>::value ||
+              std::is_same<T, std::string_view>::value>;
+
+template <typename T>
+using is_copy_arg = std::integral_constant<
+    bool, std::is_arithmetic<T>::value || std::is_enum<T>::value ||
+              std::is_same<T, void*>::value ||
+              std::is_same<T, const void*>::value ||
+              std::is_same<T, std::nullptr_t>::value ||
+              (is_deferrable<T>::value && std::is_trivially_copyable<T>::value)>;
+
+template <typename T>
+using is_deferred_arg = std::integral_constant<bool, is_string_arg<T>::value ||
+                                                         is_copy_arg<T>::value>;
+
+// Type the backend thread formats, strings are decoded as views of the record
+template <typename T>
+using decoded_t =
+    std::conditional_t<is_string_arg<T>::value, std::string_view, T>;
+
+constexpr size_t kArgSlot = 8;
+constexpr size_t align_slot(size_t size) {
+  return (size + kArgSlot - 1) & ~(kArgSlot - 1);
+}
+
+inline std::string_view string_arg(const char* s) {
+  return s ? std::string_view(s) : std::string_view();
+}
+inline std::string_view string_arg(std::string_view s) { return s; }
+
+template <typename T>
+size_t encoded_size(const T& arg) {
+  if constexpr (is_string_arg<T>::value) {
+    return kArgSlot + align_slot(string_arg(arg).size());
+  } else {
+    return align_slot(sizeof(T));
+  }
+}
+
+template <typename T>
+uint8_t* encode_arg(uint8_t* p, const T& arg) {
+  if constexpr (is_string_arg<T>::value) {
+    const std::string_view str = string_arg(arg);
+    const uint64_t len = str.size();
+    memcpy(p, &len, sizeof(len));
+    memcpy(p + kArgSlot, str.data(), str.size());
+    return p + kArgSlot + align_slot(str.size());
+  } else {
+    memcpy(p, &arg, sizeof(T));
+    return p + align_slot(sizeof(T));
+  }
+}
+
+template <typename T>
+decoded_t<T> decode_arg(const uint8_t*& p) {
+  if constexpr (is_string_arg<T>::value) {
+    uint64_t len;
+    memcpy(&len, p, sizeof(len));
+    const std::string_view str(reinterpret_cast<const char*>(p + kArgSlot),
+                               len);
+    p += kArgSlot + align_slot(len);
+    return str;
+  } else {
+    T value;
+    memcpy(&value, p, sizeof(T));
+    p += align_slot(sizeof(T));
+    return value;
+  }
+}
+
+using decode_fn = void (*)(std::string& out, std::string_view fmt_str,
+                           const uint8_t* payload);
+
+// One decoder per argument signature, instantiated at compile time
+template <typename... Args>
+void decode_and_format(std::string& out, std::string_view fmt_str,
+                       const uint8_t* payload) {
+  const uint8_t* p = payload;
+  // Braced initialization evaluates the arguments from left to right
+  const std::tuple<decoded_t<Args>...> decoded{decode_arg<Args>(p)...};
+  (void)p;
+  std::apply(
+      [&](const auto&... args) { vformat_append(out, fmt_str, args...); },
+      decoded);
+}
+
+// Header of every record in the queue, followed by the payload
+struct async_record {
+  decode_fn decode;  // nullptr: the payload is the formatted message
+  const char* fmt_data;
+  const char* file;  // File name without the directories
+  const char* func;
+  timestamp time;
+  uint32_t fmt_size;
+  uint32_t fields_size;  // Binary fields of a structured log, end the payload
+  uint8_t kv_format;     // Rendering of the fields
+  uint32_t num;
+  int32_t tid;
+  int32_t line;
+  int32_t format;
+  uint8_t level;
+  bool raw;   // No header and no newline
+  bool heap;  // The payload is a std::string* that owns the text, see push_text_
+};
+
+}  // namespace detail
+
+// ---------------------------------------------------------------------------
+// AsyncLogger class
+// ---------------------------------------------------------------------------
+class AsyncLogger {
+ public:
+  /**
+   * @param queue_size Size of the record queue in bytes, callers block while
+   * it is full
+   */
+  explicit AsyncLogger(size_t queue_size = 1024 * 1024)
+      : queue_size_(queue::RoundUpPowOfTwo(
+            static_cast<uint32_t>(std::max<size_t>(queue_size, 4096)))),
+        mq_(mpsc::Mq::Create(queue_size_)),
+        id_(next_id().fetch_add(1, std::memory_order_relaxed)) {
+    thread_ = std::thread([this] { run_(); });
+  }
+
+  ~AsyncLogger() {
+    mq_->Flush(std::chrono::seconds(5));
+    should_exit_ = true;
+    mq_->Notify();
+    thread_.join();
+  }
+
+  AsyncLogger(const AsyncLogger&)            = delete;
+  AsyncLogger& operator=(const AsyncLogger&) = delete;
+
+  // --- Configuration ---
+  // The callbacks are called on the background thread, set them before
+  // logging.
+
+  void set_output_callback(output_callback_t cb,
+                           void* user_data = nullptr) noexcept {
+    output_.cb        = cb;
+    output_.user_data = user_data;
+  }
+
+  void set_output_callback_len(output_len_callback_t cb,
+                               void* user_data = nullptr) noexcept {
+    output_.len_cb    = cb;
+    output_.user_data = user_data;
+  }
+
+  void set_output_callback_v(output_v_callback_t cb,
+                             void* user_data = nullptr) noexcept {
+    output_.v_cb      = cb;
+    output_.user_data = user_data;
+  }
+
+  void set_flush_callback(flush_callback_t cb) noexcept { flush_cb_ = cb; }
+
+  // Same as Logger::set_output_kv_callback()
+  void set_output_kv_callback(output_kv_callback_t cb,
+                              void* user_data = nullptr) noexcept {
+    output_.kv_cb     = cb;
+    output_.user_data = user_data;
+  }
+
+  // Same as Logger::set_kv_format()
+  void set_kv_format(kv_format format) noexcept { kv_format_ = format; }
+
+  void set_level(level lvl) noexcept { level_ = lvl; }
+
+  // Same as Logger::set_module()
+  void set_module(const char* module) { module_.set(module); }
+
+  void enable_format(int flags) noexcept { format_ |= flags; }
+  void disable_format(int flags) noexcept { format_ &= ~flags; }
+  bool check_format(int flags) const noexcept {
+    return (format_ & flags) != 0;
+  }
+  void enable_output(bool enable) noexcept { output_enabled_ = enable; }
+
+  // Same as logger_set_number_mode()
+  void set_number_mode(number_mode mode) noexcept { number_mode_ = mode; }
+
+  // Same as logger_set_clock(), false if the clock is not available. The
+  // producers only read the clock, the background thread converts it.
+  bool set_clock(ulog::clock clk) noexcept {
+    if (logger_clock_prepare(static_cast<ulog_clock_e>(clk)) != 0) return false;
+    clock_ = clk;
+    return true;
+  }
+
+  // Same as logger_set_time_precision()
+  void set_time_precision(unsigned frac_digits) noexcept {
+    time_digits_ = frac_digits < 9 ? frac_digits : 9;
+  }
+
+  // Number of logs that have been numbered
+  uint64_t log_count() const noexcept { return log_num_.count(); }
+
+  // Wait until all queued logs are output
+  void flush() { mq_->Flush(std::chrono::seconds(5)); }
+
+  // Same as Logger::should_log()
+  bool should_log(level lvl) const noexcept { return is_enabled(lvl); }
+
+  // --- Logging methods ---
+
+  template <typename... Args>
+  void trace(detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+             Args&&... args) {
+    log_<Args...>(level::trace, false, 0, lf, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void debug(detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+             Args&&... args) {
+    log_<Args...>(level::debug, false, 0, lf, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void info(detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+            Args&&... args) {
+    log_<Args...>(level::info, false, 0, lf, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void warn(detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+            Args&&... args) {
+    log_<Args...>(level::warn, false, 0, lf, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void error(detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+             Args&&... args) {
+    log_<Args...>(level::error, false, 0, lf, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void fatal(detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+             Args&&... args) {
+    log_<Args...>(level::fatal, false, 0, lf, std::forward<Args>(args)...);
+  }
+
+  // raw: outputs the formatted message without any log header
+  template <typename... Args>
+  void raw(level lvl, detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+           Args&&... args) {
+    log_<Args...>(lvl, true, 0, lf, std::forward<Args>(args)...);
+  }
+
+  // Rate limited logs, see log_limit
+  template <typename... Args>
+  void trace(log_limit& limit,
+             detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+             Args&&... args) {
+    log_limited_<Args...>(limit, level::trace, lf, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void debug(log_limit& limit,
+             detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+             Args&&... args) {
+    log_limited_<Args...>(limit, level::debug, lf, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void info(log_limit& limit,
+            detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+            Args&&... args) {
+    log_limited_<Args...>(limit, level::info, lf, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void warn(log_limit& limit,
+            detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+            Args&&... args) {
+    log_limited_<Args...>(limit, level::warn, lf, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void error(log_limit& limit,
+             detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+             Args&&... args) {
+    log_limited_<Args...>(limit, level::error, lf, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void fatal(log_limit& limit,
+             detail::non_deducible<detail::loc_fmt_str<Args...>> lf,
+             Args&&... args) {
+    log_limited_<Args...>(limit, level::fatal, lf, std::forward<Args>(args)...);
+  }
+
+ private:
+  static int default_output(void*, const char* s) {
+    return ::printf("%s", s);
+  }
+
+  static std::atomic<uint64_t>& next_id() {
+    static std::atomic<uint64_t> id{1};
+    return id;
+  }
+
+  detail::output_callbacks output_{default_output};
+  flush_callback_t         flush_cb_       = nullptr;
+  level                    level_          = level::trace;
+  int                      format_         = kDefaultFormat;
+  bool                     output_enabled_ = true;
+  number_mode              number_mode_    = number_mode::sequential;
+  ulog::clock              clock_          = ulog::clock::realtime;
+  unsigned                 time_digits_    = 3;
+  kv_format                kv_format_      = kv_format::logfmt;
+  detail::log_counter      log_num_;
+  detail::module_filter    module_;
+
+  const size_t                 queue_size_;
+  std::shared_ptr<mpsc::Mq>    mq_;
+  const uint64_t               id_;
+  std::atomic_bool             should_exit_{false};
+  std::thread                  thread_;
+
+  // Producers of the threads that have logged, freed with the logger
+  std::mutex producers_mutex_;
+  std::unordered_map<std::thread::id, std::unique_ptr<mpsc::Producer>>
+      producers_;
+
+  // @param structured Whether the log has fields
+  bool is_enabled(level lvl, bool structured = false) const noexcept {
+    return output_enabled_ && output_.valid(structured) &&
+           static_cast<int>(lvl) >= static_cast<int>(level_) &&
+           static_cast<int>(lvl) >= module_.level();
+  }
+
+  // Each thread caches its producers of the last few loggers it used, so
+  // logging does not take a lock or touch the reference count of the queue.
+  // The ids of the loggers are never reused, the entry of a destroyed logger
+  // is never matched again.
+  mpsc::Producer& producer_() {
+    struct cached_producer {
+      uint64_t        id;
+      mpsc::Producer* producer;
+    };
+    constexpr unsigned kCached = 4;
+    thread_local cached_producer cache[kCached] = {};
+    thread_local unsigned next_slot = 0;
+    for (const auto& c : cache) {
+      if (c.id == id_) return *c.producer;
+    }
+
+    mpsc::Producer* producer;
+    {
+      std::lock_guard<std::mutex> lock(producers_mutex_);
+      auto& owned = producers_[std::this_thread::get_id()];
+      if (!owned) owned = std::make_unique<mpsc::Producer>(mq_);
+      producer = owned.get();
+    }
+    cache[next_slot++ % kCached] = {id_, producer};
+    return *producer;
+  }
+
+  // @return nullptr if the record is too large for the queue
+  detail::async_record* reserve_(size_t size) {
+    // A packet larger than a quarter of the queue may never find room around
+    // the wrap point
+    if (size > queue_size_ / 4) return nullptr;
+    return reinterpret_cast<detail::async_record*>(
+        producer_().ReserveOrWait(size));
+  }
+
+  void commit_(detail::async_record* record, size_t size) {
+    producer_().Commit(reinterpret_cast<uint8_t*>(record), size);
+  }
+
+  template <typename... Args>
+  void log_limited_(log_limit& limit, level lvl,
+                    const detail::loc_fmt_str<Args...>& lf, Args&&... args) {
+    if (!is_enabled(lvl, detail::field_count<Args...>() > 0) || !limit.allow())
+      return;
+    log_<Args...>(lvl, false, limit.take_suppressed(), lf,
+                  std::forward<Args>(args)...);
+  }
+
+  // @param suppressed Number of logs suppressed by the rate limit of the call
+  // site, appended to the message
+  template <typename... Args>
+  void log_(level lvl, bool raw, uint64_t suppressed,
+            const detail::loc_fmt_str<Args...>& lf, Args&&... args) {
+    constexpr bool structured = detail::field_count<Args...>() > 0;
+    if (!is_enabled(lvl, structured)) return;
+
+    detail::async_record header{};
+    header.format = format_;
+    header.level = static_cast<uint8_t>(lvl);
+    header.raw = raw;
+    if (!raw) {
+      header.file = lf.file.data();
+      header.func = lf.func.data();
+      header.line = lf.line;
+      if (header.format & kFormatNumber)
+        header.num = log_num_.next(number_mode_);
+      if (header.format & kFormatTime)
+        header.time = detail::timestamp::now(clock_, time_digits_);
+      if (header.format & kFormatPid)
+        header.tid = static_cast<int32_t>(detail::get_tid());
+    }
+
+    // The rare logs with a suppressed count are formatted here, and the
+    // structured ones, which are queued with their encoded fields
+    if constexpr (structured) {
+      uint8_t fields[ULOG_OUTBUF_LEN];
+      const size_t fields_len =
+          detail::encode_fields(fields, sizeof(fields), args...);
+      detail::line_buffer buffer;
+      std::string& msg = buffer.str();
+      detail::format_append(msg, lf.fmt, std::forward<Args>(args)...);
+      detail::append_suppressed(msg, suppressed);
+      msg.append(reinterpret_cast<const char*>(fields), fields_len);
+      header.fields_size = static_cast<uint32_t>(fields_len);
+      header.kv_format = static_cast<uint8_t>(kv_format_);
+      push_text_(header, msg);
+    } else if (suppressed || !push_deferred_<Args...>(header, lf, args...)) {
+      detail::line_buffer buffer;
+      std::string& msg = buffer.str();
+      detail::format_append(msg, lf.fmt, std::forward<Args>(args)...);
+      detail::append_suppressed(msg, suppressed);
+      push_text_(header, msg);
+    }
+
+    if (lvl == level::fatal) {
+      flush();
+      if (flush_cb_) flush_cb_(output_.user_data);
+    }
+  }
+
+  template <typename... Args>
+  bool push_deferred_(const detail::async_record& header,
+                      const detail::loc_fmt_str<Args...>& lf,
+                      const Args&... args) {
+    if constexpr ((detail::is_deferred_arg<std::decay_t<Args>>::value &&
+                   ...)) {
+      if (!lf.literal.data()) return false;
+
+      const size_t size = sizeof(detail::async_record) +
+                          (size_t{0} + ... +
+                           detail::encoded_size<std::decay_t<Args>>(args));
+      detail::async_record* record = reserve_(size);
+      if (!record) return false;
+
+      *record = header;
+      record->decode = detail::decode_and_format<std::decay_t<Args>...>;
+      record->fmt_data = lf.literal.data();
+      record->fmt_size = static_cast<uint32_t>(lf.literal.size());
+      uint8_t* p = reinterpret_cast<uint8_t*>(record + 1);
+      ((p = detail::encode_arg<std::decay_t<Args>>(p, args)), ...);
+      commit_(record, size);
+      return true;
+    } else {
+      (void)header, (void)lf, ((void)args, ...);
+      return false;
+    }
+  }
+
+  void push_text_(const detail::async_record& header, const std::string& msg) {
+    const size_t size = sizeof(detail::async_record) + msg.size();
+    if (detail::async_record* record = reserve_(size)) {
+      *record = header;
+      memcpy(record + 1, msg.data(), msg.size());
+      commit_(record, size);
+      return;
+    }
+
+    // Too large for the queue: the text is handed to the background thread
+    // on the heap, so it is still output in order by that thread
+    auto* text = new std::string(msg);
+    const size_t heap_size = sizeof(detail::async_record) + sizeof(text);
+    detail::async_record* record = reserve_(heap_size);
+    *record = header;
+    record->heap = true;
+    memcpy(record + 1, &text, sizeof(text));
+    commit_(record, heap_size);
+  }
+
+  void render_begin_(std::string& out,
+                     const detail::async_record& record) const {
+    if (record.raw) return;
+    detail::render_header(out, record.format, static_cast<level>(record.level),
+                          record.num, record.time, record.tid, record.file,
+                          record.line, record.func);
+  }
+
+  void render_end_(std::string& out, const detail::async_record& record) const {
+    if (!record.raw) detail::render_tail(out, record.format);
+  }
+
+  void output_record_(std::string& out, const uint8_t* data, size_t size) {
+    const auto* record = reinterpret_cast<const detail::async_record*>(data);
+    const auto* payload = data + sizeof(detail::async_record);
+    size_t payload_size = size - sizeof(detail::async_record);
+    std::unique_ptr<std::string> heap_text;
+    if (record->heap) {
+      std::string* text;
+      memcpy(&text, payload, sizeof(text));
+      heap_text.reset(text);
+      payload = reinterpret_cast<const uint8_t*>(text->data());
+      payload_size = text->size();
+    }
+    const size_t text_size = payload_size - record->fields_size;
+
+    out.clear();
+    render_begin_(out, *record);
+    const size_t header_len = out.size();
+    if (record->decode) {
+      record->decode(out, std::string_view(record->fmt_data, record->fmt_size),
+                     payload);
+    } else {
+      out.append(reinterpret_cast<const char*>(payload), text_size);
+    }
+    if (record->fields_size) {
+      const uint8_t* fields = payload + text_size;
+      if (output_.kv_cb) {
+        render_end_(out, *record);
+        output_.kv_cb(output_.user_data, out.c_str(), out.size(), fields,
+                      record->fields_size);
+        return;
+      }
+      detail::append_fields(out, fields, record->fields_size,
+                            static_cast<kv_format>(record->kv_format));
+    }
+    const size_t body_len = out.size() - header_len;
+    render_end_(out, *record);
+    output_.write(out, header_len, body_len);
+  }
+
+  void run_() {
+    mpsc::Consumer reader(mq_);
+    std::string out;
+    out.reserve(256);
+    while (!should_exit_) {
+      auto data_packet =
+          reader.ReadOrWait([&] { return should_exit_.load(); });
+      while (const auto data = data_packet.next())
+        output_record_(out, data.data, data.size);
+      reader.Release(data_packet);
+    }
+  }
+};
+
+}  // namespace ulog
+
+#endif  // __cplusplus
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdarg.h>
+#include <time.h>
 #define ULOG_STR_COLOR(color) "\x1b[" color "m"
 
 #define ULOG_STR_RESET ULOG_STR_COLOR("0")
@@ -39,6 +40,10 @@ extern "C" {
 #define ULOG_OUTBUF_LEN 1024 /* Size of buffer used for log printout */
 #endif
 
+#ifndef ULOG_RESERVE_LEN
+#define ULOG_RESERVE_LEN 256 /* Room for the header in a reservation of logger_set_output_reserve_callback() */
+#endif
+
 #if ULOG_OUTBUF_LEN < 128
 #pragma message("ULOG_OUTBUF_LEN is recommended to be greater than 64")
 #endif
@@ -122,39 +127,564 @@ void logger_log_with_header(struct ulog_s *logger, enum ulog_level_e level,
                             const char *file, const char *func, uint32_t line,
                             bool newline, bool flush, const char *fmt, ...);
 
+#ifndef ULOG_DEFERRED_MAX_ARGS
+#define ULOG_DEFERRED_MAX_ARGS 16 /* Format strings with more arguments are formatted eagerly */
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__ELF__)
+// Call sites are placed in one section, the linker defines its bounds
+#define ULOG_SITE_SECTION 1
+// Explicit alignment keeps the compiler from padding the descriptors apart
+#define ULOG_SITE_ATTRIBUTE __attribute__((section("ulog_sites"), used, aligned(8)))
+#else
+// Call sites are registered the first time they are executed
+#define ULOG_SITE_SECTION 0
+#define ULOG_SITE_ATTRIBUTE
+#endif
+
+#if defined(__FILE_NAME__)
+#define ULOG_SITE_FILE __FILE_NAME__
+#else
+#define ULOG_SITE_FILE __FILE__
+#endif
+
+// Module of the call sites that follow, e.g. "net.http": defined before
+// including ulog.h or with -DULOG_MODULE=\"net.http\" (see
+// logger_set_module_levels())
+#ifndef ULOG_MODULE
+#define ULOG_MODULE NULL
+#endif
+
+/**
+ * Descriptor of a call site, a static instance is created by every LOGGER_XXX
+ * macro (see logger_site_foreach()). The first part is filled at compile time,
+ * the rest is zero initialized and owned by the logger: the cached module
+ * level filter, the file name cut from the path, and the printf argument types
+ * cached by deferred mode (see ulog_async.h), so later calls only copy the raw
+ * arguments. Internal.
+ */
+struct ulog_site_s {
+  const char *file_;    // __FILE__, the file name is cut from it on first use
+  const char *func_;
+  const char *format_;  // NULL if the format is not a string literal
+  const char *module_;  // ULOG_MODULE
+  uint32_t line_;
+  uint8_t level_;       // ULOG_LEVEL_NUMBER if the level is not a constant
+  uint8_t enabled_;     // Accessed atomically
+
+  // Accessed atomically: ulog_site_generation when the site was last found
+  // enabled, one less when it was found disabled
+  uint32_t filter_;
+  uint8_t module_level_;          // Accessed atomically, see filter_
+  const char *filename_;          // Accessed atomically
+  struct ulog_site_s *next_;      // Registration list without ULOG_SITE_SECTION
+  const char *signature_format_;  // Format string the argument types were parsed from
+  uint8_t registered_;            // Accessed atomically
+  uint8_t state_;                 // Accessed atomically
+  uint8_t argc_;
+  uint8_t arg_types_[ULOG_DEFERRED_MAX_ARGS];
+  uint16_t arg_precision_[ULOG_DEFERRED_MAX_ARGS];  // Copy limit of "%.Ns" strings
+};
+
+#define ULOG_SITE_INIT(level, fmt)                                         \
+  {ULOG_SITE_FILE,                                                         \
+   __func__,                                                               \
+   __builtin_constant_p(fmt) ? (fmt) : NULL,                               \
+   ULOG_MODULE,                                                            \
+   __LINE__,                                                               \
+   (uint8_t)(__builtin_constant_p(level) ? (level) : ULOG_LEVEL_NUMBER),  \
+   1,                                                                      \
+   0,                                                                      \
+   0,                                                                      \
+   NULL,                                                                   \
+   NULL,                                                                   \
+   NULL,                                                                   \
+   0,                                                                      \
+   0,                                                                      \
+   0,                                                                      \
+   {0},                                                                    \
+   {0}}
+
+/**
+ * Generation of the call site filters, kept odd and advanced by every change
+ * of a site or of the module levels. Accessed atomically. Internal.
+ */
+extern uint32_t ulog_site_generation;
+
+/**
+ * Recompute the filter of a call site whose cached one is stale
+ * @return Whether the site is enabled
+ */
+bool logger_site_refresh(struct ulog_site_s *site);
+
+/**
+ * Whether a call site is enabled and its level passes the level of its
+ * module. A site checked since the last change costs two loads and a compare.
+ */
+static inline bool logger_site_enabled(struct ulog_site_s *site) {
+  const uint32_t filter = __atomic_load_n(&site->filter_, __ATOMIC_RELAXED);
+  const uint32_t generation =
+      __atomic_load_n(&ulog_site_generation, __ATOMIC_RELAXED);
+  if (__builtin_expect(filter == generation, 1)) return true;
+  if (filter == generation - 1) return false;
+  return logger_site_refresh(site);
+}
+
+/**
+ * Same as logger_log_with_header(), the file, function and line are taken from
+ * the call site
+ * @param site Static descriptor of the call site
+ */
+ULOG_ATTRIBUTE_CHECK_FORMAT(6, 7)
+void logger_log_with_site(struct ulog_s *logger, struct ulog_site_s *site,
+                          enum ulog_level_e level, bool newline, bool flush,
+                          const char *fmt, ...);
+
+/**
+ * State of a rate limited call site (LOGGER_XXX_EVERY_N / _EVERY_MS / _RATE)
+ * or of a ulog::log_limit. Internal.
+ */
+struct ulog_limit_s {
+  // Accessed atomically: number of calls (every N), earliest time of the next
+  // log (every ms) or theoretical arrival time of the token bucket (rate)
+  uint64_t state_;
+  uint64_t suppressed_;  // Accessed atomically, since the last log
+};
+
+#define ULOG_LIMIT_INIT {0, 0}
+
+/**
+ * Whether a rate limited log of the call site is output, checked before the
+ * limit is consulted, so a filtered level neither takes a token nor counts as
+ * suppressed. Internal.
+ */
+bool logger_limited_enabled(struct ulog_s *logger, struct ulog_site_s *site,
+                            enum ulog_level_e level);
+
+/**
+ * Same as logger_log_with_site(), the number of logs suppressed by the limit
+ * since the last one is appended to the message as " [suppressed N]"
+ */
+ULOG_ATTRIBUTE_CHECK_FORMAT(5, 6)
+void logger_log_limited(struct ulog_s *logger, struct ulog_site_s *site,
+                        struct ulog_limit_s *limit, enum ulog_level_e level,
+                        const char *fmt, ...);
+
 /**
  * Get time of clock_id::CLOCK_MONOTONIC
  * @return Returns the system startup time, in microseconds.
  */
 uint64_t logger_monotonic_time_us();
 
+/**
+ * Same as logger_monotonic_time_us(), in nanoseconds
+ */
+uint64_t logger_monotonic_time_ns(void);
+
 /**
  * Get time of clock_id::CLOCK_REALTIME
  * @return Returns the real time, in microseconds.
  */
 uint64_t logger_real_time_us();
 
+#ifndef ULOG_TSC_CALIBRATION_MS
+#define ULOG_TSC_CALIBRATION_MS 20 /* Time spent measuring the TSC frequency */
+#endif
+
+/**
+ * Calibrate a clock before its first use, see logger_set_clock()
+ * @return 0 if the clock is available, -1 otherwise
+ */
+int logger_clock_prepare(enum ulog_clock_e clock);
+
+/**
+ * Raw value of a prepared clock: nanoseconds, or cycles for ULOG_CLOCK_TSC
+ */
+uint64_t logger_clock_now(enum ulog_clock_e clock);
+
+/**
+ * Convert a raw clock value to nanoseconds since the epoch
+ */
+uint64_t logger_clock_to_real_ns(enum ulog_clock_e clock, uint64_t tick);
+
+// Maximum length of the string rendered by logger_render_time()
+#define ULOG_TIME_STR_MAX (sizeof("YYYY-MM-DD HH:MM:SS.nnnnnnnnn") - 1)
+
+/**
+ * Render a real time as local time "YYYY-MM-DD HH:MM:SS.fff".
+ * The rendered "YYYY-MM-DD HH:MM:" prefix is cached per thread and localtime_r()
+ * is only called again when the local minute rolls over, so most calls just
+ * patch the second and fraction digits. Years outside 0..9999 are clamped, a
+ * time that localtime_r() can not convert is rendered as "0000-00-00 00:00:00".
+ * @param sec Seconds since the epoch
+ * @param nsec Nanoseconds within the second
+ * @param frac_digits Number of fraction digits (0 ~ 9), 0 omits the '.'
+ * @param buf Output buffer, at least ULOG_TIME_STR_MAX bytes, not null-terminated
+ * @return Number of characters written
+ */
+size_t logger_render_time(time_t sec, uint32_t nsec, unsigned frac_digits, char *buf);
+
+// Maximum length of the string rendered by logger_render_process_id()
+#define ULOG_PROCESS_ID_STR_MAX (sizeof("-2147483648--2147483648 ") - 1)
+
+/**
+ * Render the process id and a thread id as "pid-tid " (with the trailing
+ * space). The string of the calling thread is rendered once and cached per
+ * thread, so it is only copied.
+ * @param tid Thread id, see logger_thread_id()
+ * @param buf Output buffer, at least ULOG_PROCESS_ID_STR_MAX bytes, not
+ * null-terminated
+ * @return Number of characters written
+ */
+size_t logger_render_process_id(long tid, char *buf);
+
+/**
+ * Process id, thread id and thread name of the calling thread. They are cached
+ * per thread and refreshed in the child process after fork().
+ */
+int logger_process_id(void);
+long logger_thread_id(void);
+const char *logger_thread_name(void);  // Empty if not available
+
+/**
+ * Read the context of the calling thread again, e.g. after it was renamed
+ */
+void logger_refresh_thread_context(void);
+
+/**
+ * A log line whose body is appended piece by piece, used by LOGGER_TOKEN and
+ * LOGGER_MULTI_TOKEN. Internal.
+ */
+struct ulog_line_s {
+  struct ulog_buffer_s buffer_;  // The header, followed by the body
+  const void *layout_;           // Header layout the line was begun with
+  size_t header_len_;
+  uint8_t level_;
+  bool color_;  // ULOG_F_COLOR of the header layout
+};
+
+/**
+ * Render the header of a log into line->buffer_, the body is then appended to
+ * it and the line output by logger_line_end()
+ * @return false if the level is not output, logger_line_end() must not be
+ * called then
+ */
+bool logger_line_begin(struct ulog_s *logger, struct ulog_site_s *site,
+                       enum ulog_level_e level, struct ulog_line_s *line);
+void logger_line_end(struct ulog_s *logger, struct ulog_line_s *line);
+
+/**
+ * Append "name => value" to the buffer, without a printf format. Floating point
+ * values are written with the fewest digits that read back as the same value.
+ * @param name Text of the token, "unnamed" if NULL
+ */
+void logger_token_int(struct ulog_buffer_s *buffer, bool color,
+                      const char *name, int64_t value);
+void logger_token_uint(struct ulog_buffer_s *buffer, bool color,
+                       const char *name, uint64_t value);
+void logger_token_double(struct ulog_buffer_s *buffer, bool color,
+                         const char *name, double value);
+void logger_token_float(struct ulog_buffer_s *buffer, bool color,
+                        const char *name, float value);
+void logger_token_pointer(struct ulog_buffer_s *buffer, bool color,
+                          const char *name, const void *value);
+void logger_token_string(struct ulog_buffer_s *buffer, bool color,
+                         const char *name, const char *value);
+void logger_token_none(struct ulog_buffer_s *buffer, bool color,
+                       const char *name);
+
+// ", " between two tokens, the color reset after the last one
+void logger_token_separator(struct ulog_buffer_s *buffer, bool color,
+                            bool last);
+
+/**
+ * Descriptor of a profiled code location, a static instance is created by
+ * every LOGGER_PROFILE_XXX macro. The statistics are allocated on first use.
+ * Internal.
+ */
+struct ulog_profile_site_s {
+  const char *name_;
+  const char *file_;  // __FILE__, the file name is cut from it on first use
+  const char *func_;
+  uint32_t line_;
+  struct ulog_profile_state_s *state_;  // Accessed atomically
+};
+
+#define ULOG_PROFILE_SITE_INIT(name) \
+  {name, ULOG_SITE_FILE, __func__, __LINE__, NULL}
+
+/**
+ * Add one execution to the statistics of a profiled location
+ * @param logger Logger of the summary lines, taken from the first execution
+ * @param begin_ns, end_ns See logger_monotonic_time_ns()
+ */
+void logger_profile_record(struct ulog_s *logger,
+                           struct ulog_profile_site_s *site, uint64_t begin_ns,
+                           uint64_t end_ns);
+
+struct ulog_profile_scope_s {
+  struct ulog_s *logger;
+  struct ulog_profile_site_s *site;
+  uint64_t begin_ns;
+};
+
+static inline void logger_profile_scope_end(struct ulog_profile_scope_s *scope) {
+  logger_profile_record(scope->logger, scope->site, scope->begin_ns,
+                        logger_monotonic_time_ns());
+}
+
+/**
+ * Whether a structured log of the call site is output, checked before the
+ * fields are evaluated. Internal.
+ */
+bool logger_kv_enabled(struct ulog_s *logger, struct ulog_site_s *site,
+                       enum ulog_level_e level);
+
+/**
+ * Print a structured log enabled by logger_kv_enabled(), the fields are
+ * encoded into a binary record on the calling thread and rendered when the
+ * line is output. Internal, the LOGGER_XXX_KV macros should be used.
+ * @param msg Message, a string literal
+ * @param count Number of fields
+ */
+void logger_log_kv(struct ulog_s *logger, struct ulog_site_s *site,
+                   enum ulog_level_e level, const char *msg,
+                   const struct ulog_kv_s *fields, size_t count);
+
+// Fields of ULOG_KV, the key is a null-terminated string
+static inline struct ulog_kv_s logger_kv_int(const char *key, int64_t value) {
+  struct ulog_kv_s field;
+  field.key = key;
+  field.key_len = strlen(key);
+  field.type = ULOG_KV_INT;
+  field.value.i = value;
+  return field;
+}
+
+static inline struct ulog_kv_s logger_kv_uint(const char *key,
+                                              uint64_t value) {
+  struct ulog_kv_s field;
+  field.key = key;
+  field.key_len = strlen(key);
+  field.type = ULOG_KV_UINT;
+  field.value.u = value;
+  return field;
+}
+
+static inline struct ulog_kv_s logger_kv_double(const char *key,
+                                                double value) {
+  struct ulog_kv_s field;
+  field.key = key;
+  field.key_len = strlen(key);
+  field.type = ULOG_KV_DOUBLE;
+  field.value.d = value;
+  return field;
+}
+
+static inline struct ulog_kv_s logger_kv_bool(const char *key, bool value) {
+  struct ulog_kv_s field;
+  field.key = key;
+  field.key_len = strlen(key);
+  field.type = ULOG_KV_BOOL;
+  field.value.b = value;
+  return field;
+}
+
+// A NULL string is logged as an empty one
+static inline struct ulog_kv_s logger_kv_string_len(const char *key,
+                                                    const char *value,
+                                                    size_t len) {
+  struct ulog_kv_s field;
+  field.key = key;
+  field.key_len = strlen(key);
+  field.type = ULOG_KV_STRING;
+  field.value.str.ptr = value ? value : "";
+  field.value.str.len = value ? len : 0;
+  return field;
+}
+
+static inline struct ulog_kv_s logger_kv_string(const char *key,
+                                                const char *value) {
+  return logger_kv_string_len(key, value, value ? strlen(value) : 0);
+}
+
 #ifdef __cplusplus
 }
 #endif
 
-#define ULOG_OUT_LOG(logger, level, ...)                              \
-  ({                                                                  \
-    logger_log_with_header(logger, level, __FILENAME__, __FUNCTION__, \
-                           __LINE__, true, true, ##__VA_ARGS__);      \
+// A call site costs one compare of its cached filter
+#define ULOG_OUT_LOG(logger, level, fmt, ...)                                \
+  ({                                                                         \
+    ULOG_SITE_ATTRIBUTE static struct ulog_site_s _ulog_site =               \
+        ULOG_SITE_INIT(level, fmt);                                          \
+    if (logger_site_enabled(&_ulog_site))                                    \
+      logger_log_with_site(logger, &_ulog_site, level, true, true, fmt,      \
+                           ##__VA_ARGS__);                                   \
+  })
+
+// The rate limits are checked inline, a suppressed log only counts itself
+static inline void logger_limit_suppress(struct ulog_limit_s *limit) {
+  __atomic_fetch_add(&limit->suppressed_, 1, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t logger_limit_take_suppressed(struct ulog_limit_s *limit) {
+  return __atomic_exchange_n(&limit->suppressed_, 0, __ATOMIC_RELAXED);
+}
+
+// The 1st, (n + 1)th, (2n + 1)th... call
+static inline bool logger_limit_every_n(struct ulog_limit_s *limit,
+                                        uint64_t n) {
+  return n <= 1 ||
+         __atomic_fetch_add(&limit->state_, 1, __ATOMIC_RELAXED) % n == 0;
+}
+
+// At most one call per interval
+static inline bool logger_limit_every_ms(struct ulog_limit_s *limit,
+                                         uint64_t interval_ms) {
+  const uint64_t now_ns = logger_monotonic_time_ns();
+  uint64_t next_ns = __atomic_load_n(&limit->state_, __ATOMIC_RELAXED);
+  return now_ns >= next_ns &&
+         __atomic_compare_exchange_n(&limit->state_, &next_ns,
+                                     now_ns + interval_ms * 1000000, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// Token bucket of "burst" tokens refilled with "per_sec" tokens per second,
+// as a generic cell rate algorithm on a single atomic
+static inline bool logger_limit_rate(struct ulog_limit_s *limit,
+                                     uint32_t per_sec, uint32_t burst) {
+  if (per_sec == 0) return false;
+  const uint64_t now_ns = logger_monotonic_time_ns();
+  const uint64_t interval_ns = 1000000000 / per_sec;
+  const uint64_t tolerance_ns = interval_ns * (burst ? burst - 1 : 0);
+  uint64_t arrival_ns = __atomic_load_n(&limit->state_, __ATOMIC_RELAXED);
+  for (;;) {
+    const uint64_t begin_ns = arrival_ns > now_ns ? arrival_ns : now_ns;
+    if (begin_ns - now_ns > tolerance_ns) return false;
+    if (__atomic_compare_exchange_n(&limit->state_, &arrival_ns,
+                                    begin_ns + interval_ns, true,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return true;
+  }
+}
+
+// "allow" is evaluated with the static _ulog_limit of the call site
+#define ULOG_OUT_LOG_LIMITED(logger, level, allow, fmt, ...)                 \
+  ({                                                                         \
+    ULOG_SITE_ATTRIBUTE static struct ulog_site_s _ulog_site =               \
+        ULOG_SITE_INIT(level, fmt);                                          \
+    static struct ulog_limit_s _ulog_limit = ULOG_LIMIT_INIT;                \
+    if (logger_site_enabled(&_ulog_site) &&                                  \
+        logger_limited_enabled(logger, &_ulog_site, level)) {                \
+      if (allow)                                                             \
+        logger_log_limited(logger, &_ulog_site, &_ulog_limit, level, fmt,    \
+                           ##__VA_ARGS__);                                   \
+      else                                                                   \
+        logger_limit_suppress(&_ulog_limit);                                 \
+    }                                                                        \
   })
 
 #define ULOG_OUT_RAW(logger, level, fmt, ...) \
   ({ logger_raw(logger, level, fmt, ##__VA_ARGS__); })
 
-#define ULOG_GEN_TOKEN_FORMAT(color, format)                           \
-  color ? ULOG_STR_BLUE "%s " ULOG_STR_RED "=> " ULOG_STR_GREEN format \
-        : "%s => " format
+#ifdef __cplusplus
+namespace ulog {
+namespace _kv {
 
-#define ULOG_GEN_STRING_TOKEN_FORMAT(color)                        \
-  color ? ULOG_STR_BLUE "%s " ULOG_STR_RED "=> " ULOG_STR_RED      \
-                        "\"" ULOG_STR_GREEN "%s" ULOG_STR_RED "\"" \
-        : "%s => \"%s\""
+inline ulog_kv_s make(const char *key, const char *value) {
+  return logger_kv_string(key, value);
+}
+
+inline ulog_kv_s make(const char *key, double value) {
+  return logger_kv_double(key, value);
+}
+
+inline ulog_kv_s make(const char *key, float value) {
+  return logger_kv_double(key, value);
+}
+
+inline ulog_kv_s make(const char *key, bool value) {
+  return logger_kv_bool(key, value);
+}
+
+inline ulog_kv_s make(const char *key, long long value) {
+  return logger_kv_int(key, (int64_t)value);
+}
+
+inline ulog_kv_s make(const char *key, long value) {
+  return logger_kv_int(key, (int64_t)value);
+}
+
+inline ulog_kv_s make(const char *key, int value) {
+  return logger_kv_int(key, (int64_t)value);
+}
+
+inline ulog_kv_s make(const char *key, short value) {
+  return logger_kv_int(key, (int64_t)value);
+}
+
+inline ulog_kv_s make(const char *key, char value) {
+  return logger_kv_int(key, (int64_t)value);
+}
+
+inline ulog_kv_s make(const char *key, signed char value) {
+  return logger_kv_int(key, (int64_t)value);
+}
+
+inline ulog_kv_s make(const char *key, unsigned long long value) {
+  return logger_kv_uint(key, (uint64_t)value);
+}
+
+inline ulog_kv_s make(const char *key, unsigned long value) {
+  return logger_kv_uint(key, (uint64_t)value);
+}
+
+inline ulog_kv_s make(const char *key, unsigned int value) {
+  return logger_kv_uint(key, (uint64_t)value);
+}
+
+inline ulog_kv_s make(const char *key, unsigned short value) {
+  return logger_kv_uint(key, (uint64_t)value);
+}
+
+inline ulog_kv_s make(const char *key, unsigned char value) {
+  return logger_kv_uint(key, (uint64_t)value);
+}
+
+}  // namespace _kv
+}  // namespace ulog
+
+#define ULOG_KV(key, value) ulog::_kv::make(key, value)
+
+#else
+#define ULOG_KV(key, value)                         \
+  _Generic((value),                                 \
+      char *: logger_kv_string,                     \
+      const char *: logger_kv_string,               \
+      float: logger_kv_double,                      \
+      double: logger_kv_double,                     \
+      long double: logger_kv_double,                \
+      bool: logger_kv_bool,                         \
+      unsigned char: logger_kv_uint,                \
+      unsigned short: logger_kv_uint,               \
+      unsigned int: logger_kv_uint,                 \
+      unsigned long: logger_kv_uint,                \
+      unsigned long long: logger_kv_uint,           \
+      default: logger_kv_int)(key, value)
+#endif
+
+// The fields are only evaluated when the log is output
+#define ULOG_OUT_KV(logger, level, msg, ...)                                 \
+  ({                                                                         \
+    ULOG_SITE_ATTRIBUTE static struct ulog_site_s _ulog_site =               \
+        ULOG_SITE_INIT(level, msg);                                          \
+    if (logger_site_enabled(&_ulog_site) &&                                  \
+        logger_kv_enabled(logger, &_ulog_site, level)) {                     \
+      const struct ulog_kv_s _ulog_kv[] = {__VA_ARGS__};                     \
+      logger_log_kv(logger, &_ulog_site, level, msg, _ulog_kv,               \
+                    sizeof(_ulog_kv) / sizeof(_ulog_kv[0]));                 \
+    }                                                                        \
+  })
 
 #ifdef __cplusplus
 namespace ulog {
@@ -163,15 +693,13 @@ namespace _token {
 // void *
 inline void print(struct ulog_buffer_s *log_buffer, bool color,
                   const char *name, const void *value) {
-  logger_snprintf(log_buffer, ULOG_GEN_TOKEN_FORMAT(color, "%p"),
-                  name ? name : "unnamed", value);
+  logger_token_pointer(log_buffer, color, name, value);
 }
 
 // const char *
 inline void print(struct ulog_buffer_s *log_buffer, bool color,
                   const char *name, const char *value) {
-  logger_snprintf(log_buffer, ULOG_GEN_STRING_TOKEN_FORMAT(color),
-                  name ? name : "unnamed", value ? value : "");
+  logger_token_string(log_buffer, color, name, value);
 }
 
 inline void print(struct ulog_buffer_s *log_buffer, bool color,
@@ -182,20 +710,18 @@ inline void print(struct ulog_buffer_s *log_buffer, bool color,
 // double/float
 inline void print(struct ulog_buffer_s *log_buffer, bool color,
                   const char *name, double value) {
-  logger_snprintf(log_buffer, ULOG_GEN_TOKEN_FORMAT(color, "%f"),
-                  name ? name : "unnamed", value);
+  logger_token_double(log_buffer, color, name, value);
 }
 
 inline void print(struct ulog_buffer_s *log_buffer, bool color,
                   const char *name, float value) {
-  print(log_buffer, color, name, static_cast<double>(value));
+  logger_token_float(log_buffer, color, name, value);
 }
 
 // signed integer
 inline void print(struct ulog_buffer_s *log_buffer, bool color,
                   const char *name, long long value) {
-  logger_snprintf(log_buffer, ULOG_GEN_TOKEN_FORMAT(color, "%" PRId64),
-                  name ? name : "unnamed", (int64_t)value);
+  logger_token_int(log_buffer, color, name, (int64_t)value);
 }
 
 inline void print(struct ulog_buffer_s *log_buffer, bool color,
@@ -221,8 +747,7 @@ inline void print(struct ulog_buffer_s *log_buffer, bool color,
 // unsigned integer
 inline void print(struct ulog_buffer_s *log_buffer, bool color,
                   const char *name, unsigned long long value) {
-  logger_snprintf(log_buffer, ULOG_GEN_TOKEN_FORMAT(color, "%" PRIu64),
-                  name ? name : "unnamed", (uint64_t)value);
+  logger_token_uint(log_buffer, color, name, (uint64_t)value);
 }
 
 inline void print(struct ulog_buffer_s *log_buffer, bool color,
@@ -261,20 +786,29 @@ inline void print(struct ulog_buffer_s *log_buffer, bool color,
 #if defined(__GNUC__) || defined(__clang__)
 #define ULOG_IS_SAME_TYPE(var, type) \
   __builtin_types_compatible_p(typeof(var), typeof(type))
+// Only the branch of the matching type is compiled with the token itself
+#define ULOG_TOKEN_AS(token, is_type, otherwise) \
+  __builtin_choose_expr(is_type, token, otherwise)
 #else
 #pragma message( \
     "LOG_TOKEN is not available, plese use c++11 or clang or gcc compiler.")
 #define ULOG_IS_SAME_TYPE(var, type) false
+#define ULOG_TOKEN_AS(token, is_type, otherwise) (otherwise)
 #endif
 
 #define ULOG_OUT_TOKEN_IMPLEMENT(log_buffer, color, token)                     \
   ({                                                                           \
-    if (ULOG_IS_SAME_TYPE(token, float) || ULOG_IS_SAME_TYPE(token, double)) { \
-      logger_snprintf(log_buffer, ULOG_GEN_TOKEN_FORMAT(color, "%f"), #token,  \
-                      token);                                                  \
+    if (ULOG_IS_SAME_TYPE(token, float)) {                                     \
+      logger_token_float(                                                      \
+          log_buffer, color, #token,                                           \
+          ULOG_TOKEN_AS(token, ULOG_IS_SAME_TYPE(token, float), 0.0f));        \
+    } else if (ULOG_IS_SAME_TYPE(token, double)) {                             \
+      logger_token_double(                                                     \
+          log_buffer, color, #token,                                           \
+          ULOG_TOKEN_AS(token, ULOG_IS_SAME_TYPE(token, double), 0.0));        \
     } else if (ULOG_IS_SAME_TYPE(token, bool)) {                               \
-      logger_snprintf(log_buffer, ULOG_GEN_TOKEN_FORMAT(color, "%d"), #token,  \
-                      ((int)(intptr_t)(token)) ? 1 : 0);                       \
+      logger_token_int(log_buffer, color, #token,                              \
+                       ((int)(intptr_t)(token)) ? 1 : 0);                      \
       /* Signed integer */                                                     \
     } else if (ULOG_IS_SAME_TYPE(token, char) ||                               \
                ULOG_IS_SAME_TYPE(token, signed char) ||                        \
@@ -282,16 +816,14 @@ inline void print(struct ulog_buffer_s *log_buffer, bool color,
                ULOG_IS_SAME_TYPE(token, int) ||                                \
                ULOG_IS_SAME_TYPE(token, long) ||                               \
                ULOG_IS_SAME_TYPE(token, long long)) {                          \
-      logger_snprintf(log_buffer, ULOG_GEN_TOKEN_FORMAT(color, "%" PRId64),    \
-                      #token, (int64_t)(token));                               \
+      logger_token_int(log_buffer, color, #token, (int64_t)(token));           \
       /* Unsigned integer */                                                   \
     } else if (ULOG_IS_SAME_TYPE(token, unsigned char) ||                      \
                ULOG_IS_SAME_TYPE(token, unsigned short) ||                     \
                ULOG_IS_SAME_TYPE(token, unsigned int) ||                       \
                ULOG_IS_SAME_TYPE(token, unsigned long) ||                      \
                ULOG_IS_SAME_TYPE(token, unsigned long long)) {                 \
-      logger_snprintf(log_buffer, ULOG_GEN_TOKEN_FORMAT(color, "%" PRIu64),    \
-                      #token, (uint64_t)(token));                              \
+      logger_token_uint(log_buffer, color, #token, (uint64_t)(token));         \
     } else if (ULOG_IS_SAME_TYPE(token, char *) ||                             \
                ULOG_IS_SAME_TYPE(token, const char *) ||                       \
                ULOG_IS_SAME_TYPE(token, signed char *) ||                      \
@@ -305,8 +837,8 @@ inline void print(struct ulog_buffer_s *log_buffer, bool color,
       /* Arrays can be changed to pointer types by (var) +1, but this is not   \
        * compatible with (void *) types */                                     \
       const char *_ulog_value = (const char *)(uintptr_t)(token);              \
-      logger_snprintf(log_buffer, ULOG_GEN_STRING_TOKEN_FORMAT(color), #token, \
-                      _ulog_value ? _ulog_value : "NULL");                     \
+      logger_token_string(log_buffer, color, #token,                           \
+                          _ulog_value ? _ulog_value : "NULL");                 \
     } else if (ULOG_IS_SAME_TYPE(token, void *) ||                             \
                ULOG_IS_SAME_TYPE(token, short *) ||                            \
                ULOG_IS_SAME_TYPE(token, unsigned short *) ||                   \
@@ -318,24 +850,33 @@ inline void print(struct ulog_buffer_s *log_buffer, bool color,
                ULOG_IS_SAME_TYPE(token, unsigned long long *) ||               \
                ULOG_IS_SAME_TYPE(token, float *) ||                            \
                ULOG_IS_SAME_TYPE(token, double *)) {                           \
-      logger_snprintf(log_buffer, ULOG_GEN_TOKEN_FORMAT(color, "%p"), #token,  \
-                      (void *)(uintptr_t)(token));                             \
+      logger_token_pointer(log_buffer, color, #token,                          \
+                           (const void *)(uintptr_t)(token));                  \
     } else {                                                                   \
-      logger_snprintf(log_buffer, ULOG_GEN_TOKEN_FORMAT(color, "(none)"),      \
-                      #token);                                                 \
+      logger_token_none(log_buffer, color, #token);                            \
     }                                                                          \
   })
 #endif
 
-#define ULOG_OUT_TOKEN(logger, token)                                   \
-  ({                                                                    \
-    struct ulog_buffer_s log_buffer;                                    \
-    logger_buffer_init(&log_buffer);                                   \
-    ULOG_OUT_TOKEN_IMPLEMENT(                                           \
-        &log_buffer, logger_check_format(logger, ULOG_F_COLOR), token); \
-    LOGGER_LOCAL_DEBUG(logger, "%s", log_buffer.log_out_buf_);          \
+// The tokens are written straight behind the header of the log line
+#define ULOG_OUT_TOKEN_LINE(logger, tokens_str, ...)                 \
+  ({                                                                 \
+    ULOG_SITE_ATTRIBUTE static struct ulog_site_s _ulog_site =       \
+        ULOG_SITE_INIT(ULOG_LEVEL_DEBUG, tokens_str);                \
+    struct ulog_line_s _ulog_line;                                   \
+    if (logger_site_enabled(&_ulog_site) &&                          \
+        logger_line_begin(logger, &_ulog_site, ULOG_LEVEL_DEBUG,     \
+                          &_ulog_line)) {                            \
+      __VA_ARGS__;                                                   \
+      logger_line_end(logger, &_ulog_line);                          \
+    }                                                                \
   })
 
+#define ULOG_OUT_TOKEN(logger, token)                                  \
+  ULOG_OUT_TOKEN_LINE(logger, #token,                                  \
+                      ULOG_OUT_TOKEN_IMPLEMENT(&_ulog_line.buffer_,    \
+                                               _ulog_line.color_, token))
+
 #define ULOG_EXPAND(...) __VA_ARGS__
 #define ULOG_EAT_COMMA(...) , ##__VA_ARGS__
 
@@ -367,23 +908,17 @@ inline void print(struct ulog_buffer_s *log_buffer, bool color,
 #define ULOG_MACRO_CONCAT(l, r) ULOG_MACRO_CONCAT_PRIVATE(l, r)
 #define ULOG_UNIQUE(name) ULOG_MACRO_CONCAT(name, __LINE__)
 
-#define ULOG_OUT_MULTI_TOKEN(logger, ...)                                     \
-  ({                                                                          \
-    struct ulog_buffer_s log_buffer;                                          \
-    logger_buffer_init(&log_buffer);                                         \
-    ULOG_EXPAND(ULOG_MACRO_CONCAT(ULOG_TOKEN_AUX_,                            \
-                                  ULOG_ARG_COUNT(__VA_ARGS__))(               \
-        &log_buffer, logger_check_format(logger, ULOG_F_COLOR), __VA_ARGS__)) \
-    LOGGER_LOCAL_DEBUG(logger, "%s", log_buffer.log_out_buf_);                \
-  })
-
-#define ULOG_OUT_TOKEN_WRAPPER(log_buffer, color, token, left)         \
-  ({                                                                   \
-    ULOG_OUT_TOKEN_IMPLEMENT(log_buffer, color, token);                \
-    if (left)                                                          \
-      logger_snprintf(log_buffer, (color) ? ULOG_STR_RED ", " : ", "); \
-    else if (color)                                                    \
-      logger_snprintf(log_buffer, ULOG_STR_RESET);                     \
+#define ULOG_OUT_MULTI_TOKEN(logger, ...)                                \
+  ULOG_OUT_TOKEN_LINE(                                                   \
+      logger, #__VA_ARGS__,                                              \
+      ULOG_EXPAND(ULOG_MACRO_CONCAT(ULOG_TOKEN_AUX_,                     \
+                                    ULOG_ARG_COUNT(__VA_ARGS__))(        \
+          &_ulog_line.buffer_, _ulog_line.color_, __VA_ARGS__)))
+
+#define ULOG_OUT_TOKEN_WRAPPER(log_buffer, color, token, left) \
+  ({                                                           \
+    ULOG_OUT_TOKEN_IMPLEMENT(log_buffer, color, token);        \
+    logger_token_separator(log_buffer, color, !(left));        \
   })
 
 #define ULOG_LOG_TOKEN_AUX(log_buffer, color, _1, ...)                        \
@@ -437,6 +972,25 @@ inline void print(struct ulog_buffer_s *log_buffer, bool color,
     ULOG_UNIQUE(diff);                                                       \
   })
 
+#define ULOG_PROFILE_SCOPE(logger, name)                                    \
+  static struct ulog_profile_site_s ULOG_UNIQUE(_ulog_profile_site) =       \
+      ULOG_PROFILE_SITE_INIT(name);                                         \
+  __attribute__((cleanup(logger_profile_scope_end)))                        \
+  struct ulog_profile_scope_s ULOG_UNIQUE(_ulog_profile_scope) = {          \
+      logger, &ULOG_UNIQUE(_ulog_profile_site), logger_monotonic_time_ns()}
+
+#define ULOG_PROFILE_CODE(logger, name, ...)                                \
+  ({                                                                        \
+    static struct ulog_profile_site_s _ulog_profile_site =                  \
+        ULOG_PROFILE_SITE_INIT(name);                                       \
+    const uint64_t _ulog_begin_ns = logger_monotonic_time_ns();             \
+    __VA_ARGS__;                                                            \
+    const uint64_t _ulog_end_ns = logger_monotonic_time_ns();               \
+    logger_profile_record(logger, &_ulog_profile_site, _ulog_begin_ns,      \
+                          _ulog_end_ns);                                    \
+    _ulog_end_ns - _ulog_begin_ns;                                          \
+  })
+
 #define ULOG_GEN_COLOR_FORMAT_FOR_HEX_DUMP(place1, place2, place3, place4)    \
   ULOG_STR_RED place1 ULOG_STR_GREEN place2 ULOG_STR_RED place3 ULOG_STR_BLUE \
       place4
@@ -1,44 +1,135 @@
+// pthread_getname_np()
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "ulog/ulog.h"
+#include "ulog/ulog_async.h"
 
 #include <ctype.h>
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "ulog_internal.h"
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define ULOG_HAVE_TSC 1
+#else
+#define ULOG_HAVE_TSC 0
+#endif
+
 #define ULOG_DEFAULT_FORMAT \
   (ULOG_F_COLOR | ULOG_F_TIME | ULOG_F_LEVEL | ULOG_F_FILE_LINE | ULOG_F_FUNCTION | ULOG_F_PROCESS_ID)
 
-enum {
-  INDEX_LEVEL_COLOR,
-  INDEX_LEVEL_MARK,
-  INDEX_MAX,
+#define ULOG_STR_LITERAL(str) {str, sizeof(str) - 1}
+
+struct ulog_str_s {
+  const char *str;
+  size_t len;
 };
 
-static const char *level_infos[ULOG_LEVEL_NUMBER][INDEX_MAX] = {
-    {ULOG_STR_WHITE, "T"},   // TRACE
-    {ULOG_STR_BLUE, "D"},    // DEBUG
-    {ULOG_STR_GREEN, "I"},   // INFO
-    {ULOG_STR_YELLOW, "W"},  // WARN
-    {ULOG_STR_RED, "E"},     // ERROR
-    {ULOG_STR_PURPLE, "F"},  // FATAL
+struct ulog_level_info_s {
+  struct ulog_str_s color;
+  char mark;
 };
 
-static inline int logger_printf(void *unused, const char *str) {
-  (void)unused;
-  return printf("%s", str);
+static const struct ulog_level_info_s level_infos[ULOG_LEVEL_NUMBER] = {
+    {ULOG_STR_LITERAL(ULOG_STR_WHITE), 'T'},   // TRACE
+    {ULOG_STR_LITERAL(ULOG_STR_BLUE), 'D'},    // DEBUG
+    {ULOG_STR_LITERAL(ULOG_STR_GREEN), 'I'},   // INFO
+    {ULOG_STR_LITERAL(ULOG_STR_YELLOW), 'W'},  // WARN
+    {ULOG_STR_LITERAL(ULOG_STR_RED), 'E'},     // ERROR
+    {ULOG_STR_LITERAL(ULOG_STR_PURPLE), 'F'},  // FATAL
+};
+
+static const char digit_pairs_[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Write "value" in decimal backwards from "buf_end", zero padded to at least "min_width" digits (at most 10)
+// @return Pointer to the first character written
+static inline char *encode_u32(char *buf_end, uint32_t value, unsigned min_width) {
+  char *p = buf_end;
+  while (value >= 100) {
+    p -= 2;
+    memcpy(p, &digit_pairs_[(value % 100) * 2], 2);
+    value /= 100;
+  }
+  if (value >= 10) {
+    p -= 2;
+    memcpy(p, &digit_pairs_[value * 2], 2);
+  } else {
+    *--p = (char)('0' + value);
+  }
+  if (min_width > 10) min_width = 10;
+  while ((unsigned)(buf_end - p) < min_width) *--p = '0';
+  return p;
 }
 
-static inline int logger_get_pid() {
-  static int process_id = -1;
-  if (process_id == -1) {
-    process_id = getpid();
+// Bounded output cursor used to encode the log header in one pass
+struct ulog_writer_s {
+  char *cur;
+  char *end;  // One past the last writable character
+};
+
+static inline void writer_put(struct ulog_writer_s *w, const char *str, size_t len) {
+  const size_t room = (size_t)(w->end - w->cur);
+  if (len > room) len = room;
+  memcpy(w->cur, str, len);
+  w->cur += len;
+}
+
+static inline void writer_put_str(struct ulog_writer_s *w, struct ulog_str_s str) { writer_put(w, str.str, str.len); }
+
+static inline void writer_put_char(struct ulog_writer_s *w, char c) {
+  if (w->cur < w->end) *w->cur++ = c;
+}
+
+static inline void writer_put_u32(struct ulog_writer_s *w, uint32_t value, unsigned min_width) {
+  char tmp[10];
+  const char *p = encode_u32(tmp + sizeof(tmp), value, min_width);
+  writer_put(w, p, (size_t)(tmp + sizeof(tmp) - p));
+}
+
+static inline void writer_put_i32(struct ulog_writer_s *w, int32_t value) {
+  if (value < 0) {
+    writer_put_char(w, '-');
+    writer_put_u32(w, -(uint32_t)value, 0);
+  } else {
+    writer_put_u32(w, (uint32_t)value, 0);
   }
-  return process_id;
+}
+
+static inline int logger_printf(void *unused, const char *str) {
+  (void)unused;
+  return printf("%s", str);
 }
 
 // Get and thread id
@@ -50,39 +141,285 @@ static inline long logger_get_tid() { return pthread_mach_thread_np(pthread_self
 static inline long logger_get_tid() { return syscall(SYS_gettid); }
 #endif  // defined(__APPLE__)
 
-struct ulog_s {
-  // Internal data
-  atomic_int log_num_;
+/*****************************************************************************
+ * Thread context:
+ * The process id, the thread id, the thread name and the rendered "pid-tid "
+ * are cached per thread. fork() leaves the caches of the forking thread stale
+ * in the child, so they are reset by a pthread_atfork() handler.
+ */
+
+struct ulog_thread_context_s {
+  bool valid;
+  uint8_t prefix_len;
+  long tid;
+  char prefix[ULOG_PROCESS_ID_STR_MAX];  // "pid-tid "
+  char name[16];
+};
+
+static _Thread_local struct ulog_thread_context_s thread_context_;
+static atomic_int process_id_ = -1;
+static pthread_once_t atfork_once_ = PTHREAD_ONCE_INIT;
+
+static void logger_atfork_child(void) {
+  atomic_store_explicit(&process_id_, getpid(), memory_order_relaxed);
+  thread_context_.valid = false;
+}
+
+static void logger_atfork_register(void) { pthread_atfork(NULL, NULL, logger_atfork_child); }
+
+static inline int logger_get_pid() {
+  int process_id = atomic_load_explicit(&process_id_, memory_order_relaxed);
+  if (process_id == -1) {
+    pthread_once(&atfork_once_, logger_atfork_register);
+    process_id = getpid();
+    atomic_store_explicit(&process_id_, process_id, memory_order_relaxed);
+  }
+  return process_id;
+}
+
+// Write "pid-tid " to buf, at least ULOG_PROCESS_ID_STR_MAX bytes
+static size_t render_process_id(int pid, long tid, char *buf) {
+  struct ulog_writer_s w = {buf, buf + ULOG_PROCESS_ID_STR_MAX};
+  writer_put_i32(&w, pid);
+  writer_put_char(&w, '-');
+  writer_put_i32(&w, (int32_t)tid);
+  writer_put_char(&w, ' ');
+  return (size_t)(w.cur - buf);
+}
+
+static void thread_context_init(struct ulog_thread_context_s *context) {
+  context->tid = logger_get_tid();
+  context->prefix_len = (uint8_t)render_process_id(logger_get_pid(), context->tid, context->prefix);
+  context->name[0] = '\0';
+#if defined(__GLIBC__) || defined(__APPLE__)
+  pthread_getname_np(pthread_self(), context->name, sizeof(context->name));
+#endif
+  context->valid = true;
+}
+
+static inline const struct ulog_thread_context_s *logger_thread_context(void) {
+  struct ulog_thread_context_s *context = &thread_context_;
+  if (!context->valid) thread_context_init(context);
+  return context;
+}
+
+int logger_process_id(void) { return logger_get_pid(); }
+
+long logger_thread_id(void) { return logger_thread_context()->tid; }
+
+const char *logger_thread_name(void) { return logger_thread_context()->name; }
+
+void logger_refresh_thread_context(void) { thread_context_init(&thread_context_); }
+
+size_t logger_render_process_id(long tid, char *buf) {
+  const struct ulog_thread_context_s *context = logger_thread_context();
+  if (tid != context->tid) return render_process_id(logger_get_pid(), tid, buf);
+  memcpy(buf, context->prefix, context->prefix_len);
+  return context->prefix_len;
+}
+
+/*****************************************************************************
+ * Header layout:
+ * Each combination of the ULOG_F_XXX flags is compiled once into a flat program
+ * of header fields and precomputed literal chunks, so the hot path neither tests
+ * the format flags nor assembles static fragments like ULOG_STR_GRAY "(".
+ */
+
+#define ULOG_FORMAT_MASK 0x7f
+#define ULOG_LAYOUT_MAX_OPS 24
+
+enum ulog_layout_op_e {
+  ULOG_OP_END,
+  ULOG_OP_LITERAL,      // Static chunk from the literal pool
+  ULOG_OP_LEVEL_COLOR,  // Color of the log level
+  ULOG_OP_NUMBER,       // Sequence number, "%06u"
+  ULOG_OP_TIME,         // "YYYY-MM-DD HH:MM:SS.mmm"
+  ULOG_OP_PROCESS_ID,   // "pid-tid "
+  ULOG_OP_LEVEL_MARK,   // One char level mark
+  ULOG_OP_FILE,         // File name
+  ULOG_OP_LINE,         // Line number
+  ULOG_OP_FUNCTION,     // Function name
+};
+
+struct ulog_layout_op_s {
+  uint8_t type;
+  uint8_t len;     // ULOG_OP_LITERAL: length of the chunk
+  uint16_t begin;  // ULOG_OP_LITERAL: offset of the chunk in the literal pool
+};
+
+struct ulog_layout_s {
+  struct ulog_layout_op_s ops[ULOG_LAYOUT_MAX_OPS];  // Terminated by ULOG_OP_END
+  struct ulog_str_s tail;                            // Output after the message
+  uint8_t format;                                    // ULOG_F_XXX flags the layout was compiled from
+  uint8_t literal_len;
+  char literals[64];
+};
+
+static inline void layout_emit(struct ulog_layout_s *layout, size_t *op_count, enum ulog_layout_op_e type) {
+  layout->ops[(*op_count)++].type = type;
+}
 
+// Adjacent literals are merged into one chunk
+static inline void layout_emit_literal(struct ulog_layout_s *layout, size_t *op_count, const char *str) {
+  const size_t len = strlen(str);
+  memcpy(&layout->literals[layout->literal_len], str, len);
+
+  struct ulog_layout_op_s *last = *op_count ? &layout->ops[*op_count - 1] : NULL;
+  if (last && last->type == ULOG_OP_LITERAL) {
+    last->len += len;
+  } else {
+    struct ulog_layout_op_s *op = &layout->ops[(*op_count)++];
+    op->type = ULOG_OP_LITERAL;
+    op->begin = layout->literal_len;
+    op->len = len;
+  }
+  layout->literal_len += len;
+}
+
+static void layout_compile(struct ulog_layout_s *layout, uint8_t format) {
+  memset(layout, 0, sizeof(*layout));
+  layout->format = format;
+  size_t n = 0;
+  const bool color = format & ULOG_F_COLOR;
+
+  if (color && (format & (ULOG_F_NUMBER | ULOG_F_TIME | ULOG_F_LEVEL))) layout_emit(layout, &n, ULOG_OP_LEVEL_COLOR);
+
+  if (format & ULOG_F_NUMBER) {
+    layout_emit_literal(layout, &n, "#");
+    layout_emit(layout, &n, ULOG_OP_NUMBER);
+    layout_emit_literal(layout, &n, " ");
+  }
+
+  if (format & ULOG_F_TIME) {
+    layout_emit(layout, &n, ULOG_OP_TIME);
+    layout_emit_literal(layout, &n, " ");
+  }
+
+  if (format & ULOG_F_PROCESS_ID) layout_emit(layout, &n, ULOG_OP_PROCESS_ID);
+
+  if (format & ULOG_F_LEVEL) layout_emit(layout, &n, ULOG_OP_LEVEL_MARK);
+  if (color && (format & (ULOG_F_LEVEL | ULOG_F_FILE_LINE | ULOG_F_FUNCTION)))
+    layout_emit_literal(layout, &n, ULOG_STR_GRAY);
+  if (format & ULOG_F_LEVEL) layout_emit_literal(layout, &n, " ");
+
+  if (format & (ULOG_F_FILE_LINE | ULOG_F_FUNCTION)) {
+    layout_emit_literal(layout, &n, "(");
+    if (format & ULOG_F_FILE_LINE) {
+      layout_emit(layout, &n, ULOG_OP_FILE);
+      layout_emit_literal(layout, &n, ":");
+      layout_emit(layout, &n, ULOG_OP_LINE);
+    }
+    if (format & ULOG_F_FUNCTION) {
+      if (format & ULOG_F_FILE_LINE) layout_emit_literal(layout, &n, " ");
+      layout_emit(layout, &n, ULOG_OP_FUNCTION);
+    }
+    layout_emit_literal(layout, &n, ")");
+  }
+
+  if (format & (ULOG_F_LEVEL | ULOG_F_FILE_LINE | ULOG_F_FUNCTION)) layout_emit_literal(layout, &n, " ");
+
+  if (color) {
+    layout_emit(layout, &n, ULOG_OP_LEVEL_COLOR);
+    layout->tail = (struct ulog_str_s)ULOG_STR_LITERAL(ULOG_STR_RESET);
+  } else {
+    layout->tail = (struct ulog_str_s){"", 0};
+  }
+  layout->ops[n].type = ULOG_OP_END;
+}
+
+static struct ulog_layout_s layout_table_[ULOG_FORMAT_MASK + 1];
+static pthread_once_t layout_table_once_ = PTHREAD_ONCE_INIT;
+
+static void layout_table_init(void) {
+  for (size_t format = 0; format <= ULOG_FORMAT_MASK; format++) layout_compile(&layout_table_[format], format);
+}
+
+static const struct ulog_layout_s *logger_layout_of(uint8_t format) {
+  pthread_once(&layout_table_once_, layout_table_init);
+  return &layout_table_[format & ULOG_FORMAT_MASK];
+}
+
+#define ULOG_CACHE_LINE 64
+#define ULOG_NUMBER_STRIPES 16
+
+// A counter alone on its cache line
+struct ulog_counter_s {
+  atomic_uint value;
+  char padding_[ULOG_CACHE_LINE - sizeof(atomic_uint)];
+};
+
+struct ulog_s {
   // Private data set by the user will be passed to the output function
   void *user_data_;
   ulog_output_callback output_cb_;
+  ulog_output_len_callback output_len_cb_;  // Used instead of output_cb_ when set
+  ulog_output_v_callback output_v_cb_;      // Used instead of output_len_cb_ when set
+  ulog_reserve_callback reserve_cb_;        // Used instead of all of the above when set
+  ulog_commit_callback commit_cb_;
   ulog_flush_callback flush_cb_;
+  ulog_output_kv_callback output_kv_cb_;  // Used for structured logs instead of all of the above when set
 
   // Format configuration
   enum ulog_level_e log_level_;
   uint8_t format_;
+  uint8_t kv_format_;  // Rendering of the fields of structured logs
   bool log_output_enabled_;
+
+  // Header layout compiled from format_, NULL until first used
+  _Atomic(const struct ulog_layout_s *) layout_;
+
+  // Deferred formatting backend, NULL when logging synchronously
+  _Atomic(struct ulog_async_s *) async_;
+  uint64_t dropped_;  // Accessed atomically, logs the backend had no room for
+
+  // Filter of repeated logs, NULL until logger_set_repeat_filter() is first called
+  _Atomic(struct ulog_repeat_s *) repeat_;
+
+  // Timestamps, see logger_set_clock()
+  uint8_t clock_;
+  uint8_t time_digits_;
+
+  // Log numbering, kept off the cache lines of the configuration above
+  uint8_t number_mode_;
+  char padding_[ULOG_CACHE_LINE];
+  struct ulog_counter_s log_num_;                               // Next number of ULOG_NUMBER_SEQUENTIAL
+  struct ulog_counter_s log_num_stripes_[ULOG_NUMBER_STRIPES];  // Numbers taken from each stripe
 };
 
 // Will be exported externally
 static struct ulog_s global_logger_instance_ = {
-    .log_num_ = 1,
+    .log_num_ = {.value = 1},
 
     // Logger default configuration
     .user_data_ = NULL,
     .output_cb_ = logger_printf,
+    .output_len_cb_ = NULL,
+    .output_v_cb_ = NULL,
+    .reserve_cb_ = NULL,
+    .commit_cb_ = NULL,
     .flush_cb_ = NULL,
+    .output_kv_cb_ = NULL,
 
     .format_ = ULOG_DEFAULT_FORMAT,
+    .kv_format_ = ULOG_KV_LOGFMT,
     .log_output_enabled_ = true,
     .log_level_ = ULOG_LEVEL_TRACE,
+    .layout_ = NULL,
+    .async_ = NULL,
+    .dropped_ = 0,
+    .repeat_ = NULL,
+    .clock_ = ULOG_CLOCK_REALTIME,
+    .time_digits_ = 3,
+    .number_mode_ = ULOG_NUMBER_SEQUENTIAL,
 };
 
 struct ulog_s *ulog_global_logger = &global_logger_instance_;
 
+static void repeat_destroy(struct ulog_s *logger);
+
 static inline bool is_logger_valid(struct ulog_s *logger) {
-  return logger && logger->output_cb_ && logger->log_output_enabled_;
+  return logger && (logger->output_cb_ || logger->output_len_cb_ || logger->output_v_cb_ || logger->reserve_cb_) &&
+         logger->log_output_enabled_;
 }
 
 struct ulog_s *logger_create() {
@@ -90,15 +427,25 @@ struct ulog_s *logger_create() {
   if (!logger) return NULL;
   memset(logger, 0, sizeof(struct ulog_s));
 
-  logger->log_num_ = 1;
+  logger->log_num_.value = 1;
+  logger->number_mode_ = ULOG_NUMBER_SEQUENTIAL;
+  logger->clock_ = ULOG_CLOCK_REALTIME;
+  logger->time_digits_ = 3;
 
   logger->user_data_ = NULL;
   logger->output_cb_ = NULL;
+  logger->output_len_cb_ = NULL;
+  logger->output_v_cb_ = NULL;
+  logger->reserve_cb_ = NULL;
+  logger->commit_cb_ = NULL;
   logger->flush_cb_ = NULL;
+  logger->output_kv_cb_ = NULL;
 
   logger->log_output_enabled_ = true;
   logger->format_ = ULOG_DEFAULT_FORMAT;
+  logger->kv_format_ = ULOG_KV_LOGFMT;
   logger->log_level_ = ULOG_LEVEL_TRACE;
+  logger->layout_ = logger_layout_of(logger->format_);
   return logger;
 }
 
@@ -106,6 +453,8 @@ void logger_destroy(struct ulog_s **logger_ptr) {
   if (!logger_ptr || !*logger_ptr) {
     return;
   }
+  logger_set_async(*logger_ptr, NULL);
+  repeat_destroy(*logger_ptr);
   free(*logger_ptr);
   (*logger_ptr) = NULL;
 }
@@ -121,6 +470,21 @@ void logger_set_output_callback(struct ulog_s *logger, ulog_output_callback outp
   ULOG_SET(logger, output_cb_, output_callback);
 }
 
+void logger_set_output_callback_len(struct ulog_s *logger, ulog_output_len_callback output_callback) {
+  ULOG_SET(logger, output_len_cb_, output_callback);
+}
+
+void logger_set_output_callback_v(struct ulog_s *logger, ulog_output_v_callback output_callback) {
+  ULOG_SET(logger, output_v_cb_, output_callback);
+}
+
+void logger_set_output_reserve_callback(struct ulog_s *logger, ulog_reserve_callback reserve_callback,
+                                        ulog_commit_callback commit_callback) {
+  if (!logger) return;
+  logger->reserve_cb_ = reserve_callback && commit_callback ? reserve_callback : NULL;
+  logger->commit_cb_ = commit_callback;
+}
+
 void logger_set_flush_callback(struct ulog_s *logger, ulog_flush_callback flush_callback) {
   ULOG_SET(logger, flush_cb_, flush_callback);
 }
@@ -129,9 +493,17 @@ void logger_enable_output(struct ulog_s *logger, bool enable) {
   (void)(logger && (logger->log_output_enabled_ = enable));
 }
 
-void logger_format_enable(struct ulog_s *logger, int32_t format) { (void)(logger && (logger->format_ |= format)); }
+void logger_format_enable(struct ulog_s *logger, int32_t format) {
+  if (!logger) return;
+  logger->format_ |= format;
+  atomic_store_explicit(&logger->layout_, logger_layout_of(logger->format_), memory_order_release);
+}
 
-void logger_format_disable(struct ulog_s *logger, int32_t format) { (void)(logger && (logger->format_ &= ~format)); }
+void logger_format_disable(struct ulog_s *logger, int32_t format) {
+  if (!logger) return;
+  logger->format_ &= ~format;
+  atomic_store_explicit(&logger->layout_, logger_layout_of(logger->format_), memory_order_release);
+}
 
 bool logger_check_format(struct ulog_s *logger, int32_t format) { return logger && (logger->format_ & format); }
 
@@ -139,6 +511,47 @@ void logger_set_output_level(struct ulog_s *logger, enum ulog_level_e level) {
   (void)(logger && (logger->log_level_ = level));
 }
 
+void logger_set_number_mode(struct ulog_s *logger, enum ulog_number_mode_e mode) {
+  ULOG_SET(logger, number_mode_, mode);
+}
+
+int logger_set_clock(struct ulog_s *logger, enum ulog_clock_e clock) {
+  if (!logger || logger_clock_prepare(clock) != 0) return -1;
+  logger->clock_ = clock;
+  return 0;
+}
+
+void logger_set_time_precision(struct ulog_s *logger, unsigned frac_digits) {
+  ULOG_SET(logger, time_digits_, frac_digits < 9 ? frac_digits : 9);
+}
+
+uint64_t logger_get_log_count(struct ulog_s *logger) {
+  if (!logger) return 0;
+  uint64_t count = atomic_load_explicit(&logger->log_num_.value, memory_order_relaxed) - 1;
+  for (size_t i = 0; i < ULOG_NUMBER_STRIPES; i++)
+    count += atomic_load_explicit(&logger->log_num_stripes_[i].value, memory_order_relaxed);
+  return count;
+}
+
+// Stripe of the calling thread, threads are spread over the stripes round-robin
+static inline unsigned logger_number_stripe(void) {
+  static atomic_uint next_stripe;
+  static _Thread_local unsigned stripe_plus_one;
+  if (!stripe_plus_one)
+    stripe_plus_one = atomic_fetch_add_explicit(&next_stripe, 1, memory_order_relaxed) % ULOG_NUMBER_STRIPES + 1;
+  return stripe_plus_one - 1;
+}
+
+static inline uint32_t logger_next_number(struct ulog_s *logger) {
+  if (logger->number_mode_ == ULOG_NUMBER_STRIPED) {
+    // Stripe s hands out s + 1, s + 1 + ULOG_NUMBER_STRIPES, ...
+    const unsigned stripe = logger_number_stripe();
+    const uint32_t n = atomic_fetch_add_explicit(&logger->log_num_stripes_[stripe].value, 1, memory_order_relaxed);
+    return n * ULOG_NUMBER_STRIPES + stripe + 1;
+  }
+  return atomic_fetch_add_explicit(&logger->log_num_.value, 1, memory_order_relaxed);
+}
+
 uint64_t logger_real_time_us() {
   struct timespec tp;
   clock_gettime(CLOCK_REALTIME, &tp);
@@ -151,147 +564,2363 @@ uint64_t logger_monotonic_time_us() {
   return (uint64_t)(tp.tv_sec) * 1000 * 1000 + tp.tv_nsec / 1000;
 }
 
-static inline int logger_flush(struct ulog_s *logger, struct ulog_buffer_s *log_buffer) {
-  int ret = 0;
-  if (is_logger_valid(logger) && log_buffer->cur_buf_ptr_ != log_buffer->log_out_buf_) {
-    ret = logger->output_cb_(logger->user_data_, log_buffer->log_out_buf_);
-    log_buffer->cur_buf_ptr_ = log_buffer->log_out_buf_;
+uint64_t logger_monotonic_time_ns(void) {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (uint64_t)(tp.tv_sec) * 1000 * 1000 * 1000 + tp.tv_nsec;
+}
+
+/*****************************************************************************
+ * Clocks:
+ * A log records the raw value of the clock of its logger, which is converted
+ * to the wall time when the header is rendered, possibly on another thread.
+ */
+
+// Offsets measured once by clock_measure_offset() and tsc_calibrate()
+static struct {
+  int64_t monotonic_offset_ns;  // Wall time - CLOCK_MONOTONIC
+  uint64_t tsc_begin;           // Cycle counter at tsc_begin_ns
+  uint64_t tsc_begin_ns;        // Wall time
+  uint64_t tsc_ns_mult;         // Nanoseconds per cycle << 32, 0 without an invariant TSC
+} clock_calibration_;
+
+// The cheap offset of CLOCK_MONOTONIC is measured apart from the TSC calibration, which takes ULOG_TSC_CALIBRATION_MS
+static pthread_once_t clock_offset_once_ = PTHREAD_ONCE_INIT;
+static pthread_once_t tsc_once_ = PTHREAD_ONCE_INIT;
+
+static inline uint64_t clock_read_ns(clockid_t id) {
+  struct timespec tp;
+  clock_gettime(id, &tp);
+  return (uint64_t)tp.tv_sec * 1000000000 + (uint64_t)tp.tv_nsec;
+}
+
+#if ULOG_HAVE_TSC
+// Reads CLOCK_MONOTONIC and the cycle counter in the middle of the read. The read with the fewest cycles of a few is
+// kept, so a thread preempted during one read does not shift the calibration.
+static uint64_t tsc_sample(uint64_t *monotonic_ns) {
+  uint64_t best = 0, best_ns = 0, best_cycles = UINT64_MAX;
+  for (int i = 0; i < 8; i++) {
+    const uint64_t before = __rdtsc();
+    const uint64_t ns = logger_monotonic_time_ns();
+    const uint64_t after = __rdtsc();
+    if (after - before < best_cycles) {
+      best_cycles = after - before;
+      best = before + (after - before) / 2;
+      best_ns = ns;
+    }
   }
-  return ret;
+  *monotonic_ns = best_ns;
+  return best;
 }
 
-uintptr_t logger_hex_dump(struct ulog_s *logger, const void *data, size_t length, size_t width, uintptr_t base_address,
-                          bool tail_addr_out) {
-  if (!data || width == 0 || !is_logger_valid(logger)) return 0;
+static bool tsc_is_invariant(void) {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) return false;
+  __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+  return edx & (1U << 8);
+}
+#endif
 
-  struct ulog_buffer_s log_buffer;
-  logger_buffer_init(&log_buffer);
+static void clock_measure_offset(void) {
+  const uint64_t real_ns = clock_read_ns(CLOCK_REALTIME);
+  const uint64_t monotonic_ns = logger_monotonic_time_ns();
+  clock_calibration_.monotonic_offset_ns = (int64_t)(real_ns - monotonic_ns);
+}
 
-  const uint8_t *data_raw = data;
-  const uint8_t *data_cur = data;
+static void tsc_calibrate(void) {
+#if ULOG_HAVE_TSC
+  if (!tsc_is_invariant()) return;
+  pthread_once(&clock_offset_once_, clock_measure_offset);
+  uint64_t begin_ns, end_ns;
+  const uint64_t begin = tsc_sample(&begin_ns);
+  uint64_t end;
+  do {
+    end = tsc_sample(&end_ns);
+  } while (end_ns - begin_ns < ULOG_TSC_CALIBRATION_MS * 1000000ULL);
+  if (end <= begin) return;
+  clock_calibration_.tsc_begin = begin;
+  clock_calibration_.tsc_begin_ns = begin_ns + (uint64_t)clock_calibration_.monotonic_offset_ns;
+  clock_calibration_.tsc_ns_mult = ((end_ns - begin_ns) << 32) / (end - begin);
+#endif
+}
 
-  bool out_break = false;
-  while (length) {
-    logger_snprintf(&log_buffer, "%08" PRIxPTR "  ", data_cur - data_raw + base_address);
-    for (size_t i = 0; i < width; i++) {
-      if (i < length)
-        logger_snprintf(&log_buffer, "%02" PRIx8 " %s", data_cur[i], i == width / 2 - 1 ? " " : "");
-      else
-        logger_snprintf(&log_buffer, "   %s", i == width / 2 - 1 ? " " : "");
-    }
-    logger_snprintf(&log_buffer, " |");
-    for (size_t i = 0; i < width && i < length; i++)
-      logger_snprintf(&log_buffer, "%c", isprint(data_cur[i]) ? data_cur[i] : '.');
-    logger_snprintf(&log_buffer, "|\n");
-
-    // The output fails, in order to avoid output confusion, the rest will not
-    // be output
-    if (logger_flush(logger, &log_buffer) <= 0) {
-      out_break = true;
-      break;
+int logger_clock_prepare(enum ulog_clock_e clock) {
+  switch (clock) {
+    case ULOG_CLOCK_REALTIME:
+      return 0;
+    case ULOG_CLOCK_REALTIME_COARSE:
+#ifdef CLOCK_REALTIME_COARSE
+      return 0;
+#else
+      return -1;
+#endif
+    case ULOG_CLOCK_MONOTONIC:
+      pthread_once(&clock_offset_once_, clock_measure_offset);
+      return 0;
+    case ULOG_CLOCK_TSC:
+      pthread_once(&tsc_once_, tsc_calibrate);
+      return clock_calibration_.tsc_ns_mult ? 0 : -1;
+  }
+  return -1;
+}
+
+uint64_t logger_clock_now(enum ulog_clock_e clock) {
+  switch (clock) {
+#ifdef CLOCK_REALTIME_COARSE
+    case ULOG_CLOCK_REALTIME_COARSE:
+      return clock_read_ns(CLOCK_REALTIME_COARSE);
+#endif
+    case ULOG_CLOCK_MONOTONIC:
+      return logger_monotonic_time_ns();
+#if ULOG_HAVE_TSC
+    case ULOG_CLOCK_TSC:
+      return __rdtsc();
+#endif
+    default:
+      return clock_read_ns(CLOCK_REALTIME);
+  }
+}
+
+uint64_t logger_clock_to_real_ns(enum ulog_clock_e clock, uint64_t tick) {
+  switch (clock) {
+    case ULOG_CLOCK_MONOTONIC:
+      return tick + (uint64_t)clock_calibration_.monotonic_offset_ns;
+#if ULOG_HAVE_TSC
+    case ULOG_CLOCK_TSC: {
+      const uint64_t mult = clock_calibration_.tsc_ns_mult;
+      if (tick >= clock_calibration_.tsc_begin)
+        return clock_calibration_.tsc_begin_ns +
+               (uint64_t)(((unsigned __int128)(tick - clock_calibration_.tsc_begin) * mult) >> 32);
+      return clock_calibration_.tsc_begin_ns -
+             (uint64_t)(((unsigned __int128)(clock_calibration_.tsc_begin - tick) * mult) >> 32);
     }
+#endif
+    default:
+      return tick;
+  }
+}
 
-    data_cur += length < width ? length : width;
-    length -= length < width ? length : width;
+// Per-thread cache of the rendered local date and minute
+struct ulog_time_cache_s {
+  time_t minute_begin;  // Inclusive
+  time_t minute_end;    // Exclusive, an empty range means the cache is invalid
+  char prefix[sizeof("YYYY-MM-DD HH:MM:") - 1];
+};
+
+static _Thread_local struct ulog_time_cache_s time_cache_;
+
+static inline char *write_2digits(char *p, unsigned value) {
+  memcpy(p, &digit_pairs_[value * 2], 2);
+  return p + 2;
+}
+
+// Renders the local date and minute of "sec" into the cache
+static void time_cache_update(struct ulog_time_cache_s *cache, time_t sec) {
+  struct tm lt;
+  if (!localtime_r(&sec, &lt)) {
+    // Out of the range of struct tm: rendered as zeros and not cached
+    memcpy(cache->prefix, "0000-00-00 00:00:", sizeof(cache->prefix));
+    cache->minute_begin = cache->minute_end = sec;
+    return;
   }
 
-  if (out_break) {
-    logger_snprintf(&log_buffer, "hex dump is break!\n");
-  } else if (tail_addr_out) {
-    logger_snprintf(&log_buffer, "%08" PRIxPTR "\n", data_cur - data_raw + base_address);
+  // The year has four digits, years before 0 or after 9999 are clamped
+  const long year = (long)lt.tm_year + 1900;
+  const unsigned year4 = year < 0 ? 0 : year > 9999 ? 9999 : (unsigned)year;
+  char *p = cache->prefix;
+  p = write_2digits(p, year4 / 100);
+  p = write_2digits(p, year4 % 100);
+  *p++ = '-';
+  p = write_2digits(p, (unsigned)lt.tm_mon + 1);
+  *p++ = '-';
+  p = write_2digits(p, (unsigned)lt.tm_mday);
+  *p++ = ' ';
+  p = write_2digits(p, (unsigned)lt.tm_hour);
+  *p++ = ':';
+  p = write_2digits(p, (unsigned)lt.tm_min);
+  *p = ':';
+
+  // Leap second (tm_sec == 60) is not cached, it only lasts one second
+  cache->minute_begin = sec - lt.tm_sec;
+  cache->minute_end = lt.tm_sec < 60 ? cache->minute_begin + 60 : cache->minute_begin;
+}
+
+size_t logger_render_time(time_t sec, uint32_t nsec, unsigned frac_digits, char *buf) {
+  struct ulog_time_cache_s *cache = &time_cache_;
+  if (sec < cache->minute_begin || sec >= cache->minute_end) time_cache_update(cache, sec);
+
+  char *p = buf;
+  memcpy(p, cache->prefix, sizeof(cache->prefix));
+  p += sizeof(cache->prefix);
+  p = write_2digits(p, (unsigned)(sec - cache->minute_begin));
+
+  if (frac_digits) {
+    if (frac_digits > 9) frac_digits = 9;
+    *p++ = '.';
+    for (unsigned i = frac_digits; i < 9; i++) nsec /= 10;
+    for (unsigned i = frac_digits; i > 0; i--) {
+      p[i - 1] = (char)('0' + nsec % 10);
+      nsec /= 10;
+    }
+    p += frac_digits;
   }
-  logger_flush(logger, &log_buffer);
-  return data_cur - data_raw + base_address;
+  return (size_t)(p - buf);
 }
 
-void logger_raw(struct ulog_s *logger, enum ulog_level_e level, const char *fmt, ...) {
-  if (!is_logger_valid(logger) || !fmt || level < logger->log_level_) return;
+static inline struct ulog_async_s *logger_async(struct ulog_s *logger) {
+  return atomic_load_explicit(&logger->async_, memory_order_acquire);
+}
 
-  struct ulog_buffer_s log_buffer;
-  logger_buffer_init(&log_buffer);
+/*****************************************************************************
+ * Call sites:
+ * The descriptors of the log macros are collected by the linker into the
+ * "ulog_sites" section. Without linker sections, a site is pushed to a list the
+ * first time it is executed.
+ */
+
+#if ULOG_SITE_SECTION
+extern struct ulog_site_s __start_ulog_sites[] __attribute__((weak));
+extern struct ulog_site_s __stop_ulog_sites[] __attribute__((weak));
+
+static inline void site_register(struct ulog_site_s *site) { (void)site; }
+#else
+static struct ulog_site_s *_Atomic site_list_;
+
+static inline void site_register(struct ulog_site_s *site) {
+  if (__atomic_load_n(&site->registered_, __ATOMIC_ACQUIRE)) return;
+  if (__atomic_exchange_n(&site->registered_, 1, __ATOMIC_ACQ_REL)) return;
+  site->next_ = atomic_load_explicit(&site_list_, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&site_list_, &site->next_, site, memory_order_release,
+                                                memory_order_relaxed)) {
+  }
+}
+#endif
+
+static const char *site_filename(struct ulog_site_s *site) {
+  const char *filename = __atomic_load_n(&site->filename_, __ATOMIC_RELAXED);
+  if (!filename) {
+    // Racing threads store the same pointer
+    filename = ulog_get_filename(site->file_);
+    __atomic_store_n(&site->filename_, filename, __ATOMIC_RELAXED);
+  }
+  return filename;
+}
 
-  va_list ap;
-  va_start(ap, fmt);
-  logger_vsnprintf(&log_buffer, fmt, ap);
-  va_end(ap);
+size_t logger_site_foreach(ulog_site_callback callback, void *arg) {
+  size_t count = 0;
+#if ULOG_SITE_SECTION
+  for (struct ulog_site_s *site = __start_ulog_sites; site < __stop_ulog_sites; site++, count++) {
+    if (callback) callback(arg, site);
+  }
+#else
+  for (struct ulog_site_s *site = atomic_load_explicit(&site_list_, memory_order_acquire); site;
+       site = site->next_, count++) {
+    if (callback) callback(arg, site);
+  }
+#endif
+  return count;
+}
 
-  logger_flush(logger, &log_buffer);
+void logger_site_get_info(struct ulog_site_s *site, struct ulog_site_info_s *info) {
+  if (!site || !info) return;
+  info->level = (enum ulog_level_e)site->level_;
+  info->file = site_filename(site);
+  info->func = site->func_;
+  info->line = site->line_;
+  info->format = site->format_;
+  info->module = site->module_;
+  info->enabled = __atomic_load_n(&site->enabled_, __ATOMIC_RELAXED);
 }
 
-void logger_log_with_header(struct ulog_s *logger, enum ulog_level_e level, const char *file, const char *func,
-                            uint32_t line, bool newline, bool flush, const char *fmt, ...) {
-  if (!is_logger_valid(logger) || !fmt || level < logger->log_level_) return;
+/*****************************************************************************
+ * Module levels:
+ * A rule "net.http=debug" applies to the module "net.http" and to all modules
+ * below it ("net.http.client"), the longest matching rule wins. The filters of
+ * the call sites are cached against ulog_site_generation: a change of the rules
+ * or of a site advances the generation, so every site recomputes its filter
+ * once on its next call and compares a single integer afterwards.
+ */
+
+// Starts above 1, so the zero initialized filter of a new site is always stale
+uint32_t ulog_site_generation = 3;
+
+struct ulog_module_rule_s {
+  char *module;  // "" for the root rule "*"
+  size_t len;
+  enum ulog_level_e level;
+};
 
-  struct ulog_buffer_s log_buffer;
-  logger_buffer_init(&log_buffer);
+static pthread_mutex_t module_mutex_ = PTHREAD_MUTEX_INITIALIZER;  // Guards the rules
+static struct ulog_module_rule_s *module_rules_;
+static size_t module_rule_count_;
+
+static void site_generation_advance(void) {
+  // Skips the generation 1, whose disabled value is the filter of a new site
+  if (__atomic_add_fetch(&ulog_site_generation, 2, __ATOMIC_RELEASE) == 1)
+    __atomic_add_fetch(&ulog_site_generation, 2, __ATOMIC_RELEASE);
+}
 
-  // Color
-  if (logger_check_format(logger, ULOG_F_NUMBER | ULOG_F_TIME | ULOG_F_LEVEL))
-    logger_snprintf(&log_buffer, "%s",
-                    logger_check_format(logger, ULOG_F_COLOR) ? level_infos[level][INDEX_LEVEL_COLOR] : "");
+// Must hold module_mutex_
+static enum ulog_level_e module_level_locked(const char *module) {
+  enum ulog_level_e level = ULOG_LEVEL_TRACE;
+  size_t best_len = 0;
+  bool matched = false;
+  for (size_t i = 0; i < module_rule_count_; i++) {
+    const struct ulog_module_rule_s *rule = &module_rules_[i];
+    if (matched && rule->len < best_len) continue;
+    if (rule->len) {
+      if (!module || strncmp(module, rule->module, rule->len) != 0) continue;
+      if (module[rule->len] != '\0' && module[rule->len] != '.') continue;
+    }
+    level = rule->level;
+    best_len = rule->len;
+    matched = true;
+  }
+  return level;
+}
+
+enum ulog_level_e logger_get_module_level(const char *module) {
+  pthread_mutex_lock(&module_mutex_);
+  const enum ulog_level_e level = module_level_locked(module);
+  pthread_mutex_unlock(&module_mutex_);
+  return level;
+}
+
+bool logger_site_refresh(struct ulog_site_s *site) {
+  site_register(site);
+  const uint32_t generation = __atomic_load_n(&ulog_site_generation, __ATOMIC_ACQUIRE);
+  const enum ulog_level_e module_level = logger_get_module_level(site->module_);
+  __atomic_store_n(&site->module_level_, (uint8_t)module_level, __ATOMIC_RELAXED);
+
+  // Sites with a variable level only check the site switch, the level is checked by every call
+  const bool enabled = __atomic_load_n(&site->enabled_, __ATOMIC_RELAXED) &&
+                       (site->level_ == ULOG_LEVEL_NUMBER || site->level_ >= module_level);
+  // A concurrent change has advanced the generation again, so the stored filter is stale at worst
+  __atomic_store_n(&site->filter_, enabled ? generation : generation - 1, __ATOMIC_RELAXED);
+  return enabled;
+}
 
-  const uint32_t log_num = atomic_fetch_add_explicit(&logger->log_num_, 1, memory_order_relaxed);
+static inline bool site_level_enabled(struct ulog_site_s *site, enum ulog_level_e level) {
+  return level >= __atomic_load_n(&site->module_level_, __ATOMIC_RELAXED);
+}
 
-  // Print serial number
-  if (logger_check_format(logger, ULOG_F_NUMBER)) logger_snprintf(&log_buffer, "#%06" PRIu32 " ", log_num);
+// Same as the argument, without the surrounding spaces
+static void str_trim(const char **begin, const char **end) {
+  while (*begin < *end && isspace((unsigned char)**begin)) (*begin)++;
+  while (*end > *begin && isspace((unsigned char)(*end)[-1])) (*end)--;
+}
 
-  // Print time
-  if (logger_check_format(logger, ULOG_F_TIME)) {
-    uint64_t time_ms = logger_real_time_us() / 1000;
-    time_t time_s = (time_t)(time_ms / 1000);
-    struct tm lt = *localtime(&time_s);
-    logger_snprintf(&log_buffer, "%04d-%02d-%02d %02d:%02d:%02d.%03d ", lt.tm_year + 1900, lt.tm_mon + 1, lt.tm_mday,
-                    lt.tm_hour, lt.tm_min, lt.tm_sec, (int)(time_ms % 1000));
+static bool level_parse(const char *str, size_t len, enum ulog_level_e *level) {
+  static const char *const names[] = {"trace", "debug", "info", "warn", "error", "fatal", "off"};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strlen(names[i]) == len && strncasecmp(str, names[i], len) == 0) {
+      *level = (enum ulog_level_e)i;  // "off" is ULOG_LEVEL_NUMBER, above every level
+      return true;
+    }
   }
+  return false;
+}
+
+// Adds or replaces the rule of a module, must hold module_mutex_
+static int module_rule_set_locked(const char *module, size_t len, enum ulog_level_e level) {
+  // "net.*" and "net" are the same rule, "*" is the root
+  if (len && module[len - 1] == '*') len--;
+  if (len && module[len - 1] == '.') len--;
 
-  // Print process and thread id
-  if (logger_check_format(logger, ULOG_F_PROCESS_ID))
-    logger_snprintf(&log_buffer, "%" PRId32 "-%" PRId32 " ", (int32_t)logger_get_pid(), (int32_t)logger_get_tid());
+  for (size_t i = 0; i < module_rule_count_; i++) {
+    if (module_rules_[i].len == len && strncmp(module_rules_[i].module, module, len) == 0) {
+      module_rules_[i].level = level;
+      return 0;
+    }
+  }
+  struct ulog_module_rule_s *rules = realloc(module_rules_, sizeof(*rules) * (module_rule_count_ + 1));
+  if (!rules) return -1;
+  module_rules_ = rules;
+  char *copy = malloc(len + 1);
+  if (!copy) return -1;
+  memcpy(copy, module, len);
+  copy[len] = '\0';
+  module_rules_[module_rule_count_++] = (struct ulog_module_rule_s){copy, len, level};
+  return 0;
+}
 
-  // Print level
-  if (logger_check_format(logger, ULOG_F_LEVEL))
-    logger_snprintf(&log_buffer, "%s", level_infos[level][INDEX_LEVEL_MARK]);
+// Must hold module_mutex_
+static void module_rules_clear_locked(void) {
+  for (size_t i = 0; i < module_rule_count_; i++) free(module_rules_[i].module);
+  free(module_rules_);
+  module_rules_ = NULL;
+  module_rule_count_ = 0;
+}
 
-  // Print gray color
-  if (logger_check_format(logger, ULOG_F_LEVEL | ULOG_F_FILE_LINE | ULOG_F_FUNCTION))
-    logger_snprintf(&log_buffer, "%s", logger_check_format(logger, ULOG_F_COLOR) ? ULOG_STR_GRAY : "");
+int logger_set_module_level(const char *module, enum ulog_level_e level) {
+  if (!module || level < ULOG_LEVEL_TRACE || level > ULOG_LEVEL_NUMBER) return -1;
+  pthread_mutex_lock(&module_mutex_);
+  const int ret = module_rule_set_locked(module, strlen(module), level);
+  pthread_mutex_unlock(&module_mutex_);
+  site_generation_advance();
+  return ret;
+}
 
-  if (logger_check_format(logger, ULOG_F_LEVEL)) logger_snprintf(&log_buffer, " ");
+// Splits the item "module=level" of a spec, an item without '=' is the level of the root
+// @return 1 for a rule, 0 for a blank item, -1 for an invalid item
+static int module_item_parse(const char *item, const char *end, const char **module, size_t *module_len,
+                             enum ulog_level_e *level) {
+  const char *eq = memchr(item, '=', (size_t)(end - item));
+  const char *module_end = eq ? eq : item, *value = eq ? eq + 1 : item;
+  *module = item;
+  str_trim(module, &module_end);
+  str_trim(&value, &end);
+  *module_len = (size_t)(module_end - *module);
+  if (!eq && value == end) return 0;
+  return level_parse(value, (size_t)(end - value), level) ? 1 : -1;
+}
 
-  // Print '('
-  if (logger_check_format(logger, ULOG_F_FILE_LINE | ULOG_F_FUNCTION)) logger_snprintf(&log_buffer, "(");
+int logger_set_module_levels(const char *spec) {
+  const char *module;
+  size_t module_len;
+  enum ulog_level_e level;
 
-  // Print file and line
-  if (logger_check_format(logger, ULOG_F_FILE_LINE)) logger_snprintf(&log_buffer, "%s:%" PRIu32, file, line);
+  // The whole spec is checked before the rules are replaced
+  for (const char *item = spec; item && *item;) {
+    const char *end = item + strcspn(item, ",");
+    if (module_item_parse(item, end, &module, &module_len, &level) < 0) return -1;
+    item = *end ? end + 1 : end;
+  }
 
-  // Print function
-  if (logger_check_format(logger, ULOG_F_FUNCTION))
-    logger_snprintf(&log_buffer, "%s%s", logger_check_format(logger, ULOG_F_FILE_LINE) ? " " : "", func);
+  int ret = 0;
+  pthread_mutex_lock(&module_mutex_);
+  module_rules_clear_locked();
+  for (const char *item = spec; item && *item && ret == 0;) {
+    const char *end = item + strcspn(item, ",");
+    if (module_item_parse(item, end, &module, &module_len, &level) > 0)
+      ret = module_rule_set_locked(module, module_len, level);
+    item = *end ? end + 1 : end;
+  }
+  pthread_mutex_unlock(&module_mutex_);
+  site_generation_advance();
+  return ret;
+}
 
-  // Print ')'
-  if (logger_check_format(logger, ULOG_F_FILE_LINE | ULOG_F_FUNCTION)) logger_snprintf(&log_buffer, ")");
+void logger_site_enable(struct ulog_site_s *site, bool enable) {
+  if (!site) return;
+  __atomic_store_n(&site->enabled_, enable, __ATOMIC_RELAXED);
+  site_generation_advance();
+}
 
-  // Print ' '
-  if (logger_check_format(logger, ULOG_F_LEVEL | ULOG_F_FILE_LINE | ULOG_F_FUNCTION)) logger_snprintf(&log_buffer, " ");
+struct ulog_site_match_s {
+  const char *file;
+  uint32_t line;
+  bool enable;
+  size_t count;
+};
 
-  // Print log info
-  logger_snprintf(&log_buffer, "%s",
-                  logger_check_format(logger, ULOG_F_COLOR) ? level_infos[level][INDEX_LEVEL_COLOR] : "");
+static void site_enable_if_match(void *arg, struct ulog_site_s *site) {
+  struct ulog_site_match_s *match = arg;
+  if (match->file && strcmp(match->file, site_filename(site)) != 0) return;
+  if (match->line && match->line != site->line_) return;
+  logger_site_enable(site, match->enable);
+  match->count++;
+}
 
-  va_list ap;
-  va_start(ap, fmt);
-  logger_vsnprintf(&log_buffer, fmt, ap);
-  va_end(ap);
+size_t logger_site_enable_match(const char *file, uint32_t line, bool enable) {
+  struct ulog_site_match_s match = {file, line, enable, 0};
+  logger_site_foreach(site_enable_if_match, &match);
+  return match.count;
+}
 
-  logger_snprintf(&log_buffer, "%s", logger_check_format(logger, ULOG_F_COLOR) ? ULOG_STR_RESET : "");
+/*****************************************************************************
+ * Deferred formatting:
+ * When a backend is attached, the log macros do not call vsnprintf on the
+ * calling thread. The printf format of each call site is parsed once into a
+ * list of argument types (struct ulog_site_s), then every call only captures
+ * the header fields and copies the raw arguments into a record. The backend
+ * thread renders the record with the same layout and the same printf
+ * conversions, so the output is identical to synchronous logging.
+ */
+
+enum ulog_arg_type_e {
+  ULOG_ARG_NONE,  // "%%", consumes no argument
+  ULOG_ARG_INT,
+  ULOG_ARG_LONG,
+  ULOG_ARG_LONG_LONG,
+  ULOG_ARG_INTMAX,
+  ULOG_ARG_SIZE,
+  ULOG_ARG_PTRDIFF,
+  ULOG_ARG_DOUBLE,
+  ULOG_ARG_LONG_DOUBLE,
+  ULOG_ARG_POINTER,
+  ULOG_ARG_STRING,
+  ULOG_ARG_INVALID,  // Not supported, the call site is formatted eagerly
+};
+
+#define ULOG_PRECISION_NONE 0xffff
+#define ULOG_PRECISION_STAR 0xfffe
+#define ULOG_SPEC_MAX 32  // Longest conversion specification, "%" included
+
+#define ULOG_ARG_SLOT 8
+#define ULOG_ALIGN_SLOT(size) (((size) + ULOG_ARG_SLOT - 1) & ~(size_t)(ULOG_ARG_SLOT - 1))
+
+// One conversion specification of a printf format
+struct ulog_format_spec_s {
+  const char *begin;   // The '%'
+  const char *end;     // One past the conversion character
+  uint8_t stars;       // Number of int arguments for '*' width and precision
+  uint8_t type;        // enum ulog_arg_type_e
+  uint16_t precision;  // Static precision, ULOG_PRECISION_NONE or ULOG_PRECISION_STAR
+};
+
+static const char *format_parse_spec(const char *p, struct ulog_format_spec_s *spec) {
+  enum { LEN_NONE, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_J, LEN_Z, LEN_T, LEN_BIG_L } length = LEN_NONE;
+
+  spec->begin = p++;
+  spec->end = p;
+  spec->stars = 0;
+  spec->type = ULOG_ARG_INVALID;
+  spec->precision = ULOG_PRECISION_NONE;
+
+  while (*p && strchr("-+ #0'I", *p)) p++;
 
-  if (newline) logger_snprintf(&log_buffer, "\n");
+  // Width, positional arguments ("%1$d", "%*1$d") are not supported
+  if (*p == '*') {
+    spec->stars++;
+    p++;
+  }
+  while (isdigit((unsigned char)*p)) p++;
+  if (*p == '$') return p;
+
+  if (*p == '.') {
+    p++;
+    if (*p == '*') {
+      spec->stars++;
+      spec->precision = ULOG_PRECISION_STAR;
+      p++;
+      if (isdigit((unsigned char)*p)) return p;
+    } else {
+      uint32_t precision = 0;
+      while (isdigit((unsigned char)*p)) {
+        precision = precision * 10 + (*p++ - '0');
+        if (precision >= ULOG_PRECISION_STAR) return p;
+      }
+      spec->precision = precision;
+    }
+  }
+
+  switch (*p) {
+    case 'h':
+      length = p[1] == 'h' ? LEN_HH : LEN_H;
+      p += length == LEN_HH ? 2 : 1;
+      break;
+    case 'l':
+      length = p[1] == 'l' ? LEN_LL : LEN_L;
+      p += length == LEN_LL ? 2 : 1;
+      break;
+    case 'q':
+      length = LEN_LL;
+      p++;
+      break;
+    case 'j':
+      length = LEN_J;
+      p++;
+      break;
+    case 'z':
+    case 'Z':
+      length = LEN_Z;
+      p++;
+      break;
+    case 't':
+      length = LEN_T;
+      p++;
+      break;
+    case 'L':
+      length = LEN_BIG_L;
+      p++;
+      break;
+    default:
+      break;
+  }
 
-  if (flush) {
-    logger_flush(logger, &log_buffer);
+  const char conversion = *p;
+  if (!conversion) return p;
+  spec->end = ++p;
+  if (spec->end - spec->begin >= ULOG_SPEC_MAX) return p;
+
+  switch (conversion) {
+    case 'd':
+    case 'i':
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'c': {
+      static const uint8_t integer_types[] = {
+          [LEN_NONE] = ULOG_ARG_INT,       [LEN_HH] = ULOG_ARG_INT,    [LEN_H] = ULOG_ARG_INT,
+          [LEN_L] = ULOG_ARG_LONG,         [LEN_LL] = ULOG_ARG_LONG_LONG, [LEN_J] = ULOG_ARG_INTMAX,
+          [LEN_Z] = ULOG_ARG_SIZE,         [LEN_T] = ULOG_ARG_PTRDIFF, [LEN_BIG_L] = ULOG_ARG_LONG_LONG,
+      };
+      // "%lc" takes a wint_t
+      if (conversion != 'c' || length == LEN_NONE) spec->type = integer_types[length];
+      break;
+    }
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+      if (length == LEN_NONE || length == LEN_L) spec->type = ULOG_ARG_DOUBLE;
+      if (length == LEN_BIG_L) spec->type = ULOG_ARG_LONG_DOUBLE;
+      break;
+    case 's':
+      if (length == LEN_NONE) spec->type = ULOG_ARG_STRING;
+      break;
+    case 'p':
+      if (length == LEN_NONE) spec->type = ULOG_ARG_POINTER;
+      break;
+    case '%':
+      if (spec->end - spec->begin == 2) spec->type = ULOG_ARG_NONE;
+      break;
+    default:  // "%n", "%m", "%C", "%S" and unknown conversions
+      break;
+  }
+  return p;
+}
 
-    if (level == ULOG_LEVEL_FATAL && logger->flush_cb_) {
-      logger->flush_cb_(logger->user_data_);
+static bool format_parse_signature(struct ulog_site_s *site, const char *fmt) {
+  uint8_t argc = 0;
+  for (const char *p = strchr(fmt, '%'); p; p = strchr(p, '%')) {
+    struct ulog_format_spec_s spec;
+    p = format_parse_spec(p, &spec);
+    if (spec.type == ULOG_ARG_INVALID) return false;
+    if (spec.type == ULOG_ARG_NONE) continue;
+    if (argc + spec.stars + 1 > ULOG_DEFERRED_MAX_ARGS) return false;
+
+    for (uint8_t i = 0; i < spec.stars; i++) {
+      site->arg_types_[argc] = ULOG_ARG_INT;
+      site->arg_precision_[argc++] = ULOG_PRECISION_NONE;
     }
+    site->arg_types_[argc] = spec.type;
+    site->arg_precision_[argc++] = spec.precision;
   }
+  site->argc_ = argc;
+  return true;
+}
+
+enum ulog_site_state_e {
+  ULOG_SITE_UNPARSED,
+  ULOG_SITE_PARSING,
+  ULOG_SITE_DEFERRABLE,
+  ULOG_SITE_EAGER,
+};
+
+// @return The site if calls with this format can be deferred
+static const struct ulog_site_s *site_signature(struct ulog_site_s *site, const char *fmt) {
+  if (!site) return NULL;
+
+  uint8_t state = __atomic_load_n(&site->state_, __ATOMIC_ACQUIRE);
+  if (state == ULOG_SITE_UNPARSED &&
+      __atomic_compare_exchange_n(&site->state_, &state, ULOG_SITE_PARSING, false, __ATOMIC_ACQUIRE,
+                                  __ATOMIC_ACQUIRE)) {
+    site->signature_format_ = fmt;
+    state = format_parse_signature(site, fmt) ? ULOG_SITE_DEFERRABLE : ULOG_SITE_EAGER;
+    __atomic_store_n(&site->state_, state, __ATOMIC_RELEASE);
+  }
+
+  // A site whose format is not a literal may be called with other formats
+  return state == ULOG_SITE_DEFERRABLE && site->signature_format_ == fmt ? site : NULL;
+}
+
+// Header fields of a log, captured on the calling thread
+struct ulog_event_s {
+  uint64_t time;  // Raw value of the clock, see logger_clock_now()
+  const char *file;
+  const char *func;
+  uint32_t line;
+  uint32_t log_num;
+  int32_t tid;
+  uint8_t level;
+  uint8_t clock;
+  uint8_t time_digits;
+};
+
+enum ulog_record_type_e {
+  ULOG_RECORD_TEXT,      // Rendered text
+  ULOG_RECORD_DEFERRED,  // Header fields and raw arguments of the call site
+  ULOG_RECORD_KV,        // Header fields, message and binary fields of a structured log
+};
+
+struct ulog_record_s {
+  uint8_t type;
+  uint8_t format;
+  uint8_t kv_format;
+  bool newline;
+  uint32_t header_len;  // Segments of the text, the tail is the rest. Message and fields of a structured log.
+  uint32_t body_len;
+  struct ulog_event_s event;
+  const struct ulog_site_s *site;
+  uint8_t payload[];  // Null-terminated text or the argument slots
+};
+
+static inline void event_capture(struct ulog_event_s *event, struct ulog_s *logger, const struct ulog_layout_s *layout,
+                                 enum ulog_level_e level, const char *file, const char *func, uint32_t line) {
+  event->level = level;
+  event->file = file;
+  event->func = func;
+  event->line = line;
+  event->log_num = layout->format & ULOG_F_NUMBER ? logger_next_number(logger) : 0;
+  event->clock = logger->clock_;
+  event->time_digits = logger->time_digits_;
+  event->time = layout->format & ULOG_F_TIME ? logger_clock_now((enum ulog_clock_e)event->clock) : 0;
+  event->tid = layout->format & ULOG_F_PROCESS_ID ? (int32_t)logger_thread_context()->tid : 0;
+}
+
+static int logger_push_text(struct ulog_s *logger, struct ulog_async_s *async, const char *str, size_t header_len,
+                            size_t body_len, size_t len) {
+  struct ulog_record_s *record = async->ops->reserve(async, sizeof(*record) + len + 1);
+  if (!record) {
+    // Text records fit the smallest queue, only a backend that drops logs when it is full fails them
+    __atomic_fetch_add(&logger->dropped_, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  record->type = ULOG_RECORD_TEXT;
+  record->header_len = (uint32_t)header_len;
+  record->body_len = (uint32_t)body_len;
+  memcpy(record->payload, str, len + 1);
+  async->ops->commit(async, record, sizeof(*record) + len + 1);
+  return (int)len;
+}
+
+// Sizes of the argument slots, strings are copied up to the length they can be printed with
+static size_t deferred_args_size(const struct ulog_site_s *site, uint32_t *str_lens, va_list ap) {
+  size_t size = 0;
+  size_t str_count = 0;
+  int last_int = -1;
+  for (uint8_t i = 0; i < site->argc_; i++) {
+    switch (site->arg_types_[i]) {
+      case ULOG_ARG_INT:
+        last_int = va_arg(ap, int);
+        break;
+      case ULOG_ARG_LONG:
+        (void)va_arg(ap, long);
+        break;
+      case ULOG_ARG_LONG_LONG:
+        (void)va_arg(ap, long long);
+        break;
+      case ULOG_ARG_INTMAX:
+        (void)va_arg(ap, intmax_t);
+        break;
+      case ULOG_ARG_SIZE:
+        (void)va_arg(ap, size_t);
+        break;
+      case ULOG_ARG_PTRDIFF:
+        (void)va_arg(ap, ptrdiff_t);
+        break;
+      case ULOG_ARG_DOUBLE:
+        (void)va_arg(ap, double);
+        break;
+      case ULOG_ARG_LONG_DOUBLE:
+        (void)va_arg(ap, long double);
+        size += ULOG_ALIGN_SLOT(sizeof(long double)) - ULOG_ARG_SLOT;
+        break;
+      case ULOG_ARG_POINTER:
+        (void)va_arg(ap, void *);
+        break;
+      case ULOG_ARG_STRING: {
+        const char *str = va_arg(ap, const char *);
+        size_t limit = ULOG_OUTBUF_LEN;
+        const uint16_t precision = site->arg_precision_[i];
+        if (precision == ULOG_PRECISION_STAR) {
+          // A negative precision is taken as if it were omitted
+          if (last_int >= 0 && (size_t)last_int < limit) limit = last_int;
+        } else if (precision < limit) {
+          limit = precision;
+        }
+        const uint32_t len = str ? (uint32_t)strnlen(str, limit) : UINT32_MAX;
+        str_lens[str_count++] = len;
+        if (str) size += ULOG_ALIGN_SLOT(len + 1);
+        break;
+      }
+      default:
+        break;
+    }
+    size += ULOG_ARG_SLOT;
+  }
+  return size;
+}
+
+#define ULOG_STORE_ARG(slot, type, ap) \
+  ({                                   \
+    type _value = va_arg(ap, type);    \
+    memcpy(slot, &_value, sizeof(_value)); \
+    (slot) += ULOG_ARG_SLOT;           \
+  })
+
+static void deferred_args_store(const struct ulog_site_s *site, const uint32_t *str_lens, uint8_t *slot, va_list ap) {
+  for (uint8_t i = 0; i < site->argc_; i++) {
+    switch (site->arg_types_[i]) {
+      case ULOG_ARG_INT:
+        ULOG_STORE_ARG(slot, int, ap);
+        break;
+      case ULOG_ARG_LONG:
+        ULOG_STORE_ARG(slot, long, ap);
+        break;
+      case ULOG_ARG_LONG_LONG:
+        ULOG_STORE_ARG(slot, long long, ap);
+        break;
+      case ULOG_ARG_INTMAX:
+        ULOG_STORE_ARG(slot, intmax_t, ap);
+        break;
+      case ULOG_ARG_SIZE:
+        ULOG_STORE_ARG(slot, size_t, ap);
+        break;
+      case ULOG_ARG_PTRDIFF:
+        ULOG_STORE_ARG(slot, ptrdiff_t, ap);
+        break;
+      case ULOG_ARG_DOUBLE:
+        ULOG_STORE_ARG(slot, double, ap);
+        break;
+      case ULOG_ARG_LONG_DOUBLE:
+        ULOG_STORE_ARG(slot, long double, ap);
+        slot += ULOG_ALIGN_SLOT(sizeof(long double)) - ULOG_ARG_SLOT;
+        break;
+      case ULOG_ARG_POINTER:
+        ULOG_STORE_ARG(slot, void *, ap);
+        break;
+      case ULOG_ARG_STRING: {
+        const char *str = va_arg(ap, const char *);
+        const uint32_t len = *str_lens++;
+        memcpy(slot, &len, sizeof(len));
+        slot += ULOG_ARG_SLOT;
+        if (str) {
+          memcpy(slot, str, len);
+          slot[len] = '\0';
+          slot += ULOG_ALIGN_SLOT(len + 1);
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+}
+
+// @return false if the record does not fit the backend
+static bool logger_push_deferred(struct ulog_async_s *async, const struct ulog_site_s *site,
+                                 const struct ulog_layout_s *layout, const struct ulog_event_s *event, bool newline,
+                                 va_list ap) {
+  uint32_t str_lens[ULOG_DEFERRED_MAX_ARGS];
+  va_list ap_size;
+  va_copy(ap_size, ap);
+  const size_t size = sizeof(struct ulog_record_s) + deferred_args_size(site, str_lens, ap_size);
+  va_end(ap_size);
+
+  struct ulog_record_s *record = async->ops->reserve(async, size);
+  if (!record) return false;
+
+  record->type = ULOG_RECORD_DEFERRED;
+  record->format = layout->format;
+  record->newline = newline;
+  record->event = *event;
+  record->site = site;
+  deferred_args_store(site, str_lens, record->payload, ap);
+  async->ops->commit(async, record, size);
+  return true;
+}
+
+static inline void buffer_put(struct ulog_buffer_s *buffer, const char *str, size_t len) {
+  // Keep the last byte for the terminating null byte
+  struct ulog_writer_s w = {buffer->cur_buf_ptr_, buffer->log_out_buf_ + sizeof(buffer->log_out_buf_) - 1};
+  writer_put(&w, str, len);
+  *w.cur = '\0';
+  buffer->cur_buf_ptr_ = w.cur;
+}
+
+#define ULOG_LOAD_ARG(slot, type)           \
+  ({                                        \
+    type _value;                            \
+    memcpy(&_value, slot, sizeof(_value));  \
+    (slot) += ULOG_ARG_SLOT;                \
+    _value;                                 \
+  })
+
+#define ULOG_SPEC_PRINTF(buffer, spec, spec_str, star, value)                             \
+  ((spec)->stars == 0   ? logger_snprintf(buffer, spec_str, value)                        \
+   : (spec)->stars == 1 ? logger_snprintf(buffer, spec_str, (star)[0], value)             \
+                        : logger_snprintf(buffer, spec_str, (star)[0], (star)[1], value))
+
+// Print the message piece by piece, the concatenation is truncated the same way as one vsnprintf call
+static void deferred_render_body(struct ulog_buffer_s *buffer, const struct ulog_site_s *site, const uint8_t *slot) {
+  const char *p = site->signature_format_;
+  for (const char *percent = strchr(p, '%'); percent; percent = strchr(p, '%')) {
+    buffer_put(buffer, p, (size_t)(percent - p));
+
+    struct ulog_format_spec_s spec;
+    p = format_parse_spec(percent, &spec);
+    if (spec.type == ULOG_ARG_NONE) {
+      buffer_put(buffer, "%", 1);
+      continue;
+    }
+
+    char spec_str[ULOG_SPEC_MAX];
+    memcpy(spec_str, spec.begin, (size_t)(spec.end - spec.begin));
+    spec_str[spec.end - spec.begin] = '\0';
+
+    int star[2] = {0, 0};
+    for (uint8_t i = 0; i < spec.stars; i++) star[i] = ULOG_LOAD_ARG(slot, int);
+
+    switch (spec.type) {
+      case ULOG_ARG_INT:
+        ULOG_SPEC_PRINTF(buffer, &spec, spec_str, star, ULOG_LOAD_ARG(slot, int));
+        break;
+      case ULOG_ARG_LONG:
+        ULOG_SPEC_PRINTF(buffer, &spec, spec_str, star, ULOG_LOAD_ARG(slot, long));
+        break;
+      case ULOG_ARG_LONG_LONG:
+        ULOG_SPEC_PRINTF(buffer, &spec, spec_str, star, ULOG_LOAD_ARG(slot, long long));
+        break;
+      case ULOG_ARG_INTMAX:
+        ULOG_SPEC_PRINTF(buffer, &spec, spec_str, star, ULOG_LOAD_ARG(slot, intmax_t));
+        break;
+      case ULOG_ARG_SIZE:
+        ULOG_SPEC_PRINTF(buffer, &spec, spec_str, star, ULOG_LOAD_ARG(slot, size_t));
+        break;
+      case ULOG_ARG_PTRDIFF:
+        ULOG_SPEC_PRINTF(buffer, &spec, spec_str, star, ULOG_LOAD_ARG(slot, ptrdiff_t));
+        break;
+      case ULOG_ARG_DOUBLE:
+        ULOG_SPEC_PRINTF(buffer, &spec, spec_str, star, ULOG_LOAD_ARG(slot, double));
+        break;
+      case ULOG_ARG_LONG_DOUBLE: {
+        const long double value = ULOG_LOAD_ARG(slot, long double);
+        slot += ULOG_ALIGN_SLOT(sizeof(long double)) - ULOG_ARG_SLOT;
+        ULOG_SPEC_PRINTF(buffer, &spec, spec_str, star, value);
+        break;
+      }
+      case ULOG_ARG_POINTER:
+        ULOG_SPEC_PRINTF(buffer, &spec, spec_str, star, ULOG_LOAD_ARG(slot, void *));
+        break;
+      case ULOG_ARG_STRING: {
+        const uint32_t len = ULOG_LOAD_ARG(slot, uint32_t);
+        const char *str = NULL;
+        if (len != UINT32_MAX) {
+          str = (const char *)slot;
+          slot += ULOG_ALIGN_SLOT(len + 1);
+        }
+        ULOG_SPEC_PRINTF(buffer, &spec, spec_str, star, str);
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  buffer_put(buffer, p, strlen(p));
+}
+
+// Pass a rendered, null-terminated string to the output, bypassing the deferred backend. The string is made of the
+// header, the body and the tail, which the vectored output callback receives as separate segments.
+static int logger_emit(struct ulog_s *logger, const char *str, size_t header_len, size_t body_len, size_t len) {
+  if (logger->reserve_cb_) {
+    void *data = logger->reserve_cb_(logger->user_data_, len);
+    if (!data) return 0;
+    memcpy(data, str, len);
+    logger->commit_cb_(logger->user_data_, data, len);
+    return (int)len;
+  }
+
+  if (logger->output_v_cb_) {
+    const struct ulog_iovec_s iov[3] = {
+        {str, header_len},
+        {str + header_len, body_len},
+        {str + header_len + body_len, len - header_len - body_len},
+    };
+    // Raw output and hex dumps have no header or tail
+    if (header_len == 0 && body_len == len) return logger->output_v_cb_(logger->user_data_, &iov[1], 1);
+    return logger->output_v_cb_(logger->user_data_, iov, 3);
+  }
+
+  if (logger->output_len_cb_) return logger->output_len_cb_(logger->user_data_, str, len);
+  return logger->output_cb_ ? logger->output_cb_(logger->user_data_, str) : 0;
+}
+
+static inline int logger_output(struct ulog_s *logger, const char *str, size_t header_len, size_t body_len,
+                                size_t len) {
+  struct ulog_async_s *async = logger_async(logger);
+  return async ? logger_push_text(logger, async, str, header_len, body_len, len)
+               : logger_emit(logger, str, header_len, body_len, len);
+}
+
+static inline int logger_flush(struct ulog_s *logger, struct ulog_buffer_s *log_buffer) {
+  int ret = 0;
+  if (is_logger_valid(logger) && log_buffer->cur_buf_ptr_ != log_buffer->log_out_buf_) {
+    const size_t len = (size_t)(log_buffer->cur_buf_ptr_ - log_buffer->log_out_buf_);
+    ret = logger_output(logger, log_buffer->log_out_buf_, 0, len, len);
+    log_buffer->cur_buf_ptr_ = log_buffer->log_out_buf_;
+  }
+  return ret;
+}
+
+/*****************************************************************************
+ * Hex dump:
+ * Lines of "hexdump -C" are encoded without printf and batched into one output
+ * per ULOG_OUTBUF_LEN bytes. With SSE2, the ASCII column and the hex digits of
+ * 8 bytes are computed at once; with SSSE3, the digits are also spread to the
+ * "xx " columns with shuffles.
+ */
+
+static const char hex_digits_[] = "0123456789abcdef";
+
+#if defined(__SSE2__)
+// Hex digits of 8 bytes, in order: high nibble, low nibble
+static inline __m128i hex_encode_8(const uint8_t *data) {
+  const __m128i bytes = _mm_loadl_epi64((const __m128i *)data);
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  const __m128i nibbles = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(bytes, 4), mask), _mm_and_si128(bytes, mask));
+  // '0' + n, plus 'a' - '0' - 10 for n > 9
+  const __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+  return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')), letters);
+}
+#endif
+
+// Write "xx " for each byte
+static inline char *hex_put_bytes(char *p, const uint8_t *data, size_t count) {
+  size_t i = 0;
+#if defined(__SSSE3__)
+  // Output byte k is digit 2 * (k / 3) + k % 3 of the pairs, or a space when k % 3 == 2
+  const __m128i spread0 = _mm_setr_epi8(0, 1, -1, 2, 3, -1, 4, 5, -1, 6, 7, -1, 8, 9, -1, 10);
+  const __m128i spread1 = _mm_setr_epi8(11, -1, 12, 13, -1, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i spaces0 = _mm_setr_epi8(0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0);
+  const __m128i spaces1 = _mm_setr_epi8(0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, 0, 0, 0, 0, 0, 0);
+  for (; i + 8 <= count; i += 8, p += 24) {
+    const __m128i pairs = hex_encode_8(data + i);
+    _mm_storeu_si128((__m128i *)p, _mm_or_si128(_mm_shuffle_epi8(pairs, spread0), spaces0));
+    _mm_storel_epi64((__m128i *)(p + 16), _mm_or_si128(_mm_shuffle_epi8(pairs, spread1), spaces1));
+  }
+#elif defined(__SSE2__)
+  for (; i + 8 <= count; i += 8) {
+    char pairs[16];
+    _mm_storeu_si128((__m128i *)pairs, hex_encode_8(data + i));
+    for (size_t j = 0; j < 16; j += 2, p += 3) {
+      p[0] = pairs[j];
+      p[1] = pairs[j + 1];
+      p[2] = ' ';
+    }
+  }
+#endif
+  for (; i < count; i++, p += 3) {
+    p[0] = hex_digits_[data[i] >> 4];
+    p[1] = hex_digits_[data[i] & 0x0f];
+    p[2] = ' ';
+  }
+  return p;
+}
+
+// Write the bytes, non-printable ones as '.'
+static inline char *hex_put_ascii(char *p, const uint8_t *data, size_t count) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 16 <= count; i += 16, p += 16) {
+    const __m128i bytes = _mm_loadu_si128((const __m128i *)(data + i));
+    // Printable is 0x20 <= c < 0x7f, compared unsigned through the sign bit
+    const __m128i shifted = _mm_xor_si128(_mm_sub_epi8(bytes, _mm_set1_epi8(0x20)), _mm_set1_epi8((char)0x80));
+    const __m128i printable = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(0x5f ^ 0x80)));
+    const __m128i dots = _mm_andnot_si128(printable, _mm_set1_epi8('.'));
+    _mm_storeu_si128((__m128i *)p, _mm_or_si128(_mm_and_si128(printable, bytes), dots));
+  }
+#endif
+  for (; i < count; i++) *p++ = data[i] >= 0x20 && data[i] < 0x7f ? (char)data[i] : '.';
+  return p;
+}
+
+static inline char *hex_put_spaces(char *p, size_t count) {
+  memset(p, ' ', count);
+  return p + count;
+}
+
+// Address with at least 8 digits, like "%08" PRIxPTR
+static inline char *hex_put_address(char *p, uintptr_t address) {
+  unsigned digits = 8;
+  while (digits < sizeof(address) * 2 && (address >> (digits * 4))) digits++;
+  for (unsigned i = digits; i > 0; i--) {
+    p[i - 1] = hex_digits_[address & 0x0f];
+    address >>= 4;
+  }
+  return p + digits;
+}
+
+static inline size_t hex_line_max_len(size_t width) { return sizeof(uintptr_t) * 2 + 2 + width * 4 + 5; }
+
+// One line of "count" bytes (<= width), same layout as "hexdump -C"
+static char *hex_dump_line(char *p, const uint8_t *data, size_t count, size_t width, uintptr_t address) {
+  const size_t half = width / 2;  // An extra space follows column half - 1
+  p = hex_put_address(p, address);
+  *p++ = ' ';
+  *p++ = ' ';
+
+  const size_t first = count < half ? count : half;
+  p = hex_put_bytes(p, data, first);
+  p = hex_put_spaces(p, (half - first) * 3);
+  if (half) *p++ = ' ';
+  const size_t second = count - first;
+  p = hex_put_bytes(p, data + first, second);
+  p = hex_put_spaces(p, (width - half - second) * 3);
+
+  *p++ = ' ';
+  *p++ = '|';
+  p = hex_put_ascii(p, data, count);
+  *p++ = '|';
+  *p++ = '\n';
+  return p;
+}
+
+uintptr_t logger_hex_dump(struct ulog_s *logger, const void *data, size_t length, size_t width, uintptr_t base_address,
+                          bool tail_addr_out) {
+  if (!data || width == 0 || !is_logger_valid(logger)) return 0;
+
+  // Lines are collected in the buffer, a line longer than the buffer is output alone from the heap
+  char buffer[ULOG_OUTBUF_LEN];
+  const size_t line_max = hex_line_max_len(width);
+  char *line_buffer = line_max < sizeof(buffer) ? buffer : malloc(line_max + 1);
+  if (!line_buffer) return base_address;
+  const size_t capacity = line_buffer == buffer ? sizeof(buffer) - 1 : line_max;
+
+  const uint8_t *data_raw = data;
+  const uint8_t *data_cur = data;
+  const uint8_t *batch_begin = data;  // Data of the buffered lines begins here
+  char *p = line_buffer;
+
+  bool out_break = false;
+  while (length || p != line_buffer) {
+    // The output fails, in order to avoid output confusion, the rest will not be output
+    if (!length || (size_t)(line_buffer + capacity - p) < line_max) {
+      *p = '\0';
+      if (logger_output(logger, line_buffer, 0, (size_t)(p - line_buffer), (size_t)(p - line_buffer)) <= 0) {
+        data_cur = batch_begin;
+        out_break = true;
+        break;
+      }
+      p = line_buffer;
+      batch_begin = data_cur;
+      continue;
+    }
+
+    const size_t count = length < width ? length : width;
+    p = hex_dump_line(p, data_cur, count, width, data_cur - data_raw + base_address);
+    data_cur += count;
+    length -= count;
+  }
+  if (line_buffer != buffer) free(line_buffer);
+
+  struct ulog_buffer_s log_buffer;
+  logger_buffer_init(&log_buffer);
+  if (out_break) {
+    logger_snprintf(&log_buffer, "hex dump is break!\n");
+  } else if (tail_addr_out) {
+    logger_snprintf(&log_buffer, "%08" PRIxPTR "\n", data_cur - data_raw + base_address);
+  }
+  logger_flush(logger, &log_buffer);
+  return data_cur - data_raw + base_address;
+}
+
+void logger_raw(struct ulog_s *logger, enum ulog_level_e level, const char *fmt, ...) {
+  if (!is_logger_valid(logger) || !fmt || level < logger->log_level_) return;
+
+  struct ulog_buffer_s log_buffer;
+  logger_buffer_init(&log_buffer);
+
+  va_list ap;
+  va_start(ap, fmt);
+  logger_vsnprintf(&log_buffer, fmt, ap);
+  va_end(ap);
+
+  logger_flush(logger, &log_buffer);
+}
+
+static inline const struct ulog_layout_s *logger_layout(struct ulog_s *logger) {
+  const struct ulog_layout_s *layout = atomic_load_explicit(&logger->layout_, memory_order_acquire);
+  if (!layout) {
+    // Statically initialized logger, compile on first use
+    layout = logger_layout_of(logger->format_);
+    atomic_store_explicit(&logger->layout_, layout, memory_order_release);
+  }
+  return layout;
+}
+
+static void layout_render(const struct ulog_layout_s *layout, struct ulog_writer_s *w,
+                          const struct ulog_event_s *event) {
+  const struct ulog_level_info_s *info = &level_infos[event->level];
+  for (const struct ulog_layout_op_s *op = layout->ops;; op++) {
+    switch (op->type) {
+      case ULOG_OP_END:
+        return;
+      case ULOG_OP_LITERAL:
+        writer_put(w, &layout->literals[op->begin], op->len);
+        break;
+      case ULOG_OP_LEVEL_COLOR:
+        writer_put_str(w, info->color);
+        break;
+      case ULOG_OP_NUMBER:
+        writer_put_u32(w, event->log_num, 6);
+        break;
+      case ULOG_OP_TIME: {
+        char time_str[ULOG_TIME_STR_MAX];
+        const uint64_t ns = logger_clock_to_real_ns((enum ulog_clock_e)event->clock, event->time);
+        writer_put(w, time_str,
+                   logger_render_time((time_t)(ns / 1000000000), (uint32_t)(ns % 1000000000), event->time_digits,
+                                      time_str));
+        break;
+      }
+      case ULOG_OP_PROCESS_ID: {
+        char process_id[ULOG_PROCESS_ID_STR_MAX];
+        writer_put(w, process_id, logger_render_process_id(event->tid, process_id));
+        break;
+      }
+      case ULOG_OP_LEVEL_MARK:
+        writer_put_char(w, info->mark);
+        break;
+      case ULOG_OP_FILE:
+        writer_put(w, event->file, strlen(event->file));
+        break;
+      case ULOG_OP_LINE:
+        writer_put_u32(w, event->line, 0);
+        break;
+      case ULOG_OP_FUNCTION:
+        writer_put(w, event->func, strlen(event->func));
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+static inline void layout_render_tail(const struct ulog_layout_s *layout, struct ulog_buffer_s *log_buffer,
+                                      bool newline) {
+  struct ulog_writer_s w = {log_buffer->cur_buf_ptr_,
+                            log_buffer->log_out_buf_ + sizeof(log_buffer->log_out_buf_) - 1};
+  writer_put_str(&w, layout->tail);
+  if (newline) writer_put_char(&w, '\n');
+  *w.cur = '\0';
+  log_buffer->cur_buf_ptr_ = w.cur;
+}
+
+// Render the log in place into memory reserved from the output. The message is formatted into a stack buffer first,
+// which also measures it, so one reservation holds the whole line: ULOG_RESERVE_LEN bytes of room for the header, the
+// message and the tail. Only a message longer than ULOG_OUTBUF_LEN is formatted again, straight into the reservation.
+// The unused room of the header is given back by the size of the commit.
+static void logger_log_reserved(struct ulog_s *logger, const struct ulog_layout_s *layout,
+                                const struct ulog_event_s *event, bool newline, const char *fmt, va_list ap) {
+  struct ulog_buffer_s body;
+  body.cur_buf_ptr_ = body.log_out_buf_;
+  va_list ap_copy;
+  va_copy(ap_copy, ap);
+  const int measured = logger_vsnprintf(&body, fmt, ap_copy);
+  va_end(ap_copy);
+  const size_t body_len = measured > 0 ? (size_t)measured : 0;
+
+  // The terminating null byte of vsnprintf is overwritten by the tail
+  const size_t size = ULOG_RESERVE_LEN + body_len + layout->tail.len + 2;
+  char *data = logger->reserve_cb_(logger->user_data_, size);
+  if (!data) return;
+
+  struct ulog_writer_s w = {data, data + ULOG_RESERVE_LEN};
+  layout_render(layout, &w, event);
+  if (body_len < sizeof(body.log_out_buf_)) {
+    memcpy(w.cur, body.log_out_buf_, body_len);
+  } else {
+    va_copy(ap_copy, ap);
+    vsnprintf(w.cur, body_len + 1, fmt, ap_copy);
+    va_end(ap_copy);
+  }
+  w.cur += body_len;
+  w.end = data + size - 1;
+  writer_put_str(&w, layout->tail);
+  if (newline) writer_put_char(&w, '\n');
+  logger->commit_cb_(logger->user_data_, data, (size_t)(w.cur - data));
+}
+
+/*****************************************************************************
+ * Repeat filter:
+ * A log with the same level, location and message as the previous log of the
+ * logger is only counted. The count is output as one summary line when another
+ * log arrives, when the filter is changed, or by the repeat timer at the latest
+ * ULOG_REPEAT_TIMER_MS after the timeout expires.
+ *
+ * The last log is kept as the hash of its message, its length and its first
+ * ULOG_REPEAT_PREFIX_LEN bytes, guarded by a sequence (odd while it changes)
+ * that shares one atomic word with the count of the run. A repetition adds to
+ * the count with a compare-and-swap of that word, so it is never counted into
+ * the run of another log. Only the first repetition of a run and the end of a
+ * run take the mutex of the filter, another log without a run replaces the
+ * last one without it.
+ */
+
+#ifndef ULOG_REPEAT_TIMER_MS
+#define ULOG_REPEAT_TIMER_MS 100 /* Period of the thread that outputs the summaries of the runs that stopped */
+#endif
+
+#ifndef ULOG_REPEAT_PREFIX_LEN
+#define ULOG_REPEAT_PREFIX_LEN 64 /* Bytes of the last message compared with a log of the same hash */
+#endif
+
+#define ULOG_REPEAT_COUNT_MASK ((UINT64_C(1) << 40) - 1) /* Count of the run in the low bits of the state */
+#define ULOG_REPEAT_WRITING (UINT64_C(1) << 40)          /* Lowest bit of the sequence, set while the last log changes */
+
+// A log as compared by the filter
+struct ulog_repeat_log_s {
+  uint64_t hash;  // 0 for no log
+  enum ulog_level_e level;
+  const char *file;
+  const char *func;
+  uint32_t line;
+  const char *body;
+  size_t len;
+};
+
+struct ulog_repeat_s {
+  _Atomic uint64_t state;  // Sequence of the last log and count of its run
+
+  // Written by the thread that made the sequence odd
+  struct ulog_repeat_log_s last;  // Without the body
+  char prefix[ULOG_REPEAT_PREFIX_LEN];
+
+  struct ulog_s *logger;
+  struct ulog_repeat_s *next;  // Guarded by repeat_list_mutex_
+  pthread_mutex_t mutex;       // Serializes the start and the end of the runs
+  uint32_t timeout_ms;         // 0 when the filter is disabled
+  uint64_t begin_ns;           // Time of the first repetition of the run
+};
+
+static pthread_mutex_t repeat_list_mutex_ = PTHREAD_MUTEX_INITIALIZER;  // Guards the filters seen by the timer
+static struct ulog_repeat_s *repeat_list_;
+static atomic_bool repeat_timer_started_;
+static pthread_once_t repeat_atfork_once_ = PTHREAD_ONCE_INIT;
+
+static inline uint64_t repeat_mix(uint64_t h, uint64_t v) {
+  h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+  return h ^ (h >> 29);
+}
+
+// Hash of the message, 32 bytes per round in four independent lanes, so the multiplications of a round overlap
+static uint64_t repeat_hash(const char *data, size_t len, uint64_t seed) {
+  uint64_t h0 = seed, h1 = seed ^ 0x6a09e667f3bcc908ULL, h2 = seed ^ 0xbb67ae8584caa73bULL, h3 = ~seed;
+  const char *p = data;
+  const char *end = data + len;
+  for (; end - p >= 32; p += 32) {
+    uint64_t v[4];
+    memcpy(v, p, sizeof(v));
+    h0 = repeat_mix(h0, v[0]);
+    h1 = repeat_mix(h1, v[1]);
+    h2 = repeat_mix(h2, v[2]);
+    h3 = repeat_mix(h3, v[3]);
+  }
+  for (; end - p >= 8; p += 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    h0 = repeat_mix(h0, v);
+  }
+  uint64_t last = 0;
+  memcpy(&last, p, (size_t)(end - p));
+  h1 = repeat_mix(h1, last);
+  uint64_t h = h0 ^ (h1 << 17 | h1 >> 47) ^ (h2 << 31 | h2 >> 33) ^ (h3 << 47 | h3 >> 17);
+  return repeat_mix(h, len) | 1;  // Never 0
+}
+
+static inline size_t repeat_prefix_len(size_t len) {
+  return len < ULOG_REPEAT_PREFIX_LEN ? len : ULOG_REPEAT_PREFIX_LEN;
+}
+
+// Only meaningful if the sequence did not change since it was read
+static inline bool repeat_is_last(const struct ulog_repeat_s *repeat, const struct ulog_repeat_log_s *log) {
+  const struct ulog_repeat_log_s *last = &repeat->last;
+  return last->hash == log->hash && last->len == log->len && last->line == log->line && last->file == log->file &&
+         last->level == log->level && !memcmp(repeat->prefix, log->body, repeat_prefix_len(log->len));
+}
+
+// Must own the odd sequence
+static inline void repeat_record(struct ulog_repeat_s *repeat, const struct ulog_repeat_log_s *log) {
+  repeat->last = *log;
+  repeat->last.body = NULL;
+  memcpy(repeat->prefix, log->body, repeat_prefix_len(log->len));
+}
+
+// Makes the sequence taken from @param state odd, @return false if the state changed
+static inline bool repeat_claim(struct ulog_repeat_s *repeat, uint64_t *state) {
+  const uint64_t writing = (*state & ~ULOG_REPEAT_COUNT_MASK) + ULOG_REPEAT_WRITING;
+  if (!atomic_compare_exchange_weak_explicit(&repeat->state, state, writing, memory_order_acquire,
+                                             memory_order_acquire))
+    return false;
+  atomic_thread_fence(memory_order_release);  // The odd sequence is visible before the last log changes
+  return true;
+}
+
+// Ends the odd sequence of the @param claimed state, with no run
+static inline void repeat_publish(struct ulog_repeat_s *repeat, uint64_t claimed) {
+  atomic_store_explicit(&repeat->state, (claimed & ~ULOG_REPEAT_COUNT_MASK) + 2 * ULOG_REPEAT_WRITING,
+                        memory_order_release);
+}
+
+// Must hold repeat->mutex: ends the run of the last log and makes the sequence odd until repeat_publish(), the last
+// log is copied to @param last. @return the state with the count of the run
+static uint64_t repeat_end_run_locked(struct ulog_repeat_s *repeat, struct ulog_repeat_log_s *last) {
+  uint64_t state = atomic_load_explicit(&repeat->state, memory_order_relaxed);
+  while (!repeat_claim(repeat, &state)) {
+    if (state & ULOG_REPEAT_WRITING) {
+      sched_yield();  // Another thread replaces a last log without a run
+      state = atomic_load_explicit(&repeat->state, memory_order_relaxed);
+    }
+  }
+  *last = repeat->last;
+  return state;
+}
+
+static void repeat_output_summary(struct ulog_s *logger, const struct ulog_repeat_log_s *last, uint64_t count) {
+  if (!count || !is_logger_valid(logger)) return;
+
+  const struct ulog_layout_s *layout = logger_layout(logger);
+  struct ulog_event_s event;
+  event_capture(&event, logger, layout, last->level, last->file, last->func, last->line);
+  struct ulog_buffer_s log_buffer;
+  struct ulog_writer_s w = {log_buffer.log_out_buf_, log_buffer.log_out_buf_ + sizeof(log_buffer.log_out_buf_) - 1};
+  layout_render(layout, &w, &event);
+  *w.cur = '\0';
+  log_buffer.cur_buf_ptr_ = w.cur;
+  const size_t header_len = (size_t)(w.cur - log_buffer.log_out_buf_);
+  logger_snprintf(&log_buffer, "last message repeated %" PRIu64 " times", count);
+  const size_t body_len = (size_t)(log_buffer.cur_buf_ptr_ - log_buffer.log_out_buf_) - header_len;
+  layout_render_tail(layout, &log_buffer, true);
+  logger_output(logger, log_buffer.log_out_buf_, header_len, body_len,
+                (size_t)(log_buffer.cur_buf_ptr_ - log_buffer.log_out_buf_));
+}
+
+static void *repeat_timer(void *unused) {
+  (void)unused;
+  const struct timespec period = {ULOG_REPEAT_TIMER_MS / 1000, (ULOG_REPEAT_TIMER_MS % 1000) * 1000000L};
+  for (;;) {
+    nanosleep(&period, NULL);
+    const uint64_t now_ns = logger_monotonic_time_ns();
+    pthread_mutex_lock(&repeat_list_mutex_);
+    for (struct ulog_repeat_s *repeat = repeat_list_; repeat; repeat = repeat->next) {
+      if (!(atomic_load_explicit(&repeat->state, memory_order_relaxed) & ULOG_REPEAT_COUNT_MASK)) continue;
+      pthread_mutex_lock(&repeat->mutex);
+      // A run only starts and ends under the mutex
+      if ((atomic_load_explicit(&repeat->state, memory_order_relaxed) & ULOG_REPEAT_COUNT_MASK) &&
+          now_ns - repeat->begin_ns >= (uint64_t)repeat->timeout_ms * 1000000) {
+        struct ulog_repeat_log_s last;
+        const uint64_t claimed = repeat_end_run_locked(repeat, &last);
+        repeat_publish(repeat, claimed);  // The log stays the last one, its next repetition starts another run
+        repeat_output_summary(repeat->logger, &last, claimed & ULOG_REPEAT_COUNT_MASK);
+      }
+      pthread_mutex_unlock(&repeat->mutex);
+    }
+    pthread_mutex_unlock(&repeat_list_mutex_);
+  }
+  return NULL;
+}
+
+// The timer does not survive fork(), the first run counted in the child starts another one
+static void repeat_atfork_prepare(void) { pthread_mutex_lock(&repeat_list_mutex_); }
+static void repeat_atfork_parent(void) { pthread_mutex_unlock(&repeat_list_mutex_); }
+static void repeat_atfork_child(void) {
+  pthread_mutex_unlock(&repeat_list_mutex_);
+  atomic_store(&repeat_timer_started_, false);
+}
+
+static void repeat_atfork_register(void) {
+  pthread_atfork(repeat_atfork_prepare, repeat_atfork_parent, repeat_atfork_child);
+}
+
+static void repeat_start_timer(void) {
+  bool expected = false;
+  if (!atomic_compare_exchange_strong(&repeat_timer_started_, &expected, true)) return;
+  pthread_once(&repeat_atfork_once_, repeat_atfork_register);
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, repeat_timer, NULL) != 0) atomic_store(&repeat_timer_started_, false);
+  pthread_attr_destroy(&attr);
+}
+
+// Starts or ends a run, @return true if the log is counted
+static bool repeat_filter_locked(struct ulog_s *logger, struct ulog_repeat_s *repeat,
+                                 const struct ulog_repeat_log_s *log) {
+  if (!atomic_load_explicit(&repeat_timer_started_, memory_order_relaxed)) repeat_start_timer();
+
+  bool counted = false;
+  pthread_mutex_lock(&repeat->mutex);
+  uint64_t state = atomic_load_explicit(&repeat->state, memory_order_acquire);
+  const uint64_t count = state & ULOG_REPEAT_COUNT_MASK;
+  if (!(state & ULOG_REPEAT_WRITING) && repeat_is_last(repeat, log) && count != ULOG_REPEAT_COUNT_MASK &&
+      repeat->timeout_ms) {
+    if (!count) {
+      // The first repetition, fails if another thread replaced the last log meanwhile
+      repeat->begin_ns = logger_monotonic_time_ns();
+      counted = atomic_compare_exchange_strong_explicit(&repeat->state, &state, state + 1, memory_order_relaxed,
+                                                        memory_order_relaxed);
+    } else {
+      // The sequence does not change during a run while the mutex is held
+      atomic_fetch_add_explicit(&repeat->state, 1, memory_order_relaxed);
+      counted = true;
+    }
+  } else {
+    // The summary is output before the log that ended the run
+    struct ulog_repeat_log_s last;
+    const uint64_t claimed = repeat_end_run_locked(repeat, &last);
+    repeat_record(repeat, log);
+    repeat_publish(repeat, claimed);
+    repeat_output_summary(logger, &last, claimed & ULOG_REPEAT_COUNT_MASK);
+  }
+  pthread_mutex_unlock(&repeat->mutex);
+  return counted;
+}
+
+// @return true if the log repeats the previous one and is only counted
+static bool repeat_filter(struct ulog_s *logger, struct ulog_repeat_s *repeat, enum ulog_level_e level,
+                          const char *file, const char *func, uint32_t line, const char *body, size_t body_len) {
+  const uint64_t seed = (uintptr_t)file ^ (uint64_t)line << 32 ^ level;
+  const struct ulog_repeat_log_s log = {repeat_hash(body, body_len, seed), level, file, func, line, body, body_len};
+  uint64_t state = atomic_load_explicit(&repeat->state, memory_order_acquire);
+  for (;;) {
+    if (state & ULOG_REPEAT_WRITING) return false;  // The last log is being replaced
+    const uint64_t count = state & ULOG_REPEAT_COUNT_MASK;
+    const bool is_last = repeat_is_last(repeat, &log);
+    atomic_thread_fence(memory_order_acquire);  // The last log is read before the sequence is checked again
+    if (is_last) {
+      if (!count || count == ULOG_REPEAT_COUNT_MASK) break;
+      // A repetition during a run, fails if the sequence or the count changed
+      if (atomic_compare_exchange_weak_explicit(&repeat->state, &state, state + 1, memory_order_acquire,
+                                                memory_order_acquire))
+        return true;
+    } else {
+      if (count) break;
+      // Another log without a run replaces the last one
+      if (repeat_claim(repeat, &state)) {
+        repeat_record(repeat, &log);
+        repeat_publish(repeat, state);
+        return false;
+      }
+    }
+  }
+  return repeat_filter_locked(logger, repeat, &log);
+}
+
+// The message is formatted before the header, so a repetition takes no log number and costs no header
+static void logger_log_filtered(struct ulog_s *logger, struct ulog_repeat_s *repeat, const struct ulog_layout_s *layout,
+                                enum ulog_level_e level, const char *file, const char *func, uint32_t line,
+                                bool newline, uint64_t suppressed, const char *fmt, va_list ap) {
+  struct ulog_buffer_s body;
+  body.cur_buf_ptr_ = body.log_out_buf_;
+  logger_vsnprintf(&body, fmt, ap);
+  if (suppressed) logger_snprintf(&body, " [suppressed %" PRIu64 "]", suppressed);
+  const size_t body_len = (size_t)(body.cur_buf_ptr_ - body.log_out_buf_);
+  if (repeat_filter(logger, repeat, level, file, func, line, body.log_out_buf_, body_len)) return;
+
+  struct ulog_event_s event;
+  event_capture(&event, logger, layout, level, file, func, line);
+  struct ulog_buffer_s log_buffer;
+  struct ulog_writer_s w = {log_buffer.log_out_buf_, log_buffer.log_out_buf_ + sizeof(log_buffer.log_out_buf_) - 1};
+  layout_render(layout, &w, &event);
+  *w.cur = '\0';
+  log_buffer.cur_buf_ptr_ = w.cur;
+  const size_t header_len = (size_t)(w.cur - log_buffer.log_out_buf_);
+  buffer_put(&log_buffer, body.log_out_buf_, body_len);
+  const size_t log_body_len = (size_t)(log_buffer.cur_buf_ptr_ - log_buffer.log_out_buf_) - header_len;
+  layout_render_tail(layout, &log_buffer, newline);
+  logger_output(logger, log_buffer.log_out_buf_, header_len, log_body_len,
+                (size_t)(log_buffer.cur_buf_ptr_ - log_buffer.log_out_buf_));
+}
+
+static inline struct ulog_repeat_s *logger_repeat(struct ulog_s *logger) {
+  struct ulog_repeat_s *repeat = atomic_load_explicit(&logger->repeat_, memory_order_acquire);
+  return repeat && __atomic_load_n(&repeat->timeout_ms, __ATOMIC_RELAXED) ? repeat : NULL;
+}
+
+void logger_set_repeat_filter(struct ulog_s *logger, uint32_t timeout_ms) {
+  if (!logger) return;
+  struct ulog_repeat_s *repeat = atomic_load_explicit(&logger->repeat_, memory_order_acquire);
+  if (!repeat) {
+    if (!timeout_ms) return;
+    struct ulog_repeat_s *created = calloc(1, sizeof(*created));
+    if (!created) return;
+    created->logger = logger;
+    pthread_mutex_init(&created->mutex, NULL);
+    if (atomic_compare_exchange_strong_explicit(&logger->repeat_, &repeat, created, memory_order_acq_rel,
+                                                memory_order_acquire)) {
+      repeat = created;
+      pthread_mutex_lock(&repeat_list_mutex_);
+      repeat->next = repeat_list_;
+      repeat_list_ = repeat;
+      pthread_mutex_unlock(&repeat_list_mutex_);
+    } else {
+      pthread_mutex_destroy(&created->mutex);
+      free(created);
+    }
+  }
+
+  pthread_mutex_lock(&repeat->mutex);
+  struct ulog_repeat_log_s last;
+  const uint64_t claimed = repeat_end_run_locked(repeat, &last);
+  repeat->last.hash = 0;  // The next log is not a repetition
+  repeat_publish(repeat, claimed);
+  repeat_output_summary(logger, &last, claimed & ULOG_REPEAT_COUNT_MASK);
+  __atomic_store_n(&repeat->timeout_ms, timeout_ms, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&repeat->mutex);
+}
+
+static void repeat_destroy(struct ulog_s *logger) {
+  struct ulog_repeat_s *repeat = atomic_load_explicit(&logger->repeat_, memory_order_acquire);
+  if (!repeat) return;
+  pthread_mutex_lock(&repeat_list_mutex_);
+  struct ulog_repeat_s **link = &repeat_list_;
+  while (*link != repeat) link = &(*link)->next;
+  *link = repeat->next;
+  pthread_mutex_unlock(&repeat_list_mutex_);
+
+  logger_set_repeat_filter(logger, 0);
+  pthread_mutex_destroy(&repeat->mutex);
+  free(repeat);
+}
+
+// @param suppressed Number of logs suppressed by the rate limit of the call site, appended to the message
+static void logger_vlog(struct ulog_s *logger, struct ulog_site_s *site, enum ulog_level_e level, const char *file,
+                        const char *func, uint32_t line, bool newline, bool flush, uint64_t suppressed,
+                        const char *fmt, va_list ap) {
+  if (!is_logger_valid(logger) || !fmt || level < logger->log_level_) return;
+
+  const struct ulog_layout_s *layout = logger_layout(logger);
+  struct ulog_async_s *async = flush ? logger_async(logger) : NULL;
+  struct ulog_repeat_s *repeat = flush ? logger_repeat(logger) : NULL;
+  if (repeat) {
+    // The filter compares the formatted messages
+    logger_log_filtered(logger, repeat, layout, level, file, func, line, newline, suppressed, fmt, ap);
+  } else {
+    struct ulog_event_s event;
+    event_capture(&event, logger, layout, level, file, func, line);
+
+    // The rare logs with a suppressed count are rendered here, with the count behind the message
+    const struct ulog_site_s *signature = async && !suppressed ? site_signature(site, fmt) : NULL;
+    if (signature && logger_push_deferred(async, signature, layout, &event, newline, ap)) {
+      // Formatted by the backend thread
+    } else if (flush && !async && !suppressed && logger->reserve_cb_) {
+      logger_log_reserved(logger, layout, &event, newline, fmt, ap);
+    } else {
+      struct ulog_buffer_s log_buffer;
+      // Keep the last byte for the terminating null byte
+      struct ulog_writer_s w = {log_buffer.log_out_buf_,
+                                log_buffer.log_out_buf_ + sizeof(log_buffer.log_out_buf_) - 1};
+      layout_render(layout, &w, &event);
+      *w.cur = '\0';
+      log_buffer.cur_buf_ptr_ = w.cur;
+      const size_t header_len = (size_t)(w.cur - log_buffer.log_out_buf_);
+
+      logger_vsnprintf(&log_buffer, fmt, ap);
+      if (suppressed) logger_snprintf(&log_buffer, " [suppressed %" PRIu64 "]", suppressed);
+      const size_t body_len = (size_t)(log_buffer.cur_buf_ptr_ - log_buffer.log_out_buf_) - header_len;
+      layout_render_tail(layout, &log_buffer, newline);
+
+      const size_t len = (size_t)(log_buffer.cur_buf_ptr_ - log_buffer.log_out_buf_);
+      if (flush && len) logger_output(logger, log_buffer.log_out_buf_, header_len, body_len, len);
+    }
+  }
+
+  if (flush && level == ULOG_LEVEL_FATAL) {
+    if (async) async->ops->flush(async);
+    if (logger->flush_cb_) logger->flush_cb_(logger->user_data_);
+  }
+}
+
+void logger_log_with_header(struct ulog_s *logger, enum ulog_level_e level, const char *file, const char *func,
+                            uint32_t line, bool newline, bool flush, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  logger_vlog(logger, NULL, level, file, func, line, newline, flush, 0, fmt, ap);
+  va_end(ap);
+}
+
+void logger_log_with_site(struct ulog_s *logger, struct ulog_site_s *site, enum ulog_level_e level, bool newline,
+                          bool flush, const char *fmt, ...) {
+  if (!site_level_enabled(site, level)) return;
+  site_register(site);
+  va_list ap;
+  va_start(ap, fmt);
+  logger_vlog(logger, site, level, site_filename(site), site->func_, site->line_, newline, flush, 0, fmt, ap);
+  va_end(ap);
+}
+
+bool logger_limited_enabled(struct ulog_s *logger, struct ulog_site_s *site, enum ulog_level_e level) {
+  if (!is_logger_valid(logger) || level < logger->log_level_ || !site_level_enabled(site, level)) return false;
+  site_register(site);
+  return true;
+}
+
+void logger_log_limited(struct ulog_s *logger, struct ulog_site_s *site, struct ulog_limit_s *limit,
+                        enum ulog_level_e level, const char *fmt, ...) {
+  // The suppressed count is kept for the next log that is output
+  if (!logger_limited_enabled(logger, site, level)) return;
+  const uint64_t suppressed = logger_limit_take_suppressed(limit);
+  va_list ap;
+  va_start(ap, fmt);
+  logger_vlog(logger, site, level, site_filename(site), site->func_, site->line_, true, true, suppressed, fmt, ap);
+  va_end(ap);
+}
+
+/*****************************************************************************
+ * Tokens:
+ * LOGGER_TOKEN and LOGGER_MULTI_TOKEN write "name => value" with a writer per
+ * type instead of a printf format per token, straight behind the header of the
+ * log line opened by logger_line_begin().
+ */
+
+bool logger_line_begin(struct ulog_s *logger, struct ulog_site_s *site, enum ulog_level_e level,
+                       struct ulog_line_s *line) {
+  if (!is_logger_valid(logger) || level < logger->log_level_ || !site_level_enabled(site, level)) return false;
+  site_register(site);
+
+  const struct ulog_layout_s *layout = logger_layout(logger);
+  struct ulog_event_s event;
+  event_capture(&event, logger, layout, level, site_filename(site), site->func_, site->line_);
+
+  struct ulog_buffer_s *buffer = &line->buffer_;
+  // Keep the last byte for the terminating null byte
+  struct ulog_writer_s w = {buffer->log_out_buf_, buffer->log_out_buf_ + sizeof(buffer->log_out_buf_) - 1};
+  layout_render(layout, &w, &event);
+  *w.cur = '\0';
+  buffer->cur_buf_ptr_ = w.cur;
+
+  line->layout_ = layout;
+  line->header_len_ = (size_t)(w.cur - buffer->log_out_buf_);
+  line->level_ = level;
+  line->color_ = layout->format & ULOG_F_COLOR;
+  return true;
+}
+
+void logger_line_end(struct ulog_s *logger, struct ulog_line_s *line) {
+  struct ulog_buffer_s *buffer = &line->buffer_;
+  const size_t body_len = (size_t)(buffer->cur_buf_ptr_ - buffer->log_out_buf_) - line->header_len_;
+  layout_render_tail(line->layout_, buffer, true);
+  logger_output(logger, buffer->log_out_buf_, line->header_len_, body_len,
+                (size_t)(buffer->cur_buf_ptr_ - buffer->log_out_buf_));
+
+  if (line->level_ == ULOG_LEVEL_FATAL) {
+    struct ulog_async_s *async = logger_async(logger);
+    if (async) async->ops->flush(async);
+    if (logger->flush_cb_) logger->flush_cb_(logger->user_data_);
+  }
+}
+
+// Write "value" in decimal backwards from "buf_end", 8 digits at a time in 32-bit arithmetic
+// @return Pointer to the first character written
+static inline char *encode_u64(char *buf_end, uint64_t value) {
+  char *p = buf_end;
+  while (value > UINT32_MAX) {
+    p = encode_u32(p, (uint32_t)(value % 100000000), 8);
+    value /= 100000000;
+  }
+  return encode_u32(p, (uint32_t)value, 0);
+}
+
+static const double pow10_[] = {1e0, 1e1, 1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,
+                                1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17};
+
+// Write "mantissa / 10^exp10" in fixed-point notation, e.g. (12345, 3) as "12.345"
+static char *put_fixed(char *p, uint64_t mantissa, unsigned exp10) {
+  char digits[40];
+  char *end = digits + sizeof(digits);
+  char *begin = encode_u64(end, mantissa);
+  while ((unsigned)(end - begin) <= exp10) *--begin = '0';
+  while (exp10 && end[-1] == '0') end--, exp10--;
+
+  const size_t int_len = (size_t)(end - begin) - exp10;
+  memcpy(p, begin, int_len);
+  p += int_len;
+  if (exp10) {
+    *p++ = '.';
+    memcpy(p, begin + int_len, exp10);
+    p += exp10;
+  }
+  return p;
+}
+
+// Shortest decimal of a value in [1e-4, 1e14) ([1e-4, 1e5) for a float), where "%g" uses fixed-point notation, in
+// exact 128-bit arithmetic: with value = m / 2^shift, a decimal reads back as value when it lies between the midpoints
+// to the neighbouring doubles (floats), which belong to value if m is even. As in put_general(), the digits are
+// rounded to DBL_DIG (FLT_DIG) places first, one more place at a time after that.
+// @return NULL for values out of the range
+static char *put_shortest(char *p, double value, bool single) {
+  if (value < 1e-4 || value >= (single ? 1e5 : 1e14)) return NULL;
+  // value = m * 2^exp2 with a normal mantissa of 24 (53) bits
+  const int bits = single ? 24 : 53;
+  uint64_t m;
+  int exp2;
+  if (single) {
+    const float f = (float)value;
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    m = (u & 0x7fffff) | 0x800000;
+    exp2 = (int)(u >> 23) - 127 - 23;
+  } else {
+    uint64_t u;
+    memcpy(&u, &value, sizeof(u));
+    m = (u & 0xfffffffffffffULL) | 0x10000000000000ULL;
+    exp2 = (int)(u >> 52) - 1023 - 52;
+  }
+  const unsigned shift = (unsigned)(2 - exp2);  // value = 4m / 2^shift, shift in 9..68
+  // The double (float) below is closer above a power of 2
+  const uint64_t low = m == 1ULL << (bits - 1) ? 4 * m - 1 : 4 * m - 2;
+  const uint64_t high = 4 * m + 2;
+  const unsigned __int128 half = (unsigned __int128)1 << (shift - 1);
+
+  // 10^exp10 <= value < 10^(exp10 + 1), from value >= 2^(exp2 + bits - 1) and log10(2) ~ 1233 / 4096; corrected below
+  // when it is one too small
+  int exp10 = (exp2 + bits - 1) * 1233 >> 12;
+  for (int digits = single ? FLT_DIG : DBL_DIG; digits <= (single ? 9 : 17); digits++) {
+    unsigned __int128 scale;
+    uint64_t q;
+    for (;;) {
+      scale = 1;
+      for (int i = digits - 1 - exp10; i > 0; i--) scale *= 10;
+      const unsigned __int128 scaled = (unsigned __int128)(4 * m) * scale;
+      q = (uint64_t)(scaled >> shift);
+      const unsigned __int128 rem = scaled & (2 * half - 1);
+      if (rem > half || (rem == half && (q & 1))) q++;
+      if (q < (uint64_t)pow10_[digits - 1]) {
+        exp10--;
+      } else if (q > (uint64_t)pow10_[digits]) {
+        exp10++;
+      } else {
+        break;
+      }
+    }
+    const unsigned __int128 decimal = (unsigned __int128)q << shift;
+    const unsigned __int128 below = low * scale, above = high * scale;
+    if ((decimal > below && decimal < above) || (!(m & 1) && (decimal == below || decimal == above))) {
+      return put_fixed(p, q, (unsigned)(digits - 1 - exp10));
+    }
+  }
+  return NULL;
+}
+
+// Digits of the mantissa of a "%g" number without the leading and trailing zeros, e.g. 1 for "0.01" and "100"
+static int count_significant(const char *str) {
+  int count = 0, zeros = 0;
+  for (; *str && *str != 'e'; str++) {
+    if (*str == '0') {
+      if (count) zeros++;
+    } else if (*str >= '1' && *str <= '9') {
+      count += zeros + 1;
+      zeros = 0;
+    }
+  }
+  return count;
+}
+
+// Fewest "%.*g" digits that read back as "value". A decimal of at most FLT_DIG (DBL_DIG) digits is closer to the
+// nearest normal float (double) than any other, so rounding to that precision finds a shorter form when there is one;
+// only values that need more digits take one or two more tries. Subnormals have fewer digits and try them all. A
+// shorter form is printed again with its own precision, which decides the notation, e.g. "1e+14" for "%.15g"'s
+// "100000000000000".
+static char *put_general(char *p, char *end, double value, bool single) {
+  const int max_digits = single ? 9 : 17;  // Enough digits for any float / double
+  const bool subnormal = value < (single ? FLT_MIN : DBL_MIN);
+  for (int digits = subnormal ? 1 : single ? FLT_DIG : DBL_DIG;; digits++) {
+    int len = snprintf(p, (size_t)(end - p), "%.*g", digits, value);
+    const bool exact = digits == max_digits || (single ? strtof(p, NULL) == (float)value : strtod(p, NULL) == value);
+    if (!exact) continue;
+    const int significant = count_significant(p);
+    if (significant < digits) len = snprintf(p, (size_t)(end - p), "%.*g", significant, value);
+    return p + (len < end - p ? len : end - p - 1);
+  }
+}
+
+// Maximum length of a number rendered by put_double()
+#define ULOG_DOUBLE_STR_MAX 32
+
+// Shortest decimal that reads back as "value" (as a float if "single"): in fixed-point notation in [1e-4, 1e14)
+// ([1e-4, 1e5) for a float) by put_shortest(), where "%g" uses it for the longest numbers, and in "%g" notation by
+// put_general() outside, e.g. "1e-10" and "1.5e+15".
+static char *put_double(char *p, double value, bool single) {
+  char *const end = p + ULOG_DOUBLE_STR_MAX;
+  if (signbit(value)) {
+    *p++ = '-';
+    value = -value;
+  }
+  if (isnan(value) || isinf(value)) {
+    memcpy(p, isnan(value) ? "nan" : "inf", 3);
+    return p + 3;
+  }
+  if (value == 0) {
+    *p++ = '0';
+    return p;
+  }
+  char *const shortest = put_shortest(p, value, single);
+  return shortest ? shortest : put_general(p, end, value, single);
+}
+
+static inline void token_put_name(struct ulog_buffer_s *buffer, bool color, const char *name) {
+  static const struct ulog_str_s arrows[2] = {ULOG_STR_LITERAL(" => "),
+                                              ULOG_STR_LITERAL(" " ULOG_STR_RED "=> " ULOG_STR_GREEN)};
+  if (!name) name = "unnamed";
+  if (color) buffer_put(buffer, ULOG_STR_BLUE, sizeof(ULOG_STR_BLUE) - 1);
+  buffer_put(buffer, name, strlen(name));
+  buffer_put(buffer, arrows[color].str, arrows[color].len);
+}
+
+void logger_token_int(struct ulog_buffer_s *buffer, bool color, const char *name, int64_t value) {
+  token_put_name(buffer, color, name);
+  char tmp[21];
+  char *p = encode_u64(tmp + sizeof(tmp), value < 0 ? -(uint64_t)value : (uint64_t)value);
+  if (value < 0) *--p = '-';
+  buffer_put(buffer, p, (size_t)(tmp + sizeof(tmp) - p));
+}
+
+void logger_token_uint(struct ulog_buffer_s *buffer, bool color, const char *name, uint64_t value) {
+  token_put_name(buffer, color, name);
+  char tmp[20];
+  const char *p = encode_u64(tmp + sizeof(tmp), value);
+  buffer_put(buffer, p, (size_t)(tmp + sizeof(tmp) - p));
+}
+
+void logger_token_double(struct ulog_buffer_s *buffer, bool color, const char *name, double value) {
+  token_put_name(buffer, color, name);
+  char tmp[ULOG_DOUBLE_STR_MAX];
+  buffer_put(buffer, tmp, (size_t)(put_double(tmp, value, false) - tmp));
+}
+
+void logger_token_float(struct ulog_buffer_s *buffer, bool color, const char *name, float value) {
+  token_put_name(buffer, color, name);
+  char tmp[ULOG_DOUBLE_STR_MAX];
+  buffer_put(buffer, tmp, (size_t)(put_double(tmp, value, true) - tmp));
+}
+
+void logger_token_pointer(struct ulog_buffer_s *buffer, bool color, const char *name, const void *value) {
+  token_put_name(buffer, color, name);
+  if (!value) {
+    buffer_put(buffer, "(nil)", 5);  // Same as "%p" of glibc
+    return;
+  }
+  char tmp[sizeof(uintptr_t) * 2 + 2];
+  char *p = tmp + sizeof(tmp);
+  for (uintptr_t address = (uintptr_t)value; address; address >>= 4) *--p = hex_digits_[address & 0xf];
+  *--p = 'x';
+  *--p = '0';
+  buffer_put(buffer, p, (size_t)(tmp + sizeof(tmp) - p));
+}
+
+void logger_token_string(struct ulog_buffer_s *buffer, bool color, const char *name, const char *value) {
+  static const struct ulog_str_s opening_quotes[2] = {ULOG_STR_LITERAL("\""),
+                                                      ULOG_STR_LITERAL(ULOG_STR_RED "\"" ULOG_STR_GREEN)};
+  static const struct ulog_str_s closing_quotes[2] = {ULOG_STR_LITERAL("\""), ULOG_STR_LITERAL(ULOG_STR_RED "\"")};
+  token_put_name(buffer, color, name);
+  if (!value) value = "";
+  buffer_put(buffer, opening_quotes[color].str, opening_quotes[color].len);
+  buffer_put(buffer, value, strlen(value));
+  buffer_put(buffer, closing_quotes[color].str, closing_quotes[color].len);
+}
+
+void logger_token_none(struct ulog_buffer_s *buffer, bool color, const char *name) {
+  token_put_name(buffer, color, name);
+  buffer_put(buffer, "(none)", 6);
+}
+
+void logger_token_separator(struct ulog_buffer_s *buffer, bool color, bool last) {
+  static const struct ulog_str_s separators[2] = {ULOG_STR_LITERAL(", "), ULOG_STR_LITERAL(ULOG_STR_RED ", ")};
+  if (!last) {
+    buffer_put(buffer, separators[color].str, separators[color].len);
+  } else if (color) {
+    buffer_put(buffer, ULOG_STR_RESET, sizeof(ULOG_STR_RESET) - 1);
+  }
+}
+
+/*****************************************************************************
+ * Structured logs:
+ * The fields are encoded into a binary record on the calling thread (see
+ * logger_kv_next() for the layout), which is all a deferred backend copies.
+ * They are rendered as logfmt or JSON behind the message only when the line
+ * is output, or passed undecoded to the structured output callback.
+ */
+
+#define ULOG_KV_VARINT_MAX 10  // Bytes of a 64-bit varint
+
+void logger_set_kv_format(struct ulog_s *logger, enum ulog_kv_format_e format) {
+  ULOG_SET(logger, kv_format_, (uint8_t)format);
+}
+
+void logger_set_output_kv_callback(struct ulog_s *logger, ulog_output_kv_callback output_callback) {
+  ULOG_SET(logger, output_kv_cb_, output_callback);
+}
+
+static inline uint8_t *kv_put_varint(uint8_t *p, uint64_t value) {
+  while (value >= 0x80) {
+    *p++ = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  *p++ = (uint8_t)value;
+  return p;
+}
+
+static inline bool kv_get_varint(const uint8_t **pos, const uint8_t *end, uint64_t *value) {
+  uint64_t result = 0;
+  for (unsigned shift = 0; *pos < end && shift < 64; shift += 7) {
+    const uint8_t byte = *(*pos)++;
+    result |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t logger_kv_encode(const struct ulog_kv_s *fields, size_t count, void *buf, size_t size) {
+  uint8_t *const begin = buf;
+  uint8_t *p = begin;
+  for (size_t i = 0; i < count; i++) {
+    const struct ulog_kv_s *field = &fields[i];
+    const size_t key_len = field->key ? field->key_len : 0;
+    const size_t str_len = field->type == ULOG_KV_STRING && field->value.str.ptr ? field->value.str.len : 0;
+    if (field->type < ULOG_KV_INT || field->type > ULOG_KV_STRING) continue;
+
+    // Upper bound of the encoded field, a field that may not fit is left out
+    const size_t max_len = 1 + ULOG_KV_VARINT_MAX + key_len + ULOG_KV_VARINT_MAX + str_len;
+    if (max_len > size - (size_t)(p - begin)) continue;
+
+    *p++ = (uint8_t)field->type;
+    p = kv_put_varint(p, key_len);
+    if (key_len) memcpy(p, field->key, key_len);
+    p += key_len;
+    switch (field->type) {
+      case ULOG_KV_INT: {
+        const uint64_t value = (uint64_t)field->value.i;
+        p = kv_put_varint(p, (value << 1) ^ (uint64_t)(field->value.i >> 63));  // Zigzag, small magnitudes are short
+        break;
+      }
+      case ULOG_KV_UINT:
+        p = kv_put_varint(p, field->value.u);
+        break;
+      case ULOG_KV_DOUBLE: {
+        uint64_t bits;
+        memcpy(&bits, &field->value.d, sizeof(bits));
+        for (unsigned byte = 0; byte < 8; byte++) *p++ = (uint8_t)(bits >> (byte * 8));
+        break;
+      }
+      case ULOG_KV_BOOL:
+        *p++ = field->value.b;
+        break;
+      default:
+        p = kv_put_varint(p, str_len);
+        if (str_len) memcpy(p, field->value.str.ptr, str_len);
+        p += str_len;
+        break;
+    }
+  }
+  return (size_t)(p - begin);
+}
+
+bool logger_kv_next(const void **pos, const void *end, struct ulog_kv_s *field) {
+  const uint8_t *p = *pos;
+  const uint8_t *const record_end = end;
+  uint64_t value;
+  if (p >= record_end) return false;
+
+  field->type = (enum ulog_kv_type_e)*p++;
+  if (!kv_get_varint(&p, record_end, &value) || value > (uint64_t)(record_end - p)) return false;
+  field->key = (const char *)p;
+  field->key_len = (size_t)value;
+  p += value;
+
+  switch (field->type) {
+    case ULOG_KV_INT:
+      if (!kv_get_varint(&p, record_end, &value)) return false;
+      field->value.i = (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+      break;
+    case ULOG_KV_UINT:
+      if (!kv_get_varint(&p, record_end, &field->value.u)) return false;
+      break;
+    case ULOG_KV_DOUBLE: {
+      if (record_end - p < 8) return false;
+      uint64_t bits = 0;
+      for (unsigned byte = 0; byte < 8; byte++) bits |= (uint64_t)*p++ << (byte * 8);
+      memcpy(&field->value.d, &bits, sizeof(bits));
+      break;
+    }
+    case ULOG_KV_BOOL:
+      if (p >= record_end) return false;
+      field->value.b = *p++ != 0;
+      break;
+    case ULOG_KV_STRING:
+      if (!kv_get_varint(&p, record_end, &value) || value > (uint64_t)(record_end - p)) return false;
+      field->value.str.ptr = (const char *)p;
+      field->value.str.len = (size_t)value;
+      p += value;
+      break;
+    default:
+      return false;
+  }
+  *pos = p;
+  return true;
+}
+
+// Quoted string with the escapes of JSON, which logfmt parsers accept as well
+static void kv_put_quoted(struct ulog_writer_s *w, const char *str, size_t len) {
+  const char *const end = str + len;
+  const char *run = str;
+  writer_put_char(w, '"');
+  for (const char *p = str; p < end; p++) {
+    const unsigned char c = (unsigned char)*p;
+    if (c >= 0x20 && c != '"' && c != '\\') continue;
+    writer_put(w, run, (size_t)(p - run));
+    run = p + 1;
+    writer_put_char(w, '\\');
+    switch (c) {
+      case '"':
+      case '\\':
+        writer_put_char(w, (char)c);
+        break;
+      case '\n':
+        writer_put_char(w, 'n');
+        break;
+      case '\r':
+        writer_put_char(w, 'r');
+        break;
+      case '\t':
+        writer_put_char(w, 't');
+        break;
+      default: {
+        const char escape[5] = {'u', '0', '0', hex_digits_[c >> 4], hex_digits_[c & 0xf]};
+        writer_put(w, escape, sizeof(escape));
+        break;
+      }
+    }
+  }
+  writer_put(w, run, (size_t)(end - run));
+  writer_put_char(w, '"');
+}
+
+// logfmt values are quoted when they are empty or contain a space, '=', '"' or a control character
+static bool kv_logfmt_needs_quotes(const char *str, size_t len) {
+  if (!len) return true;
+  for (size_t i = 0; i < len; i++) {
+    const unsigned char c = (unsigned char)str[i];
+    if (c <= ' ' || c == '=' || c == '"' || c == 0x7f) return true;
+  }
+  return false;
+}
+
+static void kv_put_value(struct ulog_writer_s *w, const struct ulog_kv_s *field, bool json) {
+  char tmp[ULOG_DOUBLE_STR_MAX];
+  char *p;
+  switch (field->type) {
+    case ULOG_KV_INT:
+      p = encode_u64(tmp + sizeof(tmp), field->value.i < 0 ? -(uint64_t)field->value.i : (uint64_t)field->value.i);
+      if (field->value.i < 0) *--p = '-';
+      writer_put(w, p, (size_t)(tmp + sizeof(tmp) - p));
+      break;
+    case ULOG_KV_UINT:
+      p = encode_u64(tmp + sizeof(tmp), field->value.u);
+      writer_put(w, p, (size_t)(tmp + sizeof(tmp) - p));
+      break;
+    case ULOG_KV_DOUBLE:
+      // JSON has no literal for NaN and infinities
+      if (json && (isnan(field->value.d) || isinf(field->value.d))) {
+        writer_put(w, "null", 4);
+      } else {
+        writer_put(w, tmp, (size_t)(put_double(tmp, field->value.d, false) - tmp));
+      }
+      break;
+    case ULOG_KV_BOOL:
+      if (field->value.b) {
+        writer_put(w, "true", 4);
+      } else {
+        writer_put(w, "false", 5);
+      }
+      break;
+    default:
+      if (json || kv_logfmt_needs_quotes(field->value.str.ptr, field->value.str.len)) {
+        kv_put_quoted(w, field->value.str.ptr, field->value.str.len);
+      } else {
+        writer_put(w, field->value.str.ptr, field->value.str.len);
+      }
+      break;
+  }
+}
+
+size_t logger_kv_render(const void *fields, size_t fields_len, enum ulog_kv_format_e format, char *buf, size_t size) {
+  if (!buf || !size) return 0;
+  if (!fields || !fields_len || size < 4) {
+    *buf = '\0';
+    return 0;
+  }
+
+  const bool json = format == ULOG_KV_JSON;
+  // The end is the terminating null byte, before it the closing brace of JSON, so a field that fits ends before it
+  struct ulog_writer_s w = {buf, buf + size - json};
+  if (json) writer_put(&w, " {", 2);
+
+  const void *pos = fields;
+  const void *const end = (const uint8_t *)fields + fields_len;
+  struct ulog_kv_s field;
+  bool first = true;
+  while (logger_kv_next(&pos, end, &field)) {
+    char *const field_begin = w.cur;
+    if (json) {
+      if (!first) writer_put_char(&w, ',');
+      kv_put_quoted(&w, field.key, field.key_len);
+      writer_put_char(&w, ':');
+    } else {
+      writer_put_char(&w, ' ');
+      writer_put(&w, field.key, field.key_len);
+      writer_put_char(&w, '=');
+    }
+    kv_put_value(&w, &field, json);
+
+    // A field that reaches the end may be cut, it is left out with the ones behind it
+    if (w.cur == w.end) {
+      w.cur = field_begin;
+      break;
+    }
+    first = false;
+  }
+
+  if (json) {
+    w.end++;
+    writer_put_char(&w, '}');
+  }
+  *w.cur = '\0';
+  return (size_t)(w.cur - buf);
+}
+
+// Output a structured log: the message and the rendered fields are the body of the line, or the line without the
+// fields and the record are passed to the structured output callback
+static void kv_emit(struct ulog_s *logger, const struct ulog_layout_s *layout, const struct ulog_event_s *event,
+                    const char *msg, size_t msg_len, const uint8_t *fields, size_t fields_len,
+                    enum ulog_kv_format_e format) {
+  struct ulog_buffer_s log_buffer;
+  // Keep the last byte for the terminating null byte
+  struct ulog_writer_s w = {log_buffer.log_out_buf_, log_buffer.log_out_buf_ + sizeof(log_buffer.log_out_buf_) - 1};
+  layout_render(layout, &w, event);
+  *w.cur = '\0';
+  log_buffer.cur_buf_ptr_ = w.cur;
+  const size_t header_len = (size_t)(w.cur - log_buffer.log_out_buf_);
+  buffer_put(&log_buffer, msg, msg_len);
+
+  if (logger->output_kv_cb_) {
+    layout_render_tail(layout, &log_buffer, true);
+    logger->output_kv_cb_(logger->user_data_, log_buffer.log_out_buf_,
+                          (size_t)(log_buffer.cur_buf_ptr_ - log_buffer.log_out_buf_), fields, fields_len);
+    return;
+  }
+
+  // The fields are left out rather than the tail
+  const size_t room = sizeof(log_buffer.log_out_buf_) - (size_t)(log_buffer.cur_buf_ptr_ - log_buffer.log_out_buf_);
+  const size_t tail_len = layout->tail.len + 1;
+  log_buffer.cur_buf_ptr_ += logger_kv_render(fields, fields_len, format, log_buffer.cur_buf_ptr_,
+                                              room > tail_len ? room - tail_len : 1);
+  const size_t body_len = (size_t)(log_buffer.cur_buf_ptr_ - log_buffer.log_out_buf_) - header_len;
+  layout_render_tail(layout, &log_buffer, true);
+  logger_emit(logger, log_buffer.log_out_buf_, header_len, body_len,
+              (size_t)(log_buffer.cur_buf_ptr_ - log_buffer.log_out_buf_));
+}
+
+static void logger_push_kv(struct ulog_s *logger, struct ulog_async_s *async, const struct ulog_layout_s *layout,
+                           const struct ulog_event_s *event, const char *msg, size_t msg_len, const uint8_t *fields,
+                           size_t fields_len) {
+  const size_t size = sizeof(struct ulog_record_s) + msg_len + fields_len;
+  struct ulog_record_s *record = async->ops->reserve(async, size);
+  if (!record) {
+    // Also fits the smallest queue, with the longest message and fields
+    __atomic_fetch_add(&logger->dropped_, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  record->type = ULOG_RECORD_KV;
+  record->format = layout->format;
+  record->kv_format = logger->kv_format_;
+  record->newline = true;
+  record->header_len = (uint32_t)msg_len;
+  record->body_len = (uint32_t)fields_len;
+  record->event = *event;
+  record->site = NULL;
+  memcpy(record->payload, msg, msg_len);
+  memcpy(record->payload + msg_len, fields, fields_len);
+  async->ops->commit(async, record, size);
+}
+
+bool logger_kv_enabled(struct ulog_s *logger, struct ulog_site_s *site, enum ulog_level_e level) {
+  // Structured logs only need the structured output callback
+  if (!logger || !(is_logger_valid(logger) || (logger->output_kv_cb_ && logger->log_output_enabled_)) ||
+      level < logger->log_level_ || !site_level_enabled(site, level))
+    return false;
+  site_register(site);
+  return true;
+}
+
+void logger_log_kv(struct ulog_s *logger, struct ulog_site_s *site, enum ulog_level_e level, const char *msg,
+                   const struct ulog_kv_s *fields, size_t count) {
+  if (!msg) return;
+
+  uint8_t record[ULOG_OUTBUF_LEN];
+  const size_t fields_len = logger_kv_encode(fields, count, record, sizeof(record));
+  size_t msg_len = strlen(msg);
+  if (msg_len > ULOG_OUTBUF_LEN) msg_len = ULOG_OUTBUF_LEN;
+
+  const struct ulog_layout_s *layout = logger_layout(logger);
+  struct ulog_event_s event;
+  event_capture(&event, logger, layout, level, site_filename(site), site->func_, site->line_);
+
+  // The repeat filter compares rendered text, it does not apply to structured logs
+  struct ulog_async_s *async = logger_async(logger);
+  if (async) {
+    logger_push_kv(logger, async, layout, &event, msg, msg_len, record, fields_len);
+  } else {
+    kv_emit(logger, layout, &event, msg, msg_len, record, fields_len, (enum ulog_kv_format_e)logger->kv_format_);
+  }
+
+  if (level == ULOG_LEVEL_FATAL) {
+    if (async) async->ops->flush(async);
+    if (logger->flush_cb_) logger->flush_cb_(logger->user_data_);
+  }
+}
+
+void logger_set_async(struct ulog_s *logger, struct ulog_async_s *async) {
+  if (!logger) return;
+  struct ulog_async_s *previous = atomic_exchange_explicit(&logger->async_, async, memory_order_acq_rel);
+  if (previous) previous->ops->destroy(previous);
+}
+
+struct ulog_async_s *logger_get_async(struct ulog_s *logger) { return logger ? logger_async(logger) : NULL; }
+
+uint64_t logger_get_dropped_count(struct ulog_s *logger) {
+  return logger ? __atomic_load_n(&logger->dropped_, __ATOMIC_RELAXED) : 0;
+}
+
+void logger_output_record(struct ulog_s *logger, const void *data, size_t size) {
+  const struct ulog_record_s *record = data;
+  if (!logger || size < sizeof(*record)) return;
+
+  if (record->type == ULOG_RECORD_TEXT) {
+    logger_emit(logger, (const char *)record->payload, record->header_len, record->body_len,
+                size - sizeof(*record) - 1);
+    return;
+  }
+
+  if (record->type == ULOG_RECORD_KV) {
+    const char *msg = (const char *)record->payload;
+    kv_emit(logger, logger_layout_of(record->format), &record->event, msg, record->header_len,
+            record->payload + record->header_len, record->body_len, (enum ulog_kv_format_e)record->kv_format);
+    return;
+  }
+
+  const struct ulog_layout_s *layout = logger_layout_of(record->format);
+  struct ulog_buffer_s log_buffer;
+  struct ulog_writer_s w = {log_buffer.log_out_buf_, log_buffer.log_out_buf_ + sizeof(log_buffer.log_out_buf_) - 1};
+  layout_render(layout, &w, &record->event);
+  *w.cur = '\0';
+  log_buffer.cur_buf_ptr_ = w.cur;
+  const size_t header_len = (size_t)(w.cur - log_buffer.log_out_buf_);
+
+  deferred_render_body(&log_buffer, record->site, record->payload);
+  const size_t body_len = (size_t)(log_buffer.cur_buf_ptr_ - log_buffer.log_out_buf_) - header_len;
+  layout_render_tail(layout, &log_buffer, record->newline);
+  logger_emit(logger, log_buffer.log_out_buf_, header_len, body_len,
+              (size_t)(log_buffer.cur_buf_ptr_ - log_buffer.log_out_buf_));
 }
@@ -0,0 +1,265 @@
+#include "ulog/ulog_async.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <unordered_map>
+
+#include "ulog/queue/mpsc_ring.h"
+#include "ulog_internal.h"
+
+namespace {
+
+int WriteAll(int fd, const char *ptr, size_t len) {
+  size_t written = 0;
+  while (written < len) {
+    const ssize_t n = write(fd, ptr + written, len - written);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    written += static_cast<size_t>(n);
+  }
+  return static_cast<int>(written);
+}
+
+// Synchronous output of a logger_create_async() logger to a file descriptor, the user data is the descriptor
+int WriteFd(void *user_data, const char *ptr, size_t len) {
+  return WriteAll(static_cast<int>(reinterpret_cast<intptr_t>(user_data)), ptr, len);
+}
+
+/**
+ * Output of a logger_create_async() logger, driven by the background thread: lines are collected into a batch for a
+ * file descriptor, and passed on when the batch is full or the flush interval has passed.
+ */
+class BatchedOutput {
+ public:
+  explicit BatchedOutput(const ulog_async_config_s &config)
+      : config_(config), batch_(config.output_cb ? nullptr : new char[ULOG_ASYNC_BATCH_LEN]) {}
+
+  // Output callback of the logger, called by the background thread with mutex() held
+  static int Output(void *user_data, const char *ptr, size_t len) {
+    return static_cast<BatchedOutput *>(user_data)->Append(ptr, len);
+  }
+
+  std::mutex &mutex() { return mutex_; }
+  std::chrono::milliseconds flush_interval() const { return std::chrono::milliseconds(config_.flush_interval_ms); }
+
+  // Must hold mutex()
+  void FlushIfDue() {
+    if (pending_ && (config_.flush_interval_ms == 0 ||
+                     logger_monotonic_time_ns() - first_ns_ >= config_.flush_interval_ms * 1000000ULL)) {
+      Flush();
+    }
+  }
+
+  // Must hold mutex()
+  void Flush() {
+    if (batch_) {
+      WriteAll(config_.fd, batch_.get(), batch_len_);
+      batch_len_ = 0;
+    } else if (config_.flush_cb) {
+      config_.flush_cb(config_.user_data);
+    }
+    pending_ = false;
+  }
+
+  // Return the logger to writing to the same output on the calling thread
+  void RestoreSynchronous(ulog_s *logger) const {
+    if (batch_) {
+      logger_set_user_data(logger, reinterpret_cast<void *>(static_cast<intptr_t>(config_.fd)));
+      logger_set_output_callback_len(logger, WriteFd);
+    } else {
+      logger_set_user_data(logger, config_.user_data);
+      logger_set_output_callback_len(logger, config_.output_cb);
+      logger_set_flush_callback(logger, config_.flush_cb);
+    }
+  }
+
+ private:
+  int Append(const char *ptr, size_t len) {
+    if (!pending_) first_ns_ = logger_monotonic_time_ns();
+    pending_ = true;
+    if (!batch_) return config_.output_cb(config_.user_data, ptr, len);
+
+    if (batch_len_ + len > ULOG_ASYNC_BATCH_LEN) {
+      WriteAll(config_.fd, batch_.get(), batch_len_);
+      batch_len_ = 0;
+      if (len > ULOG_ASYNC_BATCH_LEN) return WriteAll(config_.fd, ptr, len);
+    }
+    memcpy(batch_.get() + batch_len_, ptr, len);
+    batch_len_ += len;
+    return static_cast<int>(len);
+  }
+
+  const ulog_async_config_s config_;
+  std::mutex mutex_;  // The batch is also flushed by logger_flush_deferred() and FATAL logs
+  std::unique_ptr<char[]> batch_;  // NULL with an output callback
+  size_t batch_len_ = 0;
+  bool pending_ = false;   // Output since the last flush
+  uint64_t first_ns_ = 0;  // Monotonic time of the first output since the last flush
+};
+
+/**
+ * Deferred formatting backend: records are written into a lock-free queue by
+ * the logging threads and rendered by a single background thread.
+ */
+class DeferredBackend final : public ulog_async_s {
+ public:
+  DeferredBackend(ulog_s *logger, size_t queue_size, ulog_queue_full_e full_policy,
+                  std::unique_ptr<BatchedOutput> output)
+      : ulog_async_s{&kOps},
+        logger_(logger),
+        queue_size_(ulog::queue::RoundUpPowOfTwo(std::max(queue_size, kMinQueueSize))),
+        drop_when_full_(full_policy == ULOG_QUEUE_FULL_DROP),
+        output_(std::move(output)),
+        mq_(ulog::mpsc::Mq::Create(queue_size_)),
+        id_(next_id_.fetch_add(1, std::memory_order_relaxed)) {
+    thread_ = std::thread([this, flush_interval = output_ ? output_->flush_interval() : std::chrono::milliseconds(0)] {
+      ulog::mpsc::Consumer reader(mq_);
+      const auto should_exit = [&] { return should_exit_.load(); };
+      while (!should_exit_) {
+        // Wakes up at least once per flush interval to pass on the batched output
+        auto data_packet = flush_interval.count() ? reader.ReadOrWait(flush_interval, should_exit)
+                                                  : reader.ReadOrWait(should_exit);
+        std::unique_lock<std::mutex> lock;
+        if (output_) lock = std::unique_lock<std::mutex>(output_->mutex());
+        while (const auto data = data_packet.next()) logger_output_record(logger_, data.data, data.size);
+        if (output_) output_->FlushIfDue();
+        reader.Release(data_packet);
+      }
+    });
+  }
+
+  DeferredBackend(const DeferredBackend &) = delete;
+  DeferredBackend &operator=(const DeferredBackend &) = delete;
+
+  ~DeferredBackend() {
+    mq_->Flush(std::chrono::seconds(5));
+    should_exit_ = true;
+    mq_->Notify();
+    thread_.join();
+    if (output_) {
+      output_->Flush();
+      output_->RestoreSynchronous(logger_);
+    }
+  }
+
+ private:
+  // Each thread caches its producers of the last few backends it used, so logging does not take a lock or touch the
+  // reference count of the queue. The ids of the backends are never reused, the entry of a destroyed backend is never
+  // matched again.
+  ulog::mpsc::Producer &ThreadProducer() {
+    struct CachedProducer {
+      uint64_t id;
+      ulog::mpsc::Producer *producer;
+    };
+    constexpr unsigned kCached = 4;
+    thread_local CachedProducer cache[kCached] = {};
+    thread_local unsigned next_slot = 0;
+    for (const auto &c : cache) {
+      if (c.id == id_) return *c.producer;
+    }
+
+    ulog::mpsc::Producer *producer;
+    {
+      std::lock_guard<std::mutex> lock(producers_mutex_);
+      auto &owned = producers_[std::this_thread::get_id()];
+      if (!owned) owned = std::make_unique<ulog::mpsc::Producer>(mq_);
+      producer = owned.get();
+    }
+    cache[next_slot++ % kCached] = {id_, producer};
+    return *producer;
+  }
+
+  void *ReserveRecord(size_t size) {
+    // A packet larger than a quarter of the queue may never find room around the wrap point. The text and the
+    // structured records of the logger always fit, a deferred record with long strings is formatted eagerly instead.
+    if (size > queue_size_ / 4) return nullptr;
+    // A deferred record that finds the queue full is formatted and tried once more as text, which the logger counts
+    // as dropped when it fails too
+    return drop_when_full_ ? ThreadProducer().Reserve(size) : ThreadProducer().ReserveOrWait(size);
+  }
+
+  void FlushRecords() {
+    mq_->Flush(std::chrono::seconds(5));
+    if (output_) {
+      std::lock_guard<std::mutex> lock(output_->mutex());
+      output_->Flush();
+    }
+  }
+
+  static DeferredBackend *Cast(ulog_async_s *async) { return static_cast<DeferredBackend *>(async); }
+
+  static void *Reserve(ulog_async_s *async, size_t size) { return Cast(async)->ReserveRecord(size); }
+  static void Commit(ulog_async_s *async, void *data, size_t size) {
+    Cast(async)->ThreadProducer().Commit(static_cast<uint8_t *>(data), size);
+  }
+  static void Flush(ulog_async_s *async) { Cast(async)->FlushRecords(); }
+  static void Destroy(ulog_async_s *async) { delete Cast(async); }
+
+  static const ulog_async_ops_s kOps;
+  // A quarter holds the largest record: a structured log with ULOG_OUTBUF_LEN of message and of fields plus the
+  // record header. Text records are at most ULOG_OUTBUF_LEN plus the header.
+  static constexpr size_t kMinQueueSize = 16 * ULOG_OUTBUF_LEN;
+  static std::atomic<uint64_t> next_id_;
+
+  ulog_s *logger_;
+  const size_t queue_size_;
+  const bool drop_when_full_;
+  std::unique_ptr<BatchedOutput> output_;  // Owned output of logger_create_async(), NULL otherwise
+  std::shared_ptr<ulog::mpsc::Mq> mq_;
+  const uint64_t id_;
+  // Producers of the threads that have logged, freed with the backend
+  std::mutex producers_mutex_;
+  std::unordered_map<std::thread::id, std::unique_ptr<ulog::mpsc::Producer>> producers_;
+  std::atomic_bool should_exit_{false};
+  std::thread thread_;
+};
+
+const ulog_async_ops_s DeferredBackend::kOps = {Reserve, Commit, Flush, Destroy};
+std::atomic<uint64_t> DeferredBackend::next_id_{1};
+
+}  // namespace
+
+int logger_enable_deferred(ulog_s *logger, size_t queue_size) {
+  if (!logger) return -1;
+  auto *backend = new (std::nothrow) DeferredBackend(logger, queue_size, ULOG_QUEUE_FULL_BLOCK, nullptr);
+  if (!backend) return -1;
+  logger_set_async(logger, backend);
+  return 0;
+}
+
+ulog_s *logger_create_async(const ulog_async_config_s *config) {
+  const ulog_async_config_s default_config = ULOG_ASYNC_CONFIG_INIT;
+  if (!config) config = &default_config;
+  if (!config->output_cb && config->fd < 0) return nullptr;
+
+  ulog_s *logger = logger_create();
+  if (!logger) return nullptr;
+  auto output = std::make_unique<BatchedOutput>(*config);
+  logger_set_user_data(logger, output.get());
+  logger_set_output_callback_len(logger, BatchedOutput::Output);
+
+  auto *backend = new (std::nothrow) DeferredBackend(logger, config->queue_size, config->full_policy, std::move(output));
+  if (!backend) {
+    logger_destroy(&logger);
+    return nullptr;
+  }
+  logger_set_async(logger, backend);
+  return logger;
+}
+
+void logger_disable_deferred(ulog_s *logger) { logger_set_async(logger, nullptr); }
+
+void logger_flush_deferred(ulog_s *logger) {
+  if (ulog_async_s *async = logger_get_async(logger)) async->ops->flush(async);
+}
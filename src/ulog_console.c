@@ -0,0 +1,213 @@
+// Default console output: log lines are batched in a buffer of the calling
+// thread and written to stdout with one write() per batch.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ulog/ulog.h"
+
+// Not larger than PIPE_BUF, so a batch written to a pipe is never interleaved with the batches of other threads. Each
+// write() is one batch, only a line longer than the buffer is written by itself.
+#ifndef ULOG_CONSOLE_BUFFER_LEN
+#define ULOG_CONSOLE_BUFFER_LEN 4096
+#endif
+
+#ifndef ULOG_CONSOLE_FLUSH_MS
+#define ULOG_CONSOLE_FLUSH_MS 100 /* Buffered lines are written at the latest after this time */
+#endif
+
+struct ulog_console_buffer_s {
+  pthread_mutex_t mutex;  // Flushed by other threads: the flusher thread, FATAL logs and exit
+  struct ulog_console_buffer_s *next;
+  bool in_use;        // Owned by a thread, guarded by console_mutex_
+  uint64_t first_us;  // Monotonic time of the first buffered line
+  size_t len;
+  char data[ULOG_CONSOLE_BUFFER_LEN];
+};
+
+static pthread_mutex_t console_mutex_ = PTHREAD_MUTEX_INITIALIZER;  // Guards the buffer list
+static struct ulog_console_buffer_s *console_buffers_;
+static _Thread_local struct ulog_console_buffer_s *console_buffer_;
+static pthread_key_t console_key_;
+static pthread_once_t console_once_ = PTHREAD_ONCE_INIT;
+static atomic_bool flusher_started_;
+
+// Lines are written through on a terminal, so they show up immediately
+static int console_batching_ = -1;
+
+static void console_write(const struct iovec *iov, int iovcnt) {
+  struct iovec rest[2];
+  memcpy(rest, iov, sizeof(*iov) * iovcnt);
+  struct iovec *cur = rest;
+  while (iovcnt > 0) {
+    ssize_t n = writev(STDOUT_FILENO, cur, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    while (iovcnt > 0 && (size_t)n >= cur->iov_len) {
+      n -= (ssize_t)cur->iov_len;
+      cur++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      cur->iov_base = (char *)cur->iov_base + n;
+      cur->iov_len -= (size_t)n;
+    }
+  }
+}
+
+// Must hold buffer->mutex
+static void buffer_flush_locked(struct ulog_console_buffer_s *buffer) {
+  if (!buffer->len) return;
+  const struct iovec iov = {buffer->data, buffer->len};
+  console_write(&iov, 1);
+  buffer->len = 0;
+}
+
+static void console_flush_all(void) {
+  pthread_mutex_lock(&console_mutex_);
+  for (struct ulog_console_buffer_s *buffer = console_buffers_; buffer; buffer = buffer->next) {
+    pthread_mutex_lock(&buffer->mutex);
+    buffer_flush_locked(buffer);
+    pthread_mutex_unlock(&buffer->mutex);
+  }
+  pthread_mutex_unlock(&console_mutex_);
+}
+
+static void *console_flusher(void *unused) {
+  (void)unused;
+  const struct timespec period = {ULOG_CONSOLE_FLUSH_MS / 1000, (ULOG_CONSOLE_FLUSH_MS % 1000) * 1000000L};
+  for (;;) {
+    nanosleep(&period, NULL);
+    const uint64_t now_us = logger_monotonic_time_us();
+    pthread_mutex_lock(&console_mutex_);
+    for (struct ulog_console_buffer_s *buffer = console_buffers_; buffer; buffer = buffer->next) {
+      pthread_mutex_lock(&buffer->mutex);
+      if (buffer->len && now_us - buffer->first_us >= ULOG_CONSOLE_FLUSH_MS * 1000) buffer_flush_locked(buffer);
+      pthread_mutex_unlock(&buffer->mutex);
+    }
+    pthread_mutex_unlock(&console_mutex_);
+  }
+  return NULL;
+}
+
+static void console_start_flusher(void) {
+  bool expected = false;
+  if (!atomic_compare_exchange_strong(&flusher_started_, &expected, true)) return;
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, console_flusher, NULL) != 0) atomic_store(&flusher_started_, false);
+  pthread_attr_destroy(&attr);
+}
+
+// The buffer of an exiting thread is flushed and left for the next thread
+static void console_thread_exit(void *data) {
+  struct ulog_console_buffer_s *buffer = data;
+  pthread_mutex_lock(&console_mutex_);
+  pthread_mutex_lock(&buffer->mutex);
+  buffer_flush_locked(buffer);
+  buffer->in_use = false;
+  pthread_mutex_unlock(&buffer->mutex);
+  pthread_mutex_unlock(&console_mutex_);
+}
+
+// Buffers are kept locked across fork(), so neither process writes the lines twice or finds a lock held
+static void console_atfork_prepare(void) {
+  pthread_mutex_lock(&console_mutex_);
+  for (struct ulog_console_buffer_s *buffer = console_buffers_; buffer; buffer = buffer->next) {
+    pthread_mutex_lock(&buffer->mutex);
+    buffer_flush_locked(buffer);
+  }
+}
+
+static void console_atfork_parent(void) {
+  for (struct ulog_console_buffer_s *buffer = console_buffers_; buffer; buffer = buffer->next)
+    pthread_mutex_unlock(&buffer->mutex);
+  pthread_mutex_unlock(&console_mutex_);
+}
+
+static void console_atfork_child(void) {
+  // Only the forking thread is left, the buffers of the other threads are free
+  for (struct ulog_console_buffer_s *buffer = console_buffers_; buffer; buffer = buffer->next) {
+    buffer->in_use = buffer == console_buffer_;
+    pthread_mutex_unlock(&buffer->mutex);
+  }
+  pthread_mutex_unlock(&console_mutex_);
+  atomic_store(&flusher_started_, false);
+}
+
+static void console_init(void) {
+  console_batching_ = !isatty(STDOUT_FILENO);
+  pthread_key_create(&console_key_, console_thread_exit);
+  pthread_atfork(console_atfork_prepare, console_atfork_parent, console_atfork_child);
+  atexit(console_flush_all);
+}
+
+static struct ulog_console_buffer_s *console_thread_buffer(void) {
+  if (console_buffer_) return console_buffer_;
+
+  pthread_mutex_lock(&console_mutex_);
+  struct ulog_console_buffer_s *buffer = console_buffers_;
+  while (buffer && buffer->in_use) buffer = buffer->next;
+  if (!buffer) {
+    buffer = malloc(sizeof(*buffer));
+    if (buffer) {
+      pthread_mutex_init(&buffer->mutex, NULL);
+      buffer->len = 0;
+      buffer->next = console_buffers_;
+      console_buffers_ = buffer;
+    }
+  }
+  if (buffer) buffer->in_use = true;
+  pthread_mutex_unlock(&console_mutex_);
+
+  if (buffer) pthread_setspecific(console_key_, buffer);
+  console_buffer_ = buffer;
+  return buffer;
+}
+
+int logger_console_output(void *user_data, const char *ptr, size_t len) {
+  (void)user_data;
+  pthread_once(&console_once_, console_init);
+
+  struct ulog_console_buffer_s *buffer = console_batching_ ? console_thread_buffer() : NULL;
+  if (!buffer) {
+    const struct iovec iov = {(void *)ptr, len};
+    console_write(&iov, 1);
+    return (int)len;
+  }
+
+  pthread_mutex_lock(&buffer->mutex);
+  // The batch is written alone, so a write never exceeds the buffer; the line that does not fit starts the next one
+  if (buffer->len + len > sizeof(buffer->data)) buffer_flush_locked(buffer);
+  if (len > sizeof(buffer->data)) {
+    const struct iovec iov = {(void *)ptr, len};
+    console_write(&iov, 1);
+  } else {
+    if (!buffer->len) buffer->first_us = logger_monotonic_time_us();
+    memcpy(buffer->data + buffer->len, ptr, len);
+    buffer->len += len;
+  }
+  const bool buffered = buffer->len != 0;
+  pthread_mutex_unlock(&buffer->mutex);
+
+  if (buffered && !atomic_load_explicit(&flusher_started_, memory_order_relaxed)) console_start_flusher();
+  return (int)len;
+}
+
+void logger_console_flush(void *user_data) {
+  (void)user_data;
+  console_flush_all();
+}
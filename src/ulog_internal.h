@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "ulog/ulog_c.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ulog_async_s;
+
+/**
+ * Operations of a deferred formatting backend. The logger serializes each
+ * record into memory reserved from the backend, the backend hands the committed
+ * records back to logger_output_record() on its own thread.
+ */
+struct ulog_async_ops_s {
+  /**
+   * Reserve memory for one record
+   * @return Pointer to at least size bytes aligned to 8, NULL if the record does
+   * not fit the backend
+   */
+  void *(*reserve)(struct ulog_async_s *async, size_t size);
+  void (*commit)(struct ulog_async_s *async, void *data, size_t size);
+
+  // Wait until all committed records are output
+  void (*flush)(struct ulog_async_s *async);
+
+  // Output the remaining records and release the backend
+  void (*destroy)(struct ulog_async_s *async);
+};
+
+// Base of a backend, embedded as the first member
+struct ulog_async_s {
+  const struct ulog_async_ops_s *ops;
+};
+
+/**
+ * Attach a deferred formatting backend to the logger, the previous backend is
+ * destroyed after its records are output. Must not race with other threads
+ * logging to the same logger.
+ * @param async The backend, NULL to return to synchronous output
+ */
+void logger_set_async(struct ulog_s *logger, struct ulog_async_s *async);
+
+// @return The attached backend, NULL when logging synchronously
+struct ulog_async_s *logger_get_async(struct ulog_s *logger);
+
+/**
+ * Render a record produced by the logger and pass it to the output callback.
+ * Called by the backend thread.
+ */
+void logger_output_record(struct ulog_s *logger, const void *data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,255 @@
+// Aggregating profiler: the running times of a code location are collected in
+// per-thread slots and output as one summary line per interval.
+//
+// Only its thread writes a slot, with plain loads and stores. A slot has a
+// window per parity of the epoch of the location: a summary advances the epoch
+// and reads the windows of the previous one, a thread clears its window when it
+// first records in a new epoch.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ulog/ulog.h"
+
+// Slots of the locations a thread executed last, looked up without walking the slot list
+#ifndef ULOG_PROFILE_SLOT_CACHE
+#define ULOG_PROFILE_SLOT_CACHE 8
+#endif
+
+// 4 buckets per power of 2, the last one collects everything from 2^33 ns (8.6 s)
+#define ULOG_PROFILE_SUB_BUCKETS 4
+#define ULOG_PROFILE_BUCKETS 128
+
+struct ulog_profile_window_s {
+  atomic_uint_least64_t epoch;  // Epoch of the statistics, the window is cleared before it is written in another one
+  atomic_uint_least64_t count;
+  atomic_uint_least64_t sum_ns;
+  atomic_uint_least64_t min_ns;  // UINT64_MAX if empty
+  atomic_uint_least64_t max_ns;
+  atomic_uint_least32_t buckets[ULOG_PROFILE_BUCKETS];
+};
+
+struct ulog_profile_slot_s {
+  _Alignas(64) struct ulog_profile_window_s windows[2];  // Indexed by the parity of the epoch
+  pthread_t owner;  // A thread that reuses the id of an exited thread takes over its slot
+  struct ulog_profile_slot_s *next;
+};
+
+struct ulog_profile_state_s {
+  struct ulog_profile_site_s *site;
+  const char *filename;
+  struct ulog_s *logger;
+  struct ulog_profile_state_s *next;
+  atomic_uint_least64_t window_begin_ns;  // Begin of the statistics, claimed by the thread that outputs the summary
+  atomic_uint_least64_t epoch;            // Advanced by every summary
+  _Atomic(struct ulog_profile_slot_s *) slots;
+};
+
+static _Atomic(struct ulog_profile_state_s *) profile_states_;
+static atomic_uint_least64_t report_interval_ns_ = (uint64_t)ULOG_PROFILE_REPORT_MS * 1000000;
+
+static _Thread_local struct {
+  struct ulog_profile_state_s *state;
+  struct ulog_profile_slot_s *slot;
+} slot_cache_[ULOG_PROFILE_SLOT_CACHE];
+
+// Slot of the calling thread, created on its first execution of the location
+static struct ulog_profile_slot_s *profile_slot(struct ulog_profile_state_s *state) {
+  const size_t index = ((uintptr_t)state >> 4) % ULOG_PROFILE_SLOT_CACHE;
+  if (slot_cache_[index].state == state) return slot_cache_[index].slot;
+
+  const pthread_t self = pthread_self();
+  struct ulog_profile_slot_s *slot = atomic_load_explicit(&state->slots, memory_order_acquire);
+  while (slot && !pthread_equal(slot->owner, self)) slot = slot->next;
+  if (!slot) {
+    slot = aligned_alloc(64, sizeof(*slot));
+    if (!slot) return NULL;
+    memset(slot, 0, sizeof(*slot));  // Epoch 0 comes before the first one of the location
+    slot->owner = self;
+    slot->next = atomic_load_explicit(&state->slots, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&state->slots, &slot->next, slot, memory_order_release,
+                                                  memory_order_relaxed)) {
+    }
+  }
+  slot_cache_[index].state = state;
+  slot_cache_[index].slot = slot;
+  return slot;
+}
+
+static inline unsigned profile_bucket(uint64_t ns) {
+  if (ns < ULOG_PROFILE_SUB_BUCKETS) return (unsigned)ns;
+  const unsigned octave = 63 - (unsigned)__builtin_clzll(ns);  // >= 2
+  const unsigned bucket = (octave - 1) * ULOG_PROFILE_SUB_BUCKETS + (unsigned)((ns >> (octave - 2)) & 3);
+  return bucket < ULOG_PROFILE_BUCKETS ? bucket : ULOG_PROFILE_BUCKETS - 1;
+}
+
+// Largest value of a bucket
+static inline uint64_t profile_bucket_max(unsigned bucket) {
+  if (bucket < ULOG_PROFILE_SUB_BUCKETS) return bucket;
+  const unsigned octave = bucket / ULOG_PROFILE_SUB_BUCKETS + 1;
+  const uint64_t lower = (uint64_t)(ULOG_PROFILE_SUB_BUCKETS + bucket % ULOG_PROFILE_SUB_BUCKETS) << (octave - 2);
+  return lower + ((uint64_t)1 << (octave - 2)) - 1;
+}
+
+// Called by the thread of the slot only
+static void window_clear(struct ulog_profile_window_s *window, uint64_t epoch) {
+  atomic_store_explicit(&window->count, 0, memory_order_relaxed);
+  atomic_store_explicit(&window->sum_ns, 0, memory_order_relaxed);
+  atomic_store_explicit(&window->min_ns, UINT64_MAX, memory_order_relaxed);
+  atomic_store_explicit(&window->max_ns, 0, memory_order_relaxed);
+  for (size_t i = 0; i < ULOG_PROFILE_BUCKETS; i++) atomic_store_explicit(&window->buckets[i], 0, memory_order_relaxed);
+  atomic_store_explicit(&window->epoch, epoch, memory_order_release);
+}
+
+static struct ulog_profile_state_s *profile_state_create(struct ulog_s *logger, struct ulog_profile_site_s *site,
+                                                         uint64_t now_ns) {
+  struct ulog_profile_state_s *state = malloc(sizeof(*state));
+  if (!state) return NULL;
+
+  const char *slash = strrchr(site->file_, '/');
+  state->site = site;
+  state->filename = slash ? slash + 1 : site->file_;
+  state->logger = logger;
+  atomic_init(&state->window_begin_ns, now_ns);
+  atomic_init(&state->epoch, 1);
+  atomic_init(&state->slots, NULL);
+
+  // Threads executing the location for the first time race to install their state
+  struct ulog_profile_state_s *expected = NULL;
+  if (!__atomic_compare_exchange_n(&site->state_, &expected, state, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(state);
+    return expected;
+  }
+
+  state->next = atomic_load_explicit(&profile_states_, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&profile_states_, &state->next, state, memory_order_release,
+                                                memory_order_relaxed)) {
+  }
+  return state;
+}
+
+// Sum up the windows of the current epoch of the slots, starting the next epoch if "reset"
+static uint64_t profile_collect(struct ulog_profile_state_s *state, bool reset, struct ulog_profile_info_s *info) {
+  uint64_t buckets[ULOG_PROFILE_BUCKETS] = {0};
+  memset(info, 0, sizeof(*info));
+  info->min_ns = UINT64_MAX;
+
+  // An execution that read the epoch before it advanced lands in the old statistics, possibly after they were read
+  const uint64_t epoch = reset ? atomic_fetch_add_explicit(&state->epoch, 1, memory_order_relaxed)
+                               : atomic_load_explicit(&state->epoch, memory_order_relaxed);
+  for (struct ulog_profile_slot_s *slot = atomic_load_explicit(&state->slots, memory_order_acquire); slot;
+       slot = slot->next) {
+    const struct ulog_profile_window_s *window = &slot->windows[epoch & 1];
+    if (atomic_load_explicit(&window->epoch, memory_order_acquire) != epoch) continue;
+    info->count += atomic_load_explicit(&window->count, memory_order_relaxed);
+    info->sum_ns += atomic_load_explicit(&window->sum_ns, memory_order_relaxed);
+    const uint64_t min_ns = atomic_load_explicit(&window->min_ns, memory_order_relaxed);
+    const uint64_t max_ns = atomic_load_explicit(&window->max_ns, memory_order_relaxed);
+    if (min_ns < info->min_ns) info->min_ns = min_ns;
+    if (max_ns > info->max_ns) info->max_ns = max_ns;
+    for (size_t b = 0; b < ULOG_PROFILE_BUCKETS; b++)
+      buckets[b] += atomic_load_explicit(&window->buckets[b], memory_order_relaxed);
+  }
+
+  info->name = state->site->name_;
+  info->file = state->filename;
+  info->func = state->site->func_;
+  info->line = state->site->line_;
+  if (!info->count) {
+    info->min_ns = 0;
+    return 0;
+  }
+
+  // Percentiles of the histogram, within the observed range
+  uint64_t total = 0;
+  for (size_t b = 0; b < ULOG_PROFILE_BUCKETS; b++) total += buckets[b];
+  const struct {
+    uint64_t *value;
+    uint32_t per_mille;
+  } percentiles[] = {{&info->p50_ns, 500}, {&info->p90_ns, 900}, {&info->p99_ns, 990}};
+  uint64_t seen = 0;
+  size_t p = 0;
+  for (unsigned b = 0; b < ULOG_PROFILE_BUCKETS && p < sizeof(percentiles) / sizeof(percentiles[0]); b++) {
+    seen += buckets[b];
+    while (p < sizeof(percentiles) / sizeof(percentiles[0]) && seen * 1000 >= total * percentiles[p].per_mille) {
+      const uint64_t value = profile_bucket_max(b);
+      *percentiles[p].value = value < info->min_ns ? info->min_ns : value > info->max_ns ? info->max_ns : value;
+      p++;
+    }
+  }
+  return info->count;
+}
+
+static void profile_output(struct ulog_profile_state_s *state, uint64_t window_ns) {
+  struct ulog_profile_info_s info;
+  if (!profile_collect(state, true, &info)) return;
+
+  logger_log_with_header(state->logger, ULOG_LEVEL_DEBUG, info.file, info.func, info.line, true, true,
+                         "profile \"%s\": count=%" PRIu64 " avg=%" PRIu64 "ns min=%" PRIu64 "ns p50=%" PRIu64
+                         "ns p90=%" PRIu64 "ns p99=%" PRIu64 "ns max=%" PRIu64 "ns (%.3fs)",
+                         info.name, info.count, info.sum_ns / info.count, info.min_ns, info.p50_ns, info.p90_ns,
+                         info.p99_ns, info.max_ns, (double)window_ns / 1e9);
+}
+
+void logger_profile_record(struct ulog_s *logger, struct ulog_profile_site_s *site, uint64_t begin_ns,
+                           uint64_t end_ns) {
+  struct ulog_profile_state_s *state = __atomic_load_n(&site->state_, __ATOMIC_ACQUIRE);
+  if (!state) state = profile_state_create(logger, site, begin_ns);
+  if (!state) return;
+
+  struct ulog_profile_slot_s *slot = profile_slot(state);
+  if (!slot) return;
+
+  // The only writer of the slot, no read-modify-write is needed
+  const uint64_t ns = end_ns - begin_ns;
+  const uint64_t epoch = atomic_load_explicit(&state->epoch, memory_order_relaxed);
+  struct ulog_profile_window_s *window = &slot->windows[epoch & 1];
+  if (atomic_load_explicit(&window->epoch, memory_order_relaxed) != epoch) window_clear(window, epoch);
+  atomic_store_explicit(&window->count, atomic_load_explicit(&window->count, memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+  atomic_store_explicit(&window->sum_ns, atomic_load_explicit(&window->sum_ns, memory_order_relaxed) + ns,
+                        memory_order_relaxed);
+  atomic_uint_least32_t *bucket = &window->buckets[profile_bucket(ns)];
+  atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1, memory_order_relaxed);
+  if (ns < atomic_load_explicit(&window->min_ns, memory_order_relaxed))
+    atomic_store_explicit(&window->min_ns, ns, memory_order_relaxed);
+  if (ns > atomic_load_explicit(&window->max_ns, memory_order_relaxed))
+    atomic_store_explicit(&window->max_ns, ns, memory_order_relaxed);
+
+  const uint64_t interval_ns = atomic_load_explicit(&report_interval_ns_, memory_order_relaxed);
+  uint64_t window_begin_ns = atomic_load_explicit(&state->window_begin_ns, memory_order_relaxed);
+  if (interval_ns && end_ns - window_begin_ns >= interval_ns &&
+      atomic_compare_exchange_strong_explicit(&state->window_begin_ns, &window_begin_ns, end_ns,
+                                              memory_order_relaxed, memory_order_relaxed)) {
+    profile_output(state, end_ns - window_begin_ns);
+  }
+}
+
+void logger_profile_set_report_interval(uint32_t interval_ms) {
+  atomic_store_explicit(&report_interval_ns_, (uint64_t)interval_ms * 1000000, memory_order_relaxed);
+}
+
+void logger_profile_report(void) {
+  const uint64_t now_ns = logger_monotonic_time_ns();
+  for (struct ulog_profile_state_s *state = atomic_load_explicit(&profile_states_, memory_order_acquire); state;
+       state = state->next) {
+    const uint64_t window_begin_ns = atomic_exchange_explicit(&state->window_begin_ns, now_ns, memory_order_relaxed);
+    profile_output(state, now_ns - window_begin_ns);
+  }
+}
+
+size_t logger_profile_foreach(ulog_profile_callback callback, void *arg) {
+  size_t count = 0;
+  for (struct ulog_profile_state_s *state = atomic_load_explicit(&profile_states_, memory_order_acquire); state;
+       state = state->next) {
+    struct ulog_profile_info_s info;
+    profile_collect(state, false, &info);
+    if (callback) callback(arg, &info);
+    count++;
+  }
+  return count;
+}
@@ -5,6 +5,18 @@
 
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include "ulog/crash_handler.h"
+#include "ulog/file/file_writer_unbuffered_io.h"
+#include "ulog/file/sink_async_wrapper.h"
+#include "ulog/file/sink_limit_size_file.h"
+#include "ulog/queue/mpsc_ring.h"
+#include "ulog/queue/spsc_ring.h"
+
 using namespace ulog::file;
 
 TEST(file, SplitByExtension) {
@@ -24,3 +36,70 @@ TEST(file, SplitByExtension) {
   ASSERT_EQ(SplitByExtension("my_folder/.mylog.txt.zst"), std::make_tuple("my_folder/.mylog", ".txt.zst"));
   ASSERT_EQ(SplitByExtension("/etc/rc.d/somelogfile"), std::make_tuple("/etc/rc.d/somelogfile", ""));
 }
+
+namespace {
+
+// Holds the background thread of the async sink from the first packet on
+class StuckSink final : public SinkBase {
+ public:
+  explicit StuckSink(std::atomic_bool &reached) : reached_(reached) {}
+  ulog::Status SinkIt(const void *, size_t) override {
+    reached_ = true;
+    for (;;) std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+  ulog::Status SinkIt(const void *data, size_t len, std::chrono::milliseconds) override { return SinkIt(data, len); }
+  ulog::Status Flush() override { return ulog::Status::OK(); }
+
+ private:
+  std::atomic_bool &reached_;
+};
+
+}  // namespace
+
+TEST(file, CrashDrainWritesQueuedData) {
+  const std::string filename = testing::TempDir() + "ulog_crash_drain_test.log";
+  const auto crash = [&] {
+    ulog::crash::InstallHandler();
+    std::atomic_bool stuck{false};
+    SinkAsyncWrapper<ulog::mpsc::Mq> sink(
+        64 * 1024, std::chrono::seconds(1),
+        std::make_unique<SinkLimitSizeFile>(std::make_unique<FileWriterUnbufferedIo>(), filename, 1024 * 1024),
+        std::make_unique<StuckSink>(stuck));
+    sink.EnableCrashDrain();
+    for (int i = 0; i < 5; i++) {
+      const std::string line = "line " + std::to_string(i) + "\n";
+      sink.SinkIt(line.data(), line.size());
+    }
+    while (!stuck) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    abort();
+  };
+  EXPECT_EXIT(crash(), testing::KilledBySignal(SIGABRT), "");
+
+  // The first line was being sunk when the process crashed, it is written again
+  std::ifstream file(filename);
+  std::stringstream content;
+  content << file.rdbuf();
+  EXPECT_EQ(content.str(), "line 0\nline 0\nline 1\nline 2\nline 3\nline 4\n");
+  std::remove(filename.c_str());
+}
+
+// The single-producer queue of the logroller tool
+TEST(file, SpscSinkAsyncWrapper) {
+  const std::string filename = testing::TempDir() + "ulog_spsc_sink_test.log";
+  {
+    SinkAsyncWrapper<ulog::spsc::Mq<>> sink(
+        64 * 1024, std::chrono::seconds(1),
+        std::make_unique<SinkLimitSizeFile>(std::make_unique<FileWriterUnbufferedIo>(), filename, 1024 * 1024));
+    ASSERT_TRUE(sink.EnableCrashDrain());
+    for (int i = 0; i < 3; i++) {
+      const std::string line = "line " + std::to_string(i) + "\n";
+      ASSERT_TRUE(sink.SinkIt(line.data(), line.size()));
+    }
+  }
+
+  std::ifstream file(filename);
+  std::stringstream content;
+  content << file.rdbuf();
+  EXPECT_EQ(content.str(), "line 0\nline 1\nline 2\n");
+  std::remove(filename.c_str());
+}
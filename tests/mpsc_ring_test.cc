@@ -174,6 +174,48 @@ TEST(MpscRingTest, discard_packet) {
   consumer.Release(rdata);
 }
 
+TEST(MpscRingTest, for_each_pending) {
+  const auto umq = Mq::Create(256);
+  Mq::Producer producer(umq);
+  Mq::Consumer consumer(umq);
+  const auto pending_of = [&] {
+    std::vector<uint8_t> pending;
+    umq->ForEachPending([&](const void *data, const size_t size) {
+      ASSERT_EQ(size, 20u);
+      pending.push_back(*static_cast<const uint8_t *>(data));
+    });
+    return pending;
+  };
+
+  // The committed packets are listed in order without consuming them, also across the wrap point
+  uint8_t next = 0;
+  for (int cycle = 0; cycle < 20; cycle++) {
+    for (int i = 0; i < 3; i++) {
+      auto p = producer.Reserve(20);
+      ASSERT_NE(p, nullptr);
+      memset(p, next++, 20);
+      producer.Commit(p, 20);
+    }
+    ASSERT_EQ(pending_of(), (std::vector<uint8_t>{uint8_t(next - 3), uint8_t(next - 2), uint8_t(next - 1)}));
+    ASSERT_EQ(pending_of().size(), 3u);
+
+    while (auto rd = consumer.Read()) consumer.Release(rd);
+    ASSERT_TRUE(pending_of().empty());
+  }
+
+  // Stops at a packet that is still being written, skips discarded packets
+  auto first = producer.Reserve(20);
+  memset(first, 1, 20);
+  producer.Commit(first, 20);
+  auto second = producer.Reserve(20);
+  auto third = producer.Reserve(20);
+  memset(third, 3, 20);
+  producer.Commit(third, 20);
+  ASSERT_EQ(pending_of(), std::vector<uint8_t>{1});
+  producer.Commit(second, 0);
+  ASSERT_EQ(pending_of(), (std::vector<uint8_t>{1, 3}));
+}
+
 // ── Blocking / timeout tests ────────────────────────────────────────────
 
 TEST(MpscRingTest, read_or_wait_timeout) {
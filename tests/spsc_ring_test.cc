@@ -67,3 +67,32 @@ TEST(BipBufferTestSingle, singl_producer_single_consumer) {
   LOGGER_TIME_CODE({ spsc<ulog::spsc::Mq<uint32_t>>(1 << 14, 1024 * 1024); });
   LOGGER_TIME_CODE({ spsc<ulog::spsc::Mq<uint32_t>>(1 << 16, 1024 * 1024); });
 }
+
+TEST(BipBufferTestSingle, for_each_pending) {
+  const auto buffer = ulog::spsc::Mq<>::Create(64);
+  ulog::spsc::Mq<>::Producer producer(buffer);
+  ulog::spsc::Mq<>::Consumer consumer(buffer);
+  const auto pending_of = [&] {
+    std::string pending;
+    buffer->ForEachPending(
+        [&](const void *data, const size_t size) { pending.append(static_cast<const char *>(data), size); });
+    return pending;
+  };
+
+  // The committed data is listed in order without consuming it, also across the wrap point
+  for (int cycle = 0; cycle < 20; cycle++) {
+    std::string expected;
+    for (int i = 0; i < 2; i++) {
+      const std::string chunk(10 + cycle % 7, static_cast<char>('a' + (cycle + i) % 26));
+      auto data = producer.Reserve(chunk.size());
+      ASSERT_NE(data, nullptr);
+      memcpy(data, chunk.data(), chunk.size());
+      producer.Commit(data, chunk.size());
+      expected += chunk;
+    }
+    ASSERT_EQ(pending_of(), expected);
+
+    while (auto data = consumer.Read()) consumer.Release(data);
+    ASSERT_EQ(pending_of(), "");
+  }
+}
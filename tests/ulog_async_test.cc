@@ -0,0 +1,333 @@
+#include "ulog/ulog_async.h"
+
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ulog/ulog.h"
+
+namespace {
+
+// Captures all output written to a C logger instance
+class Capture {
+ public:
+  explicit Capture(struct ulog_s *logger) {
+    logger_set_user_data(logger, this);
+    logger_set_output_callback(logger, Callback);
+  }
+  std::string str() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return buf_;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::string buf_;
+  static int Callback(void *self, const char *s) {
+    auto *capture = static_cast<Capture *>(self);
+    std::lock_guard<std::mutex> lock(capture->mutex_);
+    capture->buf_ += s;
+    return static_cast<int>(strlen(s));
+  }
+};
+
+// The time differs between the two loggers, everything else must be identical
+struct ulog_s *CreateLogger() {
+  struct ulog_s *logger = logger_create();
+  logger_format_disable(logger, ULOG_F_TIME);
+  logger_format_enable(logger, ULOG_F_NUMBER);
+  return logger;
+}
+
+}  // namespace
+
+#define LOG_BOTH(sync, deferred, ...)         \
+  do {                                        \
+    LOGGER_LOCAL_INFO(sync, __VA_ARGS__);     \
+    LOGGER_LOCAL_INFO(deferred, __VA_ARGS__); \
+  } while (0)
+
+TEST(UlogAsync, DeferredOutputMatchesSynchronous) {
+  struct ulog_s *sync = CreateLogger();
+  struct ulog_s *deferred = CreateLogger();
+  Capture sync_capture(sync);
+  Capture deferred_capture(deferred);
+  ASSERT_EQ(logger_enable_deferred(deferred, 64 * 1024), 0);
+
+  const std::string long_str(3000, 'x');
+  const char *null_str = nullptr;
+  int value = 0;
+
+  for (int i = 0; i < 3; i++) {
+    LOG_BOTH(sync, deferred, "plain text without arguments");
+    LOG_BOTH(sync, deferred, "int %d, unsigned %u, hex %#x, octal %o, char %c", -i, 42u, 255, 8, 'c');
+    LOG_BOTH(sync, deferred, "short %hd, char %hhd, long %ld, long long %lld", (short)-3, (char)7, -1234567890L,
+             -123456789012345LL);
+    LOG_BOTH(sync, deferred, "size %zu, ptrdiff %td, intmax %jd, uint64 %" PRIu64, (size_t)77, (ptrdiff_t)-9,
+             (intmax_t)-5, (uint64_t)1 << 60);
+    LOG_BOTH(sync, deferred, "double %f %.3e %g %a %5.2F", 3.14159, 1e100, 0.0001, 1.0, -2.5);
+    LOG_BOTH(sync, deferred, "long double %Lf %.20Lg", (long double)1 / 3, (long double)2 / 3);
+    LOG_BOTH(sync, deferred, "pointer %p %p", (void *)&value, (void *)nullptr);
+    LOG_BOTH(sync, deferred, "string '%s' '%-8s' '%8s' '%.3s' '%s'", "abc", "left", "right", "truncated", null_str);
+    LOG_BOTH(sync, deferred, "star '%*d' '%-*d' '%.*s' '%*.*f' '%.*s'", 6, i, 4, i, 2, "precision", 8, 2, 1.5, -1,
+             "negative");
+    LOG_BOTH(sync, deferred, "percent 100%% %d%%", 50);
+    LOG_BOTH(sync, deferred, "long %s end", long_str.c_str());
+    LOG_BOTH(sync, deferred, "precision of a long string %.2000s", long_str.c_str());
+    LOG_BOTH(sync, deferred, "wide char %lc is formatted eagerly", (wint_t)'w');
+    LOG_BOTH(sync, deferred, "%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d", 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+             12, 13, 14, 15, 16, 17);
+    LOGGER_LOCAL_RAW(sync, "raw %d\n", i);
+    LOGGER_LOCAL_RAW(deferred, "raw %d\n", i);
+  }
+
+  logger_disable_deferred(deferred);
+  EXPECT_EQ(deferred_capture.str(), sync_capture.str());
+  EXPECT_FALSE(sync_capture.str().empty());
+
+  logger_destroy(&sync);
+  logger_destroy(&deferred);
+}
+
+TEST(UlogAsync, MultipleThreads) {
+  struct ulog_s *logger = CreateLogger();
+  logger_format_disable(logger, ULOG_F_COLOR);
+  Capture capture(logger);
+  ASSERT_EQ(logger_enable_deferred(logger, 0), 0);
+
+  const int kThreads = 4;
+  const int kLogsPerThread = 2000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([logger, t] {
+      for (int i = 0; i < kLogsPerThread; i++) LOGGER_LOCAL_INFO(logger, "thread %d log %d %s", t, i, "payload");
+    });
+  }
+  for (auto &thread : threads) thread.join();
+
+  logger_flush_deferred(logger);
+  const std::string out = capture.str();
+  EXPECT_EQ(std::count(out.begin(), out.end(), '\n'), kThreads * kLogsPerThread);
+  for (int t = 0; t < kThreads; t++) {
+    EXPECT_NE(out.find("thread " + std::to_string(t) + " log " + std::to_string(kLogsPerThread - 1) + " payload\n"),
+              std::string::npos);
+  }
+  logger_destroy(&logger);
+}
+
+TEST(UlogAsync, ThreadSwitchesBetweenLoggers) {
+  struct ulog_s *first = CreateLogger();
+  struct ulog_s *second = CreateLogger();
+  Capture first_capture(first);
+  Capture second_capture(second);
+  ASSERT_EQ(logger_enable_deferred(first, 0), 0);
+  ASSERT_EQ(logger_enable_deferred(second, 0), 0);
+
+  // The thread keeps a producer per backend, also across a re-enabled backend of the same logger
+  for (int i = 0; i < 100; i++) {
+    LOGGER_LOCAL_INFO(first, "first %d", i);
+    LOGGER_LOCAL_INFO(second, "second %d", i);
+    if (i == 50) {
+      ASSERT_EQ(logger_enable_deferred(second, 0), 0);
+    }
+  }
+  logger_flush_deferred(first);
+  logger_flush_deferred(second);
+  const std::string out = first_capture.str();
+  EXPECT_EQ(std::count(out.begin(), out.end(), '\n'), 100);
+  EXPECT_NE(out.find("first 99"), std::string::npos);
+  EXPECT_EQ(out.find("second"), std::string::npos);
+  const std::string second_out = second_capture.str();
+  EXPECT_EQ(std::count(second_out.begin(), second_out.end(), '\n'), 100);
+  EXPECT_NE(second_out.find("second 99"), std::string::npos);
+  logger_destroy(&first);
+  logger_destroy(&second);
+}
+
+TEST(UlogAsync, FatalFlushesQueue) {
+  struct ulog_s *logger = CreateLogger();
+  Capture capture(logger);
+  ASSERT_EQ(logger_enable_deferred(logger, 0), 0);
+
+  LOGGER_LOCAL_INFO(logger, "before fatal %d", 1);
+  LOGGER_LOCAL_FATAL(logger, "fatal %s", "error");
+  const std::string out = capture.str();
+  EXPECT_NE(out.find("before fatal 1"), std::string::npos);
+  EXPECT_NE(out.find("fatal error"), std::string::npos);
+  logger_destroy(&logger);
+}
+
+TEST(UlogAsync, RepeatFilter) {
+  struct ulog_s *logger = CreateLogger();
+  logger_format_disable(logger, 0x7f);
+  Capture capture(logger);
+  ASSERT_EQ(logger_enable_deferred(logger, 0), 0);
+  logger_set_repeat_filter(logger, 60000);
+
+  // The filtered logs are formatted by the caller and queued as text, in order with their summaries
+  for (int i = 0; i < 4; i++) LOGGER_LOCAL_INFO(logger, "value %d", i < 3 ? 7 : 8);
+  logger_flush_deferred(logger);
+  EXPECT_EQ(capture.str(), "value 7\nlast message repeated 2 times\nvalue 8\n");
+  logger_destroy(&logger);
+}
+
+TEST(UlogAsync, StructuredLogMatchesSynchronous) {
+  struct ulog_s *sync = CreateLogger();
+  struct ulog_s *deferred = CreateLogger();
+  Capture sync_capture(sync);
+  Capture deferred_capture(deferred);
+  ASSERT_EQ(logger_enable_deferred(deferred, 64 * 1024), 0);
+  logger_format_disable(sync, ULOG_F_FILE_LINE);
+  logger_format_disable(deferred, ULOG_F_FILE_LINE);
+
+  // The record is rendered by the backend thread, the strings are copied into it
+  for (int format = ULOG_KV_LOGFMT; format <= ULOG_KV_JSON; format++) {
+    logger_set_kv_format(sync, (enum ulog_kv_format_e)format);
+    logger_set_kv_format(deferred, (enum ulog_kv_format_e)format);
+    for (int i = 0; i < 3; i++) {
+      std::string side = i % 2 ? "buy limit" : "sell";
+      LOGGER_LOCAL_INFO_KV(sync, "order filled", ULOG_KV("id", i), ULOG_KV("px", 100.5 + i),
+                           ULOG_KV("side", side.c_str()), ULOG_KV("ioc", i == 1));
+      LOGGER_LOCAL_INFO_KV(deferred, "order filled", ULOG_KV("id", i), ULOG_KV("px", 100.5 + i),
+                           ULOG_KV("side", side.c_str()), ULOG_KV("ioc", i == 1));
+      side.assign("overwritten");
+    }
+  }
+
+  logger_disable_deferred(deferred);
+  EXPECT_EQ(deferred_capture.str(), sync_capture.str());
+  EXPECT_NE(sync_capture.str().find("order filled id=1 px=101.5 side=\"buy limit\" ioc=true"), std::string::npos);
+  EXPECT_NE(sync_capture.str().find("order filled {\"id\":2,\"px\":102.5,\"side\":\"sell\",\"ioc\":false}"),
+            std::string::npos);
+
+  logger_destroy(&sync);
+  logger_destroy(&deferred);
+}
+
+TEST(UlogAsync, LargestStructuredLogFitsTheSmallestQueue) {
+  struct ulog_s *logger = CreateLogger();
+  logger_format_disable(logger, 0x7f);
+  Capture capture(logger);
+  ASSERT_EQ(logger_enable_deferred(logger, 0), 0);
+
+  // A message and fields of about ULOG_OUTBUF_LEN each, the line is cut at ULOG_OUTBUF_LEN without its newline
+  const std::string msg = "begin " + std::string(ULOG_OUTBUF_LEN, 'm');
+  const std::string value(ULOG_OUTBUF_LEN - 64, 'v');
+  for (int i = 0; i < 20; i++) LOGGER_LOCAL_INFO_KV(logger, msg.c_str(), ULOG_KV("value", value.c_str()));
+  logger_flush_deferred(logger);
+
+  EXPECT_EQ(logger_get_dropped_count(logger), 0u);
+  const std::string out = capture.str();
+  size_t count = 0;
+  for (size_t pos = 0; (pos = out.find("begin ", pos)) != std::string::npos; pos++) count++;
+  EXPECT_EQ(count, 20u);
+  logger_destroy(&logger);
+}
+
+// Everything written to the pipe so far
+static std::string ReadPipe(int fd) {
+  std::string out;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) out.append(buf, static_cast<size_t>(n));
+  return out;
+}
+
+TEST(UlogAsync, CreateAsyncBatchesIntoFd) {
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+  struct ulog_async_config_s config = ULOG_ASYNC_CONFIG_INIT;
+  config.fd = fds[1];
+  config.flush_interval_ms = 60000;
+  struct ulog_s *logger = logger_create_async(&config);
+  ASSERT_NE(logger, nullptr);
+  logger_format_disable(logger, 0x7f);
+
+  // Held back until the flush interval has passed or the logs are flushed
+  for (int i = 0; i < 3; i++) LOGGER_LOCAL_INFO(logger, "batched %d", i);
+  usleep(50 * 1000);
+  EXPECT_EQ(ReadPipe(fds[0]), "");
+  logger_flush_deferred(logger);
+  EXPECT_EQ(ReadPipe(fds[0]), "batched 0\nbatched 1\nbatched 2\n");
+
+  // Back to synchronous writes into the same descriptor
+  LOGGER_LOCAL_INFO(logger, "queued");
+  logger_disable_deferred(logger);
+  LOGGER_LOCAL_INFO(logger, "synchronous");
+  EXPECT_EQ(ReadPipe(fds[0]), "queued\nsynchronous\n");
+  logger_destroy(&logger);
+
+  config.flush_interval_ms = 10;
+  logger = logger_create_async(&config);
+  ASSERT_NE(logger, nullptr);
+  logger_format_disable(logger, 0x7f);
+  LOGGER_LOCAL_INFO(logger, "after the interval");
+  std::string out;
+  for (int i = 0; i < 100 && out.empty(); i++) {
+    usleep(10 * 1000);
+    out = ReadPipe(fds[0]);
+  }
+  EXPECT_EQ(out, "after the interval\n");
+  logger_destroy(&logger);
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+namespace {
+
+// Output callback that holds the background thread until it is released
+struct BlockingOutput {
+  std::mutex mutex;
+  std::string out;
+  std::atomic_bool released{false};
+  std::atomic_int flushes{0};
+
+  static int Output(void *self, const char *ptr, size_t len) {
+    auto *output = static_cast<BlockingOutput *>(self);
+    while (!output->released) usleep(1000);
+    std::lock_guard<std::mutex> lock(output->mutex);
+    output->out.append(ptr, len);
+    return static_cast<int>(len);
+  }
+  static void Flush(void *self) { static_cast<BlockingOutput *>(self)->flushes++; }
+};
+
+}  // namespace
+
+TEST(UlogAsync, CreateAsyncDropsWhenFull) {
+  BlockingOutput output;
+  struct ulog_async_config_s config = ULOG_ASYNC_CONFIG_INIT;
+  config.queue_size = 0;
+  config.full_policy = ULOG_QUEUE_FULL_DROP;
+  config.output_cb = BlockingOutput::Output;
+  config.flush_cb = BlockingOutput::Flush;
+  config.user_data = &output;
+  struct ulog_s *logger = logger_create_async(&config);
+  ASSERT_NE(logger, nullptr);
+  logger_format_disable(logger, 0x7f);
+
+  // The callers never wait for the blocked output
+  const int kLogs = 20000;
+  for (int i = 0; i < kLogs; i++) LOGGER_LOCAL_INFO(logger, "log %d %s", i, "payload");
+  const uint64_t dropped = logger_get_dropped_count(logger);
+  EXPECT_GT(dropped, 0u);
+
+  output.released = true;
+  logger_flush_deferred(logger);
+  EXPECT_GE(output.flushes, 1);
+  {
+    std::lock_guard<std::mutex> lock(output.mutex);
+    EXPECT_EQ(static_cast<uint64_t>(std::count(output.out.begin(), output.out.end(), '\n')), kLogs - dropped);
+    EXPECT_EQ(output.out.find("log 0 payload\n"), 0u);
+  }
+  logger_destroy(&logger);
+}
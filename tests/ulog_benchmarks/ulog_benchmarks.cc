@@ -0,0 +1,515 @@
+//
+// Micro benchmarks of the log hot path, results are printed in ns/op.
+//
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "ulog/file/sink_async_wrapper.h"
+#include "ulog/queue/fifo_power_of_two.h"
+#include "ulog/queue/mpsc_ring.h"
+#include "ulog/ulog.h"
+#include "ulog/ulog_async.h"
+#include "ulog/ulog_fmt_async.h"
+
+// Run "op" for "iterations" times in each of "thread_count" threads, return the wall time divided by the total number
+// of operations in ns (so the result is comparable on machines with fewer cores than threads)
+static double BenchmarkNsPerOp(const size_t thread_count, const size_t iterations, const std::function<void()>& op) {
+  std::vector<std::thread> threads;
+  const auto begin = std::chrono::steady_clock::now();
+  for (size_t t = 0; t < thread_count; ++t) {
+    threads.emplace_back([&] {
+      for (size_t i = 0; i < iterations; ++i) op();
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  const auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - begin).count() / (iterations * thread_count);
+}
+
+// Same as BenchmarkNsPerOp(), but only counts the CPU time of the calling threads, so work handed over to a background
+// thread is excluded
+static double BenchmarkCpuNsPerOp(const size_t thread_count, const size_t iterations, const std::function<void()>& op) {
+  std::vector<std::thread> threads;
+  std::atomic<uint64_t> total_ns{0};
+  for (size_t t = 0; t < thread_count; ++t) {
+    threads.emplace_back([&] {
+      struct timespec begin, end;
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &begin);
+      for (size_t i = 0; i < iterations; ++i) op();
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+      total_ns += (end.tv_sec - begin.tv_sec) * 1000000000ULL + end.tv_nsec - begin.tv_nsec;
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  return static_cast<double>(total_ns) / (iterations * thread_count);
+}
+
+// The timestamp rendering used before the per-thread date cache
+static void LegacyRenderTime(char* buf, size_t size) {
+  uint64_t time_ms = logger_real_time_us() / 1000;
+  time_t time_s = (time_t)(time_ms / 1000);
+  struct tm lt = *localtime(&time_s);
+  snprintf(buf, size, "%04d-%02d-%02d %02d:%02d:%02d.%03d ", lt.tm_year + 1900, lt.tm_mon + 1, lt.tm_mday, lt.tm_hour,
+           lt.tm_min, lt.tm_sec, (int)(time_ms % 1000));
+}
+
+static void CachedRenderTime(char* buf) {
+  const uint64_t time_us = logger_real_time_us();
+  logger_render_time((time_t)(time_us / 1000000), (uint32_t)(time_us % 1000000) * 1000, 3, buf);
+}
+
+static void TimestampBenchmarks() {
+  constexpr size_t kIterations = 200 * 1000;
+
+  LOGGER_INFO("%-40s %8s %14s", "timestamp", "threads", "ns/op");
+  for (const size_t thread_count : {1, 8, 64}) {
+    LOGGER_INFO("%-40s %8zu %14.1f", "localtime() + snprintf (legacy)", thread_count,
+                BenchmarkNsPerOp(thread_count, kIterations, [] {
+                  char buf[64];
+                  LegacyRenderTime(buf, sizeof(buf));
+                }));
+    LOGGER_INFO("%-40s %8zu %14.1f", "logger_render_time()", thread_count,
+                BenchmarkNsPerOp(thread_count, kIterations, [] {
+                  char buf[ULOG_TIME_STR_MAX];
+                  CachedRenderTime(buf);
+                }));
+  }
+
+  // What the logging thread pays for the timestamp of each clock
+  LOGGER_INFO("%-40s %8s %14s", "clock read", "threads", "ns/op");
+  const struct {
+    const char* name;
+    enum ulog_clock_e clock;
+  } clocks[] = {
+      {"ULOG_CLOCK_REALTIME", ULOG_CLOCK_REALTIME},
+      {"ULOG_CLOCK_REALTIME_COARSE", ULOG_CLOCK_REALTIME_COARSE},
+      {"ULOG_CLOCK_MONOTONIC", ULOG_CLOCK_MONOTONIC},
+      {"ULOG_CLOCK_TSC", ULOG_CLOCK_TSC},
+  };
+  for (const auto& c : clocks) {
+    if (logger_clock_prepare(c.clock) != 0) continue;
+    LOGGER_INFO("%-40s %8d %14.1f", c.name, 1, BenchmarkNsPerOp(1, kIterations, [&] {
+                  volatile uint64_t tick = logger_clock_now(c.clock);
+                  (void)tick;
+                }));
+  }
+}
+
+static void LogLineBenchmarks() {
+  constexpr size_t kIterations = 200 * 1000;
+
+  struct ulog_s* logger = logger_create();
+  logger_set_output_callback(logger, [](void*, const char*) { return 0; });
+
+  struct ulog_s* repeat_logger = logger_create();
+  logger_set_output_callback(repeat_logger, [](void*, const char*) { return 0; });
+  logger_set_repeat_filter(repeat_logger, 1000);
+
+  struct ulog_s* deferred_logger = logger_create();
+  logger_set_output_callback(deferred_logger, [](void*, const char*) { return 0; });
+  logger_enable_deferred(deferred_logger, 1024 * 1024);
+
+  ulog::Logger cpp_logger;
+  cpp_logger.set_output_callback([](void*, const char*) { return 0; });
+
+  ulog::AsyncLogger cpp_async_logger(1024 * 1024);
+  cpp_async_logger.set_output_callback([](void*, const char*) { return 0; });
+
+  LOGGER_INFO("%-40s %8s %14s", "log line (null output)", "threads", "ns/op");
+  for (const size_t thread_count : {1, 8, 64}) {
+    const double c_ns = BenchmarkNsPerOp(thread_count, kIterations, [=] { LOGGER_LOCAL_INFO(logger, "value = %d", 42); });
+    LOGGER_INFO("%-40s %8zu %14.1f", "LOGGER_LOCAL_INFO", thread_count, c_ns);
+    const double token_ns = BenchmarkNsPerOp(thread_count, kIterations, [=] {
+      const int count = 42;
+      const double position = 0.125;
+      const float speed = 3.5f;
+      LOGGER_LOCAL_MULTI_TOKEN(logger, count, position, speed);
+    });
+    LOGGER_INFO("%-40s %8zu %14.1f", "LOGGER_LOCAL_MULTI_TOKEN (3 values)", thread_count, token_ns);
+    const double arbitrary_ns = BenchmarkNsPerOp(thread_count, kIterations, [=] {
+      // Values without a short decimal form, which take the "%g" path
+      thread_local uint64_t state = 0x9e3779b97f4a7c15ULL;
+      state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+      const int count = 42;
+      const double position = static_cast<double>(state >> 11) / 9007199254740992.0 * 1000.0;
+      const float speed = static_cast<float>(position) / 7.0f;
+      LOGGER_LOCAL_MULTI_TOKEN(logger, count, position, speed);
+    });
+    LOGGER_INFO("%-40s %8zu %14.1f", "LOGGER_LOCAL_MULTI_TOKEN (arbitrary)", thread_count, arbitrary_ns);
+    const double limited_ns = BenchmarkNsPerOp(thread_count, kIterations, [=] {
+      LOGGER_LOCAL_INFO_EVERY_N(logger, 1000 * 1000, "value = %d", 42);
+    });
+    LOGGER_INFO("%-40s %8zu %14.1f", "LOGGER_LOCAL_INFO_EVERY_N (suppressed)", thread_count, limited_ns);
+    const double repeat_ns = BenchmarkNsPerOp(thread_count, kIterations, [=] {
+      LOGGER_LOCAL_INFO(repeat_logger, "value = %d", 42);
+    });
+    LOGGER_INFO("%-40s %8zu %14.1f", "LOGGER_LOCAL_INFO (repeat filter)", thread_count, repeat_ns);
+    const double distinct_ns = BenchmarkNsPerOp(thread_count, kIterations, [=] {
+      thread_local int value = 0;
+      LOGGER_LOCAL_INFO(repeat_logger, "value = %d", value++);
+    });
+    LOGGER_INFO("%-40s %8zu %14.1f", "LOGGER_LOCAL_INFO (repeat filter, new)", thread_count, distinct_ns);
+    const auto deferred_op = [=] { LOGGER_LOCAL_INFO(deferred_logger, "value = %d", 42); };
+    const double deferred_ns = BenchmarkNsPerOp(thread_count, kIterations, deferred_op);
+    logger_flush_deferred(deferred_logger);
+    LOGGER_INFO("%-40s %8zu %14.1f", "LOGGER_LOCAL_INFO (deferred)", thread_count, deferred_ns);
+    const double deferred_cpu_ns = BenchmarkCpuNsPerOp(thread_count, kIterations, deferred_op);
+    logger_flush_deferred(deferred_logger);
+    LOGGER_INFO("%-40s %8zu %14.1f", "LOGGER_LOCAL_INFO (deferred, caller cpu)", thread_count, deferred_cpu_ns);
+    LOGGER_INFO("%-40s %8zu %14.1f", "ulog::Logger::info", thread_count,
+                BenchmarkNsPerOp(thread_count, kIterations, [&] { cpp_logger.info("value = {}", 42); }));
+    LOGGER_INFO("%-40s %8zu %14.1f", "ulog::Logger::info (every_n, suppressed)", thread_count,
+                BenchmarkNsPerOp(thread_count, kIterations, [&] {
+                  static ulog::every_n limit(1000 * 1000);
+                  cpp_logger.info(limit, "value = {}", 42);
+                }));
+    const double cpp_async_cpu_ns =
+        BenchmarkCpuNsPerOp(thread_count, kIterations, [&] { cpp_async_logger.info("value = {}", 42); });
+    cpp_async_logger.flush();
+    LOGGER_INFO("%-40s %8zu %14.1f", "ulog::AsyncLogger::info (caller cpu)", thread_count, cpp_async_cpu_ns);
+  }
+
+  logger_destroy(&logger);
+  logger_destroy(&deferred_logger);
+  logger_destroy(&repeat_logger);
+}
+
+// Discards everything, so only the path into the async queue is measured
+class NullSink final : public ulog::file::SinkBase {
+ public:
+  ulog::Status SinkIt(const void*, size_t) override { return ulog::Status::OK(); }
+  ulog::Status SinkIt(const void*, size_t, std::chrono::milliseconds) override { return ulog::Status::OK(); }
+  ulog::Status Flush() override { return ulog::Status::OK(); }
+};
+
+using AsyncSink = ulog::file::SinkAsyncWrapper<ulog::mpsc::Mq>;
+
+static void AsyncSinkBenchmarks() {
+  constexpr size_t kIterations = 200 * 1000;
+  AsyncSink sink(1024 * 1024, std::chrono::seconds{1}, std::make_unique<NullSink>());
+
+  // Rendered into the stack buffer, then strlen() and SinkIt() copy it into the queue
+  struct ulog_s* copy_logger = logger_create();
+  logger_set_user_data(copy_logger, &sink);
+  logger_set_output_callback(copy_logger, [](void* user_data, const char* str) {
+    const size_t len = strlen(str);
+    return static_cast<AsyncSink*>(user_data)->SinkIt(str, len, std::chrono::milliseconds{100}) ? (int)len : 0;
+  });
+
+  // Rendered in place into the queue
+  struct ulog_s* reserve_logger = logger_create();
+  logger_set_user_data(reserve_logger, &sink);
+  logger_set_output_reserve_callback(
+      reserve_logger,
+      [](void* user_data, size_t size) {
+        return static_cast<AsyncSink*>(user_data)->Reserve(size, std::chrono::milliseconds{100});
+      },
+      [](void* user_data, void* data, size_t size) { static_cast<AsyncSink*>(user_data)->Commit(data, size); });
+
+  LOGGER_INFO("%-40s %8s %14s", "log line into SinkAsyncWrapper", "threads", "ns/op");
+  for (const size_t thread_count : {1, 8, 64}) {
+    const double copy_ns = BenchmarkCpuNsPerOp(thread_count, kIterations, [=] {
+      LOGGER_LOCAL_INFO(copy_logger, "value = %d, %s", 42, "a message of a typical length for a log line");
+    });
+    sink.Flush();
+    LOGGER_INFO("%-40s %8zu %14.1f", "output callback + SinkIt (caller cpu)", thread_count, copy_ns);
+    const double reserve_ns = BenchmarkCpuNsPerOp(thread_count, kIterations, [=] {
+      LOGGER_LOCAL_INFO(reserve_logger, "value = %d, %s", 42, "a message of a typical length for a log line");
+    });
+    sink.Flush();
+    LOGGER_INFO("%-40s %8zu %14.1f", "reserve/commit (caller cpu)", thread_count, reserve_ns);
+  }
+
+  logger_destroy(&copy_logger);
+  logger_destroy(&reserve_logger);
+}
+
+static void AsyncCBenchmarks() {
+  constexpr size_t kIterations = 200 * 1000;
+  const int null_fd = open("/dev/null", O_WRONLY);
+
+  // The setup of examples/unix/ulog_example_asyn.cc: every line is copied into a mutex protected FIFO, which drops it
+  // when it is full, and a thread copies it out and writes it
+  ulog::FifoPowerOfTwo fifo(1024 * 1024);
+  std::atomic_bool fifo_stop{false};
+  std::thread fifo_thread([&] {
+    char buf[4096];
+    while (!fifo_stop) {
+      const size_t len = fifo.OutputWaitIfEmpty(buf, sizeof(buf), 100);
+      if (len) (void)!write(null_fd, buf, len);
+    }
+  });
+  struct ulog_s* fifo_logger = logger_create();
+  logger_set_user_data(fifo_logger, &fifo);
+  logger_set_output_callback_len(fifo_logger, [](void* user_data, const char* str, size_t len) {
+    return (int)static_cast<ulog::FifoPowerOfTwo*>(user_data)->InputPacketOrDrop(str, len);
+  });
+
+  struct ulog_async_config_s config = ULOG_ASYNC_CONFIG_INIT;
+  config.fd = null_fd;
+  struct ulog_s* async_logger = logger_create_async(&config);
+
+  LOGGER_INFO("%-40s %8s %14s", "log line into /dev/null", "threads", "ns/op");
+  for (const size_t thread_count : {1, 8, 64}) {
+    const double fifo_ns = BenchmarkCpuNsPerOp(thread_count, kIterations, [=] {
+      LOGGER_LOCAL_INFO(fifo_logger, "value = %d, %s", 42, "a message of a typical length for a log line");
+    });
+    LOGGER_INFO("%-40s %8zu %14.1f", "FifoPowerOfTwo + thread (caller cpu)", thread_count, fifo_ns);
+    const double async_ns = BenchmarkCpuNsPerOp(thread_count, kIterations, [=] {
+      LOGGER_LOCAL_INFO(async_logger, "value = %d, %s", 42, "a message of a typical length for a log line");
+    });
+    logger_flush_deferred(async_logger);
+    LOGGER_INFO("%-40s %8zu %14.1f", "logger_create_async (caller cpu)", thread_count, async_ns);
+  }
+
+  logger_destroy(&async_logger);
+  logger_destroy(&fifo_logger);
+  fifo_stop = true;
+  fifo.InterruptOutput();
+  fifo_thread.join();
+  close(null_fd);
+}
+
+static void HexDumpBenchmarks() {
+  constexpr size_t kIterations = 200;
+  constexpr size_t kDataSize = 64 * 1024;
+
+  static uint8_t data[kDataSize];
+  for (size_t i = 0; i < kDataSize; i++) data[i] = (uint8_t)(i * 7);
+
+  // A dump stops at the first output that reports a failure, so the whole length is reported as written
+  struct ulog_s* logger = logger_create();
+  logger_set_output_callback(logger, [](void*, const char* str) { return (int)strlen(str); });
+
+  LOGGER_INFO("%-40s %8s %14s", "hex dump of 64 KiB (null output)", "width", "ns/byte");
+  for (const uint32_t width : {16, 32}) {
+    const double ns = BenchmarkNsPerOp(1, kIterations, [=] { logger_hex_dump(logger, data, kDataSize, width, 0, false); });
+    LOGGER_INFO("%-40s %8u %14.2f", "logger_hex_dump", width, ns / kDataSize);
+  }
+
+  logger_destroy(&logger);
+}
+
+static void ModuleFilterBenchmarks() {
+  constexpr size_t kIterations = 10 * 1000 * 1000;
+  struct ulog_s* logger = logger_create();
+  logger_set_output_callback(logger, [](void*, const char*) { return 0; });
+  ulog::Logger cpp_logger;
+  cpp_logger.set_output_callback([](void*, const char*) { return 0; });
+
+  LOGGER_INFO("%-40s %8s %14s", "filtered debug log", "threads", "ns/op");
+  for (const size_t thread_count : {1, 64}) {
+    // Filtered by the level of the logger: the call reaches the logger
+    logger_set_output_level(logger, ULOG_LEVEL_INFO);
+    cpp_logger.set_level(ulog::level::info);
+    const double c_level_ns =
+        BenchmarkNsPerOp(thread_count, kIterations, [=] { LOGGER_LOCAL_DEBUG(logger, "value = %d", 42); });
+    LOGGER_INFO("%-40s %8zu %14.1f", "LOGGER_LOCAL_DEBUG (logger level)", thread_count, c_level_ns);
+    LOGGER_INFO("%-40s %8zu %14.1f", "ulog::Logger::debug (logger level)", thread_count,
+                BenchmarkNsPerOp(thread_count, kIterations, [&] { cpp_logger.debug("value = {}", 42); }));
+
+    // Filtered by the cached module level of the call site
+    logger_set_output_level(logger, ULOG_LEVEL_TRACE);
+    cpp_logger.set_level(ulog::level::trace);
+    logger_set_module_levels("info");
+    const double c_module_ns =
+        BenchmarkNsPerOp(thread_count, kIterations, [=] { LOGGER_LOCAL_DEBUG(logger, "value = %d", 42); });
+    LOGGER_INFO("%-40s %8zu %14.1f", "LOGGER_LOCAL_DEBUG (module level)", thread_count, c_module_ns);
+    LOGGER_INFO("%-40s %8zu %14.1f", "ulog::Logger::debug (module level)", thread_count,
+                BenchmarkNsPerOp(thread_count, kIterations, [&] { cpp_logger.debug("value = {}", 42); }));
+    logger_set_module_levels(nullptr);
+  }
+
+  logger_destroy(&logger);
+}
+
+// Stands for an argument that is expensive to compute, e.g. a dump of some state
+static __attribute__((noinline)) std::string DescribeState(int value) { return std::to_string(value) + " items pending"; }
+
+// Compiled out by the level floor of the macros below
+#undef ULOG_FMT_MIN_LEVEL
+#define ULOG_FMT_MIN_LEVEL 2
+static void CompiledOutDebug(ulog::Logger& logger) { ULOG_FMT_DEBUG(logger, "state = {}", DescribeState(42)); }
+#undef ULOG_FMT_MIN_LEVEL
+#define ULOG_FMT_MIN_LEVEL 0
+
+static void DisabledLevelBenchmarks() {
+  constexpr size_t kIterations = 10 * 1000 * 1000;
+  struct ulog_s* logger = logger_create();
+  logger_set_output_callback(logger, [](void*, const char*) { return 0; });
+  logger_set_output_level(logger, ULOG_LEVEL_INFO);
+  ulog::Logger cpp_logger;
+  cpp_logger.set_output_callback([](void*, const char*) { return 0; });
+  cpp_logger.set_level(ulog::level::info);
+
+  LOGGER_INFO("%-40s %8s %14s", "disabled debug log", "threads", "ns/op");
+  for (const size_t thread_count : {1, 64}) {
+    const double c_ns =
+        BenchmarkNsPerOp(thread_count, kIterations, [=] { LOGGER_LOCAL_DEBUG(logger, "value = %d", 42); });
+    LOGGER_INFO("%-40s %8zu %14.1f", "LOGGER_LOCAL_DEBUG", thread_count, c_ns);
+    LOGGER_INFO("%-40s %8zu %14.1f", "Logger::debug", thread_count,
+                BenchmarkNsPerOp(thread_count, kIterations, [&] { cpp_logger.debug("value = {}", 42); }));
+    LOGGER_INFO("%-40s %8zu %14.1f", "Logger::debug (expensive argument)", thread_count,
+                BenchmarkNsPerOp(thread_count, kIterations,
+                                 [&] { cpp_logger.debug("state = {}", DescribeState(42)); }));
+    LOGGER_INFO("%-40s %8zu %14.1f", "ULOG_FMT_DEBUG (expensive argument)", thread_count,
+                BenchmarkNsPerOp(thread_count, kIterations,
+                                 [&] { ULOG_FMT_DEBUG(cpp_logger, "state = {}", DescribeState(42)); }));
+    LOGGER_INFO("%-40s %8zu %14.1f", "ULOG_FMT_DEBUG (ULOG_FMT_MIN_LEVEL 2)", thread_count,
+                BenchmarkNsPerOp(thread_count, kIterations, [&] { CompiledOutDebug(cpp_logger); }));
+  }
+
+  logger_destroy(&logger);
+}
+
+static void ProfileBenchmarks() {
+  constexpr size_t kIterations = 1000 * 1000;
+  struct ulog_s* logger = logger_create();
+  logger_set_output_callback(logger, [](void*, const char*) { return 0; });
+  logger_profile_set_report_interval(0);
+
+  LOGGER_INFO("%-40s %8s %14s", "profiled scope", "threads", "ns/op");
+  for (const size_t thread_count : {1, 8, 64}) {
+    LOGGER_INFO("%-40s %8zu %14.1f", "LOGGER_LOCAL_PROFILE_SCOPE (empty)", thread_count,
+                BenchmarkNsPerOp(thread_count, kIterations, [=] { LOGGER_LOCAL_PROFILE_SCOPE(logger, "empty"); }));
+  }
+
+  logger_profile_set_report_interval(ULOG_PROFILE_REPORT_MS);
+  logger_destroy(&logger);
+}
+
+static void StructuredLogBenchmarks() {
+  constexpr size_t kIterations = 1000 * 1000;
+  const int null_fd = open("/dev/null", O_WRONLY);
+  struct ulog_s* logger = logger_create();
+  logger_set_output_callback_len(logger, [](void*, const char*, size_t len) { return (int)len; });
+  struct ulog_s* kv_logger = logger_create();
+  logger_set_output_kv_callback(kv_logger, [](void*, const char*, size_t len, const void*, size_t) { return (int)len; });
+  struct ulog_async_config_s config = ULOG_ASYNC_CONFIG_INIT;
+  config.fd = null_fd;
+  struct ulog_s* async_logger = logger_create_async(&config);
+  ulog::Logger cpp_logger;
+  cpp_logger.set_output_callback_len([](void*, const char*, size_t len) { return (int)len; });
+
+  const int id = 1042;
+  const double px = 101.25;
+  const char* side = "buy";
+  const double text_ns = BenchmarkNsPerOp(1, kIterations, [=] {
+    LOGGER_LOCAL_INFO(logger, "order filled id=%d px=%g side=%s", id, px, side);
+  });
+  const double logfmt_ns = BenchmarkNsPerOp(1, kIterations, [=] {
+    LOGGER_LOCAL_INFO_KV(logger, "order filled", ULOG_KV("id", id), ULOG_KV("px", px), ULOG_KV("side", side));
+  });
+  logger_set_kv_format(logger, ULOG_KV_JSON);
+  const double json_ns = BenchmarkNsPerOp(1, kIterations, [=] {
+    LOGGER_LOCAL_INFO_KV(logger, "order filled", ULOG_KV("id", id), ULOG_KV("px", px), ULOG_KV("side", side));
+  });
+  const double kv_callback_ns = BenchmarkNsPerOp(1, kIterations, [=] {
+    LOGGER_LOCAL_INFO_KV(kv_logger, "order filled", ULOG_KV("id", id), ULOG_KV("px", px), ULOG_KV("side", side));
+  });
+  const double async_text_ns = BenchmarkCpuNsPerOp(1, kIterations, [=] {
+    LOGGER_LOCAL_INFO(async_logger, "order filled id=%d px=%g side=%s", id, px, side);
+  });
+  logger_flush_deferred(async_logger);
+  const double async_kv_ns = BenchmarkCpuNsPerOp(1, kIterations, [=] {
+    LOGGER_LOCAL_INFO_KV(async_logger, "order filled", ULOG_KV("id", id), ULOG_KV("px", px), ULOG_KV("side", side));
+  });
+  logger_flush_deferred(async_logger);
+
+  LOGGER_INFO("%-40s %8s %14s", "order log (null output)", "threads", "ns/op");
+  LOGGER_INFO("%-40s %8d %14.1f", "LOGGER_LOCAL_INFO (printf text)", 1, text_ns);
+  LOGGER_INFO("%-40s %8d %14.1f", "LOGGER_LOCAL_INFO_KV (logfmt)", 1, logfmt_ns);
+  LOGGER_INFO("%-40s %8d %14.1f", "LOGGER_LOCAL_INFO_KV (JSON)", 1, json_ns);
+  LOGGER_INFO("%-40s %8d %14.1f", "LOGGER_LOCAL_INFO_KV (kv callback)", 1, kv_callback_ns);
+  LOGGER_INFO("%-40s %8d %14.1f", "LOGGER_LOCAL_INFO async (caller cpu)", 1, async_text_ns);
+  LOGGER_INFO("%-40s %8d %14.1f", "LOGGER_LOCAL_INFO_KV async (caller cpu)", 1, async_kv_ns);
+  LOGGER_INFO("%-40s %8d %14.1f", "Logger::info (text)", 1, BenchmarkNsPerOp(1, kIterations, [&] {
+                cpp_logger.info("order filled id={} px={} side={}", id, px, side);
+              }));
+  LOGGER_INFO("%-40s %8d %14.1f", "Logger::info (ulog::kv, logfmt)", 1, BenchmarkNsPerOp(1, kIterations, [&] {
+                cpp_logger.info("order filled", ulog::kv("id", id), ulog::kv("px", px), ulog::kv("side", side));
+              }));
+
+  logger_destroy(&async_logger);
+  logger_destroy(&kv_logger);
+  logger_destroy(&logger);
+  close(null_fd);
+}
+
+static int NullOutput(void*, const char*, size_t len) { return (int)len; }
+
+static void SinkFanOutBenchmarks() {
+  constexpr size_t kIterations = 1000 * 1000;
+  const int plain_format = ulog::kDefaultFormat & ~ulog::kFormatColor;
+
+  // One logger per target: info+ to a file, error+ to a second file and the console
+  ulog::Logger info_file;
+  info_file.set_output_callback_len(NullOutput);
+  info_file.set_level(ulog::level::info);
+  info_file.disable_format(ulog::kFormatColor);
+  ulog::Logger error_file;
+  error_file.set_output_callback_len(NullOutput);
+  error_file.set_level(ulog::level::error);
+  error_file.disable_format(ulog::kFormatColor);
+  ulog::Logger console;
+  console.set_output_callback_len(NullOutput);
+  console.set_level(ulog::level::error);
+
+  // The same targets as sinks of one logger
+  ulog::Logger fan_out;
+  fan_out.set_output_callback_len(NullOutput);
+  fan_out.set_level(ulog::level::info);
+  fan_out.add_sink(std::make_unique<NullSink>(), ulog::level::info, plain_format);
+  fan_out.add_sink(std::make_unique<NullSink>(), ulog::level::error, plain_format);
+
+  const int id = 1042;
+  const double px = 101.25;
+  LOGGER_INFO("%-40s %8s %14s", "info + error log (null outputs)", "threads", "ns/op");
+  for (const size_t thread_count : {1, 4}) {
+    LOGGER_INFO("%-40s %8zu %14.1f", "3 loggers (one per target)", thread_count,
+                BenchmarkNsPerOp(thread_count, kIterations, [&] {
+                  for (ulog::Logger* logger : {&info_file, &error_file, &console}) {
+                    logger->info("order filled id={} px={}", id, px);
+                    logger->error("order rejected id={} px={}", id, px);
+                  }
+                }));
+    LOGGER_INFO("%-40s %8zu %14.1f", "Logger::add_sink (2 sinks + output)", thread_count,
+                BenchmarkNsPerOp(thread_count, kIterations, [&] {
+                  fan_out.info("order filled id={} px={}", id, px);
+                  fan_out.error("order rejected id={} px={}", id, px);
+                }));
+  }
+}
+
+int main(int argc, char* argv[]) {
+  logger_format_disable(ULOG_GLOBAL, ULOG_F_FUNCTION | ULOG_F_TIME | ULOG_F_PROCESS_ID | ULOG_F_LEVEL | ULOG_F_FILE_LINE);
+
+  // Run only the benchmark named by the first argument, if any
+  const std::pair<const char*, void (*)()> benchmarks[] = {
+      {"timestamp", TimestampBenchmarks},
+      {"log_line", LogLineBenchmarks},
+      {"async_sink", AsyncSinkBenchmarks},
+      {"async_c", AsyncCBenchmarks},
+      {"hex_dump", HexDumpBenchmarks},
+      {"module_filter", ModuleFilterBenchmarks},
+      {"disabled_level", DisabledLevelBenchmarks},
+      {"structured", StructuredLogBenchmarks},
+      {"profile", ProfileBenchmarks},
+      {"sink_fanout", SinkFanOutBenchmarks},
+  };
+  for (const auto& [name, run] : benchmarks) {
+    if (argc < 2 || strcmp(argv[1], name) == 0) run();
+  }
+  return 0;
+}
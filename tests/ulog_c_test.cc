@@ -0,0 +1,1397 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__APPLE__)
+#include <pthread.h>
+#else
+#include <sys/syscall.h>
+#endif
+
+#include "ulog/ulog.h"
+
+static std::string ReferenceTime(time_t sec, uint32_t nsec, unsigned frac_digits) {
+  struct tm lt;
+  localtime_r(&sec, &lt);
+  char buf[64];
+  size_t len = strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &lt);
+  if (frac_digits) {
+    uint32_t frac = nsec;
+    for (unsigned i = frac_digits; i < 9; i++) frac /= 10;
+    snprintf(buf + len, sizeof(buf) - len, ".%0*u", (int)frac_digits, frac);
+  }
+  return buf;
+}
+
+static std::string RenderTime(time_t sec, uint32_t nsec, unsigned frac_digits) {
+  char buf[ULOG_TIME_STR_MAX];
+  return {buf, logger_render_time(sec, nsec, frac_digits, buf)};
+}
+
+TEST(UlogC, RenderTimeMatchesLocaltime) {
+  const time_t base = 1577259816;  // 2019-12-25
+  for (time_t sec = base - 130; sec < base + 130; sec += 7) {
+    EXPECT_EQ(RenderTime(sec, 123456789, 3), ReferenceTime(sec, 123456789, 3));
+  }
+
+  // The cache is re-rendered when going backwards in time or jumping far ahead
+  EXPECT_EQ(RenderTime(0, 0, 3), ReferenceTime(0, 0, 3));
+  EXPECT_EQ(RenderTime(base + 86400 * 400, 999999999, 3), ReferenceTime(base + 86400 * 400, 999999999, 3));
+}
+
+TEST(UlogC, RenderTimeOutOfRange) {
+  // A day into the year 10000 and a year before the year 0, whatever the time zone
+  EXPECT_EQ(RenderTime(253402300800 + 86400, 0, 9).substr(0, 5), "9999-");
+  EXPECT_EQ(RenderTime(-62167219200 - 86400 * 400, 0, 9).substr(0, 5), "0000-");
+  EXPECT_EQ(RenderTime(INT64_MAX, 0, 3), "0000-00-00 00:00:00.000");
+  // The failed conversion is not cached
+  EXPECT_EQ(RenderTime(0, 0, 3), ReferenceTime(0, 0, 3));
+}
+
+TEST(UlogC, RenderTimeFractionDigits) {
+  const time_t sec = 1577259816;
+  EXPECT_EQ(RenderTime(sec, 12345678, 0), ReferenceTime(sec, 12345678, 0));
+  EXPECT_EQ(RenderTime(sec, 12345678, 3), ReferenceTime(sec, 12345678, 3));
+  EXPECT_EQ(RenderTime(sec, 12345678, 6), ReferenceTime(sec, 12345678, 6));
+  EXPECT_EQ(RenderTime(sec, 12345678, 9), ReferenceTime(sec, 12345678, 9));
+}
+
+static long GetTid() {
+#if defined(__APPLE__)
+  return pthread_mach_thread_np(pthread_self());
+#else
+  return syscall(SYS_gettid);
+#endif
+}
+
+// Captures all output written to a C logger instance, the output callback is called from every logging thread
+class CLoggerCapture {
+ public:
+  explicit CLoggerCapture(struct ulog_s *logger) {
+    logger_set_user_data(logger, this);
+    logger_set_output_callback(logger, Callback);
+  }
+  std::string str() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return buf_;
+  }
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buf_.clear();
+  }
+
+ private:
+  std::string buf_;
+  mutable std::mutex mutex_;
+  static int Callback(void *self, const char *s) {
+    auto *capture = static_cast<CLoggerCapture *>(self);
+    std::lock_guard<std::mutex> lock(capture->mutex_);
+    capture->buf_ += s;
+    return static_cast<int>(strlen(s));
+  }
+};
+
+// The header layout rendered with printf, as the logger did before the dedicated header encoder
+static std::string ReferenceHeader(int format, enum ulog_level_e level, uint32_t num, const char *file,
+                                   const char *func, uint32_t line) {
+  static const char *colors[] = {ULOG_STR_WHITE, ULOG_STR_BLUE, ULOG_STR_GREEN,
+                                 ULOG_STR_YELLOW, ULOG_STR_RED, ULOG_STR_PURPLE};
+  static const char *marks[] = {"T", "D", "I", "W", "E", "F"};
+  const bool color = format & ULOG_F_COLOR;
+  char buf[512];
+  std::string out;
+  if (color && (format & (ULOG_F_NUMBER | ULOG_F_TIME | ULOG_F_LEVEL))) out += colors[level];
+  if (format & ULOG_F_NUMBER) {
+    snprintf(buf, sizeof(buf), "#%06" PRIu32 " ", num);
+    out += buf;
+  }
+  if (format & ULOG_F_PROCESS_ID) {
+    snprintf(buf, sizeof(buf), "%d-%ld ", (int)getpid(), GetTid());
+    out += buf;
+  }
+  if (format & ULOG_F_LEVEL) out += marks[level];
+  if (color && (format & (ULOG_F_LEVEL | ULOG_F_FILE_LINE | ULOG_F_FUNCTION))) out += ULOG_STR_GRAY;
+  if (format & ULOG_F_LEVEL) out += " ";
+  if (format & (ULOG_F_FILE_LINE | ULOG_F_FUNCTION)) out += "(";
+  if (format & ULOG_F_FILE_LINE) {
+    snprintf(buf, sizeof(buf), "%s:%" PRIu32, file, line);
+    out += buf;
+  }
+  if (format & ULOG_F_FUNCTION) {
+    if (format & ULOG_F_FILE_LINE) out += " ";
+    out += func;
+  }
+  if (format & (ULOG_F_FILE_LINE | ULOG_F_FUNCTION)) out += ")";
+  if (format & (ULOG_F_LEVEL | ULOG_F_FILE_LINE | ULOG_F_FUNCTION)) out += " ";
+  if (color) out += colors[level];
+  return out;
+}
+
+TEST(UlogC, HeaderLayoutMatchesReference) {
+  struct ulog_s *logger = logger_create();
+  CLoggerCapture cap(logger);
+
+  uint32_t num = 1;
+  for (int format = 0; format < (1 << 7); format++) {
+    if (format & ULOG_F_TIME) continue;  // Not reproducible, covered by RenderTime tests
+    logger_format_disable(logger, 0x7f);
+    logger_format_enable(logger, format);
+
+    for (int level = ULOG_LEVEL_TRACE; level < ULOG_LEVEL_NUMBER; level++) {
+      cap.clear();
+      // clang-format off
+      const uint32_t line = __LINE__; ULOG_OUT_LOG(logger, (enum ulog_level_e)level, "pi = %.3f", 3.14159);
+      // clang-format on
+      // Only numbered logs take a number
+      const uint32_t log_num = (format & ULOG_F_NUMBER) ? num++ : 0;
+      std::string expected = ReferenceHeader(format, (enum ulog_level_e)level, log_num, __FILENAME__, __FUNCTION__,
+                                             line) + "pi = 3.142" + ((format & ULOG_F_COLOR) ? ULOG_STR_RESET : "") +
+                             "\n";
+      EXPECT_EQ(cap.str(), expected) << "format: " << format;
+    }
+  }
+  logger_destroy(&logger);
+}
+
+TEST(UlogC, LongMessageIsTruncated) {
+  struct ulog_s *logger = logger_create();
+  CLoggerCapture cap(logger);
+
+  const std::string message(ULOG_OUTBUF_LEN * 2, 'x');
+  LOGGER_LOCAL_INFO(logger, "%s", message.c_str());
+  EXPECT_EQ(cap.str().size(), ULOG_OUTBUF_LEN - 1);
+  logger_destroy(&logger);
+}
+
+// Output through logger_set_output_reserve_callback(), every commit is recorded
+class CLoggerReserveCapture {
+ public:
+  explicit CLoggerReserveCapture(struct ulog_s *logger) {
+    logger_set_user_data(logger, this);
+    logger_set_output_callback(logger, nullptr);
+    logger_set_output_reserve_callback(logger, Reserve, Commit);
+  }
+  const std::vector<std::string> &lines() const { return lines_; }
+  std::string str() const {
+    std::string out;
+    for (const auto &line : lines_) out += line;
+    return out;
+  }
+  size_t discarded() const { return discarded_; }
+  std::vector<size_t> reserved_sizes;
+  bool full = false;
+
+ private:
+  std::vector<std::string> lines_;
+  std::vector<char> buffer_;
+  size_t discarded_ = 0;
+
+  static void *Reserve(void *self, size_t size) {
+    auto *capture = static_cast<CLoggerReserveCapture *>(self);
+    if (capture->full) return nullptr;
+    capture->reserved_sizes.push_back(size);
+    capture->buffer_.assign(size, '\xff');
+    return capture->buffer_.data();
+  }
+  static void Commit(void *self, void *data, size_t size) {
+    auto *capture = static_cast<CLoggerReserveCapture *>(self);
+    EXPECT_EQ(data, capture->buffer_.data());
+    EXPECT_LE(size, capture->buffer_.size());
+    if (size == 0) {
+      capture->discarded_++;
+    } else {
+      capture->lines_.emplace_back(static_cast<const char *>(data), size);
+    }
+  }
+};
+
+TEST(UlogC, ReserveOutputMatchesOutputCallback) {
+  struct ulog_s *reference = logger_create();
+  struct ulog_s *logger = logger_create();
+  for (struct ulog_s *l : {reference, logger}) {
+    logger_format_disable(l, ULOG_F_TIME);
+    logger_format_enable(l, ULOG_F_NUMBER);
+  }
+  CLoggerCapture reference_cap(reference);
+  CLoggerReserveCapture cap(logger);
+
+  const char data[] = "reserve and commit";
+  for (struct ulog_s *l : {reference, logger}) {
+    // clang-format off
+    LOGGER_LOCAL_INFO(l, "int %d, string %s", 42, "text"); LOGGER_LOCAL_ERROR(l, "no arguments");
+    LOGGER_LOCAL_RAW(l, "raw %d\n", 1); LOGGER_LOCAL_HEX_DUMP(l, data, sizeof(data), 16);
+    // clang-format on
+  }
+  EXPECT_EQ(cap.str(), reference_cap.str());
+  EXPECT_EQ(cap.discarded(), 0u);
+
+  logger_destroy(&reference);
+  logger_destroy(&logger);
+}
+
+TEST(UlogC, ReserveOutputIsNotTruncated) {
+  struct ulog_s *logger = logger_create();
+  logger_format_disable(logger, ULOG_F_TIME | ULOG_F_COLOR);
+  CLoggerReserveCapture cap(logger);
+
+  // The message is measured first: one reservation, nothing discarded
+  const std::string message(ULOG_OUTBUF_LEN * 3, 'x');
+  LOGGER_LOCAL_INFO(logger, "%s", message.c_str());
+  ASSERT_EQ(cap.lines().size(), 1u);
+  EXPECT_EQ(cap.discarded(), 0u);
+  ASSERT_EQ(cap.reserved_sizes.size(), 1u);
+  EXPECT_LE(cap.lines()[0].size(), cap.reserved_sizes[0]);
+  EXPECT_NE(cap.lines()[0].find(message + "\n"), std::string::npos);
+  EXPECT_EQ(cap.lines()[0].find('\0'), std::string::npos);
+
+  // Rejected reservations drop the log
+  cap.full = true;
+  LOGGER_LOCAL_INFO(logger, "dropped");
+  EXPECT_EQ(cap.lines().size(), 1u);
+  logger_destroy(&logger);
+}
+
+// Output through logger_set_output_callback_len() and logger_set_output_callback_v(), every segment is recorded
+class CLoggerSegmentCapture {
+ public:
+  explicit CLoggerSegmentCapture(struct ulog_s *logger, bool vectored) {
+    logger_set_user_data(logger, this);
+    logger_set_output_callback(logger, nullptr);
+    if (vectored) {
+      logger_set_output_callback_v(logger, CallbackV);
+    } else {
+      logger_set_output_callback_len(logger, CallbackLen);
+    }
+  }
+  std::string str() const {
+    std::string out;
+    for (const auto &segments : outputs) {
+      for (const auto &segment : segments) out += segment;
+    }
+    return out;
+  }
+  std::vector<std::vector<std::string>> outputs;
+
+ private:
+  static int CallbackLen(void *self, const char *ptr, size_t len) {
+    EXPECT_EQ(ptr[len], '\0');
+    static_cast<CLoggerSegmentCapture *>(self)->outputs.push_back({std::string(ptr, len)});
+    return static_cast<int>(len);
+  }
+  static int CallbackV(void *self, const struct ulog_iovec_s *iov, int iovcnt) {
+    std::vector<std::string> segments;
+    int len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+      segments.emplace_back(static_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+      len += static_cast<int>(iov[i].iov_len);
+    }
+    static_cast<CLoggerSegmentCapture *>(self)->outputs.push_back(segments);
+    return len;
+  }
+};
+
+TEST(UlogC, LengthAndVectoredOutputMatchOutputCallback) {
+  struct ulog_s *reference = logger_create();
+  struct ulog_s *len_logger = logger_create();
+  struct ulog_s *v_logger = logger_create();
+  for (struct ulog_s *l : {reference, len_logger, v_logger}) {
+    logger_format_disable(l, ULOG_F_TIME);
+    logger_format_enable(l, ULOG_F_NUMBER);
+  }
+  CLoggerCapture reference_cap(reference);
+  CLoggerSegmentCapture len_cap(len_logger, false);
+  CLoggerSegmentCapture v_cap(v_logger, true);
+
+  const char data[] = "vectored output";
+  for (struct ulog_s *l : {reference, len_logger, v_logger}) {
+    // clang-format off
+    LOGGER_LOCAL_INFO(l, "int %d, string %s", 42, "text"); LOGGER_LOCAL_ERROR(l, "no arguments");
+    LOGGER_LOCAL_RAW(l, "raw %d\n", 1); LOGGER_LOCAL_HEX_DUMP(l, data, sizeof(data), 16);
+    // clang-format on
+  }
+  EXPECT_EQ(len_cap.str(), reference_cap.str());
+  EXPECT_EQ(v_cap.str(), reference_cap.str());
+
+  // Log lines are split into header, message and tail, raw output is a single segment
+  ASSERT_GE(v_cap.outputs.size(), 3u);
+  ASSERT_EQ(v_cap.outputs[0].size(), 3u);
+  EXPECT_NE(v_cap.outputs[0][0].find("(ulog_c_test.cc:"), std::string::npos);
+  EXPECT_EQ(v_cap.outputs[0][1], "int 42, string text");
+  EXPECT_EQ(v_cap.outputs[0][2], ULOG_STR_RESET "\n");
+  ASSERT_EQ(v_cap.outputs[2].size(), 1u);
+  EXPECT_EQ(v_cap.outputs[2][0], "raw 1\n");
+
+  logger_destroy(&reference);
+  logger_destroy(&len_logger);
+  logger_destroy(&v_logger);
+}
+
+static std::vector<struct ulog_site_s *> SitesOfLine(uint32_t line) {
+  std::pair<uint32_t, std::vector<struct ulog_site_s *>> match{line, {}};
+  logger_site_foreach(
+      [](void *arg, struct ulog_site_s *site) {
+        auto *m = static_cast<decltype(match) *>(arg);
+        struct ulog_site_info_s info;
+        logger_site_get_info(site, &info);
+        if (info.line == m->first && strcmp(info.file, "ulog_c_test.cc") == 0) m->second.push_back(site);
+      },
+      &match);
+  return match.second;
+}
+
+TEST(UlogC, CallSitesCanBeListedAndDisabled) {
+  struct ulog_s *logger = logger_create();
+  CLoggerCapture cap(logger);
+
+  int evaluated = 0;
+  auto log = [&](int level) {
+    // clang-format off
+    LOGGER_LOCAL_WARN(logger, "warn %d", ++evaluated); ULOG_OUT_LOG(logger, (enum ulog_level_e)level, "%s", "runtime level");
+    // clang-format on
+  };
+  const uint32_t line = __LINE__ - 3;
+
+  // Listed before they are executed
+  std::vector<struct ulog_site_s *> sites = SitesOfLine(line);
+  ASSERT_EQ(sites.size(), 2u);
+  struct ulog_site_info_s info;
+  logger_site_get_info(sites[0], &info);
+  EXPECT_EQ(info.level, ULOG_LEVEL_WARN);
+  EXPECT_STREQ(info.format, "warn %d");
+  EXPECT_NE(std::string(info.func).find("operator()"), std::string::npos);
+  EXPECT_TRUE(info.enabled);
+  logger_site_get_info(sites[1], &info);
+  EXPECT_EQ(info.level, ULOG_LEVEL_NUMBER);
+  EXPECT_STREQ(info.format, "%s");
+
+  log(ULOG_LEVEL_INFO);
+  EXPECT_NE(cap.str().find("warn 1"), std::string::npos);
+  EXPECT_NE(cap.str().find("runtime level"), std::string::npos);
+
+  // A disabled site does not evaluate its arguments
+  logger_site_enable(sites[0], false);
+  cap.clear();
+  log(ULOG_LEVEL_INFO);
+  EXPECT_EQ(evaluated, 1);
+  EXPECT_EQ(cap.str().find("warn"), std::string::npos);
+  EXPECT_NE(cap.str().find("runtime level"), std::string::npos);
+
+  EXPECT_EQ(logger_site_enable_match("ulog_c_test.cc", line, false), 2u);
+  cap.clear();
+  log(ULOG_LEVEL_INFO);
+  EXPECT_TRUE(cap.str().empty());
+
+  EXPECT_GE(logger_site_enable_match("ulog_c_test.cc", 0, true), 2u);
+  cap.clear();
+  log(ULOG_LEVEL_INFO);
+  EXPECT_EQ(evaluated, 2);
+  EXPECT_NE(cap.str().find("warn 2"), std::string::npos);
+  logger_destroy(&logger);
+}
+
+// Collects the "#NNNNNN" numbers of the log lines
+class CLoggerNumberCapture {
+ public:
+  explicit CLoggerNumberCapture(struct ulog_s *logger) {
+    logger_set_user_data(logger, this);
+    logger_set_output_callback(logger, Callback);
+  }
+  std::vector<uint32_t> numbers;
+
+ private:
+  std::mutex mutex_;
+  static int Callback(void *self, const char *s) {
+    auto *capture = static_cast<CLoggerNumberCapture *>(self);
+    std::lock_guard<std::mutex> lock(capture->mutex_);
+    const char *number = strchr(s, '#');
+    if (number) capture->numbers.push_back(static_cast<uint32_t>(strtoul(number + 1, nullptr, 10)));
+    return static_cast<int>(strlen(s));
+  }
+};
+
+TEST(UlogC, LogNumbering) {
+  struct ulog_s *logger = logger_create();
+  logger_format_disable(logger, 0x7f);
+  CLoggerNumberCapture numbers(logger);
+
+  // The counter is not touched while numbering is disabled
+  LOGGER_LOCAL_INFO(logger, "not numbered");
+  EXPECT_EQ(logger_get_log_count(logger), 0u);
+  EXPECT_TRUE(numbers.numbers.empty());
+
+  logger_format_enable(logger, ULOG_F_NUMBER);
+  for (int i = 0; i < 3; i++) LOGGER_LOCAL_INFO(logger, "numbered");
+  EXPECT_EQ(numbers.numbers, (std::vector<uint32_t>{1, 2, 3}));
+
+  // Striped numbers are unique
+  logger_set_number_mode(logger, ULOG_NUMBER_STRIPED);
+  numbers.numbers.clear();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; t++) {
+    threads.emplace_back([logger] {
+      for (int i = 0; i < 1000; i++) LOGGER_LOCAL_INFO(logger, "striped");
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  EXPECT_EQ(std::set<uint32_t>(numbers.numbers.begin(), numbers.numbers.end()).size(), 8000u);
+  EXPECT_EQ(logger_get_log_count(logger), 8003u);
+  logger_destroy(&logger);
+}
+
+TEST(UlogC, ThreadContext) {
+  char expected[64];
+  snprintf(expected, sizeof(expected), "%d-%ld ", (int)getpid(), GetTid());
+  char rendered[ULOG_PROCESS_ID_STR_MAX];
+  EXPECT_EQ(std::string(rendered, logger_render_process_id(logger_thread_id(), rendered)), expected);
+  EXPECT_EQ(logger_thread_id(), GetTid());
+
+  // Other threads are rendered from the thread id
+  snprintf(expected, sizeof(expected), "%d-12345 ", (int)getpid());
+  EXPECT_EQ(std::string(rendered, logger_render_process_id(12345, rendered)), expected);
+
+#if defined(__linux__)
+  std::thread([] {
+    pthread_setname_np(pthread_self(), "ulog-named");
+    logger_refresh_thread_context();
+    EXPECT_STREQ(logger_thread_name(), "ulog-named");
+  }).join();
+#endif
+}
+
+TEST(UlogC, ThreadContextIsRefreshedAfterFork) {
+  struct ulog_s *logger = logger_create();
+  logger_format_disable(logger, 0x7f);
+  logger_format_enable(logger, ULOG_F_PROCESS_ID);
+  CLoggerCapture cap(logger);
+  LOGGER_LOCAL_INFO(logger, "parent");  // The context of this thread is cached
+
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  const pid_t child = fork();
+  ASSERT_GE(child, 0);
+  if (child == 0) {
+    cap.clear();
+    LOGGER_LOCAL_INFO(logger, "child");
+    (void)!write(fds[1], cap.str().data(), cap.str().size());
+    _exit(0);
+  }
+  close(fds[1]);
+  char buf[128] = {};
+  (void)!read(fds[0], buf, sizeof(buf) - 1);
+  close(fds[0]);
+  waitpid(child, nullptr, 0);
+
+  // The forking thread is the main thread of the child
+  char expected[64];
+  snprintf(expected, sizeof(expected), "%d-%d child\n", (int)child, (int)child);
+  EXPECT_STREQ(buf, expected);
+  logger_destroy(&logger);
+}
+
+// Redirects stdout into a pipe
+class StdoutPipe {
+ public:
+  StdoutPipe() {
+    fflush(stdout);
+    saved_ = dup(STDOUT_FILENO);
+    if (pipe(fds_) == 0) dup2(fds_[1], STDOUT_FILENO);
+  }
+  ~StdoutPipe() {
+    dup2(saved_, STDOUT_FILENO);
+    close(saved_);
+    close(fds_[0]);
+    close(fds_[1]);
+  }
+  // Read what is available within timeout_ms
+  std::string Read(int timeout_ms) {
+    std::string out;
+    struct pollfd pfd = {fds_[0], POLLIN, 0};
+    char buf[4096];
+    while (poll(&pfd, 1, timeout_ms) > 0) {
+      const ssize_t n = read(fds_[0], buf, sizeof(buf));
+      if (n <= 0) break;
+      out.append(buf, n);
+      timeout_ms = 0;
+    }
+    return out;
+  }
+
+ private:
+  int saved_;
+  int fds_[2];
+};
+
+TEST(UlogC, ConsoleOutput) {
+  struct ulog_s *logger = logger_create();
+  logger_format_disable(logger, 0x7f);
+  logger_set_output_callback_len(logger, logger_console_output);
+  logger_set_flush_callback(logger, logger_console_flush);
+  StdoutPipe out;
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([logger, t] {
+      for (int i = 0; i < 100; i++) LOGGER_LOCAL_INFO(logger, "%d %d", t, i);
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  logger_console_flush(nullptr);
+
+  // The lines of each thread are complete and in order
+  std::string lines = out.Read(1000);
+  int next[4] = {0, 0, 0, 0};
+  int t, i, n;
+  for (const char *p = lines.c_str(); sscanf(p, "%d %d\n%n", &t, &i, &n) == 2; p += n) {
+    ASSERT_TRUE(t >= 0 && t < 4);
+    EXPECT_EQ(i, next[t]++);
+  }
+  for (int count : next) EXPECT_EQ(count, 100);
+
+  // Buffered lines are written after ULOG_CONSOLE_FLUSH_MS without a flush
+  LOGGER_LOCAL_INFO(logger, "idle");
+  EXPECT_EQ(out.Read(2000), "idle\n");
+
+  // FATAL logs flush the buffers
+  LOGGER_LOCAL_FATAL(logger, "fatal");
+  EXPECT_EQ(out.Read(0), "fatal\n");
+  logger_destroy(&logger);
+}
+
+TEST(UlogC, ConsoleLongLinesAreNotInterleaved) {
+  struct ulog_s *logger = logger_create();
+  logger_format_disable(logger, 0x7f);
+  logger_set_output_callback_len(logger, logger_console_output);
+  StdoutPipe out;
+
+  // Lines of 900 bytes overflow the batch every few lines, while the pipe is drained concurrently
+  std::atomic<bool> done{false};
+  std::string lines;
+  std::thread reader([&] {
+    while (!done) lines += out.Read(10);
+  });
+  const std::string padding(890, '.');
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < 200; i++) LOGGER_LOCAL_INFO(logger, "%d %03d %s", t, i, padding.c_str());
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  logger_console_flush(nullptr);
+  done = true;
+  reader.join();
+  lines += out.Read(100);
+
+  int next[4] = {0, 0, 0, 0};
+  std::istringstream stream(lines);
+  for (std::string line; std::getline(stream, line);) {
+    int t, i;
+    ASSERT_EQ(sscanf(line.c_str(), "%d %d", &t, &i), 2) << line.substr(0, 32);
+    ASSERT_TRUE(t >= 0 && t < 4);
+    EXPECT_EQ(i, next[t]++);
+    EXPECT_EQ(line.size(), 6 + padding.size());
+  }
+  for (int count : next) EXPECT_EQ(count, 200);
+  logger_destroy(&logger);
+}
+
+// "hexdump -C" layout rendered with printf, as the logger did before the dedicated encoder
+static std::string ReferenceHexDump(const uint8_t *data, size_t length, size_t width, uintptr_t base_address) {
+  std::string out;
+  char buf[32];
+  size_t offset = 0;
+  while (offset < length) {
+    snprintf(buf, sizeof(buf), "%08" PRIxPTR "  ", offset + base_address);
+    out += buf;
+    const size_t count = length - offset < width ? length - offset : width;
+    for (size_t i = 0; i < width; i++) {
+      if (i < count)
+        snprintf(buf, sizeof(buf), "%02" PRIx8 " %s", data[offset + i], i == width / 2 - 1 ? " " : "");
+      else
+        snprintf(buf, sizeof(buf), "   %s", i == width / 2 - 1 ? " " : "");
+      out += buf;
+    }
+    out += " |";
+    for (size_t i = 0; i < count; i++) out += isprint(data[offset + i]) ? (char)data[offset + i] : '.';
+    out += "|\n";
+    offset += count;
+  }
+  snprintf(buf, sizeof(buf), "%08" PRIxPTR "\n", length + base_address);
+  return out + buf;
+}
+
+TEST(UlogC, HexDumpMatchesReference) {
+  struct ulog_s *logger = logger_create();
+  CLoggerCapture cap(logger);
+
+  std::vector<uint8_t> data(4096);
+  for (size_t i = 0; i < data.size(); i++) data[i] = static_cast<uint8_t>(i * 7919 + (i >> 8));
+
+  for (size_t width : {1, 2, 3, 7, 8, 15, 16, 17, 32, 100, 300}) {
+    for (size_t length : {0, 1, 5, 8, 16, 31, 33, 1000, 4096}) {
+      for (uintptr_t base : {(uintptr_t)0, (uintptr_t)0xfffffff0, (uintptr_t)data.data()}) {
+        cap.clear();
+        EXPECT_EQ(logger_hex_dump(logger, data.data(), length, width, base, true), base + length);
+        EXPECT_EQ(cap.str(), ReferenceHexDump(data.data(), length, width, base))
+            << "width: " << width << ", length: " << length;
+      }
+    }
+  }
+  logger_destroy(&logger);
+}
+
+TEST(UlogC, HexDumpIsBatched) {
+  struct ulog_s *logger = logger_create();
+  CLoggerSegmentCapture cap(logger, false);
+
+  std::vector<uint8_t> data(64 * 1024, 0x5a);
+  logger_hex_dump(logger, data.data(), data.size(), 16, 0, true);
+  // 4096 lines of 79 bytes and the tail address
+  EXPECT_EQ(cap.str().size(), 4096u * 79 + 9);
+  EXPECT_LT(cap.outputs.size(), 4096u / 8);
+  for (const auto &output : cap.outputs) EXPECT_LT(output[0].size(), (size_t)ULOG_OUTBUF_LEN);
+  logger_destroy(&logger);
+}
+
+static std::string TokenDouble(double value) {
+  struct ulog_buffer_s buffer;
+  logger_buffer_init(&buffer);
+  logger_token_double(&buffer, false, "v", value);
+  return std::string(buffer.log_out_buf_ + strlen("v => "), buffer.cur_buf_ptr_);
+}
+
+static std::string TokenFloat(float value) {
+  struct ulog_buffer_s buffer;
+  logger_buffer_init(&buffer);
+  logger_token_float(&buffer, false, "v", value);
+  return std::string(buffer.log_out_buf_ + strlen("v => "), buffer.cur_buf_ptr_);
+}
+
+// Fewest "%.*g" digits that read back, the reference for the length of the shortest representation
+static size_t ShortestDigits(double value, bool single) {
+  for (int precision = 1;; precision++) {
+    char str[64];
+    snprintf(str, sizeof(str), "%.*g", precision, value);
+    if (single ? strtof(str, nullptr) == (float)value : strtod(str, nullptr) == value) return precision;
+  }
+}
+
+static std::string PrintShortest(double value, bool single) {
+  char str[64];
+  snprintf(str, sizeof(str), "%.*g", (int)ShortestDigits(value, single), value);
+  return str;
+}
+
+// Digits of the mantissa without leading and trailing zeros, e.g. 1 for "0.01" and "100"
+static size_t SignificantDigits(const std::string &str) {
+  std::string digits;
+  for (const char c : str.substr(0, str.find('e'))) {
+    if (isdigit((unsigned char)c)) digits += c;
+  }
+  const size_t begin = digits.find_first_not_of('0');
+  if (begin == std::string::npos) return 1;
+  return digits.find_last_not_of('0') - begin + 1;
+}
+
+TEST(UlogC, TokenFloatingPointIsShortestRoundTrip) {
+  EXPECT_EQ(TokenDouble(0), "0");
+  EXPECT_EQ(TokenDouble(-0.0), "-0");
+  EXPECT_EQ(TokenDouble(42), "42");
+  EXPECT_EQ(TokenDouble(0.1), "0.1");
+  EXPECT_EQ(TokenDouble(-3.14), "-3.14");
+  EXPECT_EQ(TokenDouble(1.0 / 3), "0.3333333333333333");
+  EXPECT_EQ(TokenDouble(1e300), "1e+300");
+  EXPECT_EQ(TokenDouble(1e-10), "1e-10");
+  EXPECT_EQ(TokenDouble(1.5e15), "1.5e+15");
+  EXPECT_EQ(TokenDouble(1e14), "1e+14");
+  EXPECT_EQ(TokenDouble(99999999999999.0), "99999999999999");
+  EXPECT_EQ(TokenDouble(0.0001), "0.0001");
+  EXPECT_EQ(TokenDouble(5e-324), "5e-324");
+  EXPECT_EQ(TokenDouble(INFINITY), "inf");
+  EXPECT_EQ(TokenDouble(-INFINITY), "-inf");
+  EXPECT_EQ(TokenDouble(NAN), "nan");
+  EXPECT_EQ(TokenFloat(0.1f), "0.1");
+  EXPECT_EQ(TokenFloat(3.14159265f), "3.1415927");
+  EXPECT_EQ(TokenFloat(1e30f), "1e+30");
+  EXPECT_EQ(TokenFloat(123456.0f), "123456");
+  EXPECT_EQ(TokenFloat(1e-10f), "1e-10");
+
+  uint64_t seed = 0x9e3779b97f4a7c15;
+  for (int i = 0; i < 20000; i++) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    // Random bit patterns cover every exponent, scaled integers cover the fixed-point values
+    double value;
+    uint64_t bits = seed;
+    memcpy(&value, &bits, sizeof(value));
+    if (i % 3 == 1) value = (double)(int64_t)(seed >> 20) / pow(10, (double)(seed % 12));
+    if (i % 3 == 2) value = pow(10, (double)(seed >> 11) / 9007199254740992.0 * 20 - 5);  // 1e-5..1e15
+    if (!std::isfinite(value)) continue;
+
+    const std::string str = TokenDouble(value);
+    EXPECT_EQ(strtod(str.c_str(), nullptr), value) << str;
+    EXPECT_EQ(SignificantDigits(str), ShortestDigits(value, false)) << str;
+    // In fixed-point notation where "%g" uses it for the longest numbers, as "%g" outside
+    if (fabs(value) >= 1e-4 && fabs(value) < 1e14) {
+      EXPECT_EQ(str.find('e'), std::string::npos) << str;
+    } else {
+      EXPECT_EQ(str, PrintShortest(value, false));
+    }
+
+    const float single = (float)value;
+    if (!std::isfinite(single)) continue;
+    const std::string single_str = TokenFloat(single);
+    EXPECT_EQ(strtof(single_str.c_str(), nullptr), single) << single_str;
+    EXPECT_EQ(SignificantDigits(single_str), ShortestDigits(single, true)) << single_str;
+    if (fabsf(single) >= 1e-4f && fabsf(single) < 1e5f) {
+      EXPECT_EQ(single_str.find('e'), std::string::npos) << single_str;
+    } else {
+      EXPECT_EQ(single_str, PrintShortest(single, true));
+    }
+  }
+}
+
+TEST(UlogC, TokensAreWrittenIntoTheLogLine) {
+  struct ulog_s *logger = logger_create();
+  CLoggerCapture cap(logger);
+  logger_format_disable(logger, 0x7f);
+
+  const int negative = -42;
+  const unsigned long long big = UINT64_MAX;
+  const long long small = INT64_MIN;
+  const char *text = "ulog";
+  const char *null_text = nullptr;
+  const float pi = 3.14159265f;
+  LOGGER_LOCAL_TOKEN(logger, negative);
+  LOGGER_LOCAL_MULTI_TOKEN(logger, big, small, text, null_text, pi, 0.5);
+  EXPECT_EQ(cap.str(),
+            "negative => -42\n"
+            "big => 18446744073709551615, small => -9223372036854775808, text => \"ulog\", null_text => \"\", "
+            "pi => 3.1415927, 0.5 => 0.5\n");
+
+  cap.clear();
+  char expected[64];
+  snprintf(expected, sizeof(expected), "&pi => %p\n", (const void *)&pi);
+  LOGGER_LOCAL_TOKEN(logger, &pi);
+  EXPECT_EQ(cap.str(), expected);
+
+  // The tokens are not evaluated if the level is not output
+  cap.clear();
+  int evaluated = 0;
+  logger_set_output_level(logger, ULOG_LEVEL_INFO);
+  LOGGER_LOCAL_MULTI_TOKEN(logger, ++evaluated, ++evaluated);
+  EXPECT_EQ(evaluated, 0);
+  EXPECT_EQ(cap.str(), "");
+  logger_set_output_level(logger, ULOG_LEVEL_TRACE);
+
+  // The header and the tail are rendered around the tokens
+  cap.clear();
+  logger_format_enable(logger, ULOG_F_COLOR | ULOG_F_LEVEL);
+  LOGGER_LOCAL_MULTI_TOKEN(logger, negative, negative);
+  EXPECT_EQ(cap.str(), ReferenceHeader(ULOG_F_COLOR | ULOG_F_LEVEL, ULOG_LEVEL_DEBUG, 0, "", "", 0) +
+                           ULOG_STR_BLUE "negative " ULOG_STR_RED "=> " ULOG_STR_GREEN "-42" ULOG_STR_RED
+                           ", " ULOG_STR_BLUE "negative " ULOG_STR_RED "=> " ULOG_STR_GREEN "-42" ULOG_STR_RESET
+                           ULOG_STR_RESET "\n");
+  logger_destroy(&logger);
+}
+
+TEST(UlogC, StructuredLogFields) {
+  struct ulog_s *logger = logger_create();
+  CLoggerCapture cap(logger);
+  logger_format_disable(logger, 0x7f);
+
+  const int64_t id = -1042;
+  const unsigned qty = 300;
+  const double px = 101.25;
+  const char *side = "buy limit";
+  LOGGER_LOCAL_INFO_KV(logger, "order filled", ULOG_KV("id", id), ULOG_KV("qty", qty), ULOG_KV("px", px),
+                       ULOG_KV("side", side), ULOG_KV("ioc", false), ULOG_KV("venue", "X"));
+  EXPECT_EQ(cap.str(), "order filled id=-1042 qty=300 px=101.25 side=\"buy limit\" ioc=false venue=X\n");
+
+  // Values are quoted and escaped when needed
+  cap.clear();
+  const char *null_text = nullptr;
+  LOGGER_LOCAL_INFO_KV(logger, "quoting", ULOG_KV("empty", ""), ULOG_KV("null", null_text),
+                       ULOG_KV("eq", "a=b"), ULOG_KV("esc", "\"q\" \\ \n\x01"));
+  EXPECT_EQ(cap.str(), "quoting empty=\"\" null=\"\" eq=\"a=b\" esc=\"\\\"q\\\" \\\\ \\n\\u0001\"\n");
+
+  cap.clear();
+  logger_set_kv_format(logger, ULOG_KV_JSON);
+  LOGGER_LOCAL_WARN_KV(logger, "order filled", ULOG_KV("id", id), ULOG_KV("px", px), ULOG_KV("side", side),
+                       ULOG_KV("ioc", true), ULOG_KV("nan", NAN), ULOG_KV("k\"ey", "\t"));
+  EXPECT_EQ(cap.str(),
+            "order filled {\"id\":-1042,\"px\":101.25,\"side\":\"buy limit\",\"ioc\":true,\"nan\":null,"
+            "\"k\\\"ey\":\"\\t\"}\n");
+
+  // The fields are not evaluated if the level is not output
+  cap.clear();
+  int evaluated = 0;
+  logger_set_output_level(logger, ULOG_LEVEL_INFO);
+  LOGGER_LOCAL_DEBUG_KV(logger, "filtered", ULOG_KV("n", ++evaluated));
+  EXPECT_EQ(evaluated, 0);
+  EXPECT_EQ(cap.str(), "");
+  logger_set_output_level(logger, ULOG_LEVEL_TRACE);
+
+  // The header and the tail are rendered around the message and the fields
+  cap.clear();
+  logger_set_kv_format(logger, ULOG_KV_LOGFMT);
+  logger_format_enable(logger, ULOG_F_COLOR | ULOG_F_LEVEL);
+  LOGGER_LOCAL_DEBUG_KV(logger, "colored", ULOG_KV("n", 1));
+  EXPECT_EQ(cap.str(), ReferenceHeader(ULOG_F_COLOR | ULOG_F_LEVEL, ULOG_LEVEL_DEBUG, 0, "", "", 0) +
+                           "colored n=1" ULOG_STR_RESET "\n");
+  logger_destroy(&logger);
+}
+
+TEST(UlogC, StructuredRecordEncoding) {
+  const std::string long_value(ULOG_OUTBUF_LEN, 'v');
+  const struct ulog_kv_s fields[] = {
+      logger_kv_int("i", INT64_MIN),
+      logger_kv_uint("u", UINT64_MAX),
+      logger_kv_double("d", -0.1),
+      logger_kv_bool("b", true),
+      logger_kv_string_len("s", "a\0b", 3),
+      logger_kv_string("long", long_value.c_str()),  // Does not fit, left out
+      logger_kv_int("small", 1),
+  };
+  uint8_t record[ULOG_OUTBUF_LEN];
+  const size_t len = logger_kv_encode(fields, sizeof(fields) / sizeof(fields[0]), record, sizeof(record));
+  // Type, key length, key and value: INT64_MIN and UINT64_MAX take 10 bytes, a small integer 1
+  EXPECT_EQ(len, 13u + 13u + 11u + 4u + 7u + 8u);
+
+  const void *pos = record;
+  struct ulog_kv_s field;
+  ASSERT_TRUE(logger_kv_next(&pos, record + len, &field));
+  EXPECT_EQ(std::string(field.key, field.key_len), "i");
+  EXPECT_EQ(field.type, ULOG_KV_INT);
+  EXPECT_EQ(field.value.i, INT64_MIN);
+  ASSERT_TRUE(logger_kv_next(&pos, record + len, &field));
+  EXPECT_EQ(field.type, ULOG_KV_UINT);
+  EXPECT_EQ(field.value.u, UINT64_MAX);
+  ASSERT_TRUE(logger_kv_next(&pos, record + len, &field));
+  EXPECT_EQ(field.type, ULOG_KV_DOUBLE);
+  EXPECT_EQ(field.value.d, -0.1);
+  ASSERT_TRUE(logger_kv_next(&pos, record + len, &field));
+  EXPECT_EQ(field.type, ULOG_KV_BOOL);
+  EXPECT_TRUE(field.value.b);
+  ASSERT_TRUE(logger_kv_next(&pos, record + len, &field));
+  EXPECT_EQ(field.type, ULOG_KV_STRING);
+  EXPECT_EQ(std::string(field.value.str.ptr, field.value.str.len), std::string("a\0b", 3));
+  ASSERT_TRUE(logger_kv_next(&pos, record + len, &field));
+  EXPECT_EQ(std::string(field.key, field.key_len), "small");
+  EXPECT_EQ(field.value.i, 1);
+  EXPECT_FALSE(logger_kv_next(&pos, record + len, &field));
+
+  // A cut record ends at the last whole field
+  pos = record;
+  EXPECT_TRUE(logger_kv_next(&pos, record + 18, &field));
+  EXPECT_FALSE(logger_kv_next(&pos, record + 18, &field));
+
+  // The fields that do not fit the text are left out whole
+  char text[24];
+  EXPECT_EQ(logger_kv_render(record, len, ULOG_KV_LOGFMT, text, sizeof(text)), 23u);
+  EXPECT_STREQ(text, " i=-9223372036854775808");
+  EXPECT_EQ(logger_kv_render(record, len, ULOG_KV_JSON, text, sizeof(text)), 3u);
+  EXPECT_STREQ(text, " {}");
+}
+
+struct KvCapture {
+  std::string line;
+  std::vector<std::string> fields;
+
+  static int Callback(void *self, const char *str, size_t len, const void *fields, size_t fields_len) {
+    auto *capture = static_cast<KvCapture *>(self);
+    capture->line.assign(str, len);
+    capture->fields.clear();
+    const void *pos = fields;
+    struct ulog_kv_s field;
+    while (logger_kv_next(&pos, static_cast<const uint8_t *>(fields) + fields_len, &field))
+      capture->fields.emplace_back(field.key, field.key_len);
+    return static_cast<int>(len);
+  }
+};
+
+TEST(UlogC, StructuredOutputCallback) {
+  struct ulog_s *logger = logger_create();
+  logger_format_disable(logger, 0x7f);
+  KvCapture cap;
+  logger_set_user_data(logger, &cap);
+  // Structured logs only need the structured output callback
+  logger_set_output_kv_callback(logger, KvCapture::Callback);
+
+  LOGGER_LOCAL_INFO_KV(logger, "order filled", ULOG_KV("id", 7), ULOG_KV("px", 1.5));
+  EXPECT_EQ(cap.line, "order filled\n");
+  EXPECT_EQ(cap.fields, (std::vector<std::string>{"id", "px"}));
+  logger_destroy(&logger);
+}
+
+static bool FindProfile(const char *name, struct ulog_profile_info_s *found) {
+  struct Search {
+    const char *name;
+    struct ulog_profile_info_s *found;
+    bool ok;
+  } search = {name, found, false};
+  logger_profile_foreach(
+      [](void *arg, const struct ulog_profile_info_s *info) {
+        auto *search = static_cast<Search *>(arg);
+        if (strcmp(info->name, search->name) == 0) {
+          *search->found = *info;
+          search->ok = true;
+        }
+      },
+      &search);
+  return search.ok;
+}
+
+TEST(UlogC, ProfileStatistics) {
+  struct ulog_s *logger = logger_create();
+  CLoggerCapture cap(logger);
+  logger_format_disable(logger, 0x7f);
+  logger_profile_set_report_interval(0);
+
+  // Known durations: 90 x 100 ns and 10 x 10 us
+  static struct ulog_profile_site_s site = ULOG_PROFILE_SITE_INIT("known durations");
+  for (int i = 0; i < 100; i++) logger_profile_record(logger, &site, 1000, 1000 + (i < 90 ? 100 : 10000));
+
+  struct ulog_profile_info_s info;
+  ASSERT_TRUE(FindProfile("known durations", &info));
+  EXPECT_STREQ(info.file, "ulog_c_test.cc");
+  EXPECT_EQ(info.count, 100u);
+  EXPECT_EQ(info.sum_ns, 90u * 100 + 10u * 10000);
+  EXPECT_EQ(info.min_ns, 100u);
+  EXPECT_EQ(info.max_ns, 10000u);
+  EXPECT_EQ(info.p50_ns, 111u);  // Largest value of the bucket [96, 111]
+  EXPECT_EQ(info.p90_ns, 111u);
+  EXPECT_EQ(info.p99_ns, 10000u);  // Bucket [8192, 10239], limited to the maximum
+  EXPECT_EQ(cap.str(), "");
+
+  // Only executed locations are output, the statistics restart after a summary
+  logger_profile_report();
+  EXPECT_EQ(cap.str().find("profile \"known durations\": count=100 avg=1090ns min=100ns p50=111ns p90=111ns "
+                           "p99=10000ns max=10000ns ("),
+            0u);
+  ASSERT_TRUE(FindProfile("known durations", &info));
+  EXPECT_EQ(info.count, 0u);
+
+  cap.clear();
+  logger_profile_report();
+  EXPECT_EQ(cap.str().find("known durations"), std::string::npos);
+
+  logger_profile_set_report_interval(ULOG_PROFILE_REPORT_MS);
+  logger_destroy(&logger);
+}
+
+TEST(UlogC, ProfileMergesThreadSlots) {
+  struct ulog_s *logger = logger_create();
+  CLoggerCapture cap(logger);
+  logger_format_disable(logger, 0x7f);
+  logger_profile_set_report_interval(0);
+
+  // Every thread has its own slot, thread t records 1000 x (t + 1) * 100 ns
+  static struct ulog_profile_site_s site = ULOG_PROFILE_SITE_INIT("thread slots");
+  constexpr int kThreads = 16;
+  constexpr int kIterations = 1000;
+  for (int round = 0; round < 2; round++) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+      threads.emplace_back([&, t] {
+        for (int i = 0; i < kIterations; i++) logger_profile_record(logger, &site, 0, (t + 1) * 100);
+      });
+    }
+    for (auto &thread : threads) thread.join();
+
+    // The slots of exited threads are merged, and restart after a summary
+    struct ulog_profile_info_s info;
+    ASSERT_TRUE(FindProfile("thread slots", &info));
+    EXPECT_EQ(info.count, (uint64_t)kThreads * kIterations);
+    EXPECT_EQ(info.sum_ns, (uint64_t)kIterations * 100 * kThreads * (kThreads + 1) / 2);
+    EXPECT_EQ(info.min_ns, 100u);
+    EXPECT_EQ(info.max_ns, (uint64_t)kThreads * 100);
+    logger_profile_report();
+    ASSERT_TRUE(FindProfile("thread slots", &info));
+    EXPECT_EQ(info.count, 0u);
+  }
+
+  logger_profile_set_report_interval(ULOG_PROFILE_REPORT_MS);
+  logger_destroy(&logger);
+}
+
+TEST(UlogC, ProfileScopeAcrossThreads) {
+  struct ulog_s *logger = logger_create();
+  CLoggerCapture cap(logger);
+  logger_format_disable(logger, 0x7f);
+  logger_profile_set_report_interval(0);
+
+  constexpr int kThreads = 4;
+  constexpr int kIterations = 10000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < kIterations; i++) {
+        LOGGER_LOCAL_PROFILE_SCOPE(logger, "scope");
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+
+  uint64_t elapsed_ns = LOGGER_LOCAL_PROFILE_CODE(logger, "code", usleep(1000));
+  EXPECT_GE(elapsed_ns, 1000000u);
+
+  struct ulog_profile_info_s info;
+  ASSERT_TRUE(FindProfile("scope", &info));
+  EXPECT_EQ(info.count, (uint64_t)kThreads * kIterations);
+  EXPECT_LE(info.min_ns, info.p50_ns);
+  EXPECT_LE(info.p50_ns, info.p90_ns);
+  EXPECT_LE(info.p90_ns, info.p99_ns);
+  EXPECT_LE(info.p99_ns, info.max_ns);
+  ASSERT_TRUE(FindProfile("code", &info));
+  EXPECT_EQ(info.count, 1u);
+  EXPECT_EQ(info.min_ns, elapsed_ns);
+  EXPECT_EQ(info.max_ns, elapsed_ns);
+  logger_profile_report();  // Restart the statistics for the next test
+
+  // A summary is output by the first execution after the interval
+  cap.clear();
+  logger_profile_set_report_interval(1);
+  for (int i = 0; i < 3; i++) {
+    LOGGER_LOCAL_PROFILE_CODE(logger, "interval", usleep(2000));
+  }
+  EXPECT_NE(cap.str().find("profile \"interval\": count="), std::string::npos);
+
+  logger_profile_set_report_interval(ULOG_PROFILE_REPORT_MS);
+  logger_destroy(&logger);
+}
+
+TEST(UlogC, RateLimitedLogs) {
+  struct ulog_s *logger = logger_create();
+  CLoggerCapture cap(logger);
+  logger_format_disable(logger, 0x7f);
+
+  // The suppressed logs are not formatted, their number is appended to the next log
+  int formatted = 0;
+  for (int i = 0; i < 10; i++) LOGGER_LOCAL_INFO_EVERY_N(logger, 4, "every 4: %d", (formatted++, i));
+  EXPECT_EQ(cap.str(), "every 4: 0\nevery 4: 4 [suppressed 3]\nevery 4: 8 [suppressed 3]\n");
+  EXPECT_EQ(formatted, 3);
+
+  // Each call site has its own limit
+  cap.clear();
+  for (int i = 0; i < 3; i++) {
+    LOGGER_LOCAL_WARN_EVERY_MS(logger, 60000, "first site %d", i);
+    LOGGER_LOCAL_WARN_EVERY_MS(logger, 60000, "second site %d", i);
+  }
+  EXPECT_EQ(cap.str(), "first site 0\nsecond site 0\n");
+
+  cap.clear();
+  for (int i = 0; i < 3; i++) {
+    LOGGER_LOCAL_ERROR_EVERY_MS(logger, 1, "interval %d", i);
+    usleep(2000);
+  }
+  EXPECT_EQ(cap.str(), "interval 0\ninterval 1\ninterval 2\n");
+
+  // A burst of 3, then one log per 10 ms
+  cap.clear();
+  for (int i = 0; i < 10; i++) LOGGER_LOCAL_DEBUG_RATE(logger, 100, 3, "rate %d", i);
+  EXPECT_EQ(cap.str(), "rate 0\nrate 1\nrate 2\n");
+  cap.clear();
+  usleep(20000);
+  for (int i = 0; i < 2; i++) {
+    LOGGER_LOCAL_DEBUG_RATE(logger, 100, 3, "refilled %d", i);
+  }
+  EXPECT_EQ(cap.str().find("refilled 0\n"), 0u);
+
+  // Disabled levels are not counted
+  cap.clear();
+  logger_set_output_level(logger, ULOG_LEVEL_ERROR);
+  for (int i = 0; i < 4; i++) {
+    LOGGER_LOCAL_INFO_EVERY_N(logger, 2, "hidden %d", i);
+    LOGGER_LOCAL_ERROR_EVERY_N(logger, 2, "shown %d", i);
+  }
+  EXPECT_EQ(cap.str(), "shown 0\nshown 2 [suppressed 1]\n");
+
+  // A disabled level takes no token of the limit
+  cap.clear();
+  const auto limited = [&](int i) { LOGGER_LOCAL_INFO_RATE(logger, 1, 1, "limited %d", i); };
+  for (int i = 0; i < 3; i++) limited(i);
+  logger_set_output_level(logger, ULOG_LEVEL_TRACE);
+  limited(3);
+  EXPECT_EQ(cap.str(), "limited 3\n");
+  logger_destroy(&logger);
+}
+
+TEST(UlogC, RateLimitAcrossThreads) {
+  struct ulog_s *logger = logger_create();
+  CLoggerCapture cap(logger);
+  logger_format_disable(logger, 0x7f);
+
+  // Every call is either output or counted in the next output
+  constexpr int kThreads = 4;
+  constexpr int kIterations = 10000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < kIterations; i++) LOGGER_LOCAL_INFO_EVERY_N(logger, 100, "shared");
+    });
+  }
+  for (auto &thread : threads) thread.join();
+
+  uint64_t outputs = 0, suppressed = 0;
+  std::istringstream lines(cap.str());
+  for (std::string line; std::getline(lines, line);) {
+    if (line.find("shared") != 0) continue;
+    outputs++;
+    unsigned long long n = 0;
+    if (sscanf(line.c_str(), "shared [suppressed %llu]", &n) == 1) suppressed += n;
+  }
+  EXPECT_EQ(outputs, (uint64_t)kThreads * kIterations / 100);
+  EXPECT_LE(suppressed, (uint64_t)kThreads * kIterations - outputs);
+  EXPECT_GE(suppressed, (uint64_t)kThreads * kIterations - outputs - 99);
+  logger_destroy(&logger);
+}
+
+TEST(UlogC, RepeatedLogsAreCollapsed) {
+  struct ulog_s *logger = logger_create();
+  CLoggerCapture cap(logger);
+  logger_format_disable(logger, 0x7f);
+  logger_set_repeat_filter(logger, 60000);
+
+  // Only the location and the message are compared, the repetitions take no number
+  logger_format_enable(logger, ULOG_F_NUMBER);
+  for (int i = 0; i < 5; i++) LOGGER_LOCAL_ERROR(logger, "disk full");
+  LOGGER_LOCAL_ERROR(logger, "disk %s", "full");  // Another location
+  for (int i = 0; i < 4; i++) LOGGER_LOCAL_ERROR(logger, "value %d", i < 2 ? i : 2);
+  EXPECT_EQ(cap.str(),
+            "#000001 disk full\n"
+            "#000002 last message repeated 4 times\n"
+            "#000003 disk full\n"
+            "#000004 value 0\n"
+            "#000005 value 1\n"
+            "#000006 value 2\n");
+  logger_format_disable(logger, ULOG_F_NUMBER);
+
+  // A pending count is output when the filter is changed
+  cap.clear();
+  logger_set_repeat_filter(logger, 1);
+  EXPECT_EQ(cap.str(), "last message repeated 1 times\n");
+
+  // A run is summarized by the timer after the timeout, the next repetition starts another run
+  cap.clear();
+  for (int i = 0; i < 6; i++) {
+    LOGGER_LOCAL_WARN(logger, "storm");
+    if (i % 2) usleep(150000);
+  }
+  logger_set_repeat_filter(logger, 0);
+  std::istringstream lines(cap.str());
+  std::string line;
+  ASSERT_TRUE(std::getline(lines, line));
+  EXPECT_EQ(line, "storm");
+  int summaries = 0;
+  unsigned long long repeated = 0;
+  while (std::getline(lines, line)) {
+    unsigned long long n = 0;
+    ASSERT_EQ(sscanf(line.c_str(), "last message repeated %llu times", &n), 1) << line;
+    summaries++;
+    repeated += n;
+  }
+  EXPECT_GE(summaries, 3);
+  EXPECT_EQ(repeated, 5u);
+
+  // Disabled
+  cap.clear();
+  for (int i = 0; i < 2; i++) LOGGER_LOCAL_WARN(logger, "storm");
+  EXPECT_EQ(cap.str(), "storm\nstorm\n");
+  logger_destroy(&logger);
+}
+
+TEST(UlogC, RepeatedBurstThatStops) {
+  struct ulog_s *logger = logger_create();
+  CLoggerCapture cap(logger);
+  logger_format_disable(logger, 0x7f);
+  logger_set_repeat_filter(logger, 20);
+
+  const auto burst = [&](int n) {
+    for (int i = 0; i < n; i++) LOGGER_LOCAL_ERROR(logger, "link down");
+  };
+
+  // No other log follows the burst, the timer outputs its summary
+  burst(10);
+  const std::string expected = "link down\nlast message repeated 9 times\n";
+  for (int i = 0; i < 200 && cap.str() != expected; i++) usleep(10000);
+  EXPECT_EQ(cap.str(), expected);
+
+  // The next repetition starts another count
+  cap.clear();
+  burst(1);
+  LOGGER_LOCAL_ERROR(logger, "link up");
+  EXPECT_EQ(cap.str(), "last message repeated 1 times\nlink up\n");
+  logger_destroy(&logger);
+}
+
+TEST(UlogC, RepeatedLogsOfThreadsAreCountedOnce) {
+  struct ulog_s *logger = logger_create();
+  CLoggerCapture cap(logger);
+  logger_format_disable(logger, 0x7f);
+  logger_set_repeat_filter(logger, 60000);
+
+  // Every log is either output or counted by exactly one summary
+  const int kThreads = 4, kIterations = 2000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < kIterations; i++) LOGGER_LOCAL_ERROR(logger, "%s", i % 4 ? "timeout" : "reset");
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  logger_set_repeat_filter(logger, 0);
+
+  uint64_t outputs = 0, repeated = 0;
+  std::istringstream lines(cap.str());
+  for (std::string line; std::getline(lines, line);) {
+    unsigned long long n = 0;
+    if (sscanf(line.c_str(), "last message repeated %llu times", &n) == 1) {
+      repeated += n;
+    } else {
+      EXPECT_TRUE(line == "timeout" || line == "reset") << line;
+      outputs++;
+    }
+  }
+  EXPECT_EQ(outputs + repeated, (uint64_t)kThreads * kIterations);
+  EXPECT_GT(repeated, 0u);
+  logger_destroy(&logger);
+}
+
+// Nanoseconds since the epoch of a "YYYY-MM-DD HH:MM:SS.nnnnnnnnn" timestamp in local time
+static uint64_t ParseTimestampNs(const std::string &str) {
+  struct tm tm = {};
+  const char *frac = strptime(str.c_str(), "%Y-%m-%d %H:%M:%S", &tm);
+  if (!frac || *frac != '.') return 0;
+  tm.tm_isdst = -1;
+  return (uint64_t)mktime(&tm) * 1000000000 + strtoull(frac + 1, nullptr, 10);
+}
+
+TEST(UlogC, ClockSources) {
+  struct ulog_s *logger = logger_create();
+  CLoggerCapture cap(logger);
+  logger_format_disable(logger, 0x7f);
+  logger_format_enable(logger, ULOG_F_TIME);
+  logger_set_time_precision(logger, 9);
+
+  for (enum ulog_clock_e clock :
+       {ULOG_CLOCK_REALTIME, ULOG_CLOCK_REALTIME_COARSE, ULOG_CLOCK_MONOTONIC, ULOG_CLOCK_TSC}) {
+    const auto begin = std::chrono::steady_clock::now();
+    const int ret = logger_set_clock(logger, clock);
+    // Only the TSC is calibrated for ULOG_TSC_CALIBRATION_MS
+    if (clock != ULOG_CLOCK_TSC) {
+      EXPECT_LT(std::chrono::steady_clock::now() - begin, std::chrono::milliseconds(ULOG_TSC_CALIBRATION_MS / 2));
+    }
+    if (ret != 0) {
+      EXPECT_EQ(clock, ULOG_CLOCK_TSC);  // Only the TSC may be missing
+      continue;
+    }
+    cap.clear();
+    const uint64_t before_ns = logger_real_time_us() * 1000;
+    LOGGER_LOCAL_INFO(logger, "clock %d", clock);
+    const uint64_t after_ns = logger_real_time_us() * 1000 + 1000;
+    ASSERT_EQ(cap.str().size(), sizeof("YYYY-MM-DD HH:MM:SS.nnnnnnnnn clock 0\n") - 1) << cap.str();
+
+    // The coarse clock lags by up to a scheduler tick, the calibrated clocks may drift by a few microseconds
+    const uint64_t ns = ParseTimestampNs(cap.str());
+    EXPECT_GE(ns + 20000000, before_ns) << "clock " << clock;
+    EXPECT_LE(ns, after_ns + 1000000) << "clock " << clock;
+  }
+
+  // The fraction has the configured number of digits
+  logger_set_clock(logger, ULOG_CLOCK_REALTIME);
+  cap.clear();
+  logger_set_time_precision(logger, 6);
+  LOGGER_LOCAL_INFO(logger, "us");
+  EXPECT_EQ(cap.str().size(), sizeof("YYYY-MM-DD HH:MM:SS.uuuuuu us\n") - 1);
+  cap.clear();
+  logger_set_time_precision(logger, 0);
+  LOGGER_LOCAL_INFO(logger, "s");
+  EXPECT_EQ(cap.str().size(), sizeof("YYYY-MM-DD HH:MM:SS s\n") - 1);
+  logger_destroy(&logger);
+}
+
+#undef ULOG_MODULE
+#define ULOG_MODULE "net.http"
+static void LogNetHttp(struct ulog_s *logger, int level, int *evaluated) {
+  LOGGER_LOCAL_DEBUG(logger, "http debug %d", ++*evaluated);
+  LOGGER_LOCAL_WARN(logger, "http warn");
+  ULOG_OUT_LOG(logger, (enum ulog_level_e)level, "http runtime level %d", level);
+}
+
+#undef ULOG_MODULE
+#define ULOG_MODULE "db.pool"
+static void LogDbPool(struct ulog_s *logger) { LOGGER_LOCAL_DEBUG(logger, "pool debug"); }
+#undef ULOG_MODULE
+#define ULOG_MODULE NULL
+
+TEST(UlogC, ModuleLevels) {
+  struct ulog_s *logger = logger_create();
+  CLoggerCapture cap(logger);
+  logger_format_disable(logger, 0x7f);
+  int evaluated = 0;
+  auto log_all = [&](int level) {
+    LogNetHttp(logger, level, &evaluated);
+    LogDbPool(logger);
+    LOGGER_LOCAL_INFO(logger, "no module");
+  };
+
+  log_all(ULOG_LEVEL_DEBUG);
+  EXPECT_EQ(cap.str(), "http debug 1\nhttp warn\nhttp runtime level 1\npool debug\nno module\n");
+
+  // Filtered sites do not evaluate their arguments
+  ASSERT_EQ(logger_set_module_levels("warn, net.*=warn, db.pool=debug"), 0);
+  cap.clear();
+  log_all(ULOG_LEVEL_DEBUG);
+  log_all(ULOG_LEVEL_ERROR);
+  EXPECT_EQ(cap.str(), "http warn\npool debug\nhttp warn\nhttp runtime level 4\npool debug\n");
+  EXPECT_EQ(evaluated, 1);
+
+  // The longest matching rule wins
+  EXPECT_EQ(logger_get_module_level("net"), ULOG_LEVEL_WARN);
+  EXPECT_EQ(logger_get_module_level("net.http.client"), ULOG_LEVEL_WARN);
+  EXPECT_EQ(logger_get_module_level("network"), ULOG_LEVEL_WARN);
+  EXPECT_EQ(logger_get_module_level("db"), ULOG_LEVEL_WARN);
+  EXPECT_EQ(logger_get_module_level(NULL), ULOG_LEVEL_WARN);
+  ASSERT_EQ(logger_set_module_level("net.http", ULOG_LEVEL_DEBUG), 0);
+  EXPECT_EQ(logger_get_module_level("net.http.client"), ULOG_LEVEL_DEBUG);
+  EXPECT_EQ(logger_get_module_level("net.tcp"), ULOG_LEVEL_WARN);
+  cap.clear();
+  log_all(ULOG_LEVEL_INFO);
+  EXPECT_EQ(cap.str(), "http debug 2\nhttp warn\nhttp runtime level 2\npool debug\n");
+
+  // The level of the logger still applies
+  logger_set_output_level(logger, ULOG_LEVEL_ERROR);
+  cap.clear();
+  log_all(ULOG_LEVEL_DEBUG);
+  EXPECT_TRUE(cap.str().empty());
+  logger_set_output_level(logger, ULOG_LEVEL_TRACE);
+
+  // An invalid spec keeps the rules
+  EXPECT_EQ(logger_set_module_levels("net=loud"), -1);
+  EXPECT_EQ(logger_set_module_levels("db="), -1);
+  EXPECT_EQ(logger_get_module_level("net.http"), ULOG_LEVEL_DEBUG);
+
+  ASSERT_EQ(logger_set_module_levels("*=off"), 0);
+  cap.clear();
+  log_all(ULOG_LEVEL_FATAL);
+  EXPECT_TRUE(cap.str().empty());
+
+  ASSERT_EQ(logger_set_module_levels(NULL), 0);
+  cap.clear();
+  log_all(ULOG_LEVEL_TRACE);
+  EXPECT_EQ(cap.str(), "http debug 4\nhttp warn\nhttp runtime level 0\npool debug\nno module\n");
+  logger_destroy(&logger);
+}
@@ -0,0 +1,288 @@
+#include "ulog/ulog_fmt_async.h"
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Captures all output, the async logger writes from its background thread
+class Capture {
+ public:
+  template <typename LoggerType>
+  explicit Capture(LoggerType& logger) {
+    logger.set_output_callback(Callback, this);
+  }
+  std::string str() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return buf_;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::string buf_;
+  static int Callback(void* self, const char* s) {
+    auto* capture = static_cast<Capture*>(self);
+    std::lock_guard<std::mutex> lock(capture->mutex_);
+    capture->buf_ += s;
+    return static_cast<int>(strlen(s));
+  }
+};
+
+// Not trivially copyable, formatted on the calling thread
+struct Label {
+  std::string text;
+};
+
+struct Point {
+  int x;
+  int y;
+};
+
+}  // namespace
+
+template <>
+struct ulog::is_deferrable<Point> : std::true_type {};
+
+#if defined(ULOG_FMT_USE_STD)
+namespace fmt_ns = std;
+#else
+namespace fmt_ns = fmt;
+#endif
+
+template <>
+struct fmt_ns::formatter<Point> : fmt_ns::formatter<int> {
+  auto format(const Point& p, fmt_ns::format_context& ctx) const {
+    return fmt_ns::format_to(ctx.out(), "({}, {})", p.x, p.y);
+  }
+};
+
+template <>
+struct fmt_ns::formatter<Label> : fmt_ns::formatter<std::string_view> {
+  auto format(const Label& label, fmt_ns::format_context& ctx) const {
+    return fmt_ns::formatter<std::string_view>::format(label.text, ctx);
+  }
+};
+
+// Logs the same call to both loggers, the time differs between them
+#define LOG_BOTH(sync, async, ...) \
+  do {                             \
+    (sync).info(__VA_ARGS__);      \
+    (async).info(__VA_ARGS__);     \
+  } while (0)
+
+TEST(UlogFmtAsync, OutputMatchesLogger) {
+  ulog::Logger sync;
+  ulog::AsyncLogger async(64 * 1024);
+  sync.disable_format(ulog::kFormatTime);
+  async.disable_format(ulog::kFormatTime);
+  sync.enable_format(ulog::kFormatNumber);
+  async.enable_format(ulog::kFormatNumber);
+  Capture sync_capture(sync);
+  Capture async_capture(async);
+
+  std::string owned = "owned string";
+  const char* c_str = "c string";
+  std::string_view view = "view";
+  const std::string long_str(100 * 1000, 'x');
+  const Label label{"label"};
+
+  for (int i = 0; i < 3; i++) {
+    LOG_BOTH(sync, async, "plain text");
+    LOG_BOTH(sync, async, "int {} unsigned {} hex {:#x} char {} bool {}", -i, 42u, 255, 'c', true);
+    LOG_BOTH(sync, async, "int64 {} uint64 {}", INT64_MIN, UINT64_MAX);
+    LOG_BOTH(sync, async, "double {:.3f} {} {:e} float {}", 3.14159, 0.1, 1e100, 1.5f);
+    LOG_BOTH(sync, async, "strings '{}' '{}' '{}' '{:>10}' '{}'", owned, c_str, view, "literal", std::string("temp"));
+    LOG_BOTH(sync, async, "pointer {}", static_cast<const void*>(&i));
+    LOG_BOTH(sync, async, "user type {}", Point{1, 2});
+    LOG_BOTH(sync, async, "size {}", long_str.size());
+    LOG_BOTH(sync, async, "formatted on the caller {} {}", label, i);
+    LOG_BOTH(sync, async, "long string {}", long_str);
+  }
+  sync.raw(ulog::level::info, "raw {}\n", 1);
+  async.raw(ulog::level::info, "raw {}\n", 1);
+
+  async.flush();
+  EXPECT_EQ(async_capture.str(), sync_capture.str());
+  EXPECT_FALSE(sync_capture.str().empty());
+}
+
+TEST(UlogFmtAsync, ArgumentsAreCopied) {
+  ulog::AsyncLogger logger;
+  logger.disable_format(ulog::kFormatColor | ulog::kFormatTime | ulog::kFormatPid | ulog::kFormatLevel |
+                        ulog::kFormatFileLine | ulog::kFormatFunction);
+  Capture capture(logger);
+
+  {
+    std::string temp = "temporary";
+    char buffer[16] = "buffer";
+    logger.info("{} {}", temp, static_cast<const char*>(buffer));
+    temp.assign("overwritten");
+    strcpy(buffer, "changed");
+  }
+
+  logger.flush();
+  EXPECT_EQ(capture.str(), "temporary buffer\n");
+}
+
+TEST(UlogFmtAsync, MultipleThreads) {
+  ulog::AsyncLogger logger(4096);
+  logger.disable_format(ulog::kFormatColor);
+  Capture capture(logger);
+
+  const int kThreads = 4;
+  const int kLogsPerThread = 2000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&logger, t] {
+      for (int i = 0; i < kLogsPerThread; i++) logger.info("thread {} log {} {}", t, i, "payload");
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  logger.flush();
+  const std::string out = capture.str();
+  EXPECT_EQ(std::count(out.begin(), out.end(), '\n'), kThreads * kLogsPerThread);
+}
+
+TEST(UlogFmtAsync, LargeRecordsAreOutputInOrderByTheBackend) {
+  // A quarter of the smallest queue is 1 KiB, the large messages do not fit into a record
+  ulog::AsyncLogger logger(4096);
+  logger.disable_format(0x7f);
+  struct Output {
+    std::mutex mutex;
+    std::string text;
+    std::vector<std::thread::id> threads;
+  } output;
+  logger.set_output_callback(
+      [](void* user_data, const char* s) {
+        auto* o = static_cast<Output*>(user_data);
+        std::lock_guard<std::mutex> lock(o->mutex);
+        o->text += s;
+        o->threads.push_back(std::this_thread::get_id());
+        return static_cast<int>(strlen(s));
+      },
+      &output);
+
+  const std::string large(3000, 'x');
+  const int kThreads = 4;
+  const int kLogsPerThread = 200;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&logger, &large, t] {
+      for (int i = 0; i < kLogsPerThread; i++) logger.info("{} {} {}", t, i, i % 3 ? "small" : large);
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  logger.flush();
+
+  // The lines of each thread are complete and in order, all output by one thread that is not a logging thread
+  std::lock_guard<std::mutex> lock(output.mutex);
+  int next[kThreads] = {};
+  std::istringstream lines(output.text);
+  for (std::string line; std::getline(lines, line);) {
+    int t = -1, i = -1, n = 0;
+    ASSERT_EQ(sscanf(line.c_str(), "%d %d %n", &t, &i, &n), 2);
+    ASSERT_TRUE(t >= 0 && t < kThreads);
+    EXPECT_EQ(i, next[t]++);
+    EXPECT_EQ(line.substr(n), i % 3 ? "small" : large);
+  }
+  for (int count : next) EXPECT_EQ(count, kLogsPerThread);
+  ASSERT_FALSE(output.threads.empty());
+  for (const auto& id : output.threads) {
+    EXPECT_EQ(id, output.threads[0]);
+    EXPECT_NE(id, std::this_thread::get_id());
+  }
+}
+
+TEST(UlogFmtAsync, FatalFlushesQueue) {
+  ulog::AsyncLogger logger;
+  Capture capture(logger);
+
+  logger.info("before fatal {}", 1);
+  logger.fatal("fatal {}", "error");
+  const std::string out = capture.str();
+  EXPECT_NE(out.find("before fatal 1"), std::string::npos);
+  EXPECT_NE(out.find("fatal error"), std::string::npos);
+}
+
+TEST(UlogFmtAsync, RateLimitedLogs) {
+  ulog::AsyncLogger logger;
+  logger.disable_format(0x7f);
+  Capture capture(logger);
+
+  static ulog::every_n every_3(3);
+  for (int i = 0; i < 7; i++) logger.info(every_3, "every 3: {}", i);
+  logger.flush();
+  EXPECT_EQ(capture.str(),
+            "every 3: 0\nevery 3: 3 [suppressed 2]\nevery 3: 6 [suppressed 2]\n");
+}
+
+TEST(UlogFmtAsync, LevelMacros) {
+  ulog::AsyncLogger logger;
+  logger.disable_format(0x7f);
+  logger.set_level(ulog::level::info);
+  Capture capture(logger);
+
+  int evaluated = 0;
+  ULOG_FMT_DEBUG(logger, "hidden {}", ++evaluated);
+  ULOG_FMT_INFO(logger, "shown {}", ++evaluated);
+  logger.flush();
+  EXPECT_EQ(capture.str(), "shown 1\n");
+  EXPECT_EQ(evaluated, 1);
+}
+
+TEST(UlogFmtAsync, ClockIsConvertedByTheBackend) {
+  ulog::Logger sync;
+  ulog::AsyncLogger async;
+  sync.disable_format(0x7f);
+  async.disable_format(0x7f);
+  sync.enable_format(ulog::kFormatTime);
+  async.enable_format(ulog::kFormatTime);
+  ASSERT_TRUE(sync.set_clock(ulog::clock::monotonic));
+  ASSERT_TRUE(async.set_clock(ulog::clock::monotonic));
+  sync.set_time_precision(9);
+  async.set_time_precision(9);
+  Capture sync_capture(sync);
+  Capture async_capture(async);
+
+  sync.info("value {}", 1);
+  async.info("value {}", 1);
+  async.flush();
+  const size_t size = sizeof("YYYY-MM-DD HH:MM:SS.nnnnnnnnn value 1\n") - 1;
+  EXPECT_EQ(sync_capture.str().size(), size);
+  EXPECT_EQ(async_capture.str().size(), size);
+  // Same minute, unless the two logs straddle a minute boundary
+  EXPECT_EQ(sync_capture.str().substr(0, 16), async_capture.str().substr(0, 16));
+}
+
+TEST(UlogFmtAsync, StructuredLogMatchesLogger) {
+  ulog::Logger sync;
+  ulog::AsyncLogger async(64 * 1024);
+  sync.disable_format(ulog::kFormatTime);
+  async.disable_format(ulog::kFormatTime);
+  Capture sync_capture(sync);
+  Capture async_capture(async);
+
+  // The fields are queued as a binary record, the strings are copied into it
+  for (auto format : {ulog::kv_format::logfmt, ulog::kv_format::json}) {
+    sync.set_kv_format(format);
+    async.set_kv_format(format);
+    for (int i = 0; i < 3; i++) {
+      std::string side = i % 2 ? "buy limit" : "sell";
+      LOG_BOTH(sync, async, "order {} filled", i, ulog::kv("id", i),
+               ulog::kv("px", 100.5 + i), ulog::kv("side", side));
+      side.assign("overwritten");
+    }
+  }
+
+  async.flush();
+  EXPECT_EQ(async_capture.str(), sync_capture.str());
+  EXPECT_NE(sync_capture.str().find("order 1 filled id=1 px=101.5 side=\"buy limit\""),
+            std::string::npos);
+}
@@ -1,8 +1,30 @@
 #include "ulog/ulog.h"
+#include "ulog/ulog_fmt_async.h"
 
 #include <gtest/gtest.h>
+#include <chrono>
+#include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <new>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
+
+// Heap allocations of the calling thread, counted by the replaced global
+// operator new of the test binary
+static thread_local size_t heap_allocations = 0;
+
+void* operator new(size_t size) {
+  heap_allocations++;
+  if (void* p = malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+
+void operator delete(void* p, size_t) noexcept { free(p); }
 
 // Captures all output written to a Logger instance
 class OutputCapture {
@@ -75,6 +97,23 @@ TEST(UlogFmt, SourceLocation) {
   EXPECT_NE(cap.str().find("ulog_fmt_test"), std::string::npos);
 }
 
+// The file name of the call site is cut from the path at compile time
+static_assert(std::string_view(ulog::detail::path_basename("a/b/c.cc")) ==
+              "c.cc");
+static_assert(std::string_view(ulog::detail::path_basename("c.cc")) == "c.cc");
+
+TEST(UlogFmt, SourceLocationHeader) {
+  ulog::Logger logger;
+  OutputCapture cap(logger);
+  logger.disable_format(0x7f);
+  logger.enable_format(ulog::kFormatFileLine | ulog::kFormatFunction);
+
+  const int line = __LINE__ + 1;
+  logger.info("where");
+  EXPECT_EQ(cap.str(), "(ulog_fmt_test.cc:" + std::to_string(line) + " " +
+                           __func__ + ") where\n");
+}
+
 // ---------------------------------------------------------------------------
 // Various format specifiers
 // ---------------------------------------------------------------------------
@@ -109,6 +148,51 @@ TEST(UlogFmt, RawOutput) {
   EXPECT_EQ(cap.str().find('\n'), std::string::npos);
 }
 
+// ---------------------------------------------------------------------------
+// The length-aware and vectored callbacks receive the same output
+// ---------------------------------------------------------------------------
+TEST(UlogFmt, LengthAndVectoredOutput) {
+  ulog::Logger logger;
+  logger.disable_format(ulog::kFormatTime);
+  OutputCapture cap(logger);
+  std::string len_out;
+  std::vector<std::vector<std::string>> v_out;
+
+  for (int i = 0; i < 3; i++) {
+    if (i == 1) {
+      logger.set_output_callback_len(
+          [](void* self, const char* s, size_t len) -> int {
+            static_cast<std::string*>(self)->append(s, len);
+            return static_cast<int>(len);
+          },
+          &len_out);
+    } else if (i == 2) {
+      logger.set_output_callback_v(
+          [](void* self, const ulog_iovec_s* iov, int iovcnt) -> int {
+            auto& segments =
+                static_cast<std::vector<std::vector<std::string>>*>(self)
+                    ->emplace_back();
+            for (int j = 0; j < iovcnt; j++)
+              segments.emplace_back(static_cast<const char*>(iov[j].iov_base),
+                                    iov[j].iov_len);
+            return 0;
+          },
+          &v_out);
+    }
+    logger.info("segment {}", 1);
+  }
+  logger.raw(ulog::level::info, "raw {}", 2);
+
+  EXPECT_EQ(len_out, cap.str());
+  ASSERT_EQ(v_out.size(), 2u);
+  ASSERT_EQ(v_out[0].size(), 3u);
+  EXPECT_EQ(v_out[0][0] + v_out[0][1] + v_out[0][2], cap.str());
+  EXPECT_EQ(v_out[0][1], "segment 1");
+  EXPECT_EQ(v_out[0][2], std::string(ULOG_STR_RESET) + "\n");
+  ASSERT_EQ(v_out[1].size(), 1u);
+  EXPECT_EQ(v_out[1][0], "raw 2");
+}
+
 // ---------------------------------------------------------------------------
 // ulog.h is the single entry point: in C++ it includes ulog_fmt.h, giving
 // ulog::Logger and free functions without any extra includes.
@@ -138,3 +222,346 @@ TEST(UlogFmt, FreeFunctions) {
   ulog::fatal("fatal free {}", 6);
   ulog::raw(ulog::level::info, "raw free {}", 7);
 }
+
+// ---------------------------------------------------------------------------
+// Log numbering
+// ---------------------------------------------------------------------------
+TEST(UlogFmt, LogNumbering) {
+  ulog::Logger logger;
+  OutputCapture cap(logger);
+  logger.disable_format(0x7f);
+
+  logger.info("not numbered");
+  EXPECT_EQ(logger.log_count(), 0u);
+
+  logger.enable_format(ulog::kFormatNumber);
+  logger.info("a");
+  logger.info("b");
+  EXPECT_EQ(cap.str(), "not numbered\n#000001 a\n#000002 b\n");
+
+  // The first striped number of a thread is its stripe + 1
+  logger.set_number_mode(ulog::number_mode::striped);
+  cap.clear();
+  logger.info("c");
+  logger.info("d");
+  const uint32_t first = std::stoul(cap.str().substr(1));
+  const uint32_t second = std::stoul(cap.str().substr(cap.str().find('\n') + 2));
+  EXPECT_EQ(second, first + 16);
+  EXPECT_EQ(logger.log_count(), 4u);
+}
+
+// ---------------------------------------------------------------------------
+// Rate limited logs
+// ---------------------------------------------------------------------------
+TEST(UlogFmt, RateLimitedLogs) {
+  ulog::Logger logger;
+  OutputCapture cap(logger);
+  logger.disable_format(0x7f);
+
+  static ulog::every_n every_3(3);
+  for (int i = 0; i < 7; i++) logger.info(every_3, "every 3: {}", i);
+  EXPECT_EQ(cap.str(),
+            "every 3: 0\nevery 3: 3 [suppressed 2]\nevery 3: 6 [suppressed 2]\n");
+
+  cap.clear();
+  static ulog::every_ms every_minute(60000);
+  for (int i = 0; i < 3; i++) logger.warn(every_minute, "once {}", i);
+  EXPECT_EQ(cap.str(), "once 0\n");
+
+  cap.clear();
+  static ulog::rate burst_of_2(1, 2);
+  for (int i = 0; i < 5; i++) logger.error(burst_of_2, "rate {}", i);
+  EXPECT_EQ(cap.str(), "rate 0\nrate 1\n");
+
+  // Disabled levels are not counted
+  cap.clear();
+  static ulog::every_n every_2(2);
+  logger.set_level(ulog::level::error);
+  logger.info(every_2, "hidden");
+  logger.error(every_2, "shown {}", 1);
+  logger.error(every_2, "shown {}", 2);
+  logger.error(every_2, "shown {}", 3);
+  EXPECT_EQ(cap.str(), "shown 1\nshown 3 [suppressed 1]\n");
+}
+
+TEST(UlogFmt, ModuleLevels) {
+  ulog::Logger logger;
+  OutputCapture cap(logger);
+  logger.disable_format(0x7f);
+  logger.set_module("net.http");
+
+  ASSERT_EQ(logger_set_module_levels("info,net=warn"), 0);
+  logger.info("hidden");
+  logger.warn("shown {}", 1);
+  EXPECT_EQ(cap.str(), "shown 1\n");
+
+  // The cached level follows the changes of the rules
+  cap.clear();
+  ASSERT_EQ(logger_set_module_level("net.http", ULOG_LEVEL_DEBUG), 0);
+  logger.debug("shown {}", 2);
+  logger.set_module("db");
+  logger.debug("hidden");
+  logger.info("shown {}", 3);
+  EXPECT_EQ(cap.str(), "shown 2\nshown 3\n");
+
+  ASSERT_EQ(logger_set_module_levels(nullptr), 0);
+}
+
+TEST(UlogFmt, NoHeapAllocationPerLog) {
+  ulog::Logger logger;
+  size_t output_len = 0;
+  logger.set_output_callback_len(
+      [](void* user_data, const char*, size_t len) {
+        *static_cast<size_t*>(user_data) += len;
+        return static_cast<int>(len);
+      },
+      &output_len);
+  logger.enable_format(ulog::kFormatNumber);
+  static ulog::every_n every_2(2);
+  const std::string name = "a string longer than the small string buffer";
+
+  const auto log_all = [&](int i) {
+    logger.info("value {} {:.3f} {}", i, i * 0.5, name);
+    logger.warn(every_2, "limited {}", i);
+    logger.debug("{:>100}", i);
+    logger.raw(ulog::level::info, "raw {}\n", i);
+  };
+
+  // The first logs grow the line buffer of the thread
+  log_all(0);
+  const size_t allocations = heap_allocations;
+  for (int i = 1; i < 1000; i++) log_all(i);
+  EXPECT_EQ(heap_allocations - allocations, 0u);
+  EXPECT_GT(output_len, 0u);
+}
+
+TEST(UlogFmt, NoHeapAllocationSwitchingAsyncLoggers) {
+  ulog::AsyncLogger first(64 * 1024), second(64 * 1024);
+  for (ulog::AsyncLogger* logger : {&first, &second}) {
+    logger->set_output_callback_len(
+        [](void*, const char*, size_t len) { return static_cast<int>(len); });
+  }
+
+  // The producers of the thread are created by the first logs
+  first.info("value {}", 0);
+  second.info("value {}", 0);
+  const size_t allocations = heap_allocations;
+  for (int i = 1; i < 1000; i++) {
+    first.info("value {}", i);
+    second.info("value {}", i);
+  }
+  EXPECT_EQ(heap_allocations - allocations, 0u);
+}
+
+TEST(UlogFmt, StructuredLogFields) {
+  ulog::Logger logger;
+  OutputCapture cap(logger);
+  logger.disable_format(0x7f);
+
+  const std::string side = "buy limit";
+  const std::string_view venue = "X";
+  logger.info("order {} filled", 42, ulog::kv("id", -1042L),
+              ulog::kv("qty", 300u), ulog::kv("px", 101.25),
+              ulog::kv("side", side), ulog::kv("venue", venue),
+              ulog::kv("ioc", false), ulog::kv("note", ""));
+  EXPECT_EQ(cap.str(),
+            "order 42 filled id=-1042 qty=300 px=101.25 side=\"buy limit\" "
+            "venue=X ioc=false note=\"\"\n");
+
+  // Same rendering as the C core
+  cap.clear();
+  logger.set_kv_format(ulog::kv_format::json);
+  logger.warn("order filled", ulog::kv("id", 7), ulog::kv("side", side));
+  EXPECT_EQ(cap.str(),
+            "order filled {\"id\":7,\"side\":\"buy limit\"}\n");
+
+  // A field referenced by the format string is formatted into the message
+  cap.clear();
+  logger.info("{} done", ulog::kv("step", 3), ulog::kv("ok", true));
+  EXPECT_EQ(cap.str(), "step=3 done {\"step\":3,\"ok\":true}\n");
+
+  static ulog::every_n every_2(2);
+  cap.clear();
+  logger.set_kv_format(ulog::kv_format::logfmt);
+  for (int i = 0; i < 3; i++) logger.info(every_2, "limited", ulog::kv("i", i));
+  EXPECT_EQ(cap.str(), "limited i=0\nlimited [suppressed 1] i=2\n");
+}
+
+TEST(UlogFmt, StructuredOutputCallback) {
+  struct Captured {
+    std::string line;
+    std::vector<std::string> keys;
+  } captured;
+  ulog::Logger logger;
+  logger.disable_format(0x7f);
+  // Structured logs only need the structured output callback
+  logger.set_output_callback_len(nullptr);
+  logger.set_output_kv_callback(
+      [](void* user_data, const char* str, size_t len, const void* fields,
+         size_t fields_len) {
+        auto* c = static_cast<Captured*>(user_data);
+        c->line.assign(str, len);
+        const void* pos = fields;
+        const void* end = static_cast<const uint8_t*>(fields) + fields_len;
+        ulog_kv_s field;
+        while (logger_kv_next(&pos, end, &field))
+          c->keys.emplace_back(field.key, field.key_len);
+        return static_cast<int>(len);
+      },
+      &captured);
+
+  logger.info("plain {}", 1);
+  logger.info("order filled", ulog::kv("id", 7), ulog::kv("px", 1.5));
+  EXPECT_EQ(captured.line, "order filled\n");
+  EXPECT_EQ(captured.keys, (std::vector<std::string>{"id", "px"}));
+}
+
+// Appends the lines written to it to a string
+class StringSink final : public ulog::file::SinkBase {
+ public:
+  StringSink(std::string& out, int& flushes) : out_(out), flushes_(flushes) {}
+  ulog::Status SinkIt(const void* data, size_t len) override {
+    out_.append(static_cast<const char*>(data), len);
+    return ulog::Status::OK();
+  }
+  ulog::Status SinkIt(const void* data, size_t len,
+                      std::chrono::milliseconds) override {
+    return SinkIt(data, len);
+  }
+  ulog::Status Flush() override {
+    flushes_++;
+    return ulog::Status::OK();
+  }
+
+ private:
+  std::string& out_;
+  int& flushes_;
+};
+
+// Counts how often it is formatted
+struct Counted {};
+static int counted_formats = 0;
+
+#if defined(ULOG_FMT_USE_STD)
+namespace fmt_ns = std;
+#else
+namespace fmt_ns = fmt;
+#endif
+
+template <>
+struct fmt_ns::formatter<Counted> : fmt_ns::formatter<std::string_view> {
+  auto format(const Counted&, fmt_ns::format_context& ctx) const {
+    counted_formats++;
+    return fmt_ns::formatter<std::string_view>::format("x", ctx);
+  }
+};
+
+TEST(UlogFmt, SinkFanOut) {
+  ulog::Logger logger;
+  OutputCapture cap(logger);
+  logger.disable_format(0x7f);
+  std::string info_file, error_file, numbered_file;
+  int flushes = 0;
+  logger.add_sink(std::make_unique<StringSink>(info_file, flushes),
+                  ulog::level::info);
+  logger.add_sink(std::make_unique<StringSink>(error_file, flushes),
+                  ulog::level::error, ulog::kFormatLevel);
+  logger.add_sink(std::make_unique<StringSink>(numbered_file, flushes),
+                  ulog::level::warn, ulog::kFormatNumber);
+
+  // Formatted once for the output callback and all the sinks
+  logger.debug("debug {}", Counted{});
+  logger.info("info {}", Counted{});
+  logger.warn("warn {}", Counted{});
+  logger.error("error {}", Counted{});
+  EXPECT_EQ(counted_formats, 4);
+  EXPECT_EQ(cap.str(), "debug x\ninfo x\nwarn x\nerror x\n");
+  EXPECT_EQ(info_file, "info x\nwarn x\nerror x\n");
+  EXPECT_EQ(error_file, "E  error x\n");
+  // The logs are numbered for the sink
+  EXPECT_EQ(numbered_file, "#000003 warn x\n#000004 error x\n");
+
+  // Without an output callback only the sink levels are formatted
+  cap.clear();
+  info_file.clear();
+  logger.set_output_callback(nullptr);
+  logger.debug("debug {}", Counted{});
+  logger.info("order filled", ulog::kv("id", 7));
+  logger.raw(ulog::level::info, "raw {}\n", 1);
+  EXPECT_EQ(counted_formats, 4);
+  EXPECT_EQ(info_file, "order filled id=7\nraw 1\n");
+
+  // Fatal logs flush the sinks they are written to
+  logger.fatal("fatal");
+  EXPECT_EQ(flushes, 3);
+}
+
+TEST(UlogFmt, SinkFromManyThreads) {
+  ulog::Logger logger;
+  logger.set_output_callback(nullptr);
+  logger.disable_format(0x7f);
+  std::string plain_file, level_file;
+  int flushes = 0;
+  // StringSink is not thread-safe, the logger serializes its calls
+  logger.add_sink(std::make_unique<StringSink>(plain_file, flushes));
+  logger.add_sink(std::make_unique<StringSink>(level_file, flushes),
+                  ulog::level::trace, ulog::kFormatLevel);
+
+  constexpr int kThreads = 4;
+  constexpr int kIterations = 1000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&logger, t] {
+      for (int i = 0; i < kIterations; i++) logger.info("{} {}", t, i);
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  // The lines of each thread are complete and in order
+  for (const std::string* file : {&plain_file, &level_file}) {
+    int next[kThreads] = {};
+    std::istringstream lines(*file);
+    for (std::string line; std::getline(lines, line);) {
+      int t = -1, i = -1;
+      ASSERT_EQ(sscanf(line.c_str(), file == &plain_file ? "%d %d" : "I  %d %d",
+                       &t, &i),
+                2)
+          << line;
+      ASSERT_TRUE(t >= 0 && t < kThreads);
+      EXPECT_EQ(i, next[t]++);
+    }
+    for (int count : next) EXPECT_EQ(count, kIterations);
+  }
+}
+
+// Calls below the floor are compiled out, the arguments of disabled levels
+// are not evaluated
+#undef ULOG_FMT_MIN_LEVEL
+#define ULOG_FMT_MIN_LEVEL 2
+
+TEST(UlogFmt, LevelMacros) {
+  ulog::Logger logger;
+  OutputCapture cap(logger);
+  logger.disable_format(0x7f);
+
+  int evaluated = 0;
+  ULOG_FMT_TRACE(logger, "compiled out {}", ++evaluated);
+  ULOG_FMT_DEBUG(logger, "compiled out {}", ++evaluated);
+  ULOG_FMT_INFO(logger, "shown {}", ++evaluated);
+  EXPECT_EQ(evaluated, 1);
+
+  logger.set_level(ulog::level::error);
+  EXPECT_FALSE(logger.should_log(ulog::level::warn));
+  EXPECT_TRUE(logger.should_log(ulog::level::error));
+  ULOG_FMT_WARN(logger, "disabled {}", ++evaluated);
+  ULOG_FMT_ERROR(logger, "shown {}", ++evaluated);
+  EXPECT_EQ(evaluated, 2);
+
+  static ulog::every_n every_2(2);
+  for (int i = 0; i < 3; i++) ULOG_FMT_ERROR(logger, every_2, "limited {}", i);
+  EXPECT_EQ(cap.str(),
+            "shown 1\nshown 2\nlimited 0\nlimited 2 [suppressed 1]\n");
+}
+
+#undef ULOG_FMT_MIN_LEVEL
+#define ULOG_FMT_MIN_LEVEL 0
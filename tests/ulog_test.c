@@ -66,6 +66,11 @@ int main() {
   const char *text = "Ulog is a micro log library.";
   LOGGER_TOKEN(text);
 
+  // Structured log, the typed fields are rendered behind the message
+  const unsigned long long order_id = 1042;
+  LOGGER_INFO_KV("order filled", ULOG_KV("id", order_id), ULOG_KV("px", 101.25), ULOG_KV("side", text),
+                 ULOG_KV("ioc", (bool)false), ULOG_KV("level", -3));
+
   // Hex dump
   LOGGER_HEX_DUMP(text, 45, 16);
 
@@ -82,6 +87,16 @@ int main() {
 
   );
 
+  // Aggregate the execution time of a loop body, output as one summary line
+  for (int i = 0; i < 1000; i++) {
+    LOGGER_PROFILE_SCOPE("loop body");
+    LOGGER_PROFILE_CODE("inner statements", uint32_t n = 1000; while (n--););
+  }
+  logger_profile_report();
+
+  // Only every 100th execution is output, with the number of suppressed ones
+  for (int i = 0; i < 1000; i++) LOGGER_INFO_EVERY_N(100, "every 100: %d", i);
+
   logger_destroy(&local_logger);
   return 0;
 }
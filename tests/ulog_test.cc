@@ -82,6 +82,16 @@ int main() {
 
   );
 
+  // Aggregate the execution time of a loop body, output as one summary line
+  for (int i = 0; i < 1000; i++) {
+    LOGGER_PROFILE_SCOPE("loop body");
+    LOGGER_PROFILE_CODE("inner statements", uint32_t n = 1000; while (n--););
+  }
+  logger_profile_report();
+
+  // Only every 100th execution is output, with the number of suppressed ones
+  for (int i = 0; i < 1000; i++) LOGGER_INFO_EVERY_N(100, "every 100: %d", i);
+
   logger_destroy(&local_logger);
   return 0;
 }